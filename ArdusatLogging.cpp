@@ -5,409 +5,4773 @@
  * @brief  Implements functions necessary for logging results to an SD card instead of stdout.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include "ArdusatLogging.h"
+#include <utility/FmtNumber.h>
+#include <utility/Crc.h>
+#if defined(__AVR__)
+#include <util/atomic.h>
+// 16 bit loads and stores aren't atomic on AVR, so the queue indices shared
+// with an ISR are accessed with interrupts briefly disabled
+#define LOG_ATOMIC ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#else  // defined(__AVR__)
+#define LOG_ATOMIC
+#endif  // defined(__AVR__)
 
 RTC_DS1307 RTC;
 
-SdVolume vol;
+/*
+ * Cached RTC time: at millis() == _rtc_base_millis the time was
+ * _rtc_base_seconds plus _rtc_base_frac ms. The base is moved forward on
+ * every read so the millis difference never wraps, and checked against the
+ * RTC every _rtc_sync_interval ms.
+ */
+static bool _rtc_valid = false;
+static uint32_t _rtc_base_seconds = 0;
+static uint16_t _rtc_base_frac = 0;
+static uint32_t _rtc_base_millis = 0;
+static uint32_t _rtc_synced_millis = 0;
+static unsigned long _rtc_sync_interval = 3600000UL;
+
 SdFat sd;
-File file;
 const char sd_card_error[] PROGMEM = "Not enough RAM (free: ";
 const char csv_header_fmt[] PROGMEM = "time: %lu at %lu\n";
+// names of the sensor types and their fields for the binary file header, one
+// line per type in ardusat_sensor_types_e order
+const char record_field_names[] PROGMEM =
+  "acceleration,x,y,z\n"
+  "magnetic,x,y,z\n"
+  "gyro,x,y,z\n"
+  "orientation,roll,pitch,heading\n"
+  "temperature,temp\n"
+  "luminosity,lux\n"
+  "uv,uv\n"
+  "pressure,pressure\n";
+const char frame_field_names[] PROGMEM = "frame";
+const char csv_compact_header[] PROGMEM = "#ardusat compact csv\n";
+// names of the summary record fields, one line per single value sensor type
+// from ARDUSAT_SENSOR_TYPE_TEMPERATURE on
+const char summary_field_names[] PROGMEM =
+  "temperature_stats,n,min,max,mean,stddev\n"
+  "luminosity_stats,n,min,max,mean,stddev\n"
+  "uv_stats,n,min,max,mean,stddev\n"
+  "pressure_stats,n,min,max,mean,stddev\n";
 
-/**
- * Helper function to log null-terminated output buffer string to file.
- *
- * @param output_buf pointer to output buffer to log.
- *
- * @return number of bytes written
+#define INT16_VALUE_LIMIT 32767
+
+// Frame being built by beginFrame/frameLog*, written by endFrame, allocated
+// by the first beginFrame
+static unsigned char *_frame_buf = NULL;
+static uint8_t _frame_len = 0;
+
+// directory of the log files, see setLogRotation
+static const char log_dir[] = "/data";
+
+// Line buffer the CSV writer formats into instead of the SD blocks
+static char *_csv_line = NULL;
+static uint8_t _csv_line_len = 0;
+
+// the log the free functions work on, see DataLog
+static DataLog _default_log;
+// state of the log the call in progress works on, see LogScope
+static log_state_t *_log = NULL;
+// logs with an open file, sharing the card and volume
+static uint8_t _open_logs = 0;
+// the log whose raw multi-block write is running on the card, if any
+static log_state_t *_raw_stream = NULL;
+
+/*
+ * Points _log at the state of a log for the length of a public call, and
+ * back at the previous one after. A log call from an interrupt handler
+ * thus leaves _log as it found it for the call it interrupted.
  */
-int logString(const char *output_buf)
+class LogScope {
+ public:
+  LogScope(DataLog *log) : _prev(_log) { _log = &log->_state; }
+  ~LogScope() { _log = _prev; }
+
+ private:
+  log_state_t *_prev;
+};
+
+log_state_t::log_state_t() :
+  _sync_policy(LOG_SYNC_EVERY_RECORD), _sync_interval(0),
+  _unsynced_records(0), _unsynced_bytes(0), _last_sync_millis(0),
+  _burst_interval(0), _burst_bytes(0),
+  _csv_log(false), _csv_format(LOG_CSV_FULL), _csv_compact(false),
+  _csv_names(NULL), _csv_names_len(0), _csv_time(0), _csv_time_valid(false),
+  _binary_encoding(LOG_BINARY_FLOAT), _compact_log(false), _compact_streams(),
+  _compact_block(0),
+  _raw_log(false), _raw_block(0), _raw_end_block(0),
+  _block_buf(NULL), _block_count(0), _block_head(0), _block_queued(0),
+  _block_offset(0), _log_bytes(0),
+  _block_framing(false), _spi_tuning(false), _framed_log(false),
+  _block_number(0), _record_crc(false), _crc_log(false), _serial_tee(NULL),
+  _millis_epoch(0), _epoch_millis(0), _index_due(LOG_INDEX_INTERVAL),
+  _rotation(LOG_ROTATE_NONE), _rotation_limit(0), _log_opened_millis(0),
+  _rotation_failed(false), _rotating(false), _log_index(0),
+  _log_file_size(0), _log_preallocated(false), _next_index(0),
+  _next_preallocated(false),
+  _queue_buf(NULL), _queue_size(0), _queue_head(0), _queue_tail(0),
+  _queue_overruns(0), _queue_draining(false),
+  _ram_budget(0), _ram_budget_used(0), _aggregates(NULL), _deadbands(NULL)
 {
-  int buf_len = strlen(output_buf);
-  return logBytes((const unsigned char *)output_buf, buf_len);
+  static const uint16_t int16_scales[] = ARDUSAT_INT16_SCALES;
+
+#if LOG_STATS
+  memset(&_stats, 0, sizeof(_stats));
+#endif  // LOG_STATS
+  memset(_csv_precision, 0, sizeof(_csv_precision));
+  memcpy(_int16_scales, int16_scales, sizeof(_int16_scales));
+  memset(_log_prefix, 0, sizeof(_log_prefix));
 }
 
-/**
- * Log the byte array pointed to by buffer to the SD card. Note that there is
- * absolutely no safety checking on numBytes, so use with care.
- *
- * Since we use a shared buffer between the SD card library and many of the output
- * functions, performs a check first to see if we need to allocate a new buffer.
- *
- * @param buffer byte array to log
- * @param number of bytes to log 
+/*
+ * Ends the raw multi-block write running on the card, if any, so that other
+ * commands can be sent. The high-rate log it belongs to starts a new one
+ * when it next writes a block.
  *
- * @return number of bytes written
+ * @return true if successful
  */
-int logBytes(const unsigned char *buffer, unsigned char numBytes)
+static bool _end_raw_stream()
 {
-  unsigned char *buf;
-  int written;
-  bool buf_allocated = false;
-
-  if (numBytes > OUTPUT_BUF_SIZE - 1) {
-    numBytes = OUTPUT_BUF_SIZE - 1;
+  if (_raw_stream == NULL) {
+    return true;
   }
-
-  if (file.isOpen()) {
-    if (buffer == (unsigned char *) _getOutBuf()) {
-      buf = (unsigned char *) malloc(numBytes);
-      buf_allocated = true;
-      memcpy(buf, buffer, numBytes);
-    } else {
-      buf = (unsigned char *) buffer;
-    }
-
-    written = file.write(buf, numBytes);
-    file.sync();
-    if (buf_allocated)
-      free(buf);
-    return written;
-  } else {
-    return 0;
+  _raw_stream = NULL;
+  while (sd.card()->writeState() == SD_WRITE_DATA) {
+    sd.card()->writePoll();
   }
+  return sd.card()->writeStop();
 }
 
-/**
- * Logs a line of CSV formatted acceleration data to the SD card.
- *
- * @param sensorName of this sensor
- * @param data acceleration_t data to log 
- *
- * @return number of bytes written
+/*
+ * Makes the card ready for commands of the log in use, ending another log's
+ * raw multi-block write. A log's own raw write is ended where it needs to
+ * be, e.g. before a file is created.
  */
-int logAcceleration(const char *sensorName, acceleration_t & data)
+static void _claim_card()
 {
-  return logString(accelerationToCSV(sensorName, data));
+  if (_raw_stream != NULL && _raw_stream != _log) {
+    _end_raw_stream();
+  }
 }
 
-/**
- * Logs a line of CSV formatted magnetic data to the SD card.
- *
- * @param sensorName of this sensor
- * @param data magnetic_t data to log
- *
- * @return number of bytes written
+/*
+ * The SDK's CSV helpers format into _output_buffer, which shares memory with
+ * the SD block cache. Whatever block is cached is clobbered once a line is
+ * formatted on top of it, so CSV logs move it out of the buffer first (to
+ * the cache pool if SD_CACHE_BLOCK_COUNT > 1, otherwise writing it back).
  */
-int logMagnetic(const char *sensorName, magnetic_t & data)
+static void _release_cache()
 {
-  return logString(magneticToCSV(sensorName, data));
+  if (_output_buffer == sd.vol()->cacheAddress()->output_buf) {
+    sd.vol()->cacheRelease();
+  }
 }
 
-/**
- * Logs a line of CSV formatted orientation data to the SD card.
- *
- * @param sensorName of this sensor
- * @param data gyro_t data to log
- *
- * @return number of bytes written
+#if LOG_STATS
+/*
+ * Counts a record write that started at micros() start into the statistics.
  */
-int logGyro(const char *sensorName, gyro_t & data)
+static void _stats_write(uint32_t start, int written)
 {
-  return logString(gyroToCSV(sensorName, data));
+  uint32_t t = micros() - start;
+  uint8_t bucket = 0;
+
+  if (written > 0) {
+    _log->_stats.records++;
+    _log->_stats.bytes += written;
+  }
+  if (t > _log->_stats.maxWriteMicros) {
+    _log->_stats.maxWriteMicros = t;
+  }
+  while (t > 0 && bucket < LOG_STATS_BUCKETS - 1) {
+    t >>= 1;
+    bucket++;
+  }
+  _log->_stats.writeMicros[bucket]++;
 }
+#endif  // LOG_STATS
 
-/**
- * Logs a line of CSV formatted tempoerature data to the SD card.
- *
- * @param sensorName of this sensor
- * @param data temperature_t data to log
+/*
+ * Checks the active sync policy after a write of numBytes that moved the log
+ * position from prev_pos.
  *
- * @return number of bytes written
+ * @return true if the file should be synced now
  */
-int logTemperature(const char *sensorName, temperature_t & data)
+static bool _sync_due(uint32_t prev_pos, int numBytes)
 {
-  return logString(temperatureToCSV(sensorName, data));
+  switch (_log->_sync_policy) {
+    case LOG_SYNC_RECORDS:
+      return _log->_unsynced_records >= _log->_sync_interval;
+    case LOG_SYNC_BYTES:
+      return _log->_unsynced_bytes >= _log->_sync_interval;
+    case LOG_SYNC_MILLIS:
+      return millis() - _log->_last_sync_millis >= _log->_sync_interval;
+    case LOG_SYNC_BLOCK:
+      return (prev_pos >> 9) != ((prev_pos + numBytes) >> 9);
+    case LOG_SYNC_EVERY_RECORD:
+    default:
+      return true;
+  }
 }
 
-/**
- * Logs a line of CSV formatted luminosity data to the SD card.
- *
- * @param sensorName of this sensor
- * @param data luminosity_t data to log
- *
- * @return number of bytes written
+/*
+ * @return true if the records logged since the last burst should be written
+ *         now: the burst interval has passed, maxBytes have been logged or
+ *         the accumulator is full. A partial block already written by the
+ *         last burst doesn't count, so an idle log doesn't burst again.
  */
-int logLuminosity(const char *sensorName, luminosity_t & data)
+static bool _burst_due()
 {
-  return logString(luminosityToCSV(sensorName, data));
+  if (_log->_unsynced_bytes == 0) {
+    return false;
+  }
+  return millis() - _log->_last_sync_millis >= _log->_burst_interval ||
+         (_log->_burst_bytes > 0 && _log->_unsynced_bytes >= _log->_burst_bytes) ||
+         _log->_block_queued == _log->_block_count;
 }
 
-/**
- * Logs a line of CSV formatted UV light data to the SD card.
- *
- * @param sensorName of this sensor
- * @param data uvlight_t data to log
- *
- * @return number of bytes written
- */
-int logUVLight(const char *sensorName, uvlight_t & data)
+static unsigned char *_block_at(uint8_t i)
 {
-  return logString(uvlightToCSV(sensorName, data));
+  return _log->_block_buf + ((uint16_t) i << 9);
 }
 
-/**
- * Logs a line of CSV formatted orientation data to SD card.
- *
- * @param sensorName of this sensor
- * @param data orientation_t data to log
- *
- * @return number of bytes written
- */
-int logOrientation(const char *sensorName, orientation_t & data)
+static void _free_blocks()
 {
-  return logString(orientationToCSV(sensorName, data));
+  free(_log->_block_buf);
+  _log->_block_buf = NULL;
+  _log->_block_count = 0;
 }
 
-/**
- * Logs a line of CSV formatted pressure data to SD card.
+/*
+ * Allocates the accumulator buffers, backing off from max_count until they
+ * fit without cutting into the RAM the SD card needs.
  *
- * @param sensorName of this sensor
- * @param data pressure_t data to log
+ * @param min_count fewest buffers that are acceptable
+ * @param max_count most buffers to allocate
  *
- * @return number of bytes written
+ * @return true if at least min_count buffers were allocated
  */
-int logPressure(const char *sensorName, pressure_t & data)
+static bool _alloc_blocks(uint8_t min_count, uint8_t max_count)
 {
-  return logString(pressureToCSV(sensorName, data));
-}
+  uint8_t n;
 
-#define init_data_struct(type_def, type_enum) \
-  type_def bin_data; \
-  bin_data.type = type_enum; \
-  bin_data.id = sensorId; \
-  bin_data.timestamp = data.header.timestamp;
-
-int binaryLogAcceleration(const unsigned char sensorId, acceleration_t & data)
-{
-  init_data_struct(acceleration_bin_t, ARDUSAT_SENSOR_TYPE_ACCELERATION)
-  bin_data.x = data.x;
-  bin_data.y = data.y;
-  bin_data.z = data.z;
+  _free_blocks();
+  for (n = max_count; n > 0 && n >= min_count; n--) {
+    if (freeMemory() - ((long) n << 9) < LOG_RESERVED_RAM) {
+      continue;
+    }
+    _log->_block_buf = (unsigned char *) malloc((size_t) n << 9);
+    if (_log->_block_buf != NULL) {
+      _log->_block_count = n;
+      break;
+    }
+  }
 
-  return logBytes((unsigned char *) &bin_data, sizeof(acceleration_bin_t));
+  _log->_block_head = 0;
+  _log->_block_queued = 0;
+  _log->_block_offset = 0;
+  return _log->_block_count >= min_count;
 }
 
-int binaryLogMagnetic(const unsigned char sensorId, magnetic_t & data)
+/*
+ * Sends a block to the next block of the preallocated file, starting a
+ * multi-block write if one isn't already running. On boards with SPI DMA the
+ * block is still being sent when this returns, see Sd2Card::writeDataAsync.
+ *
+ * @return true if successful, false if the card reported an error
+ */
+static bool _raw_write_block(const unsigned char *block)
 {
-  init_data_struct(magnetic_bin_t, ARDUSAT_SENSOR_TYPE_MAGNETIC)
-  bin_data.x = data.x;
-  bin_data.y = data.y;
-  bin_data.z = data.z;
+  Sd2Card *card = sd.card();
+
+  if (_raw_stream != _log) {
+    _claim_card();
+    if (!card->writeStart(_log->_raw_block, _log->_raw_end_block - _log->_raw_block + 1)) {
+      return false;
+    }
+    _raw_stream = _log;
+  }
+  if (!card->writeDataAsync(block)) {
+    _raw_stream = NULL;
+    return false;
+  }
 
-  return logBytes((unsigned char *) &bin_data, sizeof(magnetic_bin_t));
+  _log->_raw_block++;
+  if (_log->_raw_block > _log->_raw_end_block) {
+    // the card finishes in the background, see Sd2Card::writePoll
+    _raw_stream = NULL;
+    return card->writeStopAsync();
+  }
+  return true;
 }
 
-int binaryLogGyro(const unsigned char sensorId, gyro_t & data)
+/*
+ * @return number of bytes still free in the preallocated file, counting the
+ *         data waiting in the accumulator as used
+ */
+static uint32_t _raw_capacity()
 {
-  init_data_struct(gyro_bin_t, ARDUSAT_SENSOR_TYPE_GYRO)
-  bin_data.x = data.x;
-  bin_data.y = data.y;
-  bin_data.z = data.z;
+  uint32_t buffered = ((uint32_t) _log->_block_queued << 9) + _log->_block_offset;
+  uint32_t space;
 
-  return logBytes((unsigned char *) &bin_data, sizeof(gyro_bin_t));
+  if (_log->_raw_block > _log->_raw_end_block) {
+    return 0;
+  }
+  space = (_log->_raw_end_block - _log->_raw_block + 1) << 9;
+  return space > buffered ? space - buffered : 0;
 }
 
-int binaryLogTemperature(const unsigned char sensorId, temperature_t & data)
+static bool _write_block(const unsigned char *block)
 {
-  init_data_struct(temperature_bin_t, ARDUSAT_SENSOR_TYPE_TEMPERATURE)
-  bin_data.temp = data.t;
-
-  return logBytes((unsigned char *) &bin_data, sizeof(temperature_bin_t));
+  if (_log->_raw_log) {
+    return _raw_write_block(block);
+  }
+  _claim_card();
+  return _log->_file.write(block, 512) == 512;
 }
 
-int binaryLogLuminosity(const unsigned char sensorId, luminosity_t & data)
+/*
+ * Writes queued blocks, oldest first, until no more than keep are left. If
+ * wait is false, stops early while the card is still programming the last
+ * block, which makes this the cooperative scheduler for card writes: the
+ * sketch gets control back during programming time instead of spinning.
+ * Waiting writes to a file hand it each run of buffers that is contiguous in
+ * RAM at once, so SdBaseFile::write sends them with multi-block writes.
+ *
+ * @return true if successful, false if a block could not be written
+ */
+static bool _write_queued(uint8_t keep, bool wait)
 {
-  init_data_struct(luminosity_bin_t, ARDUSAT_SENSOR_TYPE_LUMINOSITY)
-  bin_data.luminosity = data.lux;
+  uint8_t tail;
+  uint8_t n;
 
-  return logBytes((unsigned char *) &bin_data, sizeof(luminosity_bin_t));
+  while (_log->_block_queued > keep) {
+    if (!wait && !sd.card()->writePoll()) {
+      break;
+    }
+    tail = (_log->_block_head + _log->_block_count - _log->_block_queued) % _log->_block_count;
+    n = 1;
+    if (wait && !_log->_raw_log) {
+      n = _log->_block_queued - keep;
+      if (n > _log->_block_count - tail) {
+        n = _log->_block_count - tail;
+      }
+      _claim_card();
+      if ((uint16_t) _log->_file.write(_block_at(tail), (uint16_t) n << 9) != (uint16_t) (n << 9)) {
+        return false;
+      }
+    } else if (!_write_block(_block_at(tail))) {
+      return false;
+    }
+    _log->_block_queued -= n;
+  }
+  return true;
 }
 
-int binaryLogUVLight(const unsigned char sensorId, uvlight_t & data)
+/*
+ * Fills in the used length and CRC of the framing header of the buffer being
+ * filled, before it is written.
+ */
+static void _seal_block()
 {
-  init_data_struct(uv_light_bin_t, ARDUSAT_SENSOR_TYPE_UV)
-  bin_data.uv = data.uvindex;
+  unsigned char *block = _block_at(_log->_block_head);
+  uint16_t crc;
 
-  return logBytes((unsigned char *) &bin_data, sizeof(uv_light_bin_t));
+  block[4] = _log->_block_offset;
+  block[5] = _log->_block_offset >> 8;
+  crc = crcCcitt(0, block, 6);
+  crc = crcCcitt(crc, block + ARDUSAT_BLOCK_HEADER_SIZE,
+                 _log->_block_offset - ARDUSAT_BLOCK_HEADER_SIZE);
+  block[6] = crc;
+  block[7] = crc >> 8;
 }
 
-int binaryLogOrientation(const unsigned char sensorId, orientation_t & data)
+/*
+ * Returns the free space at the end of the accumulator buffer being filled,
+ * first writing out the oldest buffer if all of them are full. A new buffer
+ * of a framed log starts with the framing header.
+ *
+ * @return pointer to the free space, NULL if no buffer could be freed
+ */
+static unsigned char *_block_reserve(uint16_t *space)
 {
-  init_data_struct(orientation_bin_t, ARDUSAT_SENSOR_TYPE_ORIENTATION)
-  bin_data.roll = data.roll;
-  bin_data.pitch = data.pitch;
-  bin_data.heading = data.heading;
+  unsigned char *block;
 
-  return logBytes((unsigned char *) &bin_data, sizeof(orientation_bin_t));
+  // a burst writes out every buffer, not just the one needed now
+  if (_log->_block_queued == _log->_block_count &&
+      !_write_queued(_log->_burst_interval > 0 ? 0 : _log->_block_count - 1, true)) {
+    return NULL;
+  }
+  // with one buffer free, it is the one last sent, which may still be
+  // going out by DMA
+  if (_log->_block_offset == 0 && _log->_block_queued == _log->_block_count - 1) {
+    while (sd.card()->writeState() == SD_WRITE_DATA) {
+      sd.card()->writePoll();
+    }
+  }
+  block = _block_at(_log->_block_head);
+  if (_log->_framed_log && _log->_block_offset == 0) {
+    block[0] = ARDUSAT_BLOCK_MAGIC;
+    block[1] = _log->_block_number++;
+    block[2] = 0;
+    block[3] = 0;
+    _log->_block_offset = ARDUSAT_BLOCK_HEADER_SIZE;
+    _log->_log_bytes += ARDUSAT_BLOCK_HEADER_SIZE;
+  }
+  *space = 512 - _log->_block_offset;
+  return block + _log->_block_offset;
 }
 
-int binaryLogPressure(const unsigned char sensorId, pressure_t & data)
+/*
+ * Marks n bytes stored at the space returned by _block_reserve as used,
+ * queueing the buffer once it is full.
+ */
+static void _block_commit(uint16_t n)
 {
-  init_data_struct(pressure_bin_t, ARDUSAT_SENSOR_TYPE_PRESSURE)
-  bin_data.pressure = data.pressure;
-
-  return logBytes((unsigned char *) &bin_data, sizeof(pressure_bin_t));
+  _log->_block_offset += n;
+  if (_log->_block_offset == 512) {
+    if (_log->_framed_log) {
+      _seal_block();
+    }
+    _log->_block_queued++;
+    _log->_block_head = (_log->_block_head + 1) % _log->_block_count;
+    _log->_block_offset = 0;
+  }
 }
 
-
 /*
- * Helper function to log to the top of the CSV header with the current time
+ * Packs numBytes into the accumulator, followed by the record's CRC byte if
+ * crc isn't NULL, queueing each buffer as it fills. In high-rate mode
+ * records are never split across the end of the file.
+ *
+ * @return number of bytes accepted, 0 if the file is full, -1 on card error
  */
-int _log_csv_time_header(DateTime & now, unsigned long curr_millis)
+static int _block_write(const unsigned char *buffer, unsigned char numBytes,
+                        const uint8_t *crc)
 {
-  char fmt_buf[32];
-  _resetOutBuf();
+  unsigned char *dst;
+  uint16_t n;
+  uint16_t needed = numBytes + (crc != NULL);
+  int written = 0;
 
-  strcpy_P(fmt_buf, csv_header_fmt);
+  // a framed record that starts a new block, or runs into the next one,
+  // needs room for that block's header too
+  if (_log->_framed_log && (_log->_block_offset == 0 || _log->_block_offset + needed > 512)) {
+    needed += ARDUSAT_BLOCK_HEADER_SIZE;
+  }
+  if (_log->_raw_log && _raw_capacity() < needed) {
+    return 0;
+  }
 
-  sprintf(_getOutBuf(), fmt_buf, now.unixtime(), curr_millis);
-  return logString(_getOutBuf());
+  while (numBytes > 0) {
+    dst = _block_reserve(&n);
+    if (dst == NULL) {
+      return written > 0 ? written : -1;
+    }
+    // note where the first record starting in a framed block begins
+    if (_log->_framed_log && written == 0 && _block_at(_log->_block_head)[2] == 0 &&
+        _block_at(_log->_block_head)[3] == 0) {
+      _block_at(_log->_block_head)[2] = _log->_block_offset;
+      _block_at(_log->_block_head)[3] = _log->_block_offset >> 8;
+    }
+    if (n > numBytes) {
+      n = numBytes;
+    }
+    memcpy(dst, buffer, n);
+    _block_commit(n);
+    buffer += n;
+    numBytes -= n;
+    written += n;
+  }
+  if (crc != NULL) {
+    if ((dst = _block_reserve(&n)) == NULL) {
+      return written;
+    }
+    *dst = *crc;
+    _block_commit(1);
+    written++;
+  }
+
+  // Failures here are retried on the next write; bursts wait for their time
+  if (_log->_burst_interval == 0) {
+    _write_queued(0, false);
+  }
+  return written;
 }
 
-int _log_binary_time_header(DateTime & now, unsigned long curr_millis)
+/*
+ * Writes out a partially filled raw block and ends the multi-block write so
+ * that everything logged so far is on the card. The block is rewritten once
+ * it fills up, since the next write restarts at the same block.
+ */
+static bool _raw_flush()
 {
-  unsigned char buf[10];
-  unsigned long unixtime = now.unixtime();
+  unsigned char *block = _block_at(_log->_block_head);
+  bool ret = true;
 
-  buf[0] = 0xFF;
-  buf[1] = 0xFF;
-  memcpy(buf + 2, &unixtime, 4);
-  memcpy(buf + 6, &curr_millis, 4);
-  return logBytes(buf, 10);
+  if (_log->_block_offset > 0 && _log->_raw_block <= _log->_raw_end_block) {
+    if (_log->_framed_log) {
+      _seal_block();
+    }
+    memset(block + _log->_block_offset, 0, 512 - _log->_block_offset);
+    if (_raw_stream != _log) {
+      _claim_card();
+      ret = sd.card()->writeStart(_log->_raw_block, _log->_raw_end_block - _log->_raw_block + 1);
+      _raw_stream = ret ? _log : NULL;
+    }
+    ret = ret && sd.card()->writeData(block);
+  }
+  if (_raw_stream == _log) {
+    ret = sd.card()->writeStop() && ret;
+    _raw_stream = NULL;
+  }
+  return ret;
 }
 
-/**
- * Function starts the SD card service and makes sure that the appropriate directory
- * structure exists, then creates the file to use for logging data. Data will be logged
- * to a file called fileNamePrefix_0.csv or fileNamePrefix_0.bin (number will be incremented
- * for each new log file)
- *
- * @param chipSelectPin Arduino pin SD card reader CS pin is attached to
- * @param fileNamePrefix string to prefix at beginning of data file
- * @param csvData boolean flag whether we are writing csv data or binary data (used for filename)
- *
- * @return true if successful, false if failed
+/*
+ * Writes every queued block plus the partially filled one and syncs the
+ * file. The file position is moved back to the start of the partial block so
+ * that it is later written again as a whole block.
  */
-bool beginDataLog(int chipSelectPin, const char *fileNamePrefix, bool csvData)
+static bool _flush_blocks()
 {
+  uint32_t pos;
   bool ret;
-  int i = 0;
-  int max_len;
-  char fileName[19];
-  char prefix[8];
-  char rootPath[] = "/data";
 
-
-  if (_output_buffer != NULL) {
-    delete []_output_buffer;
+  if (!_write_queued(0, true)) {
+    return false;
   }
-  OUTPUT_BUF_SIZE = 512;
-  _output_buffer = vol.cacheAddress()->output_buf;
-
-  if (freeMemory() < 400) {
-    strcpy_P(_getOutBuf(), sd_card_error);
-    Serial.print(_getOutBuf());
-    Serial.print(freeMemory());
-    Serial.println(", need 400)");
-    ret = false;
-  } else {
-    ret = sd.begin(chipSelectPin, SPI_FULL_SPEED);
+  if (_log->_raw_log) {
+    return _raw_flush();
+  }
+  if (_log->_block_offset == 0) {
+    return _log->_file.sync();
   }
 
-  //Filenames need to fit the 8.3 filename convention, so truncate down the
-  //given filename if it is too long.
-  memcpy(prefix, fileNamePrefix, 7);
-  prefix[7] = '\0';
-
-  if (ret) {
-    if (!sd.exists(rootPath))
-      ret = sd.mkdir(rootPath);
-    if (ret) {
-      while (true) {
-	if (i < 10) {
-	  max_len = 7;
-	} else if (i < 100) {
-	  max_len = 6;
-	} else if (i < 1000) {
-	  max_len = 5;
-	} else {
-	  break;
-	}
-
-	prefix[max_len - 1] = '\0';
-	sprintf(fileName, "%s/%s%d.%s", rootPath, prefix, i,
-		csvData ? "csv" : "bin");
-	if (!sd.exists(fileName)) {
-	  file = sd.open(fileName, FILE_WRITE);
-	  break;
-	}
-	i++;
-      }
-    }
+  if (_log->_framed_log) {
+    _seal_block();
   }
-  return file.isOpen();
+  pos = _log->_file.curPosition();
+  ret = _log->_file.write(_block_at(_log->_block_head), _log->_block_offset) == _log->_block_offset;
+  ret = _log->_file.sync() && ret;
+  return _log->_file.seekSet(pos) && ret;
 }
 
-/*
- * @brief Helper function to get current time from RTC & Arduino.
+/**
+ * Sets how often the log file is synced to the SD card. May be called before
+ * or after beginDataLog; the policy stays in effect for later log files.
  *
- * @return 0 on success, -1 on failure
+ * @param policy one of the log_sync_policy_e values
+ * @param interval records, bytes or milliseconds between syncs, depending on
+ *        the policy (ignored for LOG_SYNC_EVERY_RECORD and LOG_SYNC_BLOCK)
+ *
+ * @return true if the policy was accepted, false if the interval is invalid
  */
-int _getCurrentTime( DateTime *now, unsigned long *curr_millis )
+bool DataLog::setSyncPolicy(log_sync_policy_e policy, unsigned long interval)
 {
-  // Try to get the current time from the RTC, if available. This will be prepended to the log file
-  // to be used to convert relative timestamps to real time values.
-  Wire.begin();
-  RTC.begin();
-  if (RTC.isrunning()) {
-    *now = RTC.now();
-    *curr_millis = millis();
-    return 0;
+  LogScope scope(this);
+
+  if ((policy == LOG_SYNC_RECORDS || policy == LOG_SYNC_BYTES) && interval == 0) {
+    return false;
   }
-  return -1;
+
+  _log->_sync_policy = policy;
+  _log->_sync_interval = interval;
+  return true;
 }
 
 /**
- * @brief Logs the current RTC timestamp and internal millis clock, if both are available
+ * Sets up burst flushing, see ArdusatLogging.h. Takes effect at once, but
+ * an open log can only start bursting if it has an accumulator buffer.
  *
- * @return number of bytes written
+ * @param intervalMillis ms between bursts, 0 to write records as they come
+ * @param maxBytes most bytes of records to buffer between bursts, 0 for as
+ *        many as the accumulator holds
+ *
+ * @return true if successful, false if the open log has no buffer to burst
+ *         from
  */
-int logRTCTimestamp()
+bool DataLog::setBurst(unsigned long intervalMillis, unsigned int maxBytes)
 {
-  unsigned long curr_millis;
-  DateTime now;
+  LogScope scope(this);
 
-  if (_getCurrentTime( &now, &curr_millis ) == 0) {
-    return _log_csv_time_header(now, curr_millis);
+  if (intervalMillis > 0 && _log->_file.isOpen() && _log->_block_count == 0) {
+    return false;
   }
-  return 0;
+
+  _log->_burst_interval = intervalMillis;
+  _log->_burst_bytes = maxBytes;
+  return true;
 }
 
 /**
- * @brief Logs the current RTC timestamp and internal millis clock, if both are available
+ * Selects how the binaryLog functions encode records. Takes effect at the
+ * next beginDataLog.
  *
- * @return number of bytes written
+ * @param encoding one of the log_binary_encoding_e values
+ *
+ * @return true if the encoding was accepted
  */
-int binaryLogRTCTimestamp()
+bool DataLog::setBinaryEncoding(log_binary_encoding_e encoding)
 {
-  unsigned long curr_millis;
-  DateTime now;
+  LogScope scope(this);
 
-  if (_getCurrentTime( &now, &curr_millis ) == 0) {
-    return _log_binary_time_header(now, curr_millis);
+  if (encoding != LOG_BINARY_FLOAT && encoding != LOG_BINARY_COMPACT &&
+      encoding != LOG_BINARY_INT16) {
+    return false;
   }
-  return 0;
+  _log->_binary_encoding = encoding;
+  return true;
 }
 
-bool setRTC()
+/**
+ * Selects the format of CSV log lines. Takes effect at the next
+ * beginDataLog.
+ *
+ * @param format one of the log_csv_format_e values
+ *
+ * @return true if the format was accepted
+ */
+bool DataLog::setCsvFormat(log_csv_format_e format)
 {
-  Wire.begin();
-  RTC.begin();
-  // Sets RTC to the date & time sketch was compiled
-  RTC.adjust(DateTime(__DATE__, __TIME__));
+  LogScope scope(this);
+
+  if (format != LOG_CSV_FULL && format != LOG_CSV_COMPACT) {
+    return false;
+  }
+  _log->_csv_format = format;
+  return true;
+}
+
+/**
+ * Sets the number of digits after the decimal point for the values of one
+ * sensor type in CSV logs, in place of LOG_CSV_PRECISION.
+ *
+ * @param sensorType one of the ardusat_sensor_types_e values
+ * @param precision digits, at most 9
+ *
+ * @return true if the precision was accepted
+ */
+bool DataLog::setCsvPrecision(unsigned char sensorType, unsigned char precision)
+{
+  LogScope scope(this);
+
+  if (sensorType >= sizeof(_log->_csv_precision) || precision > 9) {
+    return false;
+  }
+  _log->_csv_precision[sensorType] = precision + 1;
+  return true;
+}
+
+/**
+ * Sets the scale of int16 records of one sensor type: values are stored as
+ * value * scale, so a scale of 100 gives a resolution of 0.01 and a range of
+ * +-327.67. Takes effect at the next beginDataLog.
+ *
+ * @param sensorType one of the ardusat_sensor_types_e values
+ * @param scale factor, at least 1
+ *
+ * @return true if the scale was accepted
+ */
+bool DataLog::setBinaryScale(unsigned char sensorType, unsigned int scale)
+{
+  LogScope scope(this);
+
+  if (sensorType >= sizeof(_log->_int16_scales) / sizeof(_log->_int16_scales[0]) ||
+      scale == 0) {
+    return false;
+  }
+  _log->_int16_scales[sensorType] = scale;
+  return true;
+}
+
+/**
+ * Turns block framing of binary logs on or off. Takes effect at the next
+ * beginDataLog.
+ *
+ * @param enable true to frame blocks
+ *
+ * @return true
+ */
+bool DataLog::setBlockFraming(bool enable)
+{
+  LogScope scope(this);
+
+  _log->_block_framing = enable;
+  return true;
+}
+
+/**
+ * Turns the CRC-8 after every record of binary logs on or off, see
+ * ArdusatLogging.h. Takes effect at the next beginDataLog.
+ *
+ * @param enable true to add record CRCs
+ *
+ * @return true
+ */
+bool DataLog::setRecordCrc(bool enable)
+{
+  LogScope scope(this);
+
+  _log->_record_crc = enable;
+  return true;
+}
+
+/**
+ * Turns SPI clock tuning on or off, see ArdusatLogging.h. Takes effect at
+ * the next beginDataLog.
+ *
+ * @param enable true to tune the SPI clock
+ *
+ * @return true
+ */
+bool DataLog::setSpiTuning(bool enable)
+{
+  LogScope scope(this);
+
+  _log->_spi_tuning = enable;
+  return true;
+}
+
+/**
+ * Tees binary log records to a serial port, see ArdusatLogging.h.
+ *
+ * @param port to send records to, NULL to stop
+ *
+ * @return true
+ */
+bool DataLog::setSerialTee(Print *port)
+{
+  LogScope scope(this);
+
+  _log->_serial_tee = port;
+  return true;
+}
+
+/**
+ * Sets when the log moves on to a new file. May be called before or after
+ * beginDataLog; the policy stays in effect for later log files.
+ *
+ * @param policy one of the log_rotation_e values
+ * @param limit bytes or milliseconds per file, depending on the policy
+ *        (ignored for LOG_ROTATE_NONE)
+ *
+ * @return true if the policy was accepted, false if the limit is invalid
+ */
+bool DataLog::setRotation(log_rotation_e policy, unsigned long limit)
+{
+  LogScope scope(this);
+
+  if (policy != LOG_ROTATE_NONE && limit == 0) {
+    return false;
+  }
+  if (policy != LOG_ROTATE_NONE && policy != LOG_ROTATE_BYTES &&
+      policy != LOG_ROTATE_MILLIS) {
+    return false;
+  }
+
+  _log->_rotation = policy;
+  _log->_rotation_limit = limit;
+  return true;
+}
+
+static bool _queue_drain(bool wait);
+static bool _prepare_next_log();
+static bool _rotate_log();
+static bool _rotation_due(uint16_t numBytes);
+static void _end_aggregates();
+static int _log_record(const unsigned char *buffer, unsigned char numBytes);
+#if LOG_RECOVER
+static bool _clear_file_open(uint32_t bgn_block, unsigned char *block);
+#endif  // LOG_RECOVER
+
+/**
+ * Forces any buffered or queued log data and the file's directory entry to
+ * be written to the SD card, regardless of the sync policy.
+ *
+ * @return true if successful, false if no log is open or the sync failed
+ */
+static bool _flush_log()
+{
+  bool ret = true;
+
+  if (!_log->_file.isOpen()) {
+    return false;
+  }
+  _claim_card();
+  SD_STATS(_log->_stats.syncs++);
+
+  if (_log->_queue_buf != NULL && !_log->_queue_draining) {
+    ret = _queue_drain(true);
+  }
+
+  _log->_unsynced_records = 0;
+  _log->_unsynced_bytes = 0;
+  _log->_last_sync_millis = millis();
+  if (_log->_block_count > 0) {
+    return _flush_blocks() && ret;
+  }
+  return _log->_file.sync() && ret;
+}
+
+/*
+ * Trims a preallocated log file to the number of bytes actually logged,
+ * releasing the rest of the preallocation, and marks it closed.
+ */
+static bool _trim_log_file()
+{
+#if LOG_RECOVER
+  uint32_t bgn_block, end_block;
+#endif  // LOG_RECOVER
+
+  if (!_log->_log_preallocated) {
+    return true;
+  }
+  // the cache may have been formatted over while streaming; drop it
+  sd.vol()->cacheClear();
+  if (!_log->_file.truncate(_log->_log_bytes)) {
+    return false;
+  }
+#if LOG_RECOVER
+  return _log->_file.contiguousRange(&bgn_block, &end_block) &&
+         _clear_file_open(bgn_block, sd.vol()->cacheRelease()->data);
+#else  // LOG_RECOVER
+  return true;
+#endif  // LOG_RECOVER
+}
+
+/**
+ * Flushes and closes the current log file. A high-rate log file is trimmed to
+ * the number of bytes actually logged, releasing the unused preallocation.
+ *
+ * @return true if successful, false if no log is open or a write failed
+ */
+bool DataLog::end()
+{
+  LogScope scope(this);
+  bool ret;
+
+  if (!_log->_file.isOpen()) {
+    return false;
+  }
+
+  _end_aggregates();
+  ret = _flush_log();
+  ret = _trim_log_file() && ret;
+  _log->_raw_log = false;
+  free(_log->_csv_names);
+  _log->_csv_names = NULL;
+  _log->_csv_names_len = 0;
+  if (_log->_compact_log) {
+    compactEnd(&_log->_compact_streams);
+    _log->_compact_log = false;
+  }
+  _free_blocks();
+  // the next file of a rotating log was never used
+  if (_log->_next_file.isOpen()) {
+    _log->_next_file.remove();
+  }
+  _open_logs--;
+  return _log->_file.close() && ret;
+}
+
+/**
+ * Helper function to log null-terminated output buffer string to file.
+ *
+ * @param output_buf pointer to output buffer to log.
+ *
+ * @return number of bytes written
+ */
+int DataLog::logString(const char *output_buf)
+{
+  LogScope scope(this);
+  int buf_len = strlen(output_buf);
+  return _log_record((const unsigned char *)output_buf, buf_len);
+}
+
+/*
+ * Bookkeeping after a record has been logged: counts it towards the sync
+ * policy and syncs the file if one is due, or writes a burst if one is.
+ *
+ * @param prev_pos log position before the record
+ * @param written result of writing the record
+ *
+ * @return written
+ */
+static int _record_written(uint32_t prev_pos, int written)
+{
+  if (written > 0) {
+    _log->_log_bytes += written;
+    _log->_unsynced_records++;
+    _log->_unsynced_bytes += written;
+  }
+  if (_log->_burst_interval > 0 && _log->_block_count > 0) {
+    if (_burst_due()) {
+      _flush_log();
+    }
+  } else if (!_log->_raw_log && _sync_due(prev_pos, written > 0 ? written : 0)) {
+    _flush_log();
+  }
+  if (_log->_raw_log) {
+    return written;
+  }
+  // Even a synced file leaves its directory block in the cache, where the
+  // next CSV line formatted by the SDK would land
+  if (_log->_csv_log) {
+    _release_cache();
+  }
+  return written;
+}
+
+/*
+ * Zero-copy CSV writer. Fields are formatted straight into the block they
+ * will be written from: the accumulator buffer being filled or, without an
+ * accumulator, the file's block in the SD cache. Lines spill over into the
+ * next block as needed.
+ */
+static bool _csv_put(const char *str, uint8_t len, int *written)
+{
+  unsigned char *dst;
+  uint16_t n;
+
+  if (_csv_line != NULL) {
+    if (len > UCHAR_MAX - _csv_line_len) {
+      return false;
+    }
+    memcpy(_csv_line + _csv_line_len, str, len);
+    _csv_line_len += len;
+    *written += len;
+    return true;
+  }
+
+  while (len > 0) {
+    if (_log->_block_count > 0) {
+      dst = _block_reserve(&n);
+    } else {
+      _claim_card();
+      dst = _log->_file.writeReserve(&n);
+    }
+    if (dst == NULL) {
+      return false;
+    }
+    if (n > len) {
+      n = len;
+    }
+    memcpy(dst, str, n);
+    if (_log->_block_count > 0) {
+      _block_commit(n);
+    } else if (!_log->_file.writeCommit(n)) {
+      return false;
+    }
+    str += n;
+    len -= n;
+    *written += n;
+  }
   return true;
 }
+
+/*
+ * Number fields are formatted with the FmtNumber routines into a few bytes
+ * of stack (they work backwards from the end of the field), followed by the
+ * field terminator.
+ */
+static bool _csv_put_dec(uint32_t value, char term, int *written)
+{
+  char buf[12];
+  char *str = &buf[sizeof(buf)];
+
+  *--str = term;
+  str = fmtDec(value, str);
+  return _csv_put(str, &buf[sizeof(buf)] - str, written);
+}
+
+static bool _csv_put_float(float value, uint8_t prec, char term, int *written)
+{
+  char buf[24];
+  char *str = &buf[sizeof(buf)];
+
+  *--str = term;
+  str = fmtFloat(value, str, prec);
+  return _csv_put(str, &buf[sizeof(buf)] - str, written);
+}
+
+/*
+ * Looks up the id of a sensor name in the compact CSV dictionary.
+ *
+ * @return its id, or the id it gets with _csv_add_name if *added is set, 0
+ *         if the dictionary is full
+ */
+static uint8_t _csv_name_id(const char *name, uint8_t len, bool *added)
+{
+  uint8_t pos = 0;
+  uint8_t id = 1;
+
+  *added = false;
+  if (_log->_csv_names == NULL &&
+      (_log->_csv_names = (char *) malloc(LOG_CSV_NAMES_SIZE)) == NULL) {
+    return 0;
+  }
+  for (; pos < _log->_csv_names_len; id++) {
+    if (strcmp(_log->_csv_names + pos, name) == 0) {
+      return id;
+    }
+    pos += strlen(_log->_csv_names + pos) + 1;
+  }
+  if (LOG_CSV_NAMES_SIZE - _log->_csv_names_len <= len) {
+    return 0;
+  }
+  *added = true;
+  return id;
+}
+
+/*
+ * Formats a CSV line of values with _csv_put. A compact line comes after the
+ * definition of its sensor name if that is new, and has the timestamp as a
+ * delta from the line before unless absolute is set.
+ */
+static bool _csv_put_line(uint8_t type, const char *sensorName,
+                          uint8_t nameLen, uint32_t timestamp,
+                          const float *values, uint8_t numValues,
+                          bool absolute, int *written)
+{
+  uint8_t prec = LOG_CSV_PRECISION;
+  int32_t delta = timestamp - _log->_csv_time;
+  bool added = false;
+  uint8_t id = 0;
+  bool ok;
+  uint8_t i;
+
+  if (type < sizeof(_log->_csv_precision) && _log->_csv_precision[type] > 0) {
+    prec = _log->_csv_precision[type] - 1;
+  }
+  if (_log->_csv_compact) {
+    id = _csv_name_id(sensorName, nameLen, &added);
+  }
+  ok = !added || (_csv_put("#", 1, written) &&
+                  _csv_put_dec(id, '=', written) &&
+                  _csv_put(sensorName, nameLen, written) &&
+                  _csv_put("\n", 1, written));
+  if (!_log->_csv_compact || absolute || !_log->_csv_time_valid) {
+    ok = ok && _csv_put_dec(timestamp, ',', written);
+  } else {
+    ok = ok && _csv_put(delta < 0 ? "-" : "+", 1, written) &&
+         _csv_put_dec(delta < 0 ? -(uint32_t) delta : delta, ',', written);
+  }
+  if (id > 0) {
+    ok = ok && _csv_put_dec(id, ',', written);
+  } else {
+    ok = ok && _csv_put(sensorName, nameLen, written) &&
+         _csv_put(",", 1, written);
+  }
+  for (i = 0; ok && i < numValues; i++) {
+    ok = _csv_put_float(values[i], prec, i + 1 < numValues ? ',' : '\n',
+                        written);
+  }
+
+  if (ok && added) {
+    memcpy(_log->_csv_names + _log->_csv_names_len, sensorName, nameLen + 1);
+    _log->_csv_names_len += nameLen + 1;
+  }
+  if (ok) {
+    _log->_csv_time = timestamp;
+    _log->_csv_time_valid = true;
+  }
+  return ok;
+}
+
+static int _queue_csv_values(uint8_t type, const char *sensorName,
+                             uint32_t timestamp, const float *values,
+                             uint8_t numValues);
+
+/*
+ * Logs one CSV line, `timestamp,sensorName,value,...`, with the zero-copy
+ * writer.
+ *
+ * @return number of bytes written, 0 if no log is open or a high-rate log
+ *         is full, -1 on error
+ */
+static int _log_csv_values(uint8_t type, const char *sensorName,
+                           uint32_t timestamp, const float *values,
+                           uint8_t numValues)
+{
+  uint8_t name_len = strlen(sensorName);
+  uint32_t prev_pos = _log->_log_bytes;
+  // Upper bound on the line length, so lines are never cut off at the end
+  // of a preallocated file; a compact line may define its name first
+  uint16_t max_len = (_log->_csv_compact ? 22 : 13) + name_len + 24 * (uint16_t) numValues;
+  int written = 0;
+  bool ok;
+
+  if (!_log->_file.isOpen()) {
+    return 0;
+  }
+  if (_log->_queue_buf != NULL) {
+    return _queue_csv_values(type, sensorName, timestamp, values, numValues);
+  }
+  SD_STATS(uint32_t start = micros());
+  if (_rotation_due(max_len)) {
+    _rotate_log();
+  }
+  if (_log->_raw_log && _raw_capacity() < max_len) {
+    return 0;
+  }
+
+  ok = _csv_put_line(type, sensorName, name_len, timestamp, values, numValues,
+                     false, &written);
+  if (_log->_block_count > 0 && _log->_burst_interval == 0) {
+    _write_queued(0, false);
+  }
+
+  if (!ok && written == 0) {
+    written = -1;
+  }
+  written = _record_written(prev_pos, written);
+  SD_STATS(_stats_write(start, written));
+  return written;
+}
+
+/*
+ * Copies a record into the log queue. Safe to call from an ISR while the
+ * main loop drains the queue.
+ *
+ * @return number of bytes queued, 0 if the record didn't fit
+ */
+static int _queue_write(const unsigned char *buffer, unsigned char numBytes)
+{
+  uint16_t head = _log->_queue_head;
+  uint16_t tail;
+  uint16_t need = numBytes + 1;
+  uint16_t pos;
+
+  LOG_ATOMIC {
+    tail = _log->_queue_tail;
+  }
+
+  if (head >= tail) {
+    // free space runs to the end of the ring, then up to the tail
+    if (_log->_queue_size - head - (tail == 0 ? 1 : 0) >= need) {
+      pos = head;
+    } else if (tail > need) {
+      _log->_queue_buf[head] = 0;
+      pos = 0;
+    } else {
+      _log->_queue_overruns++;
+      return 0;
+    }
+  } else if (tail - head - 1 >= need) {
+    pos = head;
+  } else {
+    _log->_queue_overruns++;
+    return 0;
+  }
+
+  _log->_queue_buf[pos] = numBytes;
+  memcpy(_log->_queue_buf + pos + 1, buffer, numBytes);
+  pos += need;
+  if (pos == _log->_queue_size) {
+    pos = 0;
+  }
+  LOG_ATOMIC {
+    _log->_queue_head = pos;
+  }
+  return numBytes;
+}
+
+/*
+ * Formats a CSV line on the stack and queues it, since the zero-copy writer
+ * can't be used while records are waiting in the queue. Compact lines keep
+ * absolute timestamps, as the queue may be written across a rotation, and
+ * a new sensor name is only kept if its definition was queued.
+ */
+static int __attribute__((noinline)) _queue_csv_values(uint8_t type,
+    const char *sensorName, uint32_t timestamp, const float *values,
+    uint8_t numValues)
+{
+  char line[UCHAR_MAX];
+  uint8_t names_len = _log->_csv_names_len;
+  int written = 0;
+  bool ok;
+
+  _csv_line = line;
+  _csv_line_len = 0;
+  ok = _csv_put_line(type, sensorName, strlen(sensorName), timestamp, values,
+                     numValues, true, &written);
+  _csv_line = NULL;
+
+  if (!ok) {
+    _log->_csv_names_len = names_len;
+    _log->_queue_overruns++;
+    return 0;
+  }
+  written = _queue_write((const unsigned char *) line, _csv_line_len);
+  if (written == 0) {
+    _log->_csv_names_len = names_len;
+  }
+  return written;
+}
+
+/*
+ * Checks whether a record can go to the card without waiting on it: there
+ * is room in the accumulator, possibly after writing a full buffer while the
+ * card is idle, or the card is idle for a direct write.
+ */
+static bool _can_write_now(unsigned char numBytes)
+{
+  uint16_t room;
+
+  if (_log->_block_count == 0) {
+    return sd.card()->writePoll();
+  }
+
+  room = ((uint16_t) (_log->_block_count - _log->_block_queued) << 9) - _log->_block_offset;
+  if (room < numBytes && _log->_burst_interval == 0) {
+    _write_queued(0, false);
+    room = ((uint16_t) (_log->_block_count - _log->_block_queued) << 9) - _log->_block_offset;
+  }
+  // a single buffer is written out as the record fills it
+  return room >= numBytes || (_log->_block_queued == 0 && sd.card()->writePoll());
+}
+
+static int _write_record(const unsigned char *buffer, unsigned char numBytes);
+
+/*
+ * Moves records from the log queue to the card. Unless wait is set, stops
+ * as soon as the next record would have to wait for the card. Records
+ * queued meanwhile, by an ISR or the busy callback, are left for the next
+ * call so that a fast producer can't keep the drain going forever.
+ *
+ * @return false if a record couldn't be written
+ */
+static bool _queue_drain(bool wait)
+{
+  uint16_t tail = _log->_queue_tail;
+  uint16_t head;
+  unsigned char n;
+  bool ret = true;
+
+  LOG_ATOMIC {
+    head = _log->_queue_head;
+  }
+  _log->_queue_draining = true;
+  while (true) {
+    if (tail == head) {
+      break;
+    }
+
+    n = _log->_queue_buf[tail];
+    if (n > 0) {
+      if (!wait && !_can_write_now(n + _log->_crc_log)) {
+        break;
+      }
+      if (_write_record(_log->_queue_buf + tail + 1, n) < 0) {
+        ret = false;
+      }
+      tail += n + 1;
+    }
+    if (n == 0 || tail == _log->_queue_size) {
+      tail = 0;
+    }
+    LOG_ATOMIC {
+      _log->_queue_tail = tail;
+    }
+  }
+  _log->_queue_draining = false;
+  return ret;
+}
+
+/**
+ * Sets the size of the log queue. With a queue, logBytes and the binaryLog
+ * functions only copy the record into RAM, which makes them safe to call
+ * from an interrupt handler and keeps SD card busy time out of the sampling
+ * loop; serviceDataLog then writes the queued records to the card.
+ *
+ * Must not be called while records may be logged from an interrupt.
+ *
+ * @param bytes size of the queue, or 0 to write records immediately
+ *
+ * @return true if successful, false if the queue couldn't be allocated
+ */
+static bool _set_queue_size(unsigned int bytes)
+{
+  if (_log->_queue_buf != NULL) {
+    _queue_drain(true);
+    free(_log->_queue_buf);
+    _log->_queue_buf = NULL;
+    _log->_queue_size = 0;
+  }
+  _log->_queue_head = 0;
+  _log->_queue_tail = 0;
+
+  if (bytes == 0) {
+    return true;
+  }
+  _log->_queue_buf = (unsigned char *) malloc(bytes);
+  if (_log->_queue_buf != NULL) {
+    _log->_queue_size = bytes;
+  }
+  return _log->_queue_buf != NULL;
+}
+
+// smallest queue a RAM budget leaves a sketch that uses one
+#define LOG_QUEUE_MIN 128
+
+/*
+ * Allocates the block accumulator and, with a RAM budget, sizes the log
+ * queue to fit, see setLogRamBudget.
+ *
+ * @param min_blocks fewest accumulator buffers that are acceptable
+ *
+ * @return true if at least min_blocks buffers (and the queue) were
+ *         allocated
+ */
+static bool _alloc_buffers(uint8_t min_blocks)
+{
+  bool queued = _log->_queue_buf != NULL;
+  unsigned long budget, blocks, rest;
+  int free_ram;
+  bool ret;
+
+  _log->_ram_budget_used = 0;
+  if (_log->_ram_budget == 0) {
+    return _alloc_blocks(min_blocks, LOG_BLOCK_BUFFER_COUNT);
+  }
+
+  // the buffers about to be replaced count as free
+  _free_blocks();
+  if (queued) {
+    _set_queue_size(0);
+  }
+  free_ram = freeMemory();
+  budget = free_ram > LOG_RESERVED_RAM ? free_ram - LOG_RESERVED_RAM : 0;
+  if (budget > _log->_ram_budget) {
+    budget = _log->_ram_budget;
+  }
+  _log->_ram_budget_used = budget;
+
+  blocks = (queued ? budget / 2 : budget) >> 9;
+  if (queued && blocks == 0 && budget >= 512 + LOG_QUEUE_MIN) {
+    blocks = 1;
+  }
+  if (blocks > LOG_BLOCK_BUFFER_MAX) {
+    blocks = LOG_BLOCK_BUFFER_MAX;
+  }
+  ret = _alloc_blocks(min_blocks, blocks);
+
+  if (queued) {
+    rest = budget - ((unsigned long) _log->_block_count << 9);
+    if (rest > LOG_QUEUE_MAX) {
+      rest = LOG_QUEUE_MAX;
+    } else if (rest < LOG_QUEUE_MIN) {
+      rest = LOG_QUEUE_MIN;
+    }
+    ret = _set_queue_size(rest) && ret;
+  }
+  return ret;
+}
+
+/**
+ * Sets the RAM budget beginDataLog sizes the block accumulator and log
+ * queue to, see ArdusatLogging.h. Applies from the next beginDataLog on.
+ * As beginDataLog may then resize the queue, it must not be called while
+ * records may be logged from an interrupt.
+ *
+ * @param bytes most RAM to use for the buffers, LOG_RAM_AUTO for everything
+ *        above LOG_RESERVED_RAM, or 0 for the fixed LOG_BLOCK_BUFFER_COUNT
+ *        buffers
+ *
+ * @return true
+ */
+bool DataLog::setRamBudget(unsigned int bytes)
+{
+  LogScope scope(this);
+
+  _log->_ram_budget = bytes;
+  return true;
+}
+
+/**
+ * Reports the buffer configuration of the log, see log_config_t.
+ *
+ * @param config filled in with the configuration
+ */
+void DataLog::getConfig(log_config_t *config)
+{
+  LogScope scope(this);
+
+  config->ramBudget = _log->_ram_budget_used;
+  config->freeRam = freeMemory();
+  config->blockBuffers = _log->_block_count;
+  config->queueBytes = _log->_queue_size;
+  config->cacheBlocks = SD_CACHE_BLOCK_COUNT;
+  config->spiDivisor = sd.card()->sckDivisor();
+}
+
+/**
+ * Prints the buffer configuration of the log, one value per line.
+ *
+ * @param port to print to, e.g. &Serial
+ */
+void printLogConfig(Print *port)
+{
+  log_config_t config;
+
+  getLogConfig(&config);
+  port->print(F("ram budget: "));
+  port->println(config.ramBudget);
+  port->print(F("free ram: "));
+  port->println(config.freeRam);
+  port->print(F("block buffers: "));
+  port->println(config.blockBuffers);
+  port->print(F("queue bytes: "));
+  port->println(config.queueBytes);
+  port->print(F("cache blocks: "));
+  port->println(config.cacheBlocks);
+  port->print(F("spi divisor: "));
+  port->println(config.spiDivisor);
+}
+
+/**
+ * Writes queued records to the SD card, without waiting for the card: if it
+ * is still busy, the remaining records stay queued for the next call. Also
+ * writes a burst that is due, see setLogBurst. Call this regularly from the
+ * main loop when a log queue or burst flushing is used.
+ *
+ * @return true if successful, false if a record couldn't be written
+ */
+bool DataLog::service()
+{
+  LogScope scope(this);
+  bool ret = true;
+
+  if (!_log->_file.isOpen()) {
+    return true;
+  }
+  if (_log->_queue_buf != NULL) {
+    ret = _queue_drain(false);
+  }
+  // records left in the queue while bursting didn't fit in the accumulator
+  if (_log->_burst_interval > 0 && _log->_block_count > 0 &&
+      (_burst_due() || _log->_queue_tail != _log->_queue_head)) {
+    ret = _flush_log() && ret;
+  }
+  // create the next file of a rotating log while there is nothing to write
+  if (_log->_rotation != LOG_ROTATE_NONE && !_log->_rotation_failed &&
+      !_log->_next_file.isOpen() && _log->_queue_tail == _log->_queue_head &&
+      sd.card()->writePoll()) {
+    _prepare_next_log();
+  }
+  return ret;
+}
+
+/**
+ * Sets the function called while the SD card is busy, see ArdusatLogging.h.
+ * The card is shared by all logs, so this applies to all of them.
+ *
+ * @param callback function to call, NULL for none
+ *
+ * @return true
+ */
+bool setLogBusyCallback(void (*callback)(void))
+{
+  Sd2Card::setBusyCallback(callback);
+  return true;
+}
+
+/**
+ * @return number of records dropped because the log queue was full
+ */
+unsigned long DataLog::getOverruns()
+{
+  LogScope scope(this);
+  unsigned long overruns;
+
+  LOG_ATOMIC {
+    overruns = _log->_queue_overruns;
+  }
+  return overruns;
+}
+
+/**
+ * Copies the logging statistics, see log_stats_t.
+ *
+ * @param stats filled in with the counts since startup or resetLogStats, or
+ *        zeroed if LOG_STATS is off
+ *
+ * @return true if successful, false if statistics are not compiled in
+ */
+bool DataLog::getStats(log_stats_t *stats)
+{
+  LogScope scope(this);
+
+#if LOG_STATS
+  *stats = _log->_stats;
+  stats->overruns = getOverruns();
+  stats->busyWaits = sdStats.busyWaits;
+  stats->busyMicros = sdStats.busyMicros;
+  stats->maxBusyMicros = sdStats.maxBusyMicros;
+  stats->cacheMisses = sdStats.cacheMisses;
+  stats->cacheHits = sdStats.cacheHits;
+  stats->clusterAllocs = sdStats.clusterAllocs;
+  stats->writeErrors = sdStats.writeErrors;
+  return true;
+#else  // LOG_STATS
+  memset(stats, 0, sizeof(*stats));
+  return false;
+#endif  // LOG_STATS
+}
+
+/**
+ * Zeroes the logging statistics. The log queue overrun count is kept, see
+ * getLogOverruns.
+ */
+void DataLog::resetStats()
+{
+  LogScope scope(this);
+
+#if LOG_STATS
+  memset(&_log->_stats, 0, sizeof(_log->_stats));
+  memset(&sdStats, 0, sizeof(sdStats));
+#endif  // LOG_STATS
+}
+
+/**
+ * Prints the logging statistics, one count per line, with the write time
+ * histogram buckets that are not empty.
+ *
+ * @param port where to print, e.g. &Serial
+ */
+void printLogStats(Print *port)
+{
+  LogScope scope(&_default_log);
+
+#if LOG_STATS
+  log_stats_t stats;
+  uint8_t i;
+
+  getLogStats(&stats);
+  port->print(F("records: "));
+  port->println(stats.records);
+  port->print(F("bytes: "));
+  port->println(stats.bytes);
+  port->print(F("syncs: "));
+  port->println(stats.syncs);
+  port->print(F("overruns: "));
+  port->println(stats.overruns);
+  port->print(F("max write us: "));
+  port->println(stats.maxWriteMicros);
+  for (i = 0; i < LOG_STATS_BUCKETS; i++) {
+    if (stats.writeMicros[i] == 0) {
+      continue;
+    }
+    if (i < LOG_STATS_BUCKETS - 1) {
+      port->print(F("writes < "));
+      port->print(1UL << i);
+    } else {
+      port->print(F("writes >= "));
+      port->print(1UL << (i - 1));
+    }
+    port->print(F(" us: "));
+    port->println(stats.writeMicros[i]);
+  }
+  port->print(F("busy waits: "));
+  port->println(stats.busyWaits);
+  port->print(F("busy us: "));
+  port->println(stats.busyMicros);
+  port->print(F("max busy us: "));
+  port->println(stats.maxBusyMicros);
+  port->print(F("cache misses: "));
+  port->println(stats.cacheMisses);
+  port->print(F("cache hits: "));
+  port->println(stats.cacheHits);
+  port->print(F("cluster allocs: "));
+  port->println(stats.clusterAllocs);
+  port->print(F("write errors: "));
+  port->println(stats.writeErrors);
+#else  // LOG_STATS
+  (void) port;
+#endif  // LOG_STATS
+}
+
+/*
+ * Writes a record that was formatted into the SD cache (the shared output
+ * buffer) without an accumulator to pack it into. SdBaseFile::write reloads
+ * the cache with the file's current block before copying, which would wipe
+ * the record, so it is moved onto the stack first, followed by its CRC byte
+ * if crc isn't NULL. The copy is bounded by the 255 byte record limit and
+ * keeps the CSV path off the heap. Kept out of line so that only this path
+ * pays for the stack space.
+ */
+static int __attribute__((noinline)) _write_from_cache(const unsigned char *buffer, unsigned char numBytes,
+                                                       const uint8_t *crc)
+{
+  unsigned char record[UCHAR_MAX + 1];
+
+  memcpy(record, buffer, numBytes);
+  if (crc != NULL) {
+    record[numBytes] = *crc;
+  }
+  return _log->_file.write(record, numBytes + (crc != NULL));
+}
+
+/**
+ * Log the byte array pointed to by buffer to the SD card. Note that there is
+ * absolutely no safety checking on numBytes, so use with care.
+ *
+ * The file is synced according to the policy set with setLogSyncPolicy (by
+ * default, after every call). High-rate logs are written a block at a time
+ * instead.
+ *
+ * Records are packed into the block accumulator when its buffers could be
+ * allocated. Otherwise they are written straight to the file (see
+ * _write_from_cache for buffers shared with the SD cache).
+ *
+ * @param buffer byte array to log
+ * @param number of bytes to log 
+ *
+ * @return number of bytes written
+ */
+static int _log_record(const unsigned char *buffer, unsigned char numBytes)
+{
+  if (numBytes > OUTPUT_BUF_SIZE - 1) {
+    numBytes = OUTPUT_BUF_SIZE - 1;
+  }
+
+  if (!_log->_file.isOpen()) {
+    return 0;
+  }
+  // the next compact CSV line restarts the timestamp deltas, in case this
+  // one starts with a timestamp of its own
+  _log->_csv_time_valid = false;
+  if (_log->_queue_buf != NULL) {
+    return _queue_write(buffer, numBytes);
+  }
+  return _write_record(buffer, numBytes);
+}
+
+/*
+ * Sends a record to the serial tee in a stream frame, see BinaryDataFmt.h,
+ * along with its CRC byte if recordCrc isn't NULL.
+ */
+static void _tee_record(const unsigned char *buffer, unsigned char numBytes,
+                        const uint8_t *recordCrc)
+{
+  uint8_t head[3] = {ARDUSAT_STREAM_SYNC0, ARDUSAT_STREAM_SYNC1,
+                     (uint8_t) (numBytes + (recordCrc != NULL))};
+  uint16_t crc = crcCcitt(0, head + 2, 1);
+
+  crc = crcCcitt(crc, buffer, numBytes);
+  _log->_serial_tee->write(head, sizeof(head));
+  _log->_serial_tee->write(buffer, numBytes);
+  if (recordCrc != NULL) {
+    crc = crcCcitt(crc, recordCrc, 1);
+    _log->_serial_tee->write(*recordCrc);
+  }
+  _log->_serial_tee->write((uint8_t) crc);
+  _log->_serial_tee->write((uint8_t) (crc >> 8));
+}
+
+/*
+ * Writes an epoch anchor (see BinaryDataFmt.h) for the current millis().
+ */
+static int _log_epoch(uint32_t now)
+{
+  unsigned char buf[3 + 6];
+
+  buf[0] = 0xFF;
+  buf[1] = ARDUSAT_CONTROL_EPOCH;
+  buf[2] = 6;
+  buf[3] = _log->_millis_epoch;
+  buf[4] = _log->_millis_epoch >> 8;
+  memcpy(buf + 5, &now, 4);
+  _log->_epoch_millis = now;
+  return _write_record(buf, sizeof(buf));
+}
+
+/*
+ * Writes an index record (see BinaryDataFmt.h) once the log has reached
+ * _index_due, unless the log is about to rotate. Compact streams restart
+ * with key records after it, so decoding can start there.
+ */
+static void _check_index()
+{
+  unsigned char buf[ARDUSAT_INDEX_SIZE];
+  uint32_t now, pos;
+  uint16_t crc;
+
+  if (LOG_INDEX_INTERVAL == 0 || _log->_csv_log || _log->_log_bytes < _log->_index_due) {
+    return;
+  }
+  _log->_index_due = (_log->_log_bytes / LOG_INDEX_INTERVAL + 1) * LOG_INDEX_INTERVAL;
+  if (_rotation_due(sizeof(buf))) {
+    return;
+  }
+  // a framed log starts the next block with its header first
+  pos = _log->_log_bytes;
+  if (_log->_framed_log && _log->_block_offset == 0) {
+    pos += ARDUSAT_BLOCK_HEADER_SIZE;
+  }
+  now = millis();
+  buf[0] = 0xFF;
+  buf[1] = ARDUSAT_CONTROL_INDEX;
+  buf[2] = sizeof(buf) - 3;
+  buf[3] = _log->_millis_epoch;
+  buf[4] = _log->_millis_epoch >> 8;
+  memcpy(buf + 5, &now, 4);
+  memcpy(buf + 9, &pos, 4);
+  crc = crcCcitt(0, buf, sizeof(buf) - 2);
+  buf[13] = crc;
+  buf[14] = crc >> 8;
+  _write_record(buf, sizeof(buf));
+  if (_log->_compact_log) {
+    compactReset(&_log->_compact_streams);
+  }
+}
+
+/*
+ * Counts millis() wraps, and writes an epoch anchor into binary logs when the
+ * top bits of millis() have changed since the last one.
+ */
+static void _check_epoch()
+{
+  uint32_t now = millis();
+
+  if (now < _log->_epoch_millis) {
+    _log->_millis_epoch++;
+  }
+  if ((now >> ARDUSAT_EPOCH_SHIFT) != (_log->_epoch_millis >> ARDUSAT_EPOCH_SHIFT)) {
+    if (!_log->_csv_log && _log->_file.isOpen()) {
+      _log_epoch(now);
+    } else {
+      _log->_epoch_millis = now;
+    }
+  }
+}
+
+/*
+ * Rotates the log and writes the record to the new file. The record may have
+ * been formatted into the SD cache, which rotating reuses, so it is moved
+ * onto the stack first, as in _write_from_cache.
+ */
+static int __attribute__((noinline)) _rotate_and_write(const unsigned char *buffer, unsigned char numBytes)
+{
+  unsigned char record[UCHAR_MAX];
+
+  memcpy(record, buffer, numBytes);
+  _rotate_log();
+  return _write_record(record, numBytes);
+}
+
+/*
+ * Encodes a compact key record, as it was logged, against the streams of the
+ * log. Compact records can be decoded starting from any timestamp marker, and
+ * in logs a decoder picks up again in after damage, framed ones or those with
+ * record CRCs, from the first record of any block: the streams restart there.
+ *
+ * @return size of the record in buf, 0 to write the record as it is
+ */
+static uint8_t _compact_encode(const unsigned char *key, unsigned char numBytes,
+                               unsigned char *buf)
+{
+  uint32_t block = _log->_log_bytes >> 9;
+
+  if (key[0] == 0xFF && key[1] == ARDUSAT_CONTROL_TIMESTAMP) {
+    compactReset(&_log->_compact_streams);
+    return 0;
+  }
+  if ((_log->_framed_log || _log->_crc_log) && block != _log->_compact_block) {
+    compactReset(&_log->_compact_streams);
+    _log->_compact_block = block;
+  }
+  return compactReencode(&_log->_compact_streams, buf, key, numBytes);
+}
+
+/*
+ * Writes a record to the accumulator or the file and applies the sync policy.
+ * Binary logs with record CRCs get the CRC byte after the record.
+ */
+static int _write_record(const unsigned char *buffer, unsigned char numBytes)
+{
+  const unsigned char *cache = sd.vol()->cacheAddress()->data;
+  unsigned char compact[COMPACT_RECORD_MAX_SIZE];
+  int written;
+  uint32_t prev_pos = _log->_log_bytes;
+  uint8_t crc;
+  uint8_t n;
+
+  // a compact record may grow when it is encoded below
+  if (_rotation_due((_log->_compact_log ? COMPACT_RECORD_MAX_SIZE : numBytes) +
+                    _log->_crc_log)) {
+    return _rotate_and_write(buffer, numBytes);
+  }
+  SD_STATS(uint32_t start = micros());
+  // plain logs write through the SD cache
+  if (_log->_block_count == 0) {
+    _claim_card();
+  }
+  _check_epoch();
+  // the record may be in the cache, which writing an index record reuses
+  if (!(buffer >= cache && buffer < cache + sizeof(cache_t))) {
+    _check_index();
+  }
+  if (_log->_compact_log && (n = _compact_encode(buffer, numBytes, compact)) > 0) {
+    buffer = compact;
+    numBytes = n;
+  }
+  if (_log->_crc_log) {
+    crc = crc8(0, buffer, numBytes);
+  }
+  if (_log->_serial_tee != NULL && !_log->_csv_log) {
+    _tee_record(buffer, numBytes, _log->_crc_log ? &crc : NULL);
+  }
+  if (_log->_block_count > 0) {
+    written = _block_write(buffer, numBytes, _log->_crc_log ? &crc : NULL);
+  } else if (buffer >= cache && buffer < cache + sizeof(cache_t)) {
+    written = _write_from_cache(buffer, numBytes, _log->_crc_log ? &crc : NULL);
+  } else {
+    written = _log->_file.write(buffer, numBytes);
+    if (_log->_crc_log && written == numBytes && _log->_file.write(&crc, 1) == 1) {
+      written++;
+    }
+  }
+
+  written = _record_written(prev_pos, written);
+  SD_STATS(_stats_write(start, written));
+  return written;
+}
+
+/*
+ * Aggregation streams, see setLogAggregation. Each accumulates the readings
+ * of its current window with Welford's method, so the mean and variance take
+ * constant memory and don't lose precision to a large running sum.
+ */
+typedef struct log_aggregate_t {
+  uint32_t window;      // ms, 0 for a free stream
+  uint32_t start;       // start of the current window
+  uint32_t n;           // readings in the current window
+  float min;
+  float max;
+  float mean;
+  float m2;             // sum of squared differences from the mean
+  const char *name;     // sensor name of the last CSV reading
+  uint8_t type;
+  uint8_t id;
+} log_aggregate_t;
+
+/*
+ * @return the stream of a sensor, or with anyId the first stream of its
+ *         type, NULL if it isn't aggregated
+ */
+static log_aggregate_t *_find_aggregate(uint8_t type, uint8_t id, bool anyId)
+{
+  uint8_t i;
+
+  for (i = 0; _log->_aggregates != NULL && i < LOG_AGGREGATE_STREAMS; i++) {
+    if (_log->_aggregates[i].window > 0 && _log->_aggregates[i].type == type &&
+        (anyId || _log->_aggregates[i].id == id)) {
+      return &_log->_aggregates[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Logs the summary of a stream's current window and empties the window.
+ *
+ * @return number of bytes written
+ */
+static int _log_summary(log_aggregate_t *a)
+{
+  unsigned char buf[6 + 4 * ARDUSAT_SUMMARY_FIELDS];
+  float values[ARDUSAT_SUMMARY_FIELDS];
+
+  values[0] = a->n;
+  values[1] = a->min;
+  values[2] = a->max;
+  values[3] = a->mean;
+  values[4] = a->n > 1 ? sqrt(a->m2 / (a->n - 1)) : 0;
+  a->n = 0;
+
+  if (a->name != NULL) {
+    return _log_csv_values(a->type, a->name, a->start, values,
+                           ARDUSAT_SUMMARY_FIELDS);
+  }
+  buf[0] = ARDUSAT_RECORD_SUMMARY | a->type;
+  buf[1] = a->id;
+  memcpy(buf + 2, &a->start, 4);
+  memcpy(buf + 6, values, sizeof(values));
+  return _log_record(buf, sizeof(buf));
+}
+
+/*
+ * Adds a reading to its sensor's stream, first logging the summary of the
+ * current window if the reading is past its end (or before its start, after
+ * the clock went back). sensorName is NULL for binary log calls.
+ *
+ * @return -1 if the sensor isn't aggregated, so the reading is to be logged,
+ *         otherwise the number of bytes written for an ended window
+ */
+static int _aggregate(uint8_t type, uint8_t id, const char *sensorName,
+                      uint32_t timestamp, float value)
+{
+  log_aggregate_t *a;
+  int written = 0;
+  float delta;
+
+  if (_log->_aggregates == NULL ||
+      (a = _find_aggregate(type, id, sensorName != NULL)) == NULL) {
+    return -1;
+  }
+  if (isnan(value)) {
+    return 0;
+  }
+  if (a->n > 0 && timestamp - a->start >= a->window) {
+    written = _log_summary(a);
+  }
+  if (a->n == 0) {
+    a->start = timestamp - timestamp % a->window;
+    a->min = value;
+    a->max = value;
+    a->mean = 0;
+    a->m2 = 0;
+  }
+  a->name = sensorName;
+  if (value < a->min) {
+    a->min = value;
+  } else if (value > a->max) {
+    a->max = value;
+  }
+  a->n++;
+  delta = value - a->mean;
+  a->mean += delta / a->n;
+  a->m2 += delta * (value - a->mean);
+  return written;
+}
+
+/*
+ * Deadband filters, see setLogDeadband. Each keeps the last logged reading
+ * of its sensor, which later readings are compared with.
+ */
+typedef struct log_deadband_t {
+  float threshold;
+  uint32_t heartbeat;   // ms, 0 for none
+  uint32_t last;        // timestamp of the last logged reading
+  float values[ARDUSAT_COMPACT_MAX_VALUES];  // last logged reading
+  uint8_t mode;         // log_deadband_e, LOG_DEADBAND_OFF for a free filter
+  uint8_t type;
+  uint8_t id;
+  bool logged;          // a reading was logged in the current file
+} log_deadband_t;
+
+/*
+ * @return the filter of a sensor, or with anyId the first filter of its
+ *         type, NULL if it has none
+ */
+static log_deadband_t *_find_deadband(uint8_t type, uint8_t id, bool anyId)
+{
+  uint8_t i;
+
+  for (i = 0; _log->_deadbands != NULL && i < LOG_DEADBAND_STREAMS; i++) {
+    if (_log->_deadbands[i].mode != LOG_DEADBAND_OFF && _log->_deadbands[i].type == type &&
+        (anyId || _log->_deadbands[i].id == id)) {
+      return &_log->_deadbands[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Decides whether a reading gets past its sensor's deadband: the first
+ * reading of a file does, then readings that moved past the threshold from
+ * the last logged one, or come a heartbeat after it. A reading that passes
+ * becomes the one later readings are compared with.
+ *
+ * @return true if the reading is to be logged
+ */
+static bool _deadband_pass(uint8_t type, uint8_t id, bool anyId,
+                           uint32_t timestamp, const float *values,
+                           uint8_t numValues)
+{
+  log_deadband_t *b;
+  float limit;
+  bool pass;
+  uint8_t i;
+
+  if (_log->_deadbands == NULL || (b = _find_deadband(type, id, anyId)) == NULL) {
+    return true;
+  }
+  pass = !b->logged || (b->heartbeat > 0 && timestamp - b->last >= b->heartbeat);
+  for (i = 0; !pass && i < numValues; i++) {
+    limit = b->threshold;
+    if (b->mode == LOG_DEADBAND_RELATIVE) {
+      limit *= fabs(b->values[i]);
+    }
+    pass = isnan(values[i]) != isnan(b->values[i]) ||
+           fabs(values[i] - b->values[i]) > limit;
+  }
+  if (pass) {
+    b->logged = true;
+    b->last = timestamp;
+    memcpy(b->values, values, numValues * sizeof(float));
+  }
+  return pass;
+}
+
+/*
+ * Makes every filter log the next reading, so each file starts with one.
+ */
+static void _reset_deadbands()
+{
+  uint8_t i;
+
+  for (i = 0; _log->_deadbands != NULL && i < LOG_DEADBAND_STREAMS; i++) {
+    _log->_deadbands[i].logged = false;
+  }
+}
+
+/*
+ * Logs a CSV line of sensor readings, unless the sensor's deadband drops
+ * them.
+ */
+static int _log_csv_reading(uint8_t type, const char *sensorName,
+                            uint32_t timestamp, const float *values,
+                            uint8_t numValues)
+{
+  if (!_deadband_pass(type, 0, true, timestamp, values, numValues)) {
+    return 0;
+  }
+  return _log_csv_values(type, sensorName, timestamp, values, numValues);
+}
+
+/*
+ * Logs a CSV line of a single value sensor, unless the sensor is aggregated.
+ */
+static int _log_csv_value(uint8_t type, const char *sensorName,
+                          uint32_t timestamp, const float *value)
+{
+  int written = _aggregate(type, 0, sensorName, timestamp, *value);
+
+  return written >= 0 ? written :
+         _log_csv_reading(type, sensorName, timestamp, value, 1);
+}
+
+/*
+ * Logs the partial windows of all streams, at the end of a log.
+ */
+static void _end_aggregates()
+{
+  uint8_t i;
+
+  for (i = 0; _log->_aggregates != NULL && i < LOG_AGGREGATE_STREAMS; i++) {
+    if (_log->_aggregates[i].window > 0 && _log->_aggregates[i].n > 0) {
+      _log_summary(&_log->_aggregates[i]);
+    }
+  }
+}
+
+/**
+ * Logs a line of CSV formatted acceleration data to the SD card.
+ *
+ * @param sensorName of this sensor
+ * @param data acceleration_t data to log 
+ *
+ * @return number of bytes written
+ */
+int DataLog::logAcceleration(const char *sensorName, acceleration_t & data)
+{
+  LogScope scope(this);
+
+  return _log_csv_reading(ARDUSAT_SENSOR_TYPE_ACCELERATION, sensorName,
+                          data.header.timestamp, &data.x, 3);
+}
+
+/**
+ * Logs a line of CSV formatted magnetic data to the SD card.
+ *
+ * @param sensorName of this sensor
+ * @param data magnetic_t data to log
+ *
+ * @return number of bytes written
+ */
+int DataLog::logMagnetic(const char *sensorName, magnetic_t & data)
+{
+  LogScope scope(this);
+
+  return _log_csv_reading(ARDUSAT_SENSOR_TYPE_MAGNETIC, sensorName,
+                          data.header.timestamp, &data.x, 3);
+}
+
+/**
+ * Logs a line of CSV formatted orientation data to the SD card.
+ *
+ * @param sensorName of this sensor
+ * @param data gyro_t data to log
+ *
+ * @return number of bytes written
+ */
+int DataLog::logGyro(const char *sensorName, gyro_t & data)
+{
+  LogScope scope(this);
+
+  return _log_csv_reading(ARDUSAT_SENSOR_TYPE_GYRO, sensorName,
+                          data.header.timestamp, &data.x, 3);
+}
+
+/**
+ * Logs a line of CSV formatted tempoerature data to the SD card.
+ *
+ * @param sensorName of this sensor
+ * @param data temperature_t data to log
+ *
+ * @return number of bytes written
+ */
+int DataLog::logTemperature(const char *sensorName, temperature_t & data)
+{
+  LogScope scope(this);
+
+  return _log_csv_value(ARDUSAT_SENSOR_TYPE_TEMPERATURE, sensorName,
+                        data.header.timestamp, &data.t);
+}
+
+/**
+ * Logs a line of CSV formatted luminosity data to the SD card.
+ *
+ * @param sensorName of this sensor
+ * @param data luminosity_t data to log
+ *
+ * @return number of bytes written
+ */
+int DataLog::logLuminosity(const char *sensorName, luminosity_t & data)
+{
+  LogScope scope(this);
+
+  return _log_csv_value(ARDUSAT_SENSOR_TYPE_LUMINOSITY, sensorName,
+                        data.header.timestamp, &data.lux);
+}
+
+/**
+ * Logs a line of CSV formatted UV light data to the SD card.
+ *
+ * @param sensorName of this sensor
+ * @param data uvlight_t data to log
+ *
+ * @return number of bytes written
+ */
+int DataLog::logUVLight(const char *sensorName, uvlight_t & data)
+{
+  LogScope scope(this);
+
+  return _log_csv_value(ARDUSAT_SENSOR_TYPE_UV, sensorName,
+                        data.header.timestamp, &data.uvindex);
+}
+
+/**
+ * Logs a line of CSV formatted orientation data to SD card.
+ *
+ * @param sensorName of this sensor
+ * @param data orientation_t data to log
+ *
+ * @return number of bytes written
+ */
+int DataLog::logOrientation(const char *sensorName, orientation_t & data)
+{
+  LogScope scope(this);
+
+  return _log_csv_reading(ARDUSAT_SENSOR_TYPE_ORIENTATION, sensorName,
+                          data.header.timestamp, &data.roll, 3);
+}
+
+/**
+ * Logs a line of CSV formatted pressure data to SD card.
+ *
+ * @param sensorName of this sensor
+ * @param data pressure_t data to log
+ *
+ * @return number of bytes written
+ */
+int DataLog::logPressure(const char *sensorName, pressure_t & data)
+{
+  LogScope scope(this);
+
+  return _log_csv_value(ARDUSAT_SENSOR_TYPE_PRESSURE, sensorName,
+                        data.header.timestamp, &data.pressure);
+}
+
+/*
+ * Logs one binary record in the encoding chosen with setBinaryLogEncoding.
+ * Float records are packed by their BinaryRecord description, straight into
+ * the block accumulator where possible (see logRecord). Int16 records use
+ * the same layout with scaled int16 values, packed byte by byte so no struct
+ * padding ends up in the file.
+ */
+static int16_t _to_int16(float value, uint16_t scale)
+{
+  float q;
+
+  if (isnan(value)) {
+    return 0;
+  }
+  q = value * scale;
+  if (q >= INT16_VALUE_LIMIT) {
+    return INT16_VALUE_LIMIT;
+  } else if (q <= -INT16_VALUE_LIMIT) {
+    return -INT16_VALUE_LIMIT;
+  }
+  return q < 0 ? (int16_t) (q - 0.5f) : (int16_t) (q + 0.5f);
+}
+
+static int _binary_log_scaled(uint8_t type, uint8_t sensorId,
+                              uint32_t timestamp, const float *values,
+                              uint8_t numValues)
+{
+  unsigned char buf[COMPACT_RECORD_MAX_SIZE];
+  int16_t q;
+  uint8_t i;
+
+  if (_log->_binary_encoding == LOG_BINARY_COMPACT) {
+    // a key record for now, _write_record encodes it against the streams
+    return _log_record(buf, compactEncode(NULL, buf, type, sensorId,
+                                          timestamp, values, numValues));
+  }
+
+  buf[0] = type | ARDUSAT_RECORD_INT16;
+  buf[1] = sensorId;
+  memcpy(buf + 2, &timestamp, 4);
+  for (i = 0; i < numValues; i++) {
+    q = _to_int16(values[i], _log->_int16_scales[type]);
+    buf[6 + 2 * i] = q;
+    buf[7 + 2 * i] = q >> 8;
+  }
+  return _log_record(buf, 6 + 2 * numValues);
+}
+
+template <class Record>
+static int _binary_log(DataLog *log, uint8_t sensorId, uint32_t timestamp,
+                       const float *values)
+{
+  int written;
+
+  if (Record::count == 1 && (written = _aggregate(Record::typeByte, sensorId,
+                             NULL, timestamp, values[0])) >= 0) {
+    return written;
+  }
+  if (!_deadband_pass(Record::typeByte, sensorId, false, timestamp, values,
+                      Record::count)) {
+    return 0;
+  }
+  if (_log->_binary_encoding == LOG_BINARY_INT16 ||
+      (_log->_binary_encoding == LOG_BINARY_COMPACT && _log->_compact_log)) {
+    return _binary_log_scaled(Record::typeByte, sensorId, timestamp, values,
+                              Record::count);
+  }
+  return log->logRecord<Record>(sensorId, timestamp, values);
+}
+
+/**
+ * Reserves room for a record of numBytes in the block accumulator, so that
+ * it can be packed in place (see logRecord). The record must be stored and
+ * logCommit called before anything else is logged.
+ *
+ * @param numBytes size of the record
+ *
+ * @return where to store the record, NULL if it can't be written in place
+ *         (no accumulator, a log queue, serial tee or block framing, a
+ *         rotation due, a full high-rate log, or the record would span two
+ *         blocks), in which case log it with logBytes instead
+ */
+unsigned char *DataLog::logReserve(unsigned char numBytes)
+{
+  LogScope scope(this);
+  unsigned char *dst;
+  uint16_t space;
+
+  if (!_log->_file.isOpen() || _log->_block_count == 0 || _log->_queue_buf != NULL ||
+      (_log->_serial_tee != NULL && !_log->_csv_log) || _log->_framed_log ||
+      numBytes > OUTPUT_BUF_SIZE - 1 || _rotation_due(numBytes + _log->_crc_log) ||
+      (_log->_raw_log && _raw_capacity() < (uint16_t) (numBytes + _log->_crc_log))) {
+    return NULL;
+  }
+  _check_epoch();
+  _check_index();
+  dst = _block_reserve(&space);
+  // room for the record's CRC byte too
+  return dst != NULL && space >= numBytes + _log->_crc_log ? dst : NULL;
+}
+
+/**
+ * Logs a record stored at the space returned by logReserve, adding its CRC
+ * byte in a log with record CRCs.
+ *
+ * @param numBytes size of the record, as reserved
+ *
+ * @return number of bytes written
+ */
+int DataLog::logCommit(unsigned char numBytes)
+{
+  LogScope scope(this);
+  uint32_t prev_pos = _log->_log_bytes;
+  unsigned char *dst;
+  int written;
+
+  SD_STATS(uint32_t start = micros());
+  if (_log->_crc_log) {
+    dst = _block_at(_log->_block_head) + _log->_block_offset;
+    dst[numBytes] = crc8(0, dst, numBytes);
+  }
+  _block_commit(numBytes + _log->_crc_log);
+  // Failures here are retried on the next write
+  if (_log->_burst_interval == 0) {
+    _write_queued(0, false);
+  }
+  written = _record_written(prev_pos, numBytes + _log->_crc_log);
+  SD_STATS(_stats_write(start, written));
+  return written;
+}
+
+/*
+ * Writes a record type control record, see BinaryDataFmt.h. names points to
+ * the record's names in PROGMEM, terminated by a newline or NUL.
+ */
+static int _log_record_type(uint8_t recordType, uint8_t size,
+                            uint8_t fieldType, uint8_t fieldCount,
+                            const char *names)
+{
+  unsigned char buf[7 + 40];
+  uint8_t len = 7;
+  char c;
+
+  while (len < sizeof(buf) &&
+         (c = pgm_read_byte(names++)) != '\0' && c != '\n') {
+    buf[len++] = c;
+  }
+  buf[0] = 0xFF;
+  buf[1] = ARDUSAT_CONTROL_RECORD_TYPE;
+  buf[2] = len - 3;
+  buf[3] = recordType;
+  buf[4] = size;
+  buf[5] = fieldType;
+  buf[6] = fieldCount;
+  return _write_record(buf, len);
+}
+
+/*
+ * Writes the record type control record of a sensor type's summary records.
+ */
+static int _log_summary_type(uint8_t type)
+{
+  const char *names = summary_field_names;
+  uint8_t i;
+
+  for (i = ARDUSAT_SENSOR_TYPE_TEMPERATURE; i < type; i++) {
+    while (pgm_read_byte(names++) != '\n');
+  }
+  return _log_record_type(ARDUSAT_RECORD_SUMMARY | type,
+                          6 + 4 * ARDUSAT_SUMMARY_FIELDS, ARDUSAT_FIELD_FLOAT,
+                          ARDUSAT_SUMMARY_FIELDS, names);
+}
+
+/*
+ * Writes the deadband control record of a filtered sensor.
+ */
+static int _log_deadband(const log_deadband_t *b)
+{
+  unsigned char buf[3 + 6];
+
+  buf[0] = 0xFF;
+  buf[1] = ARDUSAT_CONTROL_DEADBAND;
+  buf[2] = 6;
+  buf[3] = b->type;
+  buf[4] = b->id;
+  memcpy(buf + 5, &b->heartbeat, 4);
+  return _write_record(buf, sizeof(buf));
+}
+
+/*
+ * Custom record types registered with logRecordType, described in the header
+ * of every binary log file after the built-in ones.
+ */
+static struct {
+  uint8_t type;
+  uint8_t size;
+  uint8_t fieldType;
+  uint8_t fieldCount;
+  const char *names;
+} _custom_types[LOG_CUSTOM_RECORD_TYPES];
+static uint8_t _custom_type_count = 0;
+
+/*
+ * Writes the binary file header: the file header control record and the
+ * description of every record type the chosen encoding produces.
+ */
+static void _log_file_header()
+{
+  static const uint8_t field_counts[] = ARDUSAT_SENSOR_FIELD_COUNTS;
+  unsigned char buf[3 + 5];
+  const char *names = record_field_names;
+  uint8_t type;
+
+  buf[0] = 0xFF;
+  buf[1] = ARDUSAT_CONTROL_FILE_HEADER;
+  buf[2] = 5;
+  memcpy(buf + 3, ARDUSAT_FILE_MAGIC, 3);
+  buf[6] = ARDUSAT_FILE_VERSION;
+  buf[7] = _log->_crc_log ? ARDUSAT_FILE_RECORD_CRC : 0;
+#if LOG_RECOVER
+  if (_log->_log_preallocated) {
+    buf[7] |= ARDUSAT_FILE_OPEN;
+  }
+#endif  // LOG_RECOVER
+  _write_record(buf, sizeof(buf));
+
+  for (type = 0; type < sizeof(field_counts); type++) {
+    if (_log->_compact_log) {
+      _log_record_type(ARDUSAT_RECORD_COMPACT_KEY | type, 0,
+                       ARDUSAT_FIELD_ZIGZAG, field_counts[type], names);
+      _log_record_type(ARDUSAT_RECORD_COMPACT_DELTA | type, 0,
+                       ARDUSAT_FIELD_ZIGZAG, field_counts[type], names);
+    } else if (_log->_binary_encoding == LOG_BINARY_INT16) {
+      _log_record_type(ARDUSAT_RECORD_INT16 | type, 6 + 2 * field_counts[type],
+                       ARDUSAT_FIELD_INT16, field_counts[type], names);
+    } else {
+      _log_record_type(type, 6 + 4 * field_counts[type],
+                       ARDUSAT_FIELD_FLOAT, field_counts[type], names);
+    }
+    while (pgm_read_byte(names++) != '\n');
+  }
+  _log_record_type(ARDUSAT_SENSOR_TYPE_FRAME, 0, ARDUSAT_FIELD_FLOAT, 0,
+                   frame_field_names);
+  for (type = 0; type < _custom_type_count; type++) {
+    _log_record_type(_custom_types[type].type, _custom_types[type].size,
+                     _custom_types[type].fieldType,
+                     _custom_types[type].fieldCount, _custom_types[type].names);
+  }
+  for (type = ARDUSAT_SENSOR_TYPE_TEMPERATURE;
+       type <= ARDUSAT_SENSOR_TYPE_PRESSURE; type++) {
+    if (_find_aggregate(type, 0, true) != NULL) {
+      _log_summary_type(type);
+    }
+  }
+  for (type = 0; _log->_deadbands != NULL && type < LOG_DEADBAND_STREAMS; type++) {
+    if (_log->_deadbands[type].mode != LOG_DEADBAND_OFF) {
+      _log_deadband(&_log->_deadbands[type]);
+    }
+  }
+}
+
+/*
+ * Writes the start of a compact CSV log file: the marker line, then the
+ * sensor names given ids so far, as lines still in the log queue may use
+ * them.
+ */
+static void _log_csv_header()
+{
+  char line[8 + LOG_CSV_NAMES_SIZE];
+  uint8_t pos, len;
+  uint8_t id = 1;
+  int written = 0;
+
+  strcpy_P(line, csv_compact_header);
+  _write_record((const unsigned char *) line, strlen(line));
+  for (pos = 0; pos < _log->_csv_names_len; pos += len + 1, id++) {
+    len = strlen(_log->_csv_names + pos);
+    _csv_line = line;
+    _csv_line_len = 0;
+    _csv_put("#", 1, &written);
+    _csv_put_dec(id, '=', &written);
+    _csv_put(_log->_csv_names + pos, len, &written);
+    _csv_put("\n", 1, &written);
+    _csv_line = NULL;
+    _write_record((const unsigned char *) line, _csv_line_len);
+  }
+}
+
+/**
+ * Sets up aggregation of a sensor's readings into one summary per window,
+ * see ArdusatLogging.h. Changing the window of an aggregated sensor first
+ * logs its partial window.
+ *
+ * @param sensorType ARDUSAT_SENSOR_TYPE_TEMPERATURE, _LUMINOSITY, _UV or
+ *        _PRESSURE
+ * @param sensorId id the sensor is logged with by the binaryLog functions
+ * @param windowMillis length of the windows in ms, 0 to stop aggregating
+ *
+ * @return true if successful, false if the sensor type has more than one
+ *         value, the streams can't be allocated or LOG_AGGREGATE_STREAMS
+ *         other sensors are aggregated already
+ */
+bool DataLog::setAggregation(unsigned char sensorType, unsigned char sensorId,
+                             unsigned long windowMillis)
+{
+  LogScope scope(this);
+  log_aggregate_t *a;
+  bool described;
+  uint8_t i;
+
+  if (sensorType < ARDUSAT_SENSOR_TYPE_TEMPERATURE ||
+      sensorType > ARDUSAT_SENSOR_TYPE_PRESSURE) {
+    return false;
+  }
+  if (_log->_aggregates == NULL) {
+    if (windowMillis == 0) {
+      return true;
+    }
+    _log->_aggregates = (log_aggregate_t *) calloc(LOG_AGGREGATE_STREAMS,
+                                                   sizeof(log_aggregate_t));
+    if (_log->_aggregates == NULL) {
+      return false;
+    }
+  }
+
+  described = _find_aggregate(sensorType, 0, true) != NULL;
+  a = _find_aggregate(sensorType, sensorId, false);
+  if (a == NULL) {
+    for (i = 0; i < LOG_AGGREGATE_STREAMS && _log->_aggregates[i].window > 0; i++);
+    if (windowMillis == 0) {
+      return true;
+    } else if (i == LOG_AGGREGATE_STREAMS) {
+      return false;
+    }
+    a = &_log->_aggregates[i];
+    a->type = sensorType;
+    a->id = sensorId;
+    a->n = 0;
+  } else if (a->n > 0 && _log->_file.isOpen()) {
+    _log_summary(a);
+  }
+  a->n = 0;
+  a->window = windowMillis;
+
+  if (!described && _log->_file.isOpen() && !_log->_csv_log) {
+    _log_summary_type(sensorType);
+  }
+  return true;
+}
+
+/**
+ * Sets up a deadband filter of a sensor's readings, see ArdusatLogging.h.
+ * The next reading of the sensor is always logged. A binary log that is
+ * already open gets the sensor's deadband control record right away.
+ *
+ * @param sensorType ARDUSAT_SENSOR_TYPE_ACCELERATION up to _PRESSURE
+ * @param sensorId id the sensor is logged with by the binaryLog functions
+ * @param mode LOG_DEADBAND_ABSOLUTE, _RELATIVE, or _OFF to stop filtering
+ * @param threshold how far a reading must move from the last logged one to
+ *        be logged, in the sensor's units or as a fraction of the last value
+ * @param heartbeatMillis longest time between logged readings in ms, 0 for
+ *        no limit
+ *
+ * @return true if successful, false if the sensor type is not a built-in
+ *         one, the filters can't be allocated or LOG_DEADBAND_STREAMS other
+ *         sensors are filtered already
+ */
+bool DataLog::setDeadband(unsigned char sensorType, unsigned char sensorId,
+                          log_deadband_e mode, float threshold,
+                          unsigned long heartbeatMillis)
+{
+  LogScope scope(this);
+  log_deadband_t *b;
+  uint8_t i;
+
+  if (sensorType > ARDUSAT_SENSOR_TYPE_PRESSURE ||
+      mode > LOG_DEADBAND_RELATIVE) {
+    return false;
+  }
+  if (_log->_deadbands == NULL) {
+    if (mode == LOG_DEADBAND_OFF) {
+      return true;
+    }
+    _log->_deadbands = (log_deadband_t *) calloc(LOG_DEADBAND_STREAMS,
+                                                 sizeof(log_deadband_t));
+    if (_log->_deadbands == NULL) {
+      return false;
+    }
+  }
+
+  b = _find_deadband(sensorType, sensorId, false);
+  if (b == NULL) {
+    for (i = 0; i < LOG_DEADBAND_STREAMS &&
+                _log->_deadbands[i].mode != LOG_DEADBAND_OFF; i++);
+    if (mode == LOG_DEADBAND_OFF) {
+      return true;
+    } else if (i == LOG_DEADBAND_STREAMS) {
+      return false;
+    }
+    b = &_log->_deadbands[i];
+    b->type = sensorType;
+    b->id = sensorId;
+  }
+  b->mode = mode;
+  b->threshold = fabs(threshold);
+  b->heartbeat = heartbeatMillis;
+  b->logged = false;
+
+  if (mode != LOG_DEADBAND_OFF && _log->_file.isOpen() && !_log->_csv_log) {
+    _log_deadband(b);
+  }
+  return true;
+}
+
+/**
+ * Describes a custom record type, so that it is listed in the header of
+ * every binary log file and the decoders can decode it. A binary log that
+ * is already open gets the description right away. Registering a type again
+ * replaces its description. See logRecordType<Record> for types described
+ * by a BinaryRecord.
+ *
+ * @param recordType type byte of the records, a type from
+ *        ARDUSAT_SENSOR_TYPE_CUSTOM up with the float or int16 encoding
+ * @param size of the records including the type byte
+ * @param fieldType ARDUSAT_FIELD_FLOAT or ARDUSAT_FIELD_INT16
+ * @param fieldCount number of values in each record
+ * @param names record and field names in PROGMEM, comma separated, e.g.
+ *        PSTR("power,volts,amps"), at most 40 characters
+ *
+ * @return true if successful, false if the type is reserved, its encoding
+ *         is not float or int16, or LOG_CUSTOM_RECORD_TYPES other types are
+ *         registered already
+ */
+bool logRecordType(unsigned char recordType, unsigned char size,
+                   unsigned char fieldType, unsigned char fieldCount,
+                   const char *names)
+{
+  LogScope scope(&_default_log);
+  uint8_t encoding = recordType & ARDUSAT_RECORD_ENCODING_MASK;
+  uint8_t i;
+
+  if ((recordType & ARDUSAT_RECORD_TYPE_MASK) < ARDUSAT_SENSOR_TYPE_CUSTOM ||
+      (encoding != ARDUSAT_RECORD_FLOAT && encoding != ARDUSAT_RECORD_INT16)) {
+    return false;
+  }
+  for (i = 0; i < _custom_type_count && _custom_types[i].type != recordType; i++);
+  if (i == LOG_CUSTOM_RECORD_TYPES) {
+    return false;
+  }
+  if (i == _custom_type_count) {
+    _custom_type_count++;
+  }
+  _custom_types[i].type = recordType;
+  _custom_types[i].size = size;
+  _custom_types[i].fieldType = fieldType;
+  _custom_types[i].fieldCount = fieldCount;
+  _custom_types[i].names = names;
+
+  if (_log->_file.isOpen() && !_log->_csv_log) {
+    _log_record_type(recordType, size, fieldType, fieldCount, names);
+  }
+  return true;
+}
+
+/**
+ * Records a name for a sensor in a binary log, for the decoders to show.
+ *
+ * @param sensorType one of the ardusat_sensor_types_e values
+ * @param sensorId id the sensor is logged with
+ * @param name of the sensor, truncated to 32 characters
+ *
+ * @return number of bytes written
+ */
+int DataLog::logSensorName(unsigned char sensorType, unsigned char sensorId,
+                           const char *name)
+{
+  LogScope scope(this);
+  unsigned char buf[5 + 32];
+  uint8_t len = strlen(name);
+
+  if (_log->_csv_log) {
+    return 0;
+  }
+  if (len > 32) {
+    len = 32;
+  }
+  buf[0] = 0xFF;
+  buf[1] = ARDUSAT_CONTROL_SENSOR_NAME;
+  buf[2] = 2 + len;
+  buf[3] = sensorType;
+  buf[4] = sensorId;
+  memcpy(buf + 5, name, len);
+  return _log_record(buf, 5 + len);
+}
+
+/*
+ * Writes the int16 scale table control record, see BinaryDataFmt.h.
+ */
+static int _log_int16_scales()
+{
+  unsigned char buf[3 + sizeof(_log->_int16_scales)];
+  uint8_t i;
+
+  buf[0] = 0xFF;
+  buf[1] = ARDUSAT_CONTROL_INT16_SCALES;
+  buf[2] = sizeof(_log->_int16_scales);
+  for (i = 0; i < sizeof(_log->_int16_scales) / sizeof(_log->_int16_scales[0]); i++) {
+    buf[3 + 2 * i] = _log->_int16_scales[i];
+    buf[4 + 2 * i] = _log->_int16_scales[i] >> 8;
+  }
+  return _write_record(buf, sizeof(buf));
+}
+
+int DataLog::binaryLogAcceleration(const unsigned char sensorId, acceleration_t & data)
+{
+  LogScope scope(this);
+
+  return _binary_log<AccelerationRecord>(this, sensorId, data.header.timestamp,
+                                         &data.x);
+}
+
+int DataLog::binaryLogMagnetic(const unsigned char sensorId, magnetic_t & data)
+{
+  LogScope scope(this);
+
+  return _binary_log<MagneticRecord>(this, sensorId, data.header.timestamp,
+                                     &data.x);
+}
+
+int DataLog::binaryLogGyro(const unsigned char sensorId, gyro_t & data)
+{
+  LogScope scope(this);
+
+  return _binary_log<GyroRecord>(this, sensorId, data.header.timestamp,
+                                 &data.x);
+}
+
+int DataLog::binaryLogTemperature(const unsigned char sensorId, temperature_t & data)
+{
+  LogScope scope(this);
+
+  return _binary_log<TemperatureRecord>(this, sensorId, data.header.timestamp,
+                                        &data.t);
+}
+
+int DataLog::binaryLogLuminosity(const unsigned char sensorId, luminosity_t & data)
+{
+  LogScope scope(this);
+
+  return _binary_log<LuminosityRecord>(this, sensorId, data.header.timestamp,
+                                       &data.lux);
+}
+
+int DataLog::binaryLogUVLight(const unsigned char sensorId, uvlight_t & data)
+{
+  LogScope scope(this);
+
+  return _binary_log<UVLightRecord>(this, sensorId, data.header.timestamp,
+                                    &data.uvindex);
+}
+
+int DataLog::binaryLogOrientation(const unsigned char sensorId, orientation_t & data)
+{
+  LogScope scope(this);
+
+  return _binary_log<OrientationRecord>(this, sensorId, data.header.timestamp,
+                                        &data.roll);
+}
+
+int DataLog::binaryLogPressure(const unsigned char sensorId, pressure_t & data)
+{
+  LogScope scope(this);
+
+  return _binary_log<PressureRecord>(this, sensorId, data.header.timestamp,
+                                     &data.pressure);
+}
+
+/**
+ * Starts a new frame record, discarding any frame that was not ended.
+ *
+ * @param timestamp of all readings in the frame
+ *
+ * @return true if successful, false if the frame buffer can't be allocated
+ */
+bool beginFrame(unsigned long timestamp)
+{
+  LogScope scope(&_default_log);
+
+  if (_frame_buf == NULL &&
+      (_frame_buf = (unsigned char *) malloc(ARDUSAT_FRAME_MAX_SIZE)) == NULL) {
+    return false;
+  }
+  _frame_buf[0] = ARDUSAT_SENSOR_TYPE_FRAME;
+  _frame_buf[1] = 0;
+  memcpy(_frame_buf + 2, &timestamp, 4);
+  _frame_len = ARDUSAT_FRAME_HEADER_SIZE;
+  return true;
+}
+
+/*
+ * Appends a reading to the current frame. Readings are stored in ascending
+ * sensor type order, so a reading may have to be inserted in the middle.
+ */
+static int _frame_log_values(uint8_t type, uint8_t sensorId,
+                             const float *values, uint8_t numValues)
+{
+  static const uint8_t field_counts[] = ARDUSAT_SENSOR_FIELD_COUNTS;
+  uint8_t mask = 1 << type;
+  uint8_t size = 1 + 4 * numValues;
+  uint8_t offset = ARDUSAT_FRAME_HEADER_SIZE;
+  uint8_t t;
+
+  if (_frame_len == 0 || (_frame_buf[1] & mask)) {
+    return 0;
+  }
+
+  for (t = 0; t < type; ++t) {
+    if (_frame_buf[1] & (1 << t)) {
+      offset += 1 + 4 * field_counts[t];
+    }
+  }
+  memmove(_frame_buf + offset + size, _frame_buf + offset, _frame_len - offset);
+  _frame_buf[offset] = sensorId;
+  memcpy(_frame_buf + offset + 1, values, 4 * numValues);
+
+  _frame_buf[1] |= mask;
+  _frame_len += size;
+  return size;
+}
+
+int frameLogAcceleration(const unsigned char sensorId, acceleration_t & data)
+{
+  LogScope scope(&_default_log);
+
+  return _frame_log_values(ARDUSAT_SENSOR_TYPE_ACCELERATION, sensorId,
+                           &data.x, 3);
+}
+
+int frameLogMagnetic(const unsigned char sensorId, magnetic_t & data)
+{
+  LogScope scope(&_default_log);
+
+  return _frame_log_values(ARDUSAT_SENSOR_TYPE_MAGNETIC, sensorId, &data.x, 3);
+}
+
+int frameLogGyro(const unsigned char sensorId, gyro_t & data)
+{
+  LogScope scope(&_default_log);
+
+  return _frame_log_values(ARDUSAT_SENSOR_TYPE_GYRO, sensorId, &data.x, 3);
+}
+
+int frameLogTemperature(const unsigned char sensorId, temperature_t & data)
+{
+  LogScope scope(&_default_log);
+
+  return _frame_log_values(ARDUSAT_SENSOR_TYPE_TEMPERATURE, sensorId,
+                           &data.t, 1);
+}
+
+int frameLogLuminosity(const unsigned char sensorId, luminosity_t & data)
+{
+  LogScope scope(&_default_log);
+
+  return _frame_log_values(ARDUSAT_SENSOR_TYPE_LUMINOSITY, sensorId,
+                           &data.lux, 1);
+}
+
+int frameLogUVLight(const unsigned char sensorId, uvlight_t & data)
+{
+  LogScope scope(&_default_log);
+
+  return _frame_log_values(ARDUSAT_SENSOR_TYPE_UV, sensorId,
+                           &data.uvindex, 1);
+}
+
+int frameLogOrientation(const unsigned char sensorId, orientation_t & data)
+{
+  LogScope scope(&_default_log);
+
+  return _frame_log_values(ARDUSAT_SENSOR_TYPE_ORIENTATION, sensorId,
+                           &data.roll, 3);
+}
+
+int frameLogPressure(const unsigned char sensorId, pressure_t & data)
+{
+  LogScope scope(&_default_log);
+
+  return _frame_log_values(ARDUSAT_SENSOR_TYPE_PRESSURE, sensorId,
+                           &data.pressure, 1);
+}
+
+/**
+ * Writes the current frame to the log as one record. Empty frames are not
+ * written.
+ *
+ * @return number of bytes written
+ */
+int endFrame()
+{
+  LogScope scope(&_default_log);
+  uint8_t len = _frame_len;
+
+  _frame_len = 0;
+  if (len <= ARDUSAT_FRAME_HEADER_SIZE) {
+    return 0;
+  }
+  return _log_record(_frame_buf, len);
+}
+
+
+/*
+ * Helper function to log to the top of the CSV header with the current time
+ */
+int _log_csv_time_header(DateTime & now, unsigned long curr_millis)
+{
+  char fmt_buf[32];
+  _release_cache();
+  _resetOutBuf();
+
+  strcpy_P(fmt_buf, csv_header_fmt);
+
+  sprintf(_getOutBuf(), fmt_buf, now.unixtime(), curr_millis);
+  return _log_record((const unsigned char *) _getOutBuf(),
+                     strlen(_getOutBuf()));
+}
+
+int _log_binary_time_header(DateTime & now, unsigned long curr_millis)
+{
+  unsigned char buf[10];
+  unsigned long unixtime = now.unixtime();
+
+  buf[0] = 0xFF;
+  buf[1] = 0xFF;
+  memcpy(buf + 2, &unixtime, 4);
+  memcpy(buf + 6, &curr_millis, 4);
+  return _log_record(buf, 10);
+}
+
+/*
+ * Sets up the raw block stream into the contiguous log file, covering only
+ * the blocks of the file's logFileSize bytes, not the whole last cluster.
+ *
+ * @return true if successful, false if the file is not contiguous
+ */
+static bool _start_raw_log(uint32_t logFileSize)
+{
+  uint32_t bgn_block, end_block;
+
+  if (!_log->_file.contiguousRange(&bgn_block, &end_block)) {
+    _log->_file.close();
+    return false;
+  }
+
+  _log->_raw_block = bgn_block;
+  _log->_raw_end_block = bgn_block + ((logFileSize - 1) >> 9);
+  if (_log->_raw_end_block > end_block) {
+    _log->_raw_end_block = end_block;
+  }
+  if (_raw_stream == _log) {
+    _raw_stream = NULL;
+  }
+  _log->_raw_log = true;
+
+  // Nothing touches the FAT while streaming, so leave the cache clean
+  sd.vol()->cacheClear();
+  return true;
+}
+
+// Blocks per erase command, small enough to finish within SD_ERASE_TIMEOUT
+#define LOG_ERASE_CHUNK 262144UL
+
+/*
+ * Erases the blocks of a preallocated log file's first logFileSize bytes, so
+ * the multi-block writes into it don't wait for the card to erase. Erasing
+ * is only an optimization: if the card refuses (cards without single block
+ * erase can only erase whole erase sectors), the file is logged unerased.
+ */
+static void _erase_log_file(SdBaseFile *f, uint32_t logFileSize)
+{
+#if LOG_PRE_ERASE
+  uint32_t bgn_block, end_block, last_block, chunk_end;
+
+  if (logFileSize == 0 || !f->contiguousRange(&bgn_block, &end_block)) {
+    return;
+  }
+  last_block = bgn_block + ((logFileSize - 1) >> 9);
+  if (last_block > end_block) {
+    last_block = end_block;
+  }
+  while (bgn_block <= last_block) {
+    chunk_end = last_block - bgn_block < LOG_ERASE_CHUNK ?
+                last_block : bgn_block + LOG_ERASE_CHUNK - 1;
+    if (!sd.card()->erase(bgn_block, chunk_end)) {
+      return;
+    }
+    bgn_block = chunk_end + 1;
+  }
+#endif  // LOG_PRE_ERASE
+}
+
+/*
+ * Creates a contiguous log file of logFileSize bytes, erases it and sets up
+ * the raw block stream into it.
+ *
+ * @return true if successful, false if the file could not be preallocated
+ */
+static bool _open_raw_log(const char *fileName, uint32_t logFileSize)
+{
+  if (!_log->_file.createContiguous(sd.vwd(), fileName, logFileSize)) {
+    _log->_file.close();
+    return false;
+  }
+  _erase_log_file(&_log->_file, logFileSize);
+  return _start_raw_log(logFileSize);
+}
+
+/*
+ * Log file numbers that exist in the log directory, one bit per number.
+ */
+#define LOG_FILE_INDEXES 1000
+typedef uint8_t log_index_map_t[(LOG_FILE_INDEXES + 7) / 8];
+
+/*
+ * Marks the log file numbers that are taken in a single pass over the
+ * directory, instead of opening every candidate name. A number is taken if
+ * any entry has the name beginDataLog would give it, the prefix cut down to
+ * fit an 8.3 name with the number's digits. Names are compared ignoring case
+ * since FAT stores short names in upper case.
+ *
+ * @return false if the directory can't be read
+ */
+static bool _scan_log_indexes(const char *dirPath, const char *prefix,
+                              const char *ext, log_index_map_t taken)
+{
+  SdBaseFile dir;
+  dir_t entry;
+  uint8_t prefix_len = strlen(prefix);
+  uint8_t digits, keep, len, j;
+  uint16_t index, low;
+  int8_t n;
+
+  memset(taken, 0, sizeof(log_index_map_t));
+  if (!dir.open(dirPath, O_READ)) {
+    return false;
+  }
+  while ((n = dir.readDir(&entry)) > 0) {
+    if (strncasecmp((const char *) entry.name + 8, ext, 3) != 0) {
+      continue;
+    }
+    for (len = 8; len > 0 && entry.name[len - 1] == ' '; len--);
+
+    for (digits = 1, low = 0; digits <= 3; digits++, low = low ? low * 10 : 10) {
+      keep = prefix_len < 7 - digits ? prefix_len : 7 - digits;
+      if (len != keep + digits ||
+          strncasecmp((const char *) entry.name, prefix, keep) != 0) {
+        continue;
+      }
+      index = 0;
+      for (j = keep; j < len && isdigit(entry.name[j]); j++) {
+        index = index * 10 + entry.name[j] - '0';
+      }
+      if (j == len && index >= low && index < LOG_FILE_INDEXES) {
+        taken[index >> 3] |= 1 << (index & 7);
+      }
+    }
+  }
+  dir.close();
+  return n == 0;
+}
+
+/*
+ * Builds the path of log file number index: the prefix, cut down so that the
+ * name with the number's digits fits 8.3, the number and the extension.
+ */
+static void _log_file_name(char *fileName, uint16_t index)
+{
+  char prefix[8];
+
+  strcpy(prefix, _log->_log_prefix);
+  prefix[index < 10 ? 6 : index < 100 ? 5 : 4] = '\0';
+  sprintf(fileName, "%s/%s%u.%s", log_dir, prefix, index,
+          _log->_csv_log ? "csv" : "bin");
+}
+
+/*
+ * @return the first log file number from first on that isn't taken, or
+ *         LOG_FILE_INDEXES if there is none or the directory can't be read
+ */
+static uint16_t _free_log_index(uint16_t first)
+{
+  log_index_map_t taken;
+  uint16_t i = first;
+
+  if (!_scan_log_indexes(log_dir, _log->_log_prefix, _log->_csv_log ? "csv" : "bin",
+                         taken)) {
+    return LOG_FILE_INDEXES;
+  }
+  while (i < LOG_FILE_INDEXES && (taken[i >> 3] & (1 << (i & 7)))) {
+    i++;
+  }
+  return i;
+}
+
+#if LOG_RECOVER
+/*
+ * @return true if a block is erased, all 0x00 or all 0xFF bytes depending
+ *         on the card
+ */
+static bool _block_erased(const unsigned char *block)
+{
+  uint16_t i;
+
+  for (i = 1; i < 512 && block[i] == block[0]; i++);
+  return i == 512 && (block[0] == 0x00 || block[0] == 0xFF);
+}
+
+/*
+ * @return number of bytes used in block number n of a framed log, 0 if the
+ *         block doesn't have a good framing header of that number
+ */
+static uint16_t _block_framed(const unsigned char *block, uint32_t n)
+{
+  uint16_t used = block[4] | (block[5] << 8);
+  uint16_t crc;
+
+  if (block[0] != ARDUSAT_BLOCK_MAGIC || block[1] != (uint8_t) n ||
+      used < ARDUSAT_BLOCK_HEADER_SIZE || used > 512) {
+    return 0;
+  }
+  crc = crcCcitt(0, block, 6);
+  crc = crcCcitt(crc, block + ARDUSAT_BLOCK_HEADER_SIZE,
+                 used - ARDUSAT_BLOCK_HEADER_SIZE);
+  return crc == (block[6] | (block[7] << 8)) ? used : 0;
+}
+
+/*
+ * @return offset of the flags byte of the file header record at the start
+ *         of the first block of a binary log, 0 if there is none
+ */
+static uint16_t _file_flags_offset(const unsigned char *block, bool framed)
+{
+  uint16_t at = framed ? ARDUSAT_BLOCK_HEADER_SIZE : 0;
+
+  if (block[at] != 0xFF || block[at + 1] != ARDUSAT_CONTROL_FILE_HEADER ||
+      block[at + 2] < 5 || memcmp(block + at + 3, ARDUSAT_FILE_MAGIC, 3) != 0) {
+    return 0;
+  }
+  return at + 7;
+}
+
+/*
+ * Clears ARDUSAT_FILE_OPEN in the file header of the preallocated log file
+ * starting at bgn_block, updating the record and block CRCs over it. block
+ * is a 512 byte buffer to work in.
+ *
+ * @return true if the header was cleared or has nothing to clear
+ */
+static bool _clear_file_open(uint32_t bgn_block, unsigned char *block)
+{
+  uint16_t used, flags, crc;
+
+  if (block == NULL || !sd.card()->readBlock(bgn_block, block)) {
+    return false;
+  }
+  used = _block_framed(block, 0);
+  flags = _file_flags_offset(block, used > 0);
+  if (flags == 0 || !(block[flags] & ARDUSAT_FILE_OPEN)) {
+    return true;
+  }
+  block[flags] &= ~ARDUSAT_FILE_OPEN;
+  if (block[flags] & ARDUSAT_FILE_RECORD_CRC) {
+    block[flags + 1] = crc8(0, block + flags - 7, 8);
+  }
+  if (used > 0) {
+    crc = crcCcitt(0, block, 6);
+    crc = crcCcitt(crc, block + ARDUSAT_BLOCK_HEADER_SIZE,
+                   used - ARDUSAT_BLOCK_HEADER_SIZE);
+    block[6] = crc;
+    block[7] = crc >> 8;
+  }
+  return sd.card()->writeBlock(bgn_block, block);
+}
+
+/*
+ * Trims a preallocated log file that lost power before it was closed to the
+ * data actually written into it. Only files whose header still has
+ * ARDUSAT_FILE_OPEN are touched: such a file still has its preallocated
+ * size, with the erased blocks of the preallocation after the data, so a
+ * binary search finds the first block without data: an erased block, or in
+ * a framed log a block without a good framing header of its number. A
+ * framed file is cut at the used bytes of its last data block. An unframed
+ * one keeps its last data block whole, as the zeros at its end can't be
+ * told from record bytes. The flag is then cleared.
+ *
+ * Blocks still holding data from before the preallocation look written, so
+ * this relies on LOG_PRE_ERASE, or on block framing.
+ */
+static void _recover_log_file(uint16_t index)
+{
+  char fileName[19];
+  File f;
+  unsigned char *block;
+  uint32_t bgn_block, end_block, blocks, lo, hi, mid;
+  uint16_t used, flags;
+  bool framed;
+
+  _log_file_name(fileName, index);
+  f = sd.open(fileName, O_RDWR);
+  if (!f.isOpen() || f.fileSize() == 0 ||
+      !f.contiguousRange(&bgn_block, &end_block) ||
+      (block = sd.vol()->cacheRelease()->data) == NULL) {
+    f.close();
+    return;
+  }
+  blocks = (f.fileSize() + 511) >> 9;
+  if (blocks > end_block - bgn_block + 1) {
+    blocks = end_block - bgn_block + 1;
+  }
+  if (!sd.card()->readBlock(bgn_block, block)) {
+    f.close();
+    return;
+  }
+  framed = _block_framed(block, 0) > 0;
+  flags = _file_flags_offset(block, framed);
+  if (flags == 0 || !(block[flags] & ARDUSAT_FILE_OPEN)) {
+    f.close();
+    return;
+  }
+
+  // blocks before lo have data, blocks from hi on don't
+  lo = 1;
+  hi = blocks;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (!sd.card()->readBlock(bgn_block + mid, block)) {
+      f.close();
+      return;
+    }
+    if (framed ? _block_framed(block, mid) > 0 : !_block_erased(block)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo < blocks) {
+    used = 512;
+    if (framed && sd.card()->readBlock(bgn_block + lo - 1, block)) {
+      used = _block_framed(block, lo - 1);
+    }
+    if (!f.truncate(((lo - 1) << 9) + used)) {
+      f.close();
+      return;
+    }
+  }
+  _clear_file_open(bgn_block, sd.vol()->cacheRelease()->data);
+  f.close();
+}
+#endif  // LOG_RECOVER
+
+// holds the tuned SPI clock in its first block, the second is for testing
+static const char spi_tune_file[] = "/data/spi.cfg";
+
+/*
+ * Fills buf with the test pattern of a tuning round, a pseudo-random
+ * sequence that toggles every bit of the bus, or checks that buf holds it.
+ *
+ * @return false if checking and buf doesn't hold the pattern
+ */
+static bool _spi_pattern(unsigned char *buf, uint8_t round, bool check)
+{
+  uint8_t x = 0x5A ^ (round * 0x35);
+  uint16_t i;
+
+  for (i = 0; i < 512; i++) {
+    x = x * 109 + 89;
+    if (!check) {
+      buf[i] = x;
+    } else if (buf[i] != x) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Writes rounds test patterns to block and reads each back at the current
+ * SPI clock.
+ *
+ * @return true if every pattern came back intact
+ */
+static bool _spi_test(uint32_t block, unsigned char *buf, uint8_t rounds)
+{
+  uint8_t round;
+
+  for (round = 0; round < rounds; round++) {
+    _spi_pattern(buf, round, false);
+    if (!sd.card()->writeBlock(block, buf)) {
+      return false;
+    }
+    memset(buf, 0, 512);
+    if (!sd.card()->readBlock(block, buf) ||
+        !_spi_pattern(buf, round, true)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Picks the SPI clock of a card started at LOG_SPI_TUNE_SLOWEST, see
+ * setLogSpiTuning. A clock stored by an earlier tuning is kept if it still
+ * passes one test round. Otherwise clocks are tested from the slowest up,
+ * and the fastest that passed before one failed is stored. A failed clock
+ * may leave the card in any state, so it is restarted at the chosen clock.
+ * The card stays at the slowest clock if the tuning file can't be made.
+ *
+ * @return false if the card fails even at the slowest clock
+ */
+static bool _tune_spi(uint8_t chipSelectPin)
+{
+  File f;
+  uint32_t bgn_block, end_block;
+  unsigned char *buf;
+  uint8_t divisor, good;
+  uint16_t crc;
+
+  if (!sd.exists(log_dir) && !sd.mkdir(log_dir)) {
+    return true;
+  }
+  f = sd.open(spi_tune_file, O_RDWR);
+  if (!f.isOpen()) {
+    f.createContiguous(sd.vwd(), spi_tune_file, 1024);
+  }
+  if (!f.isOpen() || !f.contiguousRange(&bgn_block, &end_block) ||
+      end_block == bgn_block ||
+      (buf = sd.vol()->cacheRelease()->data) == NULL) {
+    f.close();
+    return true;
+  }
+
+  // [S][C][K][divisor][uint16 CRC]
+  if (sd.card()->readBlock(bgn_block, buf) && memcmp(buf, "SCK", 3) == 0 &&
+      crcCcitt(0, buf, 4) == (buf[4] | (buf[5] << 8)) &&
+      buf[3] >= SPI_FULL_SPEED && buf[3] <= LOG_SPI_TUNE_SLOWEST) {
+    sd.card()->setSckDivisor(buf[3]);
+    if (_spi_test(bgn_block + 1, buf, 1)) {
+      f.close();
+      return true;
+    }
+    if (!sd.card()->begin(chipSelectPin, LOG_SPI_TUNE_SLOWEST)) {
+      return false;
+    }
+  }
+
+  good = 0;
+  for (divisor = LOG_SPI_TUNE_SLOWEST; divisor >= SPI_FULL_SPEED;
+       divisor >>= 1) {
+    sd.card()->setSckDivisor(divisor);
+    if (!_spi_test(bgn_block + 1, buf, LOG_SPI_TUNE_ROUNDS)) {
+      break;
+    }
+    good = divisor;
+  }
+  if (good == 0) {
+    return false;
+  }
+  if (divisor >= SPI_FULL_SPEED &&
+      !sd.card()->begin(chipSelectPin, good)) {
+    return false;
+  }
+
+  memset(buf, 0, 512);
+  memcpy(buf, "SCK", 3);
+  buf[3] = good;
+  crc = crcCcitt(0, buf, 4);
+  buf[4] = crc;
+  buf[5] = crc >> 8;
+  sd.card()->writeBlock(bgn_block, buf);
+  f.close();
+  return true;
+}
+
+/*
+ * Resets the per-file log state for a newly opened log file and writes the
+ * binary file header and an epoch anchor.
+ */
+static void _start_log_file()
+{
+  _log->_log_bytes = 0;
+  _log->_index_due = LOG_INDEX_INTERVAL;
+  _log->_block_number = 0;
+  _log->_unsynced_records = 0;
+  _log->_unsynced_bytes = 0;
+  _log->_last_sync_millis = millis();
+  _log->_log_opened_millis = _log->_last_sync_millis;
+  if (_log->_compact_log) {
+    compactReset(&_log->_compact_streams);
+  }
+  _reset_deadbands();
+  if (_log->_last_sync_millis < _log->_epoch_millis) {
+    _log->_millis_epoch++;
+  }
+  _log->_epoch_millis = _log->_last_sync_millis;
+  _log->_csv_time_valid = false;
+  if (_log->_csv_compact) {
+    _log_csv_header();
+  }
+  if (!_log->_csv_log) {
+    _log_file_header();
+    if (_log->_binary_encoding == LOG_BINARY_INT16) {
+      _log_int16_scales();
+    }
+    _log_epoch(millis());
+  }
+}
+
+/*
+ * @return true if the card has room for a file of size bytes and
+ *         LOG_MIN_FREE_KB on top
+ */
+static bool _card_has_room(uint32_t size)
+{
+  int32_t free = sd.vol()->freeClusterCount();
+  uint8_t shift = sd.vol()->clusterSizeShift() + 9;
+  uint32_t need = ((size + (1UL << shift) - 1) >> shift) +
+                  (((uint32_t) LOG_MIN_FREE_KB << 10) >> shift);
+
+  // the FSINFO count is only a hint, the FAT is counted before refusing
+  if (free >= 0 && (uint32_t) free <= need) {
+    free = sd.vol()->exactFreeClusterCount();
+  }
+  return free > 0 && (uint32_t) free > need;
+}
+
+/**
+ * @return free space on the card in KiB, 0 if no card has been started
+ */
+unsigned long getLogFreeSpace()
+{
+  int32_t free = sd.vol()->freeClusterCount();
+
+  return free > 0 ? ((uint32_t) free << sd.vol()->clusterSizeShift()) >> 1 : 0;
+}
+
+/*
+ * Creates the next file of a rotating log ahead of time, preallocated if the
+ * log has a size limit, so that rotating only has to switch files. A raw
+ * block stream is stopped first, as this works through the file system.
+ *
+ * @return true if the next file is ready
+ */
+static bool _prepare_next_log()
+{
+  char fileName[19];
+  uint32_t size = _log->_log_file_size;
+
+  if (_log->_rotation == LOG_ROTATE_BYTES && size == 0) {
+    size = _log->_rotation_limit;
+  }
+  if (!_end_raw_stream()) {
+    return false;
+  }
+
+  _log->_next_index = _free_log_index(_log->_log_index + 1);
+  if (_log->_next_index < LOG_FILE_INDEXES && _card_has_room(size)) {
+    _log_file_name(fileName, _log->_next_index);
+    _log->_next_preallocated = size > 0 &&
+                         _log->_next_file.createContiguous(sd.vwd(), fileName, size);
+    if (_log->_next_preallocated) {
+      _erase_log_file(&_log->_next_file, size);
+    }
+    // without a raw stream to feed, a fragmented card can still take a
+    // normal file
+    if (!_log->_next_preallocated && !_log->_raw_log) {
+      _log->_next_file = sd.open(fileName, FILE_WRITE);
+    }
+  }
+  if (!_log->_next_file.isOpen()) {
+    _log->_rotation_failed = true;
+  }
+
+  if (_log->_raw_log) {
+    sd.vol()->cacheClear();
+  } else if (_log->_csv_log) {
+    _release_cache();
+  }
+  return _log->_next_file.isOpen();
+}
+
+/*
+ * Closes the log file and continues in the next one. Records still in the
+ * log queue end up in the new file. If no next file can be created, logging
+ * carries on in the current one and rotation stops until the next
+ * beginDataLog.
+ *
+ * @return true if logging moved on to a new file
+ */
+static bool _rotate_log()
+{
+  bool ret;
+
+  _claim_card();
+  _log->_rotating = true;
+  if (!_log->_next_file.isOpen()) {
+    _prepare_next_log();
+  }
+  if (!_log->_next_file.isOpen()) {
+    _log->_rotating = false;
+    return false;
+  }
+
+  if (_log->_block_count > 0) {
+    _flush_blocks();
+  }
+  _trim_log_file();
+  _log->_file.close();
+  _log->_file = _log->_next_file;
+  _log->_next_file = File();
+  _log->_log_index = _log->_next_index;
+  _log->_log_preallocated = _log->_next_preallocated;
+
+  _log->_block_head = 0;
+  _log->_block_queued = 0;
+  _log->_block_offset = 0;
+  ret = !_log->_raw_log || _start_raw_log(_log->_log_file_size);
+  if (ret) {
+    _start_log_file();
+  }
+  _log->_rotating = false;
+  return ret;
+}
+
+/*
+ * Checks the rotation policy before a record of up to numBytes is logged.
+ * Raw logs also rotate once their preallocated file is full.
+ *
+ * @return true if the record should go to a new file
+ */
+static bool _rotation_due(uint16_t numBytes)
+{
+  uint32_t limit = _log->_log_file_size;
+
+  if (_log->_rotation == LOG_ROTATE_NONE || _log->_rotation_failed || _log->_rotating) {
+    return false;
+  }
+  if (_log->_rotation == LOG_ROTATE_MILLIS &&
+      millis() - _log->_log_opened_millis >= _log->_rotation_limit) {
+    return true;
+  }
+  if (_log->_rotation == LOG_ROTATE_BYTES && (limit == 0 || _log->_rotation_limit < limit)) {
+    limit = _log->_rotation_limit;
+  }
+  // a record may start a framed block and run into the next one
+  if (_log->_framed_log) {
+    numBytes += 2 * ARDUSAT_BLOCK_HEADER_SIZE;
+  }
+  return limit > 0 && _log->_log_bytes + numBytes > limit;
+}
+
+static bool _begin_data_log(int chipSelectPin, const char *fileNamePrefix,
+                            bool csvData, uint32_t logFileSize);
+static bool _rtc_sync(bool align);
+
+/**
+ * Function starts the SD card service and makes sure that the appropriate directory
+ * structure exists, then creates the file to use for logging data. Data will be logged
+ * to a file called fileNamePrefix_0.csv or fileNamePrefix_0.bin (number will be incremented
+ * for each new log file)
+ *
+ * @param chipSelectPin Arduino pin SD card reader CS pin is attached to
+ * @param fileNamePrefix string to prefix at beginning of data file
+ * @param csvData boolean flag whether we are writing csv data or binary data (used for filename)
+ *
+ * @return true if successful, false if failed
+ */
+bool DataLog::begin(int chipSelectPin, const char *fileNamePrefix, bool csvData)
+{
+  LogScope scope(this);
+
+  return _begin_data_log(chipSelectPin, fileNamePrefix, csvData, 0);
+}
+
+/**
+ * Starts the SD card service like beginDataLog, but preallocates a contiguous
+ * log file and writes it with raw multi-block SD writes for high data rates.
+ * The log file should be closed with endDataLog when logging is finished.
+ *
+ * @param chipSelectPin Arduino pin SD card reader CS pin is attached to
+ * @param fileNamePrefix string to prefix at beginning of data file
+ * @param csvData boolean flag whether we are writing csv data or binary data (used for filename)
+ * @param logFileSize number of bytes to preallocate for the log file
+ *
+ * @return true if successful, false if failed
+ */
+bool DataLog::beginHighRate(int chipSelectPin, const char *fileNamePrefix,
+                            bool csvData, unsigned long logFileSize)
+{
+  LogScope scope(this);
+
+  if (logFileSize == 0) {
+    return false;
+  }
+  return _begin_data_log(chipSelectPin, fileNamePrefix, csvData, logFileSize);
+}
+
+/*
+ * Shared implementation of beginDataLog and beginHighRateDataLog. A non-zero
+ * logFileSize preallocates a contiguous file for raw block streaming.
+ */
+static bool _begin_data_log(int chipSelectPin, const char *fileNamePrefix,
+                            bool csvData, uint32_t logFileSize)
+{
+  bool ret;
+  uint16_t i;
+  char fileName[19];
+  bool was_open = _log->_file.isOpen();
+  // other logs (see DataLog) have the card in use already
+  bool shared = _open_logs > (was_open ? 1 : 0);
+
+  _claim_card();
+  if (_output_buffer != NULL &&
+      _output_buffer != sd.vol()->cacheAddress()->output_buf) {
+    delete []_output_buffer;
+  }
+  OUTPUT_BUF_SIZE = 512;
+  _output_buffer = sd.vol()->cacheAddress()->output_buf;
+
+  if (freeMemory() < LOG_RESERVED_RAM) {
+    strcpy_P(_getOutBuf(), sd_card_error);
+    Serial.print(_getOutBuf());
+    Serial.print(freeMemory());
+    Serial.print(", need ");
+    Serial.print(LOG_RESERVED_RAM);
+    Serial.println(")");
+    ret = false;
+  } else if (shared) {
+    ret = true;
+  } else if (_log->_spi_tuning) {
+    // tune before anything else is read at the slow clock
+    ret = sd.begin(chipSelectPin, LOG_SPI_TUNE_SLOWEST) &&
+          _tune_spi(chipSelectPin);
+  } else {
+    ret = sd.begin(chipSelectPin, SPI_FULL_SPEED);
+  }
+  // read the RTC time once up front, so timestamps are cheap to make later
+  _rtc_sync(true);
+
+  //Filenames need to fit the 8.3 filename convention, so truncate down the
+  //given filename if it is too long.
+  memcpy(_log->_log_prefix, fileNamePrefix, 7);
+  _log->_log_prefix[7] = '\0';
+  _log->_csv_log = csvData;
+  _log->_csv_compact = csvData && _log->_csv_format == LOG_CSV_COMPACT;
+  _log->_csv_names_len = 0;
+
+  // Compact records fall back to float records if the stream table doesn't
+  // fit
+  _log->_compact_log = !csvData && _log->_binary_encoding == LOG_BINARY_COMPACT &&
+                       compactBegin(&_log->_compact_streams, LOG_COMPACT_STREAMS);
+
+  // High-rate and bursting logs can't work without a block buffer, normal
+  // logs fall back to writing each record straight to the file
+  _log->_raw_log = false;
+  _log->_log_file_size = logFileSize;
+  _log->_log_preallocated = logFileSize > 0;
+  _log->_rotation_failed = false;
+  _log->_next_file.close();
+  // refuse to start a log on a full card
+  if (ret) {
+    ret = _card_has_room(logFileSize) &&
+          _alloc_buffers(logFileSize > 0 || _log->_burst_interval > 0 ? 1 : 0);
+  }
+  // framing needs whole blocks, so only works through the accumulator
+  _log->_framed_log = !csvData && _log->_block_framing && _log->_block_count > 0;
+  _log->_crc_log = !csvData && _log->_record_crc;
+  if (ret) {
+    if (!sd.exists(log_dir))
+      ret = sd.mkdir(log_dir);
+    if (ret && (i = _free_log_index(0)) < LOG_FILE_INDEXES) {
+#if LOG_RECOVER
+      // the last file of a rotating log, and the one prepared after it,
+      // unless they may belong to another log that is open
+      if (i > 1 && !shared) {
+        _recover_log_file(i - 2);
+      }
+      if (i > 0 && !shared) {
+        _recover_log_file(i - 1);
+      }
+#endif  // LOG_RECOVER
+      _log->_log_index = i;
+      _log_file_name(fileName, i);
+      if (logFileSize > 0) {
+	_open_raw_log(fileName, logFileSize);
+      } else {
+	_log->_file = sd.open(fileName, FILE_WRITE);
+      }
+    }
+  }
+  if (!_log->_file.isOpen()) {
+    _free_blocks();
+  } else {
+    _start_log_file();
+  }
+  if (_log->_file.isOpen() != was_open) {
+    _open_logs += _log->_file.isOpen() ? 1 : -1;
+  }
+  return _log->_file.isOpen();
+}
+
+/*
+ * Moves the cached RTC time base up to the current millis().
+ */
+static void _rtc_advance()
+{
+  uint32_t now = millis();
+  uint32_t elapsed = now - _rtc_base_millis + _rtc_base_frac;
+
+  _rtc_base_seconds += elapsed / 1000;
+  _rtc_base_frac = elapsed % 1000;
+  _rtc_base_millis = now;
+}
+
+/*
+ * Reads the RTC into the cached time base. The RTC only counts whole
+ * seconds, so a first reading waits for the next second to tick over, which
+ * pins the base to within a few ms. Later readings don't wait; they only pull
+ * the base back into the second the RTC reports, correcting drift of the
+ * millis clock without jumping the time by more than the drift.
+ *
+ * @param align wait for the start of a second
+ *
+ * @return true if the RTC is running
+ */
+static bool _rtc_sync(bool align)
+{
+  uint32_t rtc, first, start;
+
+  Wire.begin();
+  RTC.begin();
+  if (!RTC.isrunning()) {
+    _rtc_valid = false;
+    return false;
+  }
+
+  rtc = RTC.now().unixtime();
+  _rtc_synced_millis = millis();
+  if (align || !_rtc_valid) {
+    first = rtc;
+    start = millis();
+    while (rtc == first && millis() - start < 1100) {
+      rtc = RTC.now().unixtime();
+    }
+    _rtc_base_seconds = rtc;
+    _rtc_base_frac = 0;
+    _rtc_base_millis = millis();
+    _rtc_valid = true;
+    return true;
+  }
+
+  _rtc_advance();
+  if (_rtc_base_seconds < rtc) {
+    _rtc_base_seconds = rtc;
+    _rtc_base_frac = 0;
+  } else if (_rtc_base_seconds > rtc) {
+    _rtc_base_seconds = rtc;
+    _rtc_base_frac = 999;
+  }
+  return true;
+}
+
+/*
+ * Brings the cached RTC time up to date, reading the RTC only if it has
+ * never been read or the sync interval has passed.
+ *
+ * @return true if the time is known
+ */
+static bool _rtc_update()
+{
+  if (!_rtc_valid ||
+      (_rtc_sync_interval > 0 &&
+       millis() - _rtc_synced_millis >= _rtc_sync_interval)) {
+    return _rtc_sync(false);
+  }
+  _rtc_advance();
+  return true;
+}
+
+/*
+ * @brief Helper function to get current time from the cached RTC time.
+ *
+ * Gives the start of the current second, in RTC seconds, and the millis()
+ * value it began at, so the timestamp marker converts millis timestamps to
+ * the ms.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int _getCurrentTime( uint32_t *seconds, unsigned long *curr_millis )
+{
+  if (!_rtc_update()) {
+    return -1;
+  }
+  *seconds = _rtc_base_seconds;
+  *curr_millis = _rtc_base_millis - _rtc_base_frac;
+  return 0;
+}
+
+/**
+ * Sets how often the cached RTC time is checked against the RTC to correct
+ * drift of the millis() clock. Reading the RTC takes an I2C transaction, so
+ * the time functions only do it this often.
+ *
+ * @param interval ms between RTC reads, 0 to only read it at beginDataLog
+ *
+ * @return true
+ */
+bool setRTCSyncInterval(unsigned long interval)
+{
+  _rtc_sync_interval = interval;
+  return true;
+}
+
+/**
+ * @return the current unix time in ms from the cached RTC time, 0 if there is
+ *         no running RTC. Only reads the RTC when the sync interval is due.
+ */
+uint64_t currentUnixTimeMs()
+{
+  if (!_rtc_update()) {
+    return 0;
+  }
+  return (uint64_t) _rtc_base_seconds * 1000 + _rtc_base_frac;
+}
+
+/**
+ * @brief Logs the current RTC timestamp and internal millis clock, if both are available
+ *
+ * @return number of bytes written
+ */
+int DataLog::logRTCTimestamp()
+{
+  LogScope scope(this);
+  unsigned long curr_millis;
+  uint32_t seconds;
+
+  if (_getCurrentTime( &seconds, &curr_millis ) == 0) {
+    DateTime now(seconds);
+    return _log_csv_time_header(now, curr_millis);
+  }
+  return 0;
+}
+
+/**
+ * @brief Logs the current RTC timestamp and internal millis clock, if both are available
+ *
+ * @return number of bytes written
+ */
+int DataLog::binaryLogRTCTimestamp()
+{
+  LogScope scope(this);
+  unsigned long curr_millis;
+  uint32_t seconds;
+
+  if (_getCurrentTime( &seconds, &curr_millis ) == 0) {
+    DateTime now(seconds);
+    return _log_binary_time_header(now, curr_millis);
+  }
+  return 0;
+}
+
+bool setRTC()
+{
+  Wire.begin();
+  RTC.begin();
+  // Sets RTC to the date & time sketch was compiled
+  RTC.adjust(DateTime(__DATE__, __TIME__));
+  return true;
+}
+
+// request line being received by serveLogDump, allocated on first use
+#define LOG_DUMP_LINE_SIZE 40
+static char *_dump_line = NULL;
+static uint8_t _dump_len = 0;
+
+/*
+ * Sends one dump frame, see BinaryDataFmt.h.
+ */
+static void _dump_frame(Stream *port, uint32_t block,
+                        const unsigned char *data, uint16_t n)
+{
+  uint8_t head[8] = {ARDUSAT_STREAM_SYNC0, ARDUSAT_DUMP_SYNC1,
+                     (uint8_t) block, (uint8_t) (block >> 8),
+                     (uint8_t) (block >> 16), (uint8_t) (block >> 24),
+                     (uint8_t) n, (uint8_t) (n >> 8)};
+  uint16_t crc = crcCcitt(crcCcitt(0, head + 2, 6), data, n);
+
+  port->write(head, sizeof(head));
+  port->write(data, n);
+  port->write((uint8_t) crc);
+  port->write((uint8_t) (crc >> 8));
+}
+
+/*
+ * Sends count blocks of f from first on, reading each run of contiguous
+ * clusters with one multi-block read and sending every block as soon as it
+ * is read.
+ *
+ * @return false on a card error
+ */
+static bool _dump_blocks(Stream *port, File *f, uint32_t first,
+                         uint32_t count)
+{
+  uint32_t blocks = (f->fileSize() + 511) >> 9;
+  uint8_t per_cluster = sd.vol()->blocksPerCluster();
+  uint8_t shift = sd.vol()->clusterSizeShift();
+  uint32_t b, end, cluster, lba, run;
+  unsigned char *buf;
+  uint16_t n;
+
+  b = first < blocks ? first : blocks;
+  end = count < blocks - b ? b + count : blocks;
+  while (b < end) {
+    // the cluster holding block b, and how many blocks from b on follow it
+    // on the card
+    if (!f->seekSet((b << 9) + 1)) {
+      return false;
+    }
+    cluster = f->curCluster();
+    lba = sd.vol()->dataStartBlock() + ((cluster - 2) << shift) +
+          (b & (per_cluster - 1));
+    run = per_cluster - (b & (per_cluster - 1));
+    while (b + run < end && f->seekSet(((b + run) << 9) + 1) &&
+           f->curCluster() == cluster + 1) {
+      cluster++;
+      run += per_cluster;
+    }
+    if (run > end - b) {
+      run = end - b;
+    }
+
+    if ((buf = sd.vol()->cacheRelease()->data) == NULL ||
+        !sd.card()->readStart(lba)) {
+      return false;
+    }
+    for (; run > 0; run--, b++) {
+      if (!sd.card()->readData(buf)) {
+        sd.card()->readStop();
+        return false;
+      }
+      n = b + 1 < blocks ? 512 : f->fileSize() - (b << 9);
+      _dump_frame(port, b, buf, n);
+    }
+    if (!sd.card()->readStop()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Sends the name and size of every file in the log directory, one per line,
+ * followed by an empty line.
+ */
+static void _dump_list(Stream *port)
+{
+  SdBaseFile dir, entry;
+  char name[13];
+
+  if (dir.open(log_dir, O_READ)) {
+    while (entry.openNext(&dir, O_READ)) {
+      if (entry.isFile() && entry.getFilename(name)) {
+        port->print(name);
+        port->print(' ');
+        port->println(entry.fileSize());
+      }
+      entry.close();
+    }
+    dir.close();
+  }
+  port->println();
+}
+
+/*
+ * Answers one dump request line, see serveLogDump.
+ *
+ * @return true if the request was answered in full
+ */
+static bool _dump_request(int chipSelectPin, Stream *port, char *line)
+{
+  char fileName[19];
+  char *name, *arg;
+  uint32_t first = 0, count = 0xFFFFFFFFUL, size;
+  unsigned char info[4];
+  File f;
+  bool ok;
+
+  // the card can't read while a high-rate log keeps a write open
+  if (_log->_file.isOpen() && !_log->_raw_log) {
+    _flush_log();
+  }
+  _claim_card();
+  ok = !(_log->_file.isOpen() && _log->_raw_log) &&
+       (sd.vol()->fatType() != 0 || sd.begin(chipSelectPin, SPI_FULL_SPEED));
+
+  if (strcmp(line, "L") == 0) {
+    if (ok) {
+      _dump_list(port);
+    } else {
+      port->println();
+    }
+    return ok;
+  }
+  if (line[0] != 'D' || line[1] != ' ') {
+    return false;
+  }
+
+  name = line + 2;
+  if ((arg = strchr(name, ' ')) != NULL) {
+    *arg++ = '\0';
+    first = strtoul(arg, &arg, 10);
+    if (*arg == ' ') {
+      count = strtoul(arg + 1, NULL, 10);
+    }
+  }
+  // names without a directory are in the log directory
+  if (strchr(name, '/') == NULL && strlen(name) <= 12) {
+    sprintf(fileName, "%s/%s", log_dir, name);
+  } else if (strlen(name) < sizeof(fileName)) {
+    strcpy(fileName, name);
+  } else {
+    ok = false;
+  }
+  if (ok) {
+    f = sd.open(fileName, O_READ);
+  }
+  if (!f.isOpen() || !f.isFile()) {
+    f.close();
+    _dump_frame(port, ARDUSAT_DUMP_INFO, NULL, 0);
+    return false;
+  }
+
+  size = f.fileSize();
+  memcpy(info, &size, 4);
+  _dump_frame(port, ARDUSAT_DUMP_INFO, info, 4);
+  ok = _dump_blocks(port, &f, first, count);
+  f.close();
+  return ok;
+}
+
+/**
+ * Serves log file downloads over a serial port, see ArdusatLogging.h.
+ *
+ * @param chipSelectPin Arduino pin SD card reader CS pin is attached to,
+ *        used if no log has started the card yet
+ * @param port the serial port requests come in on, e.g. &Serial
+ *
+ * @return true if a request was answered, false if none was complete or it
+ *         failed
+ */
+bool serveLogDump(int chipSelectPin, Stream *port)
+{
+  LogScope scope(&_default_log);
+  int c;
+
+  if (_dump_line == NULL &&
+      (_dump_line = (char *) malloc(LOG_DUMP_LINE_SIZE)) == NULL) {
+    return false;
+  }
+  while ((c = port->read()) >= 0) {
+    if (c == '\r') {
+      continue;
+    }
+    if (c != '\n') {
+      if (_dump_len < LOG_DUMP_LINE_SIZE - 1) {
+        _dump_line[_dump_len++] = c;
+      }
+      continue;
+    }
+    _dump_line[_dump_len] = '\0';
+    _dump_len = 0;
+    return _dump_request(chipSelectPin, port, _dump_line);
+  }
+  return false;
+}
+
+/**
+ * Opens a binary log file for reading, positioned at its first record, and
+ * reads the sizes of its custom record types from the file header. The card
+ * must have been started by beginDataLog.
+ *
+ * @param fileName name of the file, in the log directory unless it has a
+ *        directory of its own
+ *
+ * @return true if the file was opened
+ */
+bool LogReader::open(const char *fileName)
+{
+  LogScope scope(&_default_log);
+  char path[19];
+  unsigned char record[UCHAR_MAX];
+  int len;
+
+  close();
+  // the card can't read while a high-rate log keeps a write open
+  if ((_log->_file.isOpen() && _log->_raw_log) || sd.vol()->fatType() == 0) {
+    return false;
+  }
+  if (strchr(fileName, '/') == NULL && strlen(fileName) <= 12) {
+    sprintf(path, "%s/%s", log_dir, fileName);
+  } else if (strlen(fileName) < sizeof(path)) {
+    strcpy(path, fileName);
+  } else {
+    return false;
+  }
+  if (_log->_file.isOpen()) {
+    _flush_log();
+  }
+  _claim_card();
+  _file = sd.open(path, O_READ);
+  if (!_file.isOpen() || !_file.isFile()) {
+    close();
+    return false;
+  }
+
+  _framed = _file.peek() == ARDUSAT_BLOCK_MAGIC;
+  _crc = false;
+  _type_count = 0;
+  if (!_rewind()) {
+    close();
+    return false;
+  }
+  while ((len = _read_record(record, sizeof(record))) > 0 &&
+         record[0] == 0xFF) {
+    if (record[1] == ARDUSAT_CONTROL_RECORD_TYPE && len >= 7 &&
+        (record[3] & ARDUSAT_RECORD_TYPE_MASK) >= ARDUSAT_SENSOR_TYPE_CUSTOM &&
+        _type_count < LOG_CUSTOM_RECORD_TYPES) {
+      _types[_type_count][0] = record[3];
+      _types[_type_count][1] = record[4];
+      _type_count++;
+    }
+  }
+  return _rewind();
+}
+
+/**
+ * Moves to the first record logged at or after timestamp, or the end of the
+ * file if there is none. The index records are binary searched for the last
+ * one before it, and the records from there on read up to it.
+ *
+ * @param timestamp millis() value to move to
+ *
+ * @return true if successful, false if no file is open or it can't be read
+ */
+bool LogReader::seek(unsigned long timestamp)
+{
+  unsigned char record[UCHAR_MAX];
+  uint32_t lo = 0, hi, mid, at, time;
+  uint32_t start = 0, pos, end;
+  uint8_t encoding;
+  int len;
+
+  if (!_file.isOpen()) {
+    return false;
+  }
+  _end_raw_stream();
+  for (hi = _file.fileSize(); lo < hi;) {
+    mid = lo + (hi - lo) / 2;
+    if (!_find_index(mid, hi, &at, &time)) {
+      hi = mid;
+    } else if ((int32_t) (time - timestamp) < 0) {
+      start = at;
+      lo = at + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (start > 0 ? !_seek_record(start) : !_rewind()) {
+    return false;
+  }
+
+  // skip the records before timestamp, up to the first compact record
+  for (;;) {
+    pos = _file.curPosition();
+    end = _end;
+    len = _read_record(record, sizeof(record));
+    encoding = record[0] & ARDUSAT_RECORD_ENCODING_MASK;
+    if (len > 0 && record[0] == 0xFF &&
+        record[1] != ARDUSAT_CONTROL_TIMESTAMP) {
+      continue;
+    }
+    if (len < 6 || encoding == ARDUSAT_RECORD_COMPACT_KEY ||
+        encoding == ARDUSAT_RECORD_COMPACT_DELTA) {
+      break;
+    }
+    memcpy(&time, record + (record[0] == 0xFF ? 6 : 2), 4);
+    if ((int32_t) (time - timestamp) >= 0) {
+      break;
+    }
+  }
+  _end = end;
+  return _file.seekSet(pos);
+}
+
+/**
+ * Reads the next record. A record that doesn't fit, or whose size can't be
+ * told (an unknown type or a damaged file), stops reading.
+ *
+ * @param buffer where to store the record
+ * @param size size of buffer
+ *
+ * @return size of the record, 0 at the end of the file, -1 on error
+ */
+int LogReader::read(unsigned char *buffer, unsigned char size)
+{
+  uint32_t pos = _file.curPosition();
+  uint32_t end = _end;
+  int len;
+
+  if (!_file.isOpen()) {
+    return 0;
+  }
+  _end_raw_stream();
+  // stay at the record, so a failed read can be retried
+  if ((len = _read_record(buffer, size)) <= 0) {
+    _end = end;
+    _file.seekSet(pos);
+  }
+  return len;
+}
+
+/**
+ * Closes the file.
+ */
+void LogReader::close()
+{
+  _file.close();
+  _end = 0;
+}
+
+/*
+ * Moves to the first record of the file: the start of an unframed file, or
+ * the first record offset of the first block.
+ */
+bool LogReader::_rewind()
+{
+  unsigned char header[ARDUSAT_BLOCK_HEADER_SIZE];
+
+  if (!_framed) {
+    return _file.seekSet(0);
+  }
+  return _file.seekSet(0) &&
+         _file.read(header, sizeof(header)) == (int) sizeof(header) &&
+         _seek_record(header[2] | (header[3] << 8));
+}
+
+/*
+ * Moves to a record start. In a framed log this reads the header of its
+ * block for the end of the used bytes, and fails if the header is damaged
+ * or pos isn't in the used bytes.
+ */
+bool LogReader::_seek_record(uint32_t pos)
+{
+  unsigned char header[ARDUSAT_BLOCK_HEADER_SIZE];
+  uint32_t block = pos & ~511UL;
+  uint16_t used;
+
+  if (_framed) {
+    if (!_file.seekSet(block) ||
+        _file.read(header, sizeof(header)) != (int) sizeof(header)) {
+      return false;
+    }
+    used = header[4] | (header[5] << 8);
+    if (header[0] != ARDUSAT_BLOCK_MAGIC ||
+        header[1] != (uint8_t) (block >> 9) ||
+        used < ARDUSAT_BLOCK_HEADER_SIZE || used > 512 ||
+        pos < block + ARDUSAT_BLOCK_HEADER_SIZE || pos > block + used) {
+      return false;
+    }
+    _end = block + used;
+  }
+  return _file.seekSet(pos);
+}
+
+/*
+ * Reads n record bytes, moving on past the block headers of a framed log.
+ */
+bool LogReader::_read_bytes(unsigned char *dst, uint8_t n)
+{
+  uint32_t pos;
+  uint8_t m;
+
+  while (n > 0) {
+    pos = _file.curPosition();
+    if (_framed && pos >= _end) {
+      if (!_seek_record(((pos - 1) | 511) + 1 + ARDUSAT_BLOCK_HEADER_SIZE)) {
+        return false;
+      }
+      continue;
+    }
+    m = _framed && _end - pos < n ? _end - pos : n;
+    if (_file.read(dst, m) != m) {
+      return false;
+    }
+    dst += m;
+    n -= m;
+  }
+  return true;
+}
+
+/*
+ * Reads the next record, skipping those whose CRC byte doesn't match in a
+ * log with record CRCs, which the file header record tells.
+ *
+ * @return size of the record without its CRC byte, 0 at the end of the
+ *         file, -1 if it doesn't fit or its size is unknown
+ */
+int LogReader::_read_record(unsigned char *buffer, unsigned char size)
+{
+  uint8_t crc;
+  int n;
+
+  for (;;) {
+    if ((n = _read_unchecked(buffer, size)) <= 0) {
+      return n;
+    }
+    if (buffer[0] == 0xFF && buffer[1] == ARDUSAT_CONTROL_FILE_HEADER &&
+        n >= 8) {
+      _crc = buffer[7] & ARDUSAT_FILE_RECORD_CRC;
+    }
+    if (!_crc) {
+      return n;
+    }
+    if (!_read_bytes(&crc, 1)) {
+      return 0;
+    }
+    if (crc8(0, buffer, n) == crc) {
+      return n;
+    }
+  }
+}
+
+/*
+ * Reads a record, working out its size from its first bytes as laid out in
+ * BinaryDataFmt.h.
+ *
+ * @return size of the record, 0 at the end of the file, -1 if it doesn't fit
+ *         or its size is unknown
+ */
+int LogReader::_read_unchecked(unsigned char *buffer, unsigned char size)
+{
+  static const uint8_t field_counts[] = ARDUSAT_SENSOR_FIELD_COUNTS;
+  uint8_t type, count = 0, need = 0, varints = 0;
+  uint32_t start = _file.curPosition();
+  uint8_t n = 2;
+  uint8_t i;
+
+  if (size < 3) {
+    return -1;
+  }
+  if (!_read_bytes(buffer, 2) ||
+      (buffer[0] == 0 && buffer[1] == 0 && _zero_padding(start))) {
+    return 0;
+  }
+  type = buffer[0] & ARDUSAT_RECORD_TYPE_MASK;
+  if (type < sizeof(field_counts)) {
+    count = field_counts[type];
+  }
+
+  switch (buffer[0] & ARDUSAT_RECORD_ENCODING_MASK) {
+    case ARDUSAT_RECORD_CONTROL:
+      if (buffer[0] != 0xFF) {
+        return -1;
+      }
+      if (buffer[1] == ARDUSAT_CONTROL_TIMESTAMP) {
+        need = 8;
+      } else if (!_read_bytes(buffer + n++, 1)) {
+        return 0;
+      } else {
+        need = buffer[2];
+      }
+      break;
+    case ARDUSAT_RECORD_FLOAT:
+      if (type == ARDUSAT_SENSOR_TYPE_FRAME) {
+        need = 4;
+        for (i = 0; i < sizeof(field_counts); i++) {
+          if (buffer[1] & (1 << i)) {
+            need += 1 + 4 * field_counts[i];
+          }
+        }
+      } else if (count > 0) {
+        need = 4 + 4 * count;
+      }
+      break;
+    case ARDUSAT_RECORD_INT16:
+      if (count > 0) {
+        need = 4 + 2 * count;
+      }
+      break;
+    case ARDUSAT_RECORD_SUMMARY:
+      need = 4 + 4 * ARDUSAT_SUMMARY_FIELDS;
+      break;
+    case ARDUSAT_RECORD_COMPACT_KEY:
+      need = 4;
+      varints = count;
+      break;
+    case ARDUSAT_RECORD_COMPACT_DELTA:
+      varints = count > 0 ? 1 + count : 0;
+      break;
+  }
+  if (need == 0 && varints == 0) {
+    // a custom record type of the file header
+    for (i = 0; i < _type_count && _types[i][0] != buffer[0]; i++);
+    if (i == _type_count || _types[i][1] < 2) {
+      return -1;
+    }
+    need = _types[i][1] - 2;
+  }
+
+  if (n + need > size) {
+    return -1;
+  }
+  if (!_read_bytes(buffer + n, need)) {
+    return 0;
+  }
+  n += need;
+  for (i = 0; i < varints; n++) {
+    if (n >= size) {
+      return -1;
+    }
+    if (!_read_bytes(buffer + n, 1)) {
+      return 0;
+    }
+    if (!(buffer[n] & 0x80)) {
+      i++;
+    }
+  }
+  return n;
+}
+
+/*
+ * Tells if the rest of an unframed file from pos on is zeros: the padding
+ * left at the end of the last block of a log file recovered after a power
+ * loss (see ARDUSAT_FILE_OPEN), which holds no records. If not, the file is
+ * moved back to the second byte after pos, where the caller left off.
+ */
+bool LogReader::_zero_padding(uint32_t pos)
+{
+  int c;
+
+  if (_framed) {
+    return false;
+  }
+  while ((c = _file.read()) == 0);
+  return c < 0 || !_file.seekSet(pos + 2);
+}
+
+/*
+ * Looks for the first index record (see BinaryDataFmt.h) starting in
+ * [pos, limit), checked by its offset and CRC.
+ *
+ * @return true if one was found, with its position and millis
+ */
+bool LogReader::_find_index(uint32_t pos, uint32_t limit, uint32_t *at,
+                            uint32_t *time)
+{
+  unsigned char buf[64];
+  uint32_t offset;
+  int n, i;
+
+  while (pos < limit && _file.seekSet(pos) &&
+         (n = _file.read(buf, sizeof(buf))) >= ARDUSAT_INDEX_SIZE) {
+    for (i = 0; i + ARDUSAT_INDEX_SIZE <= n && pos + i < limit; i++) {
+      if (buf[i] != 0xFF || buf[i + 1] != ARDUSAT_CONTROL_INDEX ||
+          buf[i + 2] != ARDUSAT_INDEX_SIZE - 3) {
+        continue;
+      }
+      memcpy(&offset, buf + i + 9, 4);
+      if (offset == pos + i &&
+          crcCcitt(0, buf + i, ARDUSAT_INDEX_SIZE - 2) ==
+          (buf[i + 13] | (buf[i + 14] << 8))) {
+        *at = offset;
+        memcpy(time, buf + i + 5, 4);
+        return true;
+      }
+    }
+    pos += i;
+  }
+  return false;
+}
+
+/*
+ * Closes a log that goes away and frees the buffers the log functions
+ * allocated for it.
+ */
+DataLog::~DataLog()
+{
+  LogScope scope(this);
+
+  if (_log->_file.isOpen()) {
+    end();
+  }
+  free(_log->_queue_buf);
+  free(_log->_aggregates);
+  free(_log->_deadbands);
+  compactEnd(&_log->_compact_streams);
+}
+
+bool DataLog::flush()
+{
+  LogScope scope(this);
+
+  return _flush_log();
+}
+
+bool DataLog::setQueueSize(unsigned int bytes)
+{
+  LogScope scope(this);
+
+  return _set_queue_size(bytes);
+}
+
+int DataLog::logBytes(const unsigned char *buffer, unsigned char numBytes)
+{
+  LogScope scope(this);
+
+  return _log_record(buffer, numBytes);
+}
+
+/*
+ * The free functions work on the default log, see the DataLog methods of
+ * the same name.
+ */
+bool beginDataLog(int chipSelectPin, const char *fileNamePrefix, bool csvData)
+{
+  return _default_log.begin(chipSelectPin, fileNamePrefix, csvData);
+}
+
+bool beginHighRateDataLog(int chipSelectPin, const char *fileNamePrefix,
+                          bool csvData, unsigned long logFileSize)
+{
+  return _default_log.beginHighRate(chipSelectPin, fileNamePrefix, csvData,
+                                    logFileSize);
+}
+
+bool endDataLog()
+{
+  return _default_log.end();
+}
+
+bool flushDataLog()
+{
+  return _default_log.flush();
+}
+
+bool serviceDataLog()
+{
+  return _default_log.service();
+}
+
+bool setLogSyncPolicy(log_sync_policy_e policy, unsigned long interval)
+{
+  return _default_log.setSyncPolicy(policy, interval);
+}
+
+bool setLogBurst(unsigned long intervalMillis, unsigned int maxBytes)
+{
+  return _default_log.setBurst(intervalMillis, maxBytes);
+}
+
+bool setLogRotation(log_rotation_e policy, unsigned long limit)
+{
+  return _default_log.setRotation(policy, limit);
+}
+
+bool setLogAggregation(unsigned char sensorType, unsigned char sensorId,
+                       unsigned long windowMillis)
+{
+  return _default_log.setAggregation(sensorType, sensorId, windowMillis);
+}
+
+bool setLogDeadband(unsigned char sensorType, unsigned char sensorId,
+                    log_deadband_e mode, float threshold,
+                    unsigned long heartbeatMillis)
+{
+  return _default_log.setDeadband(sensorType, sensorId, mode, threshold,
+                                  heartbeatMillis);
+}
+
+bool setLogBlockFraming(bool enable)
+{
+  return _default_log.setBlockFraming(enable);
+}
+
+bool setLogRecordCrc(bool enable)
+{
+  return _default_log.setRecordCrc(enable);
+}
+
+bool setLogSpiTuning(bool enable)
+{
+  return _default_log.setSpiTuning(enable);
+}
+
+bool setLogSerialTee(Print *port)
+{
+  return _default_log.setSerialTee(port);
+}
+
+bool setCsvLogFormat(log_csv_format_e format)
+{
+  return _default_log.setCsvFormat(format);
+}
+
+bool setCsvLogPrecision(unsigned char sensorType, unsigned char precision)
+{
+  return _default_log.setCsvPrecision(sensorType, precision);
+}
+
+bool setBinaryLogEncoding(log_binary_encoding_e encoding)
+{
+  return _default_log.setBinaryEncoding(encoding);
+}
+
+bool setBinaryLogScale(unsigned char sensorType, unsigned int scale)
+{
+  return _default_log.setBinaryScale(sensorType, scale);
+}
+
+bool setLogQueueSize(unsigned int bytes)
+{
+  return _default_log.setQueueSize(bytes);
+}
+
+bool setLogRamBudget(unsigned int bytes)
+{
+  return _default_log.setRamBudget(bytes);
+}
+
+void getLogConfig(log_config_t *config)
+{
+  _default_log.getConfig(config);
+}
+
+unsigned long getLogOverruns()
+{
+  return _default_log.getOverruns();
+}
+
+bool getLogStats(log_stats_t *stats)
+{
+  return _default_log.getStats(stats);
+}
+
+void resetLogStats()
+{
+  _default_log.resetStats();
+}
+
+int logString(const char *output_buf)
+{
+  return _default_log.logString(output_buf);
+}
+
+int logBytes(const unsigned char *buffer, unsigned char numBytes)
+{
+  return _default_log.logBytes(buffer, numBytes);
+}
+
+unsigned char *logReserve(unsigned char numBytes)
+{
+  return _default_log.logReserve(numBytes);
+}
+
+int logCommit(unsigned char numBytes)
+{
+  return _default_log.logCommit(numBytes);
+}
+
+int logSensorName(unsigned char sensorType, unsigned char sensorId,
+                  const char *name)
+{
+  return _default_log.logSensorName(sensorType, sensorId, name);
+}
+
+int logRTCTimestamp()
+{
+  return _default_log.logRTCTimestamp();
+}
+
+int binaryLogRTCTimestamp()
+{
+  return _default_log.binaryLogRTCTimestamp();
+}
+
+int logAcceleration(const char *sensorName, acceleration_t & data)
+{
+  return _default_log.logAcceleration(sensorName, data);
+}
+
+int logMagnetic(const char *sensorName, magnetic_t & data)
+{
+  return _default_log.logMagnetic(sensorName, data);
+}
+
+int logGyro(const char *sensorName, gyro_t & data)
+{
+  return _default_log.logGyro(sensorName, data);
+}
+
+int logTemperature(const char *sensorName, temperature_t & data)
+{
+  return _default_log.logTemperature(sensorName, data);
+}
+
+int logLuminosity(const char *sensorName, luminosity_t & data)
+{
+  return _default_log.logLuminosity(sensorName, data);
+}
+
+int logUVLight(const char *sensorName, uvlight_t & data)
+{
+  return _default_log.logUVLight(sensorName, data);
+}
+
+int logOrientation(const char *sensorName, orientation_t & data)
+{
+  return _default_log.logOrientation(sensorName, data);
+}
+
+int logPressure(const char *sensorName, pressure_t & data)
+{
+  return _default_log.logPressure(sensorName, data);
+}
+
+int binaryLogAcceleration(const unsigned char sensorId, acceleration_t & data)
+{
+  return _default_log.binaryLogAcceleration(sensorId, data);
+}
+
+int binaryLogMagnetic(const unsigned char sensorId, magnetic_t & data)
+{
+  return _default_log.binaryLogMagnetic(sensorId, data);
+}
+
+int binaryLogGyro(const unsigned char sensorId, gyro_t & data)
+{
+  return _default_log.binaryLogGyro(sensorId, data);
+}
+
+int binaryLogTemperature(const unsigned char sensorId, temperature_t & data)
+{
+  return _default_log.binaryLogTemperature(sensorId, data);
+}
+
+int binaryLogLuminosity(const unsigned char sensorId, luminosity_t & data)
+{
+  return _default_log.binaryLogLuminosity(sensorId, data);
+}
+
+int binaryLogUVLight(const unsigned char sensorId, uvlight_t & data)
+{
+  return _default_log.binaryLogUVLight(sensorId, data);
+}
+
+int binaryLogOrientation(const unsigned char sensorId, orientation_t & data)
+{
+  return _default_log.binaryLogOrientation(sensorId, data);
+}
+
+int binaryLogPressure(const unsigned char sensorId, pressure_t & data)
+{
+  return _default_log.binaryLogPressure(sensorId, data);
+}
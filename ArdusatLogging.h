@@ -13,14 +13,528 @@
 #include <utility/SdVolume.h>
 #include <utility/MemoryFree.h>
 #include <utility/BinaryDataFmt.h>
+#include <utility/BinaryRecord.h>
+#include <utility/CompactRecord.h>
 #include <utility/RTClib.h>
 
 #include "ArdusatSDK.h"
 
+/**
+ * Number of 512 byte buffers in the block accumulator. Records are packed
+ * into these and written to the card a whole block at a time. More buffers
+ * let the sketch keep logging while the card is busy; boards with plenty of
+ * RAM (SAM3X, Teensy3) can afford more of them. On small boards fewer buffers
+ * are used if they don't fit at beginDataLog, down to none, in which case
+ * records are written directly to the file.
+ */
+#ifndef LOG_BLOCK_BUFFER_COUNT
+#if defined(__arm__)
+#define LOG_BLOCK_BUFFER_COUNT 4
+#else  // defined(__arm__)
+#define LOG_BLOCK_BUFFER_COUNT 2
+#endif  // defined(__arm__)
+#endif  // LOG_BLOCK_BUFFER_COUNT
+
+/**
+ * Most accumulator buffers beginDataLog allocates under a RAM budget (see
+ * setLogRamBudget), and the largest log queue it sizes.
+ */
+#ifndef LOG_BLOCK_BUFFER_MAX
+#if defined(__arm__)
+#define LOG_BLOCK_BUFFER_MAX 16
+#else  // defined(__arm__)
+#define LOG_BLOCK_BUFFER_MAX 8
+#endif  // defined(__arm__)
+#endif  // LOG_BLOCK_BUFFER_MAX
+
+#ifndef LOG_QUEUE_MAX
+#define LOG_QUEUE_MAX 32768U
+#endif  // LOG_QUEUE_MAX
+
+/**
+ * RAM left free for the stack, the SD card code and the sketch. The log's
+ * buffers are only allocated as far as they leave this much, and the log
+ * doesn't start with less.
+ */
+#ifndef LOG_RESERVED_RAM
+#define LOG_RESERVED_RAM 400
+#endif  // LOG_RESERVED_RAM
+
+/**
+ * Number of digits after the decimal point for values in CSV logs.
+ */
+#ifndef LOG_CSV_PRECISION
+#define LOG_CSV_PRECISION 3
+#endif  // LOG_CSV_PRECISION
+
+/**
+ * Bytes of sensor names a compact CSV log keeps ids for (see
+ * setCsvLogFormat), allocated by its first line. Names that don't fit are
+ * written out in full on each of their lines.
+ */
+#ifndef LOG_CSV_NAMES_SIZE
+#define LOG_CSV_NAMES_SIZE 64
+#endif  // LOG_CSV_NAMES_SIZE
+
+/**
+ * Number of sensor type/id pairs the compact binary encoding tracks. Sensors
+ * beyond that are still logged, but without delta compression.
+ */
+#ifndef LOG_COMPACT_STREAMS
+#define LOG_COMPACT_STREAMS 8
+#endif  // LOG_COMPACT_STREAMS
+
+/**
+ * Number of custom record types logRecordType can describe in the file
+ * header.
+ */
+#ifndef LOG_CUSTOM_RECORD_TYPES
+#define LOG_CUSTOM_RECORD_TYPES 4
+#endif  // LOG_CUSTOM_RECORD_TYPES
+
+/**
+ * Free space, in KiB, that beginDataLog and log rotation leave on the card:
+ * a new log file is only started while more than this is free. The free
+ * space comes from the FSINFO sector on FAT32 cards, so checking it is
+ * cheap; on FAT16 cards beginDataLog counts the free clusters in the FAT.
+ * As the FSINFO count may be stale, the FAT is counted before a FAT32 card
+ * is found too full.
+ */
+#ifndef LOG_MIN_FREE_KB
+#define LOG_MIN_FREE_KB 64
+#endif  // LOG_MIN_FREE_KB
+
+/**
+ * Set nonzero to erase preallocated (high-rate) log files when they are
+ * created, so the card doesn't have to erase blocks while samples are being
+ * written. Beginning the log, and preparing the next file of a rotating log,
+ * take longer instead.
+ */
+#ifndef LOG_PRE_ERASE
+#define LOG_PRE_ERASE 1
+#endif  // LOG_PRE_ERASE
+
+/**
+ * Set nonzero to have beginDataLog repair the last log files of a previous
+ * run that lost power before endDataLog: a preallocated log file keeps its
+ * preallocated size until it is closed, so it is trimmed to the blocks that
+ * were actually written. Binary log files are marked open in their header
+ * until they are closed (ARDUSAT_FILE_OPEN), and only those are repaired.
+ */
+#ifndef LOG_RECOVER
+#define LOG_RECOVER 1
+#endif  // LOG_RECOVER
+
+/**
+ * Bytes of binary log between index records (see BinaryDataFmt.h), which
+ * let decode_binary --from/--to find a time range in a long log without
+ * decoding it from the start. Each costs 15 bytes; 0 writes none.
+ */
+#ifndef LOG_INDEX_INTERVAL
+#define LOG_INDEX_INTERVAL 32768UL
+#endif  // LOG_INDEX_INTERVAL
+
+/**
+ * Number of sensors setLogAggregation can summarize at a time. The streams
+ * (32 bytes each on AVR) are allocated by the first setLogAggregation call.
+ */
+#ifndef LOG_AGGREGATE_STREAMS
+#define LOG_AGGREGATE_STREAMS 4
+#endif  // LOG_AGGREGATE_STREAMS
+
+/**
+ * Number of sensors setLogDeadband can filter at a time. The filters (about
+ * 30 bytes each) are allocated by the first setLogDeadband call.
+ */
+#ifndef LOG_DEADBAND_STREAMS
+#define LOG_DEADBAND_STREAMS 4
+#endif  // LOG_DEADBAND_STREAMS
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Sync policies control how often data written to the log file is committed
+ * to the SD card (data block written back and directory entry updated).
+ *
+ * Syncing after every record is the safest option, but costs several block
+ * operations per record. The other policies batch records between syncs at
+ * the cost of losing the unsynced records if power is lost.
+ *
+ * LOG_SYNC_EVERY_RECORD  sync after every write (default)
+ * LOG_SYNC_RECORDS       sync after every `interval` records
+ * LOG_SYNC_BYTES         sync after every `interval` bytes
+ * LOG_SYNC_MILLIS        sync when `interval` ms have passed since the last
+ *                        sync (checked whenever a record is written)
+ * LOG_SYNC_BLOCK         sync only when a 512 byte block boundary is crossed
+ */
+typedef enum {
+  LOG_SYNC_EVERY_RECORD = 0,
+  LOG_SYNC_RECORDS,
+  LOG_SYNC_BYTES,
+  LOG_SYNC_MILLIS,
+  LOG_SYNC_BLOCK,
+} log_sync_policy_e;
+
+bool setLogSyncPolicy(log_sync_policy_e policy, unsigned long interval);
+bool flushDataLog();
+
+/**
+ * Burst flushing saves power on battery and solar powered loggers, where the
+ * SD card's active current dominates. Records are kept in the block
+ * accumulator and the card is left alone, deselected, so that it drops to
+ * its idle current; every intervalMillis a burst writes all of them with
+ * multi-block writes and syncs the file:
+ *
+ *   setLogRamBudget(LOG_RAM_AUTO);  // more buffers make longer bursts
+ *   setLogBurst(60000, 4096);       // once a minute, at most 4 KB at risk
+ *   beginDataLog(chipSelect, "data", false);
+ *
+ * At most maxBytes of records are at risk of a power loss: a burst starts
+ * early once that much has been logged since the last one, and whenever the
+ * accumulator is full (maxBytes 0 only bounds by the accumulator). Nothing
+ * is written while nothing is logged. The sync policy is not used
+ * while bursting. Call serviceDataLog regularly so bursts are on time while
+ * nothing is logged. High-rate logs end their multi-block write after each
+ * burst. Set it before beginDataLog, which then needs at least one
+ * accumulator buffer; an intervalMillis of 0 stops bursting.
+ */
+bool setLogBurst(unsigned long intervalMillis, unsigned int maxBytes);
+
+/**
+ * Log rotation closes the log file and carries on in the next numbered file
+ * once it reaches a size or age limit, so a damaged file loses less data and
+ * long runs are split into files of a manageable size. The next file is
+ * created ahead of time (preallocated with createContiguous when the log has
+ * a size) by serviceDataLog while there is nothing to write, so switching
+ * files is quick; call serviceDataLog regularly from the main loop, even
+ * without a log queue. Every file starts with its own binary file header.
+ *
+ * LOG_ROTATE_NONE    one file per beginDataLog (default)
+ * LOG_ROTATE_BYTES   start a new file before the log grows past `limit`
+ *                    bytes
+ * LOG_ROTATE_MILLIS  start a new file when `limit` ms have passed since the
+ *                    current one was opened (checked when a record is logged)
+ *
+ * High-rate logs with either policy also move on when their preallocated
+ * file is full. If no next file can be created, logging continues in the
+ * current file.
+ */
+typedef enum {
+  LOG_ROTATE_NONE = 0,
+  LOG_ROTATE_BYTES,
+  LOG_ROTATE_MILLIS,
+} log_rotation_e;
+
+bool setLogRotation(log_rotation_e policy, unsigned long limit);
+
+/**
+ * Aggregation logs one summary per window of time instead of every reading
+ * of a slow changing sensor, e.g. a temperature sampled at 100 Hz of which
+ * only per-second statistics are needed:
+ *
+ *   setLogAggregation(ARDUSAT_SENSOR_TYPE_TEMPERATURE, 0, 1000);
+ *
+ * The sensor's log calls (binaryLogTemperature(0, ...) or logTemperature)
+ * then add each reading to the current window, and the first reading after
+ * the window ends logs the window's count, min, max, mean and standard
+ * deviation: a summary record in binary logs (see BinaryDataFmt.h), a CSV
+ * line `window start,sensorName,n,min,max,mean,stddev` in CSV logs. Windows
+ * start at multiples of windowMillis of the reading timestamps; endDataLog
+ * logs the last, partial, window. Log calls return 0 for readings that only
+ * went into a window.
+ *
+ * Only the single value sensor types (temperature, luminosity, UV light and
+ * pressure) can be aggregated. CSV log calls have no sensor id, so they use
+ * the first stream set up for their sensor type. A windowMillis of 0 stops
+ * aggregating the sensor, logging its partial window.
+ */
+bool setLogAggregation(unsigned char sensorType, unsigned char sensorId,
+                       unsigned long windowMillis);
+
+/**
+ * A deadband only logs a sensor's readings when they change, so slowly
+ * varying sensors cost next to nothing while they are steady:
+ *
+ *   setLogDeadband(ARDUSAT_SENSOR_TYPE_PRESSURE, 0, LOG_DEADBAND_ABSOLUTE,
+ *                  0.5, 60000);
+ *
+ * logs a pressure reading only when it is more than 0.5 hPa away from the
+ * last logged one, or a heartbeat of 60 s after it (0 for no heartbeat). The
+ * first reading of each file is always logged. With LOG_DEADBAND_RELATIVE
+ * the threshold is a fraction of the last logged value instead, e.g. 0.01
+ * for 1%. Readings of multi value sensors are logged when any value moves
+ * past the threshold. Log calls return 0 for readings the deadband drops.
+ *
+ * Binary logs record the sensor's heartbeat, so that the decoders can
+ * forward fill a regular series (decode_binary --fill). CSV log calls have
+ * no sensor id, so they use the first deadband set up for their sensor
+ * type. LOG_DEADBAND_OFF removes a sensor's deadband.
+ */
+typedef enum {
+  LOG_DEADBAND_OFF = 0,
+  LOG_DEADBAND_ABSOLUTE,
+  LOG_DEADBAND_RELATIVE,
+} log_deadband_e;
+
+bool setLogDeadband(unsigned char sensorType, unsigned char sensorId,
+                    log_deadband_e mode, float threshold,
+                    unsigned long heartbeatMillis);
+
+/**
+ * Free space left on the card in KiB, 0 before beginDataLog. A log file
+ * isn't started, nor rotated to, unless LOG_MIN_FREE_KB plus the size of a
+ * preallocated file is free.
+ */
+unsigned long getLogFreeSpace();
+
+/**
+ * Block framing starts every 512 byte block of a binary log with a small
+ * header holding a block number, the offset of the first record in the block
+ * and a CRC, so a damaged block only loses the records in it, and blocks can
+ * be decoded independently: compact streams restart with key records in
+ * every block of a framed log. Costs 8 bytes per block. Takes effect at the
+ * next beginDataLog, and needs the block accumulator (see
+ * LOG_BLOCK_BUFFER_COUNT).
+ */
+bool setLogBlockFraming(bool enable);
+
+/**
+ * Record CRCs follow every record of a binary log with a CRC-8 of its bytes
+ * (see ARDUSAT_FILE_RECORD_CRC), so that the decoders can drop a corrupted
+ * record and keep the rest of its block, where block framing can only drop
+ * the whole block. Costs one byte and a table lookup per record byte, cheap
+ * enough for multi-kHz logging. Teed records must then be at most 254 bytes.
+ * Compact streams restart with key records in every block of such a log, so
+ * a corrupted compact record costs the rest of its block, as the deltas
+ * after it can't be decoded. Takes effect at the next beginDataLog.
+ */
+bool setLogRecordCrc(bool enable);
+
+/**
+ * SPI clock tuning picks the fastest SPI clock the card's wiring carries
+ * reliably, instead of always running at SPI_FULL_SPEED, which long wires to
+ * a breakout board may not. beginDataLog then starts the card at
+ * LOG_SPI_TUNE_SLOWEST and writes LOG_SPI_TUNE_ROUNDS test patterns to a
+ * scratch block and reads them back at ever faster clocks, until one fails.
+ * The fastest clock that passed is stored in /data/spi.cfg and used from
+ * then on, as long as it still passes one round at each start; delete the
+ * file to tune again. Build with USE_SD_CRC (utility/SdFatConfig.h) set so
+ * that the card also checks the CRC of every command and block. Takes
+ * effect at the next beginDataLog.
+ */
+#ifndef LOG_SPI_TUNE_SLOWEST
+#define LOG_SPI_TUNE_SLOWEST SPI_SIXTEENTH_SPEED
+#endif  // LOG_SPI_TUNE_SLOWEST
+
+#ifndef LOG_SPI_TUNE_ROUNDS
+#define LOG_SPI_TUNE_ROUNDS 4
+#endif  // LOG_SPI_TUNE_ROUNDS
+
+bool setLogSpiTuning(bool enable);
+
+/**
+ * Sends a copy of every binary log record to a serial port as it is written
+ * to the log, in the framed form described in BinaryDataFmt.h, for a host to
+ * decode live (decode_binary --follow). Pass e.g. &Serial or &MiniSerial,
+ * or NULL to stop. Set it before beginDataLog so the file header is sent too.
+ * Records are written with the port's blocking write, so the baud rate must
+ * keep up with the logging rate.
+ */
+bool setLogSerialTee(Print *port);
+
+/**
+ * Serves log file downloads over a serial port, so logs can be pulled off a
+ * card that can't be taken out: call it from loop() while the logger is in a
+ * download mode, and run receive_log on the host. Each call answers at most
+ * one request line from the host:
+ *
+ *   L                        list the files in /data with their sizes
+ *   D <file> [first [count]] send blocks of a file, in frames with a block
+ *                            number and CRC (see BinaryDataFmt.h)
+ *
+ * Files are read with multi-block reads and each block is sent as soon as
+ * it's read. An open log is flushed first; a high-rate log must be ended.
+ * The port's baud rate sets the download speed, e.g. 115200 baud is about
+ * 11 KB/s, 1000000 about 100 KB/s.
+ */
+bool serveLogDump(int chipSelectPin, Stream *port);
+
+/**
+ * CSV line formats, see the CSV Log Format section of the README.
+ *
+ * LOG_CSV_FULL     timestamp,sensorName,values (default)
+ * LOG_CSV_COMPACT  timestamp,id,values with a number for each sensor name,
+ *                  defined by a #id=name line before its first use, and the
+ *                  timestamp as a +/- delta from the line before; expand it
+ *                  to full lines with decode_binary.py --expand-csv
+ *
+ * The format takes effect at the next beginDataLog. setCsvLogPrecision sets
+ * the digits after the decimal point for the values of one sensor type,
+ * LOG_CSV_PRECISION by default.
+ */
+typedef enum {
+  LOG_CSV_FULL = 0,
+  LOG_CSV_COMPACT,
+} log_csv_format_e;
+
+bool setCsvLogFormat(log_csv_format_e format);
+bool setCsvLogPrecision(unsigned char sensorType, unsigned char precision);
+
+/**
+ * Binary record encodings, see the Binary Data Format section of the README.
+ *
+ * LOG_BINARY_FLOAT    type, id, timestamp and 32 bit floats (default)
+ * LOG_BINARY_COMPACT  fixed point values, timestamp and values stored as
+ *                     varint deltas against the sensor's previous record
+ * LOG_BINARY_INT16    type, id, timestamp and values as int16 fixed point
+ *                     numbers, value * scale for the sensor type
+ *
+ * The int16 scales default to ARDUSAT_INT16_SCALES in BinaryDataFmt.h and can
+ * be changed with setBinaryLogScale before beginDataLog, e.g. to trade range
+ * for resolution. They are recorded in the log file for the decoders.
+ */
+typedef enum {
+  LOG_BINARY_FLOAT = 0,
+  LOG_BINARY_COMPACT,
+  LOG_BINARY_INT16,
+} log_binary_encoding_e;
+
+bool setBinaryLogEncoding(log_binary_encoding_e encoding);
+bool setBinaryLogScale(unsigned char sensorType, unsigned int scale);
+
+/**
+ * Binary logs start with a header describing the layout of every record
+ * type, so decoders don't need to know the format ahead of time. Sensors can
+ * also be given names that are recorded in the log, e.g.
+ * logSensorName(ARDUSAT_SENSOR_TYPE_ACCELERATION, 0, "LSM303"), best right
+ * after beginDataLog.
+ */
+int logSensorName(unsigned char sensorType, unsigned char sensorId,
+                  const char *name);
+
+/**
+ * Custom record types, for sensors the SDK doesn't know, use the types from
+ * ARDUSAT_SENSOR_TYPE_CUSTOM up. Describe one with a BinaryRecord
+ * (utility/BinaryRecord.h), register it once and log it with logRecord:
+ *
+ *   typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_CUSTOM, int16_t, 2> PowerRecord;
+ *
+ *   logRecordType<PowerRecord>(PSTR("power,mV,mA"));  // in setup()
+ *   logRecord<PowerRecord>(0, millis(), values);
+ *
+ * Registered types are described in the header of every binary log file,
+ * so the decoders decode them by name. logRecord packs the record straight
+ * into the block accumulator when logReserve gives it room, and falls back
+ * on logBytes when not.
+ */
+bool logRecordType(unsigned char recordType, unsigned char size,
+                   unsigned char fieldType, unsigned char fieldCount,
+                   const char *names);
+unsigned char *logReserve(unsigned char numBytes);
+int logCommit(unsigned char numBytes);
+
+/**
+ * The log queue decouples logging from the SD card. With a queue, log calls
+ * just copy the record into a RAM ring buffer, so they are fast, never wait
+ * for the card and may be called from a timer interrupt. serviceDataLog must
+ * then be called regularly from the main loop to write queued records; it
+ * only writes while the card is ready and returns instead of waiting on it.
+ *
+ * Records that don't fit in a full queue are dropped and counted, see
+ * getLogOverruns. The CSV log functions must not be called from an ISR.
+ */
+bool setLogQueueSize(unsigned int bytes);
+bool serviceDataLog();
+unsigned long getLogOverruns();
+
+/**
+ * A busy callback gets back the time the logger spends waiting on the SD
+ * card, which is mostly the few ms the card takes to program each block,
+ * and up to hundreds of ms when it erases or wear-levels:
+ *
+ *   void pollSensors() { ... }
+ *
+ *   setLogBusyCallback(pollSensors);  // in setup()
+ *
+ * The callback is called over and over from inside the card's wait loops
+ * (see Sd2Card::setBusyCallback), so it may read I2C sensors, check timers
+ * or move bytes from a serial port. As the card is selected meanwhile, it
+ * must not use the SPI bus. Of the logging functions it may only make the
+ * calls an interrupt handler may (see setLogQueueSize): log calls of the
+ * default log into a log queue. The callback is not called again while it
+ * runs, and time spent in it counts towards the card's timeouts, so it
+ * should return within a few ms. Pass NULL to remove it.
+ */
+bool setLogBusyCallback(void (*callback)(void));
+
+/**
+ * Logging statistics, kept when LOG_STATS is set nonzero in
+ * utility/SdFatConfig.h (default off, so they cost nothing). The write
+ * histogram counts record writes (log calls, or queued records written by
+ * serviceDataLog) by how long they took: bucket 0 under 1 us, bucket i from
+ * 2^(i-1) to 2^i - 1 us, the last bucket everything slower. Busy waits,
+ * cache misses, cluster allocations and write errors come from the SdFat
+ * code underneath. getLogStats returns false, and printLogStats prints
+ * nothing, when LOG_STATS is off.
+ */
+#define LOG_STATS_BUCKETS 20
+
+typedef struct {
+  unsigned long records;         // records written
+  unsigned long bytes;           // bytes written
+  unsigned long syncs;           // flushes to the card (sync policy or flushDataLog)
+  unsigned long overruns;        // records dropped by a full log queue
+  unsigned long maxWriteMicros;  // slowest record write
+  unsigned long writeMicros[LOG_STATS_BUCKETS];  // write time histogram
+  unsigned long busyWaits;       // waits for the card to be ready
+  unsigned long busyMicros;      // total time spent waiting for the card
+  unsigned long maxBusyMicros;   // longest wait for the card
+  unsigned long cacheMisses;     // blocks loaded into the SD cache
+  unsigned long cacheHits;       // blocks found in the SD cache pool instead
+  unsigned long clusterAllocs;   // clusters allocated to files
+  unsigned long writeErrors;     // failed SdBaseFile writes and syncs
+} log_stats_t;
+
+bool getLogStats(log_stats_t *stats);
+void resetLogStats();
+void printLogStats(Print *port);
+
+/**
+ * A RAM budget lets beginDataLog size the log's buffers to the board, so
+ * the same sketch runs with deep buffers on a Mega or Teensy and still fits
+ * on an Uno:
+ *
+ *   setLogRamBudget(LOG_RAM_AUTO);   // all RAM above LOG_RESERVED_RAM
+ *   setLogRamBudget(3072);           // or at most 3 KB
+ *
+ * Without a log queue the budget goes to block accumulator buffers, up to
+ * LOG_BLOCK_BUFFER_MAX. With a queue (setLogQueueSize with any nonzero size
+ * before beginDataLog), half goes to accumulator buffers, with at least
+ * one, and the queue is resized to the rest, up to LOG_QUEUE_MAX. Without a
+ * budget (0, the default) beginDataLog allocates up to
+ * LOG_BLOCK_BUFFER_COUNT buffers and leaves the queue alone.
+ *
+ * getLogConfig and printLogConfig report what was chosen, along with the
+ * SD block cache, whose size is fixed at compile time (SD_CACHE_BLOCK_COUNT
+ * in utility/SdFatConfig.h).
+ */
+#define LOG_RAM_AUTO ((unsigned int) -1)
+
+typedef struct {
+  unsigned int ramBudget;       // RAM the buffers could use at beginDataLog
+  unsigned int freeRam;         // RAM free now, with the buffers allocated
+  unsigned char blockBuffers;   // 512 byte block accumulator buffers
+  unsigned int queueBytes;      // log queue size, 0 without a queue
+  unsigned char cacheBlocks;    // blocks in the SD block cache
+  unsigned char spiDivisor;     // SPI clock divisor the card runs at
+} log_config_t;
+
+bool setLogRamBudget(unsigned int bytes);
+void getLogConfig(log_config_t *config);
+void printLogConfig(Print *port);
+
 /**
  * Log functions take care of persisting data to an SD card
  *
@@ -56,6 +570,47 @@ int binaryLogOrientation(const unsigned char sensorId, orientation_t & data);
 int binaryLogPressure(const unsigned char sensorId, pressure_t & data);
 bool beginDataLog(int chipSelectPin, const char *fileNamePrefix, bool csvData);
 
+/**
+ * Frames log one reading of several sensors as a single binary record, with
+ * one shared header and timestamp instead of one per reading, and a single
+ * write to the log:
+ *
+ *   beginFrame(millis());
+ *   frameLogAcceleration(0, accel);
+ *   frameLogTemperature(0, temp);
+ *   endFrame();
+ *
+ * A frame holds at most one reading of each sensor type; frameLog functions
+ * return 0 if the reading was not added. The readings' own timestamps are
+ * replaced by the frame timestamp. Frames always store float values, even
+ * with the compact binary encoding.
+ */
+bool beginFrame(unsigned long timestamp);
+int frameLogAcceleration(const unsigned char sensorId, acceleration_t & data);
+int frameLogMagnetic(const unsigned char sensorId, magnetic_t & data);
+int frameLogGyro(const unsigned char sensorId, gyro_t & data);
+int frameLogTemperature(const unsigned char sensorId, temperature_t & data);
+int frameLogLuminosity(const unsigned char sensorId, luminosity_t & data);
+int frameLogUVLight(const unsigned char sensorId, uvlight_t & data);
+int frameLogOrientation(const unsigned char sensorId, orientation_t & data);
+int frameLogPressure(const unsigned char sensorId, pressure_t & data);
+int endFrame();
+
+/**
+ * High-rate logging preallocates a contiguous log file of logFileSize bytes
+ * and streams full 512 byte blocks straight to the SD card with multi-block
+ * writes, skipping the FAT and directory updates of the normal write path.
+ *
+ * Data is committed a block at a time, so the sync policy is not used: call
+ * flushDataLog to force out a partially filled block. Logging stops when the
+ * preallocated file is full. endDataLog trims the file to the bytes logged.
+ *
+ * Needs an extra 512 bytes of RAM for the block buffer.
+ */
+bool beginHighRateDataLog(int chipSelectPin, const char *fileNamePrefix,
+                          bool csvData, unsigned long logFileSize);
+bool endDataLog();
+
 
 /**
  * Setup and use the RTC chip, if found
@@ -63,8 +618,15 @@ bool beginDataLog(int chipSelectPin, const char *fileNamePrefix, bool csvData);
  * The clock must be set before it can be used. This is achieved by compiling
  * and running a basic script (examples/set_rtc). After this, the library
  * automatically uses the RTC if available to timestamp.
+ *
+ * The RTC is read once at beginDataLog and the time is then kept from
+ * millis(), so timestamps don't need an I2C transaction. The cached time is
+ * checked against the RTC every setRTCSyncInterval ms (default one hour) to
+ * correct drift. currentUnixTimeMs gives the current time in ms since 1970.
  */
 bool setRTC();
+bool setRTCSyncInterval(unsigned long interval);
+uint64_t currentUnixTimeMs();
 int logRTCTimestamp();
 int binaryLogRTCTimestamp();
 
@@ -72,4 +634,354 @@ int binaryLogRTCTimestamp();
 } // extern "C"
 #endif
 
+#ifdef __cplusplus
+/**
+ * Logs a record of a type described by a BinaryRecord, see logRecordType.
+ *
+ * @param sensorId id of the sensor
+ * @param timestamp of the reading
+ * @param values Record::count field values
+ *
+ * @return number of bytes written
+ */
+template <class Record>
+int logRecord(unsigned char sensorId, unsigned long timestamp,
+              const typename Record::field_t *values)
+{
+  unsigned char buf[Record::size];
+  unsigned char *dst = logReserve(Record::size);
+
+  if (dst != NULL) {
+    Record::pack(dst, sensorId, timestamp, values);
+    return logCommit(Record::size);
+  }
+  Record::pack(buf, sensorId, timestamp, values);
+  return logBytes(buf, Record::size);
+}
+
+/**
+ * Registers the record type described by a BinaryRecord.
+ *
+ * @param names record and field names in PROGMEM, e.g. PSTR("power,mV,mA")
+ *
+ * @return true if successful
+ */
+template <class Record>
+bool logRecordType(const char *names)
+{
+  return logRecordType(Record::typeByte, Record::size, Record::fieldType,
+                       Record::count, names);
+}
+
+struct log_aggregate_t;
+struct log_deadband_t;
+
+/*
+ * State of one log, owned by its DataLog; the free functions use that of a
+ * default DataLog in ArdusatLogging.cpp. The card, its volume and block
+ * cache, the RTC time base, frames and the custom record types are shared
+ * by all logs.
+ */
+struct log_state_t {
+  log_state_t();
+
+  File _file;
+  log_sync_policy_e _sync_policy;
+  unsigned long _sync_interval;
+  unsigned long _unsynced_records;
+  unsigned long _unsynced_bytes;
+  unsigned long _last_sync_millis;
+  // burst flushing, see setLogBurst; bursts are timed from _last_sync_millis
+  unsigned long _burst_interval;
+  uint16_t _burst_bytes;
+#if LOG_STATS
+  log_stats_t _stats;
+#endif  // LOG_STATS
+  bool _csv_log;
+  log_csv_format_e _csv_format;
+  // per sensor type CSV precision + 1, 0 for LOG_CSV_PRECISION
+  uint8_t _csv_precision[ARDUSAT_SENSOR_TYPE_PRESSURE + 1];
+  /*
+   * Compact CSV log state, see setCsvLogFormat: the sensor names with ids,
+   * "name\0name\0..." with id 1 first, and the timestamp of the last line.
+   */
+  bool _csv_compact;
+  char *_csv_names;
+  uint8_t _csv_names_len;
+  uint32_t _csv_time;
+  bool _csv_time_valid;
+  log_binary_encoding_e _binary_encoding;
+  bool _compact_log;
+  // compact record streams, see CompactRecord.h, and the block of the file
+  // they last restarted in
+  compact_table_t _compact_streams;
+  uint32_t _compact_block;
+  uint16_t _int16_scales[ARDUSAT_SENSOR_TYPE_PRESSURE + 1];
+
+  // High-rate (raw contiguous) log state
+  bool _raw_log;
+  uint32_t _raw_block;
+  uint32_t _raw_end_block;
+
+  /*
+   * Block accumulator. Records are packed into 512 byte buffers and only
+   * whole blocks are handed to the card. Full buffers are queued and written
+   * while the card is idle, so the sketch can keep filling the next buffer
+   * while the card is still programming the last one.
+   */
+  unsigned char *_block_buf;
+  uint8_t _block_count;
+  uint8_t _block_head;
+  uint8_t _block_queued;
+  uint16_t _block_offset;
+  uint32_t _log_bytes;
+
+  // Block framing state, see BinaryDataFmt.h
+  bool _block_framing;
+  // tune the SPI clock at beginDataLog, see setLogSpiTuning
+  bool _spi_tuning;
+  bool _framed_log;
+  uint8_t _block_number;
+
+  // CRC-8 after every record of binary logs, see setLogRecordCrc
+  bool _record_crc;
+  bool _crc_log;
+
+  // port records are teed to, see setLogSerialTee
+  Print *_serial_tee;
+
+  // millis() wraps counted for the epoch records, see BinaryDataFmt.h
+  uint16_t _millis_epoch;
+  uint32_t _epoch_millis;
+
+  // file position from which the next index record is due
+  uint32_t _index_due;
+
+  /*
+   * Log rotation, see setLogRotation. The open log file is number
+   * _log_index; _next_file is the following one once it has been created
+   * ahead of time. Preallocated files (raw logs, and size rotated ones) are
+   * trimmed to the logged size when closed.
+   */
+  log_rotation_e _rotation;
+  unsigned long _rotation_limit;
+  unsigned long _log_opened_millis;
+  bool _rotation_failed;
+  bool _rotating;
+  char _log_prefix[8];
+  uint16_t _log_index;
+  uint32_t _log_file_size;
+  bool _log_preallocated;
+  File _next_file;
+  uint16_t _next_index;
+  bool _next_preallocated;
+
+  /*
+   * Log queue. A single-producer/single-consumer byte ring that logBytes
+   * fills (from the main loop or a timer ISR) and serviceDataLog drains to
+   * the card. Each record is stored as [length][bytes]; a zero length marks
+   * that the rest of the ring is unused and the next record starts at 0, so
+   * records are always contiguous. One byte is kept free to tell a full ring
+   * from an empty one. The producer owns _queue_head and the consumer owns
+   * _queue_tail.
+   */
+  unsigned char *_queue_buf;
+  uint16_t _queue_size;
+  volatile uint16_t _queue_head;
+  volatile uint16_t _queue_tail;
+  volatile unsigned long _queue_overruns;
+  // set while _queue_drain runs, so a sync it triggers doesn't drain again
+  bool _queue_draining;
+
+  // RAM budget set with setLogRamBudget, and the one beginDataLog had to use
+  unsigned int _ram_budget;
+  unsigned int _ram_budget_used;
+
+  // aggregation streams and deadband filters, see setLogAggregation and
+  // setLogDeadband
+  log_aggregate_t *_aggregates;
+  log_deadband_t *_deadbands;
+};
+
+/**
+ * A log of its own, in a file of its own, so that a sketch can keep e.g. a
+ * high-rate IMU log and a low-rate housekeeping log open at the same time,
+ * each with its own format, sync policy, rotation, queue and buffers:
+ *
+ *   DataLog imu;
+ *
+ *   imu.setBinaryEncoding(LOG_BINARY_INT16);
+ *   imu.beginHighRate(chipSelect, "imu", false, 4000000);
+ *   beginDataLog(chipSelect, "env", true);
+ *   ...
+ *   imu.binaryLogAcceleration(0, accel);
+ *   logTemperature("temp", temp);
+ *
+ * The methods do what the free functions of the same name do, for this log;
+ * the free functions wrap a default DataLog. Each log keeps its own state,
+ * accumulator buffers and queue, so the log calls of one log, including
+ * those from an interrupt handler, don't disturb another. All logs share the
+ * SD card, its volume and block cache, the RTC, the custom record types and
+ * the SD statistics (the record counts in log_stats_t are per log).
+ *
+ * The card takes one multi-block write at a time: a high-rate log's write
+ * runs until another log sends the card something, i.e. writes a block,
+ * syncs or opens a file, and then restarts with its next block. Queueing or
+ * accumulating the other logs' records keeps those interruptions rare.
+ *
+ * Frames (beginFrame) belong to the default log.
+ */
+class DataLog {
+ public:
+  DataLog() {}
+  ~DataLog();
+
+  bool begin(int chipSelectPin, const char *fileNamePrefix, bool csvData);
+  bool beginHighRate(int chipSelectPin, const char *fileNamePrefix,
+                     bool csvData, unsigned long logFileSize);
+  bool end();
+  bool flush();
+  bool service();
+
+  bool setSyncPolicy(log_sync_policy_e policy, unsigned long interval);
+  bool setBurst(unsigned long intervalMillis, unsigned int maxBytes);
+  bool setRotation(log_rotation_e policy, unsigned long limit);
+  bool setAggregation(unsigned char sensorType, unsigned char sensorId,
+                      unsigned long windowMillis);
+  bool setDeadband(unsigned char sensorType, unsigned char sensorId,
+                   log_deadband_e mode, float threshold,
+                   unsigned long heartbeatMillis);
+  bool setBlockFraming(bool enable);
+  bool setRecordCrc(bool enable);
+  bool setSpiTuning(bool enable);
+  bool setSerialTee(Print *port);
+  bool setCsvFormat(log_csv_format_e format);
+  bool setCsvPrecision(unsigned char sensorType, unsigned char precision);
+  bool setBinaryEncoding(log_binary_encoding_e encoding);
+  bool setBinaryScale(unsigned char sensorType, unsigned int scale);
+  bool setQueueSize(unsigned int bytes);
+  bool setRamBudget(unsigned int bytes);
+  void getConfig(log_config_t *config);
+  unsigned long getOverruns();
+  bool getStats(log_stats_t *stats);
+  void resetStats();
+
+  int logString(const char *output_buf);
+  int logBytes(const unsigned char *buffer, unsigned char numBytes);
+  unsigned char *logReserve(unsigned char numBytes);
+  int logCommit(unsigned char numBytes);
+  int logSensorName(unsigned char sensorType, unsigned char sensorId,
+                    const char *name);
+  int logRTCTimestamp();
+  int binaryLogRTCTimestamp();
+
+  int logAcceleration(const char *sensorName, acceleration_t & data);
+  int logMagnetic(const char *sensorName, magnetic_t & data);
+  int logGyro(const char *sensorName, gyro_t & data);
+  int logTemperature(const char *sensorName, temperature_t & data);
+  int logLuminosity(const char *sensorName, luminosity_t & data);
+  int logUVLight(const char *sensorName, uvlight_t & data);
+  int logOrientation(const char *sensorName, orientation_t & data);
+  int logPressure(const char *sensorName, pressure_t & data);
+
+  int binaryLogAcceleration(const unsigned char sensorId, acceleration_t & data);
+  int binaryLogMagnetic(const unsigned char sensorId, magnetic_t & data);
+  int binaryLogGyro(const unsigned char sensorId, gyro_t & data);
+  int binaryLogTemperature(const unsigned char sensorId, temperature_t & data);
+  int binaryLogLuminosity(const unsigned char sensorId, luminosity_t & data);
+  int binaryLogUVLight(const unsigned char sensorId, uvlight_t & data);
+  int binaryLogOrientation(const unsigned char sensorId, orientation_t & data);
+  int binaryLogPressure(const unsigned char sensorId, pressure_t & data);
+
+  /**
+   * Logs a record of a type described by a BinaryRecord, see logRecord.
+   */
+  template <class Record>
+  int logRecord(unsigned char sensorId, unsigned long timestamp,
+                const typename Record::field_t *values)
+  {
+    unsigned char buf[Record::size];
+    unsigned char *dst = logReserve(Record::size);
+
+    if (dst != NULL) {
+      Record::pack(dst, sensorId, timestamp, values);
+      return logCommit(Record::size);
+    }
+    Record::pack(buf, sensorId, timestamp, values);
+    return logBytes(buf, Record::size);
+  }
+
+ private:
+  friend class LogScope;
+  log_state_t _state;
+
+  // not copyable, the state belongs to one log
+  DataLog(const DataLog &);
+  DataLog &operator=(const DataLog &);
+};
+
+/**
+ * Reads the records of a binary log file back on the device, e.g. to send a
+ * summary of the last few minutes over a radio:
+ *
+ *   LogReader reader;
+ *   unsigned char record[64];
+ *
+ *   reader.open("DATA0.BIN");
+ *   reader.seek(millis() - 300000);
+ *   while (reader.read(record, sizeof(record)) > 0) ...
+ *
+ * seek binary searches the index records of the file (see
+ * LOG_INDEX_INTERVAL) with seekSet, so it reads a few blocks per step rather
+ * than the file up to the timestamp. read returns one whole record at a
+ * time, laid out as in BinaryDataFmt.h, skipping the block headers of
+ * framed logs. Custom record types are sized from the file header.
+ *
+ * open flushes the default log so its records so far can be read, and
+ * refuses while that is a high-rate log; another DataLog's raw multi-block
+ * write is ended by each read and restarts with its next block. The file is
+ * read as far as it went at open. Timestamps are compared as millis()
+ * values, so a file should not span more than 24 days. Compact records are
+ * delta encoded, so in compact logs reading starts at the index record
+ * before the timestamp, whose key records restart the streams. Framed logs
+ * are read up to the first damaged block header; block CRCs are not
+ * checked. In logs with record CRCs (see setLogRecordCrc), records whose
+ * CRC doesn't match are skipped, and read returns records without their CRC
+ * byte.
+ */
+class LogReader {
+ public:
+  LogReader() : _framed(false), _crc(false), _end(0), _type_count(0) {}
+  ~LogReader() { close(); }
+
+  bool open(const char *fileName);
+  bool seek(unsigned long timestamp);
+  int read(unsigned char *buffer, unsigned char size);
+  void close();
+
+ private:
+  bool _rewind();
+  bool _seek_record(uint32_t pos);
+  bool _read_bytes(unsigned char *dst, uint8_t n);
+  int _read_record(unsigned char *buffer, unsigned char size);
+  int _read_unchecked(unsigned char *buffer, unsigned char size);
+  bool _zero_padding(uint32_t pos);
+  bool _find_index(uint32_t pos, uint32_t limit, uint32_t *at, uint32_t *time);
+
+  File _file;
+  bool _framed;
+  // records are followed by a CRC byte, see setLogRecordCrc
+  bool _crc;
+  // end of the bytes readable at the file position in a framed log
+  uint32_t _end;
+  // type byte and size of the custom record types in the file header
+  uint8_t _types[LOG_CUSTOM_RECORD_TYPES][2];
+  uint8_t _type_count;
+
+  // not copyable, the file is opened once
+  LogReader(const LogReader &);
+  LogReader &operator=(const LogReader &);
+};
+#endif  // __cplusplus
+
 #endif /* ARDUSATLOGGING_H_ */
@@ -0,0 +1,1225 @@
+/**
+ * @file   ardusat_decode.c
+ * @brief  libardusat_decode, the decoding engine for binary data saved using
+ *         the Ardusat SDK. See ardusat_decode.h.
+ */
+#ifndef ARDUINO
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ardusat_decode.h"
+
+static const int field_counts[] = ARDUSAT_SENSOR_FIELD_COUNTS;
+static const uint16_t compact_scales[] = ARDUSAT_COMPACT_SCALES;
+static const uint16_t default_int16_scales[] = ARDUSAT_INT16_SCALES;
+static const char *sensor_names[ADS_NUM_SENSOR_TYPES] = { "acceleration",
+  "magnetic", "gyro", "orientation", "temperature", "luminosity", "uv",
+  "pressure" };
+static const char *sensor_fields[ADS_NUM_SENSOR_TYPES][ARDUSAT_COMPACT_MAX_VALUES] = {
+  { "x", "y", "z" }, { "x", "y", "z" }, { "x", "y", "z" },
+  { "roll", "pitch", "heading" }, { "temp" }, { "lux" }, { "uv" },
+  { "pressure" } };
+
+/*
+ * CRC-CCITT as computed by utility/Crc.cpp, for block framing, index records
+ * and stream frames.
+ */
+uint16_t ads_crc_ccitt(uint16_t crc, const uint8_t *data, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    crc = (uint8_t) (crc >> 8) | (crc << 8);
+    crc ^= data[i];
+    crc ^= (uint8_t) (crc & 0xff) >> 4;
+    crc ^= crc << 12;
+    crc ^= (crc & 0xff) << 5;
+  }
+  return crc;
+}
+
+static const uint8_t crc8_table[256] = {
+  0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+  0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+  0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65,
+  0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+  0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5,
+  0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+  0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85,
+  0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+  0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2,
+  0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+  0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2,
+  0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+  0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32,
+  0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+  0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42,
+  0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+  0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C,
+  0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+  0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC,
+  0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+  0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C,
+  0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+  0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C,
+  0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+  0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B,
+  0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+  0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B,
+  0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+  0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB,
+  0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+  0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB,
+  0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3
+};
+
+/*
+ * CRC-8 as computed by utility/Crc.cpp, for record CRCs.
+ */
+uint8_t ads_crc8(uint8_t crc, const uint8_t *data, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    crc = crc8_table[crc ^ data[i]];
+  }
+  return crc;
+}
+
+/*
+ * Checks a block of a framed log (see BinaryDataFmt.h).
+ *
+ * @return number of bytes used in the block, 0 if the block is damaged
+ */
+int ads_check_block(const uint8_t *block, size_t size, uint32_t number)
+{
+  int used = block[4] | (block[5] << 8);
+  uint16_t crc = block[6] | (block[7] << 8);
+
+  if (size < ARDUSAT_BLOCK_HEADER_SIZE || block[0] != ARDUSAT_BLOCK_MAGIC ||
+      block[1] != (uint8_t) number || used < ARDUSAT_BLOCK_HEADER_SIZE ||
+      used > 512 || (size_t) used > size) {
+    return 0;
+  }
+  if (ads_crc_ccitt(ads_crc_ccitt(0, block, 6), block + ARDUSAT_BLOCK_HEADER_SIZE,
+                    used - ARDUSAT_BLOCK_HEADER_SIZE) != crc) {
+    return 0;
+  }
+  return used;
+}
+
+/*
+ * Tells if the file header record at the start of the first block of a
+ * framed log says its records have CRCs, even if the block is damaged.
+ */
+static int framed_record_crc(const ads_input_t *in)
+{
+  const uint8_t *hdr = in->data + ARDUSAT_BLOCK_HEADER_SIZE;
+
+  return in->size >= ARDUSAT_BLOCK_HEADER_SIZE + 8 &&
+         hdr[0] == 0xFF && hdr[1] == ARDUSAT_CONTROL_FILE_HEADER &&
+         hdr[2] >= 5 && memcmp(hdr + 3, ARDUSAT_FILE_MAGIC, 3) == 0 &&
+         (hdr[7] & ARDUSAT_FILE_RECORD_CRC);
+}
+
+/*
+ * Sets up an input over size bytes of data and, for framed logs, checks its
+ * blocks. Damaged blocks are left out, unless the log has record CRCs: then
+ * their records are checked one by one instead, up to the used length in
+ * their header if it makes sense, or else the whole block. The data isn't
+ * copied and must outlive the input.
+ *
+ * @return 0 if successful, -1 if out of memory
+ */
+int ads_input_init(ads_input_t *in, const uint8_t *data, size_t size)
+{
+  size_t block, len, used;
+
+  memset(in, 0, sizeof(*in));
+  in->data = data;
+  in->size = size;
+  if (size > 0 && data[0] == ARDUSAT_BLOCK_MAGIC) {
+    in->framed = 1;
+    in->num_blocks = (size + 511) / 512;
+    in->block_used = (uint16_t *) malloc(in->num_blocks * sizeof(uint16_t));
+    if (in->block_used == NULL) {
+      return -1;
+    }
+    for (block = 0; block < in->num_blocks; ++block) {
+      len = size - block * 512 < 512 ? size - block * 512 : 512;
+      in->block_used[block] = ads_check_block(data + block * 512, len, block);
+    }
+    if (!framed_record_crc(in)) {
+      return 0;
+    }
+    for (block = 0; block < in->num_blocks; ++block) {
+      len = size - block * 512 < 512 ? size - block * 512 : 512;
+      used = data[block * 512 + 4] | (data[block * 512 + 5] << 8);
+      if (in->block_used[block] == 0 && len > ARDUSAT_BLOCK_HEADER_SIZE) {
+        in->block_used[block] = used > ARDUSAT_BLOCK_HEADER_SIZE && used <= len ?
+                                used : len;
+      }
+    }
+  }
+  return 0;
+}
+
+void ads_input_free(ads_input_t *in)
+{
+  free(in->block_used);
+  in->block_used = NULL;
+}
+
+/*
+ * Moves a framed reader on to the next block once the current one is used
+ * up. Reading stops at a partially filled or damaged block.
+ *
+ * @return 1 if there are bytes to read at r->pos, 0 at the end of the run
+ */
+int ads_reader_ready(ads_reader_t *r)
+{
+  const ads_input_t *in = r->in;
+  size_t block;
+
+  while (r->pos == r->end) {
+    if (!in->framed || r->end % 512 != 0) {
+      return 0;
+    }
+    block = r->end / 512;
+    if (block >= in->num_blocks || in->block_used[block] == 0) {
+      return 0;
+    }
+    r->pos = block * 512 + ARDUSAT_BLOCK_HEADER_SIZE;
+    r->end = block * 512 + in->block_used[block];
+    r->hops++;
+  }
+  return 1;
+}
+
+/*
+ * Moves a framed reader to the first record starting in or after block.
+ *
+ * @return 1 if successful, 0 if no good block with a record start is left
+ */
+int ads_seek_block_record(ads_reader_t *r, size_t block)
+{
+  const ads_input_t *in = r->in;
+  const uint8_t *hdr;
+  int first;
+
+  for (; block < in->num_blocks; ++block) {
+    hdr = in->data + block * 512;
+    first = hdr[2] | (hdr[3] << 8);
+    if (in->block_used[block] > 0 && first >= ARDUSAT_BLOCK_HEADER_SIZE &&
+        first < in->block_used[block]) {
+      r->pos = block * 512 + first;
+      r->end = block * 512 + in->block_used[block];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int read_byte(ads_reader_t *r)
+{
+  if (!ads_reader_ready(r)) {
+    return -1;
+  }
+  return r->in->data[r->pos++];
+}
+
+/*
+ * Reads n bytes, in place if they are contiguous in the input, or else
+ * gathered into the decoder's scratch buffer.
+ *
+ * @return the bytes, NULL at the end of the input
+ */
+static const uint8_t *read_span(ads_decoder_t *d, size_t n)
+{
+  ads_reader_t *r = &d->r;
+  const uint8_t *p;
+  size_t got, len;
+
+  if (!ads_reader_ready(r)) {
+    return NULL;
+  }
+  if (r->end - r->pos >= n) {
+    p = r->in->data + r->pos;
+    r->pos += n;
+    return p;
+  }
+  for (got = 0; got < n; got += len) {
+    if (!ads_reader_ready(r)) {
+      return NULL;
+    }
+    len = r->end - r->pos < n - got ? r->end - r->pos : n - got;
+    memcpy(d->raw + got, r->in->data + r->pos, len);
+    r->pos += len;
+  }
+  return d->raw;
+}
+
+static uint32_t get_uint32(const uint8_t *b)
+{
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static int read_uint32(ads_decoder_t *d, uint32_t *n)
+{
+  const uint8_t *b = read_span(d, 4);
+
+  if (b == NULL) {
+    return -1;
+  }
+  *n = get_uint32(b);
+  return 0;
+}
+
+static int read_varint(ads_reader_t *r, uint32_t *n)
+{
+  int c;
+  int shift = 0;
+
+  *n = 0;
+  do {
+    if ((c = read_byte(r)) < 0 || shift > 28) {
+      return -1;
+    }
+    *n |= (uint32_t) (c & 0x7F) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 0;
+}
+
+static int read_zigzag(ads_reader_t *r, int32_t *n)
+{
+  uint32_t u;
+
+  if (read_varint(r, &u) != 0) {
+    return -1;
+  }
+  *n = (int32_t) (u >> 1) ^ -(int32_t) (u & 1);
+  return 0;
+}
+
+void ads_format_init(ads_format_t *format)
+{
+  memset(format, 0, sizeof(*format));
+  memcpy(format->int16_scales, default_int16_scales, sizeof(format->int16_scales));
+}
+
+/*
+ * Sets up a decoder at the start of the input, reading the file header into
+ * format.
+ *
+ * @return 1 if there are records to decode, 0 if not
+ */
+int ads_decoder_init(ads_decoder_t *d, const ads_input_t *in, ads_format_t *format)
+{
+  memset(d, 0, sizeof(*d));
+  d->r.in = in;
+  d->format = format;
+  d->read_header = 1;
+  if (in->framed) {
+    return ads_seek_block_record(&d->r, 0);
+  }
+  d->r.end = in->size;
+  return in->size > 0;
+}
+
+/*
+ * Starts the next row of the record.
+ */
+static ads_row_t *new_row(ads_decoder_t *d, ads_record_t *rec, int kind)
+{
+  ads_row_t *row = &d->rows[rec->num_rows];
+
+  row->kind = kind;
+  row->integer = 0;
+  row->text = NULL;
+  return row;
+}
+
+/*
+ * Adds a finished row to the record, with its reading timestamp or marker
+ * millis placed on the 64 bit timeline.
+ */
+static void add_row(ads_decoder_t *d, ads_record_t *rec, ads_row_t *row)
+{
+  uint32_t millis = row->kind == ADS_ROW_TIMESTAMP ? row->millis : row->timestamp;
+
+  row->time = millis;
+  if (d->timeline.valid) {
+    row->time = d->timeline.time + (int32_t) (millis - d->timeline.millis);
+  }
+  rec->num_rows++;
+}
+
+/*
+ * Decodes a float record of a known sensor type whose first byte has already
+ * been read.
+ */
+static int decode_float(ads_decoder_t *d, uint8_t type, ads_record_t *rec)
+{
+  ads_row_t *row = new_row(d, rec, ADS_ROW_READING);
+  const uint8_t *buf = read_span(d, 5 + 4 * field_counts[type]);
+  float value;
+  int i;
+
+  if (buf == NULL) {
+    return -1;
+  }
+  row->id = buf[0];
+  row->timestamp = get_uint32(buf + 1);
+  row->name = sensor_names[type];
+  row->fields = sensor_fields[type];
+  row->count = field_counts[type];
+  for (i = 0; i < row->count; ++i) {
+    memcpy(&value, buf + 5 + 4 * i, 4);
+    row->values[i] = value;
+  }
+  add_row(d, rec, row);
+  return 0;
+}
+
+/*
+ * Decodes a compact key or delta record (see BinaryDataFmt.h) whose first
+ * byte has already been read.
+ */
+static int decode_compact(ads_decoder_t *d, uint8_t first_byte, ads_record_t *rec)
+{
+  ads_row_t *row = new_row(d, rec, ADS_ROW_READING);
+  uint8_t type = first_byte & ARDUSAT_RECORD_TYPE_MASK;
+  int key = (first_byte & ARDUSAT_RECORD_ENCODING_MASK) == ARDUSAT_RECORD_COMPACT_KEY;
+  ads_compact_stream_t *stream;
+  uint32_t delta;
+  int32_t value;
+  int c, i;
+
+  if ((c = read_byte(&d->r)) < 0) {
+    return -1;
+  }
+  stream = &d->streams[type][c];
+
+  if (key) {
+    if (read_uint32(d, &stream->timestamp) != 0) {
+      return -1;
+    }
+  } else {
+    if (read_varint(&d->r, &delta) != 0) {
+      return -1;
+    }
+    stream->timestamp += delta;
+  }
+
+  for (i = 0; i < field_counts[type]; ++i) {
+    if (read_zigzag(&d->r, &value) != 0) {
+      return -1;
+    }
+    stream->values[i] = key ? value : stream->values[i] + value;
+    row->values[i] = (double) stream->values[i] / compact_scales[type];
+  }
+  // deltas whose key record was lost (e.g. in a dropped block) are skipped
+  // until the next key record
+  if (!key && !stream->valid) {
+    return 0;
+  }
+  stream->valid = 1;
+
+  row->id = c;
+  row->timestamp = stream->timestamp;
+  row->name = sensor_names[type];
+  row->fields = sensor_fields[type];
+  row->count = field_counts[type];
+  add_row(d, rec, row);
+  return 0;
+}
+
+/*
+ * Decodes an int16 record (see BinaryDataFmt.h) whose first byte has already
+ * been read.
+ */
+static int decode_int16(ads_decoder_t *d, uint8_t type, ads_record_t *rec)
+{
+  ads_row_t *row = new_row(d, rec, ADS_ROW_READING);
+  const uint8_t *buf = read_span(d, 5 + 2 * field_counts[type]);
+  int i;
+
+  if (buf == NULL) {
+    return -1;
+  }
+  row->id = buf[0];
+  row->timestamp = get_uint32(buf + 1);
+  row->name = sensor_names[type];
+  row->fields = sensor_fields[type];
+  row->count = field_counts[type];
+  for (i = 0; i < row->count; ++i) {
+    row->values[i] = (double) (int16_t) (buf[5 + 2 * i] | (buf[6 + 2 * i] << 8)) /
+                     d->format->int16_scales[type];
+  }
+  add_row(d, rec, row);
+  return 0;
+}
+
+/*
+ * Decodes a fixed size record of a type the decoder doesn't know from its
+ * description in the file header. Records whose fields can't be decoded are
+ * skipped.
+ */
+static int decode_described(ads_decoder_t *d, uint8_t first_byte, ads_record_t *rec)
+{
+  const ads_record_type_t *desc = &d->format->types[first_byte];
+  ads_row_t *row = new_row(d, rec, ADS_ROW_READING);
+  const uint8_t *buf = read_span(d, desc->size - 1);
+  int width = desc->field_type == ARDUSAT_FIELD_FLOAT ? 4 :
+              desc->field_type == ARDUSAT_FIELD_INT16 ? 2 : 0;
+  float f;
+  int i;
+
+  if (buf == NULL) {
+    return -1;
+  }
+  if (width == 0 || desc->size != 6 + width * desc->field_count) {
+    return 0;
+  }
+
+  row->id = buf[0];
+  row->timestamp = get_uint32(buf + 1);
+  row->name = desc->names;
+  row->fields = desc->fields;
+  row->integer = width == 2;
+  row->count = desc->field_count;
+  for (i = 0; i < row->count; ++i) {
+    if (width == 4) {
+      memcpy(&f, buf + 5 + 4 * i, 4);
+      row->values[i] = f;
+    } else {
+      row->values[i] = (int16_t) (buf[5 + 2 * i] | (buf[6 + 2 * i] << 8));
+    }
+  }
+  add_row(d, rec, row);
+  return 0;
+}
+
+/*
+ * Built-in sensor types have fixed names, custom ones are named by their
+ * description in the file header.
+ */
+static const char *sensor_type_name(const ads_format_t *format, uint8_t type)
+{
+  if (type < ADS_NUM_SENSOR_TYPES) {
+    return sensor_names[type];
+  } else if (format->types[type].size > 0) {
+    return format->types[type].names;
+  } else if (format->types[ARDUSAT_RECORD_INT16 | type].size > 0) {
+    return format->types[ARDUSAT_RECORD_INT16 | type].names;
+  }
+  return "unknown";
+}
+
+/*
+ * Takes in a file header control record.
+ *
+ * @return 0 if successful, -1 if the file isn't an Ardusat SDK log
+ */
+static int read_header(ads_decoder_t *d, uint8_t subtype, const uint8_t *body, int len)
+{
+  ads_format_t *format = d->format;
+  ads_record_type_t *desc;
+  char *comma;
+  int i;
+
+  if (subtype == ARDUSAT_CONTROL_FILE_HEADER && len >= 4) {
+    if (memcmp(body, ARDUSAT_FILE_MAGIC, 3) != 0) {
+      d->error = "Not an ArdusatSDK file header!";
+      return -1;
+    }
+    format->version = body[3];
+    format->record_crc = len >= 5 && (body[4] & ARDUSAT_FILE_RECORD_CRC);
+  } else if (subtype == ARDUSAT_CONTROL_RECORD_TYPE && len >= 4) {
+    desc = &format->types[body[0]];
+    desc->size = body[1];
+    desc->field_type = body[2];
+    desc->field_count = body[3];
+    memcpy(desc->names, body + 4, len - 4);
+    desc->names[len - 4] = '\0';
+    // split "name,field,field" into the name and the field names
+    comma = desc->names;
+    for (i = 0; i < desc->field_count && i < ADS_MAX_ROW_VALUES; ++i) {
+      if (comma != NULL && (comma = strchr(comma, ',')) != NULL) {
+        *comma++ = '\0';
+      }
+      desc->fields[i] = comma != NULL ? comma : "";
+    }
+    if ((comma = strchr(desc->names, ',')) != NULL) {
+      *comma = '\0';
+    }
+  } else if (subtype == ARDUSAT_CONTROL_INT16_SCALES) {
+    for (i = 0; i < ADS_NUM_SENSOR_TYPES && 2 * i + 1 < len; ++i) {
+      format->int16_scales[i] = body[2 * i] | (body[2 * i + 1] << 8);
+      if (format->int16_scales[i] == 0) {
+        format->int16_scales[i] = 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Tells if the CRC byte after a control record just read matches, without
+ * reading it.
+ */
+static int control_crc_good(const ads_decoder_t *d, uint8_t subtype,
+                            const uint8_t *body, int len)
+{
+  uint8_t head[3] = { 0xFF, subtype, (uint8_t) len };
+  ads_reader_t r = d->r;
+
+  return read_byte(&r) == ads_crc8(ads_crc8(0, head, 3), body, len);
+}
+
+/*
+ * Reads a length prefixed control record (see BinaryDataFmt.h) whose first
+ * two bytes have already been read. The file header records are only taken
+ * in if d->read_header is set, and in a log with record CRCs if their CRC
+ * byte matches. Unknown subtypes are skipped.
+ */
+static int decode_control(ads_decoder_t *d, uint8_t subtype, ads_record_t *rec)
+{
+  const uint8_t *body;
+  ads_row_t *row;
+  int len;
+
+  if ((len = read_byte(&d->r)) < 0 || (body = read_span(d, len)) == NULL) {
+    return -1;
+  }
+
+  if (subtype == ARDUSAT_CONTROL_SENSOR_NAME && len >= 2) {
+    row = new_row(d, rec, ADS_ROW_SENSOR_NAME);
+    row->name = sensor_type_name(d->format, body[0] & ARDUSAT_RECORD_TYPE_MASK);
+    row->id = body[1];
+    memcpy(d->text, body + 2, len - 2);
+    d->text[len - 2] = '\0';
+    row->text = d->text;
+    add_row(d, rec, row);
+  }
+  // an index record is also an epoch anchor
+  if ((subtype == ARDUSAT_CONTROL_EPOCH && len >= 6) ||
+      (subtype == ARDUSAT_CONTROL_INDEX && len >= 12)) {
+    d->timeline.valid = 1;
+    d->timeline.millis = get_uint32(body + 2);
+    d->timeline.time = ((uint64_t) (body[0] | (body[1] << 8)) << 32) | d->timeline.millis;
+  }
+  if (subtype == ARDUSAT_CONTROL_DEADBAND && len >= 6 &&
+      body[0] < ADS_NUM_SENSOR_TYPES) {
+    row = new_row(d, rec, ADS_ROW_DEADBAND);
+    row->name = sensor_names[body[0]];
+    row->id = body[1];
+    row->heartbeat = get_uint32(body + 2);
+    row->timestamp = 0;
+    add_row(d, rec, row);
+  }
+  if (d->read_header &&
+      (!d->format->record_crc || control_crc_good(d, subtype, body, len))) {
+    return read_header(d, subtype, body, len);
+  }
+  return 0;
+}
+
+/*
+ * Decodes a frame record (see BinaryDataFmt.h) whose first byte has already
+ * been read, as one row per reading. The whole frame is read first, so a
+ * truncated frame has no rows.
+ */
+static int decode_frame(ads_decoder_t *d, ads_record_t *rec)
+{
+  const uint8_t *buf;
+  ads_row_t *row;
+  uint32_t timestamp;
+  size_t size = 0;
+  float value;
+  int mask, i;
+  unsigned int type;
+
+  if ((mask = read_byte(&d->r)) < 0 || read_uint32(d, &timestamp) != 0) {
+    return -1;
+  }
+  for (type = 0; type < ADS_NUM_SENSOR_TYPES; ++type) {
+    if (mask & (1 << type)) {
+      size += 1 + 4 * field_counts[type];
+    }
+  }
+  if ((buf = read_span(d, size)) == NULL) {
+    return -1;
+  }
+
+  for (type = 0; type < ADS_NUM_SENSOR_TYPES; ++type) {
+    if (!(mask & (1 << type))) {
+      continue;
+    }
+    row = new_row(d, rec, ADS_ROW_READING);
+    row->timestamp = timestamp;
+    row->id = buf[0];
+    row->name = sensor_names[type];
+    row->fields = sensor_fields[type];
+    row->count = field_counts[type];
+    for (i = 0; i < row->count; ++i) {
+      memcpy(&value, buf + 1 + 4 * i, 4);
+      row->values[i] = value;
+    }
+    buf += 1 + 4 * row->count;
+    add_row(d, rec, row);
+  }
+  return 0;
+}
+
+static int decode_record(ads_decoder_t *d, int c, ads_record_t *rec)
+{
+  uint8_t type = c & ARDUSAT_RECORD_TYPE_MASK;
+  ads_row_t *row;
+
+  switch (c & ARDUSAT_RECORD_ENCODING_MASK) {
+    case ARDUSAT_RECORD_COMPACT_KEY:
+    case ARDUSAT_RECORD_COMPACT_DELTA:
+      if (type < ADS_NUM_SENSOR_TYPES) {
+        return decode_compact(d, c, rec);
+      }
+      break;
+    case ARDUSAT_RECORD_INT16:
+      if (type < ADS_NUM_SENSOR_TYPES) {
+        return decode_int16(d, type, rec);
+      }
+      break;
+    case ARDUSAT_RECORD_FLOAT:
+      if (type < ADS_NUM_SENSOR_TYPES) {
+        return decode_float(d, type, rec);
+      }
+      if (type == ARDUSAT_SENSOR_TYPE_FRAME) {
+        return decode_frame(d, rec);
+      }
+      break;
+  }
+
+  if (c == 0xFF) {
+    if ((c = read_byte(&d->r)) < 0) {
+      return -1;
+    }
+    if (c != ARDUSAT_CONTROL_TIMESTAMP) {
+      return decode_control(d, c, rec);
+    }
+    row = new_row(d, rec, ADS_ROW_TIMESTAMP);
+    if (read_uint32(d, &row->timestamp) != 0 || read_uint32(d, &row->millis) != 0) {
+      return -1;
+    }
+    // compact streams restart with key records after each marker
+    memset(d->streams, 0, sizeof(d->streams));
+    add_row(d, rec, row);
+    return 0;
+  }
+
+  if (d->format->types[c].size > 0) {
+    return decode_described(d, c, rec);
+  }
+  snprintf(d->message, sizeof(d->message), "Unknown sensor type %d found!", c);
+  d->error = d->message;
+  return -1;
+}
+
+/*
+ * Tells if the rest of an unframed input from pos on is zeros: the padding
+ * left at the end of the last block of a log file recovered after a power
+ * loss (see ARDUSAT_FILE_OPEN), which holds no records.
+ */
+static int zero_padding(const ads_input_t *in, size_t pos)
+{
+  if (in->framed) {
+    return 0;
+  }
+  for (; pos < in->size; ++pos) {
+    if (in->data[pos] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Decodes the record at the reader, checking its CRC byte in a log with
+ * record CRCs.
+ *
+ * @return 0 if successful, 1 if its CRC byte doesn't match, -1 at the end of
+ *         input, -2 if it is undecodable or cut short
+ */
+static int read_record(ads_decoder_t *d, ads_record_t *rec)
+{
+  ads_reader_t start;
+  size_t len;
+  int c;
+
+  rec->num_rows = 0;
+  rec->rows = d->rows;
+  if ((c = read_byte(&d->r)) < 0) {
+    return -1;
+  }
+  start = d->r;
+  start.pos--;
+  if (c == 0 && zero_padding(d->r.in, start.pos)) {
+    d->r.pos = d->r.in->size;
+    return -1;
+  }
+  if (decode_record(d, c, rec) != 0) {
+    return -2;
+  }
+
+  rec->pos = start.pos;
+  if (d->r.hops == start.hops) {
+    rec->data = d->r.in->data + start.pos;
+    rec->size = d->r.pos - start.pos;
+  } else {
+    // split over two blocks
+    for (rec->size = 0; start.pos != d->r.pos; rec->size += len) {
+      ads_reader_ready(&start);
+      len = start.hops == d->r.hops ? d->r.pos - start.pos : start.end - start.pos;
+      memcpy(d->raw + rec->size, d->r.in->data + start.pos, len);
+      start.pos += len;
+    }
+    rec->data = d->raw;
+  }
+  if (!d->format->record_crc) {
+    return 0;
+  }
+  if ((c = read_byte(&d->r)) < 0) {
+    return -2;
+  }
+  return ads_crc8(0, rec->data, rec->size) == c ? 0 : 1;
+}
+
+/*
+ * Tells if a record is all zeros, which passes a CRC-8 check by chance.
+ */
+static int zero_record(const ads_record_t *rec)
+{
+  size_t i;
+
+  for (i = 0; i < rec->size && rec->data[i] == 0; ++i);
+  return i == rec->size;
+}
+
+/*
+ * Tells if the record after the one just decoded checks out too, or the
+ * input ends there, so that a record found by resync() is unlikely to have
+ * matched its CRC byte by chance. The look ahead is decoded on a copy of the
+ * decoder, as it must not change its state.
+ */
+static int next_record_good(const ads_decoder_t *d, ads_decoder_t **scratch)
+{
+  ads_record_t rec;
+  int ret;
+
+  if (*scratch == NULL &&
+      (*scratch = (ads_decoder_t *) malloc(sizeof(ads_decoder_t))) == NULL) {
+    return 1;
+  }
+  memcpy(*scratch, d, sizeof(ads_decoder_t));
+  ret = read_record(*scratch, &rec);
+  return ret == -1 || (ret == 0 && !zero_record(&rec));
+}
+
+/*
+ * Tells if the record at a reader position is good: it decodes, its CRC
+ * byte matches, as does the record after it, and it isn't all zeros. What
+ * the damaged record before it changed is undone first.
+ *
+ * @return 1 if it is, 0 if not, -1 at the end of input
+ */
+static int try_record(ads_decoder_t *d, ads_record_t *rec, ads_reader_t at,
+                      const ads_timeline_t *timeline, ads_decoder_t **scratch)
+{
+  int ret;
+
+  d->r = at;
+  d->timeline = *timeline;
+  memset(d->streams, 0, sizeof(d->streams));
+  if ((ret = read_record(d, rec)) == -1) {
+    return -1;
+  }
+  return ret == 0 && !zero_record(rec) && next_record_good(d, scratch);
+}
+
+/*
+ * Finds the next good record after a damaged one in a log with record CRCs
+ * (see try_record). If only its CRC byte didn't match, its size is most
+ * likely right and the record after it, at after, is tried first; else
+ * every byte after start is tried in turn. What the damaged record changed
+ * is undone: the timeline is put back, and as the compact stream it belongs
+ * to can't be told, all streams wait for key records. Header records are
+ * only taken in from the record found.
+ *
+ * @return 0 if a record was found, -1 at the end of input
+ */
+static int resync(ads_decoder_t *d, ads_record_t *rec, ads_reader_t start,
+                  const ads_reader_t *after, const ads_timeline_t *timeline)
+{
+  ads_decoder_t *scratch = NULL;
+  int read_header = d->read_header;
+  int found = 0;
+
+  d->bad_records++;
+  d->read_header = 0;
+  if (after != NULL && (found = try_record(d, rec, *after, timeline, &scratch)) == 1) {
+    start = *after;
+  }
+  while (found == 0) {
+    d->r = start;
+    if (read_byte(&d->r) < 0) {
+      found = -1;
+      break;
+    }
+    start = d->r;
+    found = try_record(d, rec, start, timeline, &scratch);
+  }
+  d->read_header = read_header;
+  if (found == 1 && read_header) {
+    // decode the record found again, taking it in if it is a header record
+    d->r = start;
+    d->timeline = *timeline;
+    memset(d->streams, 0, sizeof(d->streams));
+    read_record(d, rec);
+  }
+  if (found != 1) {
+    rec->num_rows = 0;
+  }
+  d->error = NULL;
+  free(scratch);
+  return found == 1 ? 0 : -1;
+}
+
+/*
+ * Decodes the next record. Records that hold nothing to output, such as
+ * most control records, have no rows. In a log with record CRCs (see
+ * BinaryDataFmt.h), a record that is undecodable or whose CRC byte doesn't
+ * match is counted in d->bad_records and skipped with resync().
+ *
+ * @return 0 if successful, -1 at the end of input or an undecodable record
+ *         (see d->error)
+ */
+int ads_next_record(ads_decoder_t *d, ads_record_t *rec)
+{
+  ads_reader_t start = d->r;
+  ads_reader_t after;
+  ads_timeline_t timeline = d->timeline;
+  int ret;
+
+  d->error = NULL;
+  ret = read_record(d, rec);
+  if (ret == 0) {
+    return 0;
+  }
+  if (ret == -1 || !d->format->record_crc) {
+    return -1;
+  }
+  after = d->r;
+  return resync(d, rec, start, ret == 1 ? &after : NULL, &timeline);
+}
+
+static void *grow(void *p, size_t size)
+{
+  p = realloc(p, size);
+  if (p == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static const char *timestamp_fields[] = { "unixtime", "millis" };
+
+static ads_table_t *find_table(ads_tables_t *t, const ads_row_t *row)
+{
+  const char *name = row->kind == ADS_ROW_TIMESTAMP ? "timestamp" : row->name;
+  ads_table_t *table;
+  int i;
+
+  for (i = t->num_tables - 1; i >= 0; --i) {
+    if (strcmp(t->tables[i].name, name) == 0) {
+      return &t->tables[i];
+    }
+  }
+  t->tables = (ads_table_t *) grow(t->tables, (t->num_tables + 1) * sizeof(ads_table_t));
+  table = &t->tables[t->num_tables++];
+  memset(table, 0, sizeof(*table));
+  table->name = name;
+  table->kind = row->kind;
+  table->fields = row->kind == ADS_ROW_TIMESTAMP ? timestamp_fields : row->fields;
+  table->count = row->kind == ADS_ROW_TIMESTAMP ? 0 : row->count;
+  table->values = (double **) calloc(table->count + 1, sizeof(double *));
+  return table;
+}
+
+static void add_name(ads_tables_t *t, const ads_row_t *row)
+{
+  size_t n = strlen(row->name) + strlen(row->text) + 16;
+
+  if (t->names_len + n > t->names_cap) {
+    t->names_cap = t->names_cap * 2 > t->names_len + n ? t->names_cap * 2 : t->names_len + n;
+    t->names = (char *) grow(t->names, t->names_cap);
+  }
+  t->names_len += snprintf(t->names + t->names_len, n, "%s,%d,%s\n", row->name,
+                           row->id, row->text);
+}
+
+/*
+ * Appends a row to the columns of its record name. Deadband rows aren't
+ * kept.
+ */
+void ads_tables_add(ads_tables_t *t, const ads_row_t *row)
+{
+  ads_table_t *table;
+  int i;
+
+  if (row->kind == ADS_ROW_SENSOR_NAME) {
+    add_name(t, row);
+    return;
+  }
+  if (row->kind != ADS_ROW_READING && row->kind != ADS_ROW_TIMESTAMP) {
+    return;
+  }
+
+  table = find_table(t, row);
+  if (table->rows == table->cap) {
+    table->cap = table->cap ? table->cap * 2 : 1024;
+    table->time = (uint64_t *) grow(table->time, table->cap * sizeof(uint64_t));
+    if (table->kind == ADS_ROW_TIMESTAMP) {
+      table->unixtime = (uint32_t *) grow(table->unixtime, table->cap * sizeof(uint32_t));
+    } else {
+      table->id = (uint8_t *) grow(table->id, table->cap);
+    }
+    for (i = 0; i < table->count; ++i) {
+      table->values[i] = (double *) grow(table->values[i], table->cap * sizeof(double));
+    }
+  }
+  table->time[table->rows] = row->time;
+  if (table->kind == ADS_ROW_TIMESTAMP) {
+    table->unixtime[table->rows] = row->timestamp;
+  } else {
+    table->id[table->rows] = row->id;
+    for (i = 0; i < table->count; ++i) {
+      table->values[i][table->rows] = i < row->count ? row->values[i] : 0;
+    }
+  }
+  table->rows++;
+}
+
+/*
+ * Frees the columns, leaving the tables empty.
+ */
+void ads_tables_clear(ads_tables_t *t)
+{
+  ads_table_t *table;
+  int i, j;
+
+  for (i = 0; i < t->num_tables; ++i) {
+    table = &t->tables[i];
+    free(table->time);
+    free(table->unixtime);
+    free(table->id);
+    for (j = 0; j < table->count; ++j) {
+      free(table->values[j]);
+    }
+    free(table->values);
+  }
+  free(t->tables);
+  free(t->names);
+  t->tables = NULL;
+  t->num_tables = 0;
+  t->names = NULL;
+  t->names_len = t->names_cap = 0;
+}
+
+/*
+ * Starts decoding a log from the beginning of its input, which the caller
+ * has set up with ads_input_init, into format. Such a log belongs to the
+ * caller, who frees its input with ads_input_free instead of ads_log_close.
+ */
+void ads_log_begin(ads_log_t *log, ads_format_t *format)
+{
+  size_t block;
+
+  log->format = format;
+  ads_format_init(format);
+  log->running = ads_decoder_init(&log->d, &log->in, format);
+  log->damaged = 0;
+  for (block = 0; block < log->in.num_blocks; ++block) {
+    log->damaged += log->in.block_used[block] == 0;
+  }
+  log->bad_records = 0;
+  log->error_pos = 0;
+  log->error = NULL;
+  log->start = 0;
+  log->limit = log->stop = (size_t) -1;
+}
+
+/*
+ * Limits a log started with ads_log_begin to its file header, the records
+ * before header_end, and the records from start, a record start such as an
+ * index record, up to stop.
+ */
+void ads_log_range(ads_log_t *log, size_t header_end, size_t start, size_t stop)
+{
+  log->start = start;
+  log->stop = stop;
+  log->limit = start > header_end ? header_end : stop;
+}
+
+/*
+ * Opens a binary log held in memory for decoding with ads_log_next. The
+ * data isn't copied and must outlive the log.
+ *
+ * @return the log, to be closed with ads_log_close, NULL if out of memory
+ */
+ads_log_t *ads_log_open(const uint8_t *data, size_t size)
+{
+  ads_log_t *log = (ads_log_t *) malloc(sizeof(ads_log_t));
+  ads_format_t *format;
+
+  if (log == NULL) {
+    return NULL;
+  }
+  if ((format = (ads_format_t *) malloc(sizeof(ads_format_t))) == NULL ||
+      ads_input_init(&log->in, data, size) != 0) {
+    free(format);
+    free(log);
+    return NULL;
+  }
+  ads_log_begin(log, format);
+  return log;
+}
+
+/*
+ * Decodes the next record of a log, moving on past damaged blocks, up to
+ * the end of its input or range.
+ *
+ * @return 0 if successful, -1 at the end of the log or an undecodable
+ *         record it stops at
+ */
+int ads_log_next(ads_log_t *log, ads_record_t *rec)
+{
+  ads_decoder_t *d = &log->d;
+  int ret;
+
+  while (log->running) {
+    if (d->r.pos >= log->limit) {
+      if (log->limit == log->stop) {
+        log->running = 0;
+        break;
+      }
+      // past the file header, skip ahead to the start of the range
+      log->limit = log->stop;
+      if (d->r.pos < log->start) {
+        d->r.pos = log->start;
+        d->r.end = log->in.framed ? log->start / 512 * 512 +
+                   log->in.block_used[log->start / 512] : log->in.size;
+        memset(d->streams, 0, sizeof(d->streams));
+      }
+      continue;
+    }
+    ret = ads_next_record(d, rec);
+    log->bad_records = d->bad_records;
+    if (ret == 0) {
+      return 0;
+    }
+    if (!log->in.framed) {
+      if (ads_reader_ready(&d->r)) {
+        log->error_pos = d->r.pos;
+        log->error = d->error != NULL ? d->error : "Undecodable record found!";
+      }
+      log->running = 0;
+      break;
+    }
+    // end of a run of good blocks, or an undecodable record in it
+    memset(d->streams, 0, sizeof(d->streams));
+    log->running = ads_seek_block_record(&d->r, (d->r.pos - 1) / 512 + 1);
+  }
+  return -1;
+}
+
+/*
+ * Moves a log on to a new unframed piece of input, such as the records of
+ * a serial tee frame (see setLogSerialTee), keeping the file header,
+ * timeline and compact streams read so far. The data isn't copied and must
+ * outlive the decoding of the piece.
+ */
+void ads_log_feed(ads_log_t *log, const uint8_t *data, size_t size)
+{
+  ads_input_free(&log->in);
+  memset(&log->in, 0, sizeof(log->in));
+  log->in.data = data;
+  log->in.size = size;
+  log->d.r.in = &log->in;
+  log->d.r.pos = 0;
+  log->d.r.end = size;
+  log->running = size > 0;
+  log->error = NULL;
+  log->start = 0;
+  log->limit = log->stop = (size_t) -1;
+}
+
+void ads_log_close(ads_log_t *log)
+{
+  if (log == NULL) {
+    return;
+  }
+  ads_input_free(&log->in);
+  free(log->format);
+  free(log);
+}
+
+/*
+ * Decodes a whole binary log into columns, in one pass, with an ads_log_t.
+ * Damaged blocks and records are counted, and where an unframed log stops
+ * at an undecodable record is noted.
+ *
+ * @return the columns, to be freed with ads_tables_free, NULL if out of
+ *         memory
+ */
+ads_tables_t *ads_decode_tables(const uint8_t *data, size_t size)
+{
+  ads_tables_t *t = (ads_tables_t *) calloc(1, sizeof(ads_tables_t));
+  ads_log_t *log = ads_log_open(data, size);
+  ads_record_t rec;
+  int i;
+
+  if (t == NULL || log == NULL) {
+    ads_log_close(log);
+    free(t);
+    return NULL;
+  }
+  while (ads_log_next(log, &rec) == 0) {
+    for (i = 0; i < rec.num_rows; ++i) {
+      ads_tables_add(t, &rec.rows[i]);
+    }
+  }
+  // the columns keep record type names from the format
+  t->format = log->format;
+  log->format = NULL;
+  t->damaged = log->damaged;
+  t->bad_records = log->bad_records;
+  t->error = log->error != NULL;
+  t->error_pos = log->error_pos;
+  ads_log_close(log);
+  return t;
+}
+
+void ads_tables_free(ads_tables_t *t)
+{
+  if (t == NULL) {
+    return;
+  }
+  ads_tables_clear(t);
+  free(t->format);
+  free(t);
+}
+
+#endif
@@ -0,0 +1,248 @@
+/**
+ * @file   ardusat_decode.h
+ * @brief  libardusat_decode, the decoding engine for binary data saved using
+ *         the Ardusat SDK.
+ *
+ *         Decodes the records of a binary log held in memory one at a time,
+ *         without copying the input: each record comes back as a pointer to
+ *         its bytes in the input and the rows (readings, RTC timestamp
+ *         markers, sensor names) decoded from it. decode_binary.c is built
+ *         on it, and ardusat_decode.py loads it as a shared library to
+ *         decode files into rows or whole files into numpy arrays:
+ *
+ *           cc -O2 -shared -fPIC -o libardusat_decode.so ardusat_decode.c
+ *
+ *         The file header is read into an ads_format_t, which several
+ *         decoders working on pieces of the same input can share once it
+ *         has been read.
+ */
+#ifndef ARDUSAT_DECODE_H_
+#define ARDUSAT_DECODE_H_
+#ifndef ARDUINO
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utility/BinaryDataFmt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ADS_NUM_SENSOR_TYPES 8
+#define ADS_MAX_ROW_VALUES 128
+// a frame holds at most one reading of each sensor type
+#define ADS_MAX_RECORD_ROWS ADS_NUM_SENSOR_TYPES
+
+/*
+ * The input, a whole binary log in memory. Framed logs (see BinaryDataFmt.h)
+ * also have the number of bytes used in each block, 0 for damaged blocks
+ * that are left out.
+ */
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  int framed;
+  size_t num_blocks;
+  uint16_t *block_used;
+} ads_input_t;
+
+/*
+ * Reads the record bytes of the input, skipping block headers and unused
+ * block space in framed logs. end is the end of the bytes readable at pos,
+ * hops counts the blocks moved on to.
+ */
+typedef struct {
+  const ads_input_t *in;
+  size_t pos;
+  size_t end;
+  size_t hops;
+} ads_reader_t;
+
+/*
+ * A decoded row: a sensor reading, an RTC timestamp marker, a sensor name or
+ * a sensor's deadband heartbeat (see setLogDeadband). time is the reading
+ * timestamp or marker millis on the 64 bit timeline of the last epoch
+ * anchor, or the millis value as logged before the first anchor.
+ */
+enum { ADS_ROW_READING, ADS_ROW_TIMESTAMP, ADS_ROW_SENSOR_NAME, ADS_ROW_DEADBAND };
+
+typedef struct {
+  int kind;
+  uint32_t timestamp;
+  uint32_t millis;
+  uint64_t time;
+  const char *name;
+  const char *const *fields;
+  const char *text;
+  uint32_t heartbeat;
+  int id;
+  int integer;
+  int count;
+  double values[ADS_MAX_ROW_VALUES];
+} ads_row_t;
+
+/*
+ * A decoded record. data points to its size bytes in the input, or, for a
+ * record split over two blocks of a framed log, to a copy in the decoder.
+ * pos is the input offset of its first byte. rows stay valid until the next
+ * record is decoded.
+ */
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  size_t pos;
+  int num_rows;
+  const ads_row_t *rows;
+} ads_record_t;
+
+/*
+ * Record types described by the file header, indexed by record type byte.
+ */
+typedef struct {
+  uint8_t size;
+  uint8_t field_type;
+  uint8_t field_count;
+  char names[UINT8_MAX + 1];
+  const char *fields[ADS_MAX_ROW_VALUES];
+} ads_record_type_t;
+
+/*
+ * What the file header says about the log: its format version, whether its
+ * records have CRCs, the record type descriptions and the int16 scales.
+ */
+typedef struct {
+  int version;
+  int record_crc;
+  uint16_t int16_scales[ADS_NUM_SENSOR_TYPES];
+  ads_record_type_t types[256];
+} ads_format_t;
+
+/*
+ * Latest epoch anchor (see BinaryDataFmt.h), which places 32 bit millis
+ * timestamps on a 64 bit timeline.
+ */
+typedef struct {
+  int valid;
+  uint64_t time;
+  uint32_t millis;
+} ads_timeline_t;
+
+/*
+ * Last record of every sensor type and id, for decoding compact deltas.
+ */
+typedef struct {
+  int valid;
+  uint32_t timestamp;
+  int32_t values[ARDUSAT_COMPACT_MAX_VALUES];
+} ads_compact_stream_t;
+
+typedef ads_compact_stream_t ads_compact_streams_t[ADS_NUM_SENSOR_TYPES][256];
+
+/*
+ * Decoding state of the input or a piece of it. read_header is set for the
+ * decoder that reads the file header into the format; others only use it.
+ * error describes the last record that couldn't be decoded, if known.
+ * bad_records counts the damaged records skipped in a log with record CRCs.
+ */
+typedef struct {
+  ads_reader_t r;
+  ads_format_t *format;
+  int read_header;
+  ads_timeline_t timeline;
+  ads_compact_streams_t streams;
+  size_t bad_records;
+  const char *error;
+  char message[64];
+  char text[UINT8_MAX + 1];
+  uint8_t raw[512];
+  ads_row_t rows[ADS_MAX_RECORD_ROWS];
+} ads_decoder_t;
+
+/*
+ * A whole binary log, decoded one record at a time: framed logs resume at
+ * the next good record start after a damaged block or an undecodable
+ * record, other logs stop at an undecodable record, noting its position and
+ * why in error_pos and error. damaged counts the damaged blocks left out,
+ * bad_records the damaged records skipped in a log with record CRCs. The
+ * other fields are private; bindings such as ardusat_decode.py only read
+ * the first ones.
+ */
+typedef struct {
+  size_t damaged;
+  size_t bad_records;
+  size_t error_pos;
+  const char *error;
+  int running;
+  size_t limit;
+  size_t start;
+  size_t stop;
+  ads_input_t in;
+  ads_format_t *format;
+  ads_decoder_t d;
+} ads_log_t;
+
+/*
+ * Columns of the rows of each record name, as decode_binary -c writes them
+ * and ardusat_decode.py turns them into numpy arrays: time, id and one
+ * column per field for readings, unixtime and time (millis) for timestamp
+ * markers. Sensor names are kept as "name,id,sensor name" lines in names.
+ */
+typedef struct {
+  const char *name;
+  const char *const *fields;
+  int kind;
+  int count;
+  size_t rows;
+  size_t cap;
+  uint64_t *time;
+  uint32_t *unixtime;
+  uint8_t *id;
+  double **values;
+} ads_table_t;
+
+typedef struct {
+  ads_table_t *tables;
+  int num_tables;
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+  ads_format_t *format;
+  size_t damaged;
+  size_t error_pos;
+  int error;
+  size_t bad_records;
+} ads_tables_t;
+
+uint16_t ads_crc_ccitt(uint16_t crc, const uint8_t *data, size_t n);
+uint8_t ads_crc8(uint8_t crc, const uint8_t *data, size_t n);
+
+int ads_input_init(ads_input_t *in, const uint8_t *data, size_t size);
+void ads_input_free(ads_input_t *in);
+int ads_check_block(const uint8_t *block, size_t size, uint32_t number);
+
+int ads_reader_ready(ads_reader_t *r);
+int ads_seek_block_record(ads_reader_t *r, size_t block);
+
+void ads_format_init(ads_format_t *format);
+int ads_decoder_init(ads_decoder_t *d, const ads_input_t *in, ads_format_t *format);
+int ads_next_record(ads_decoder_t *d, ads_record_t *rec);
+
+ads_log_t *ads_log_open(const uint8_t *data, size_t size);
+void ads_log_begin(ads_log_t *log, ads_format_t *format);
+void ads_log_range(ads_log_t *log, size_t header_end, size_t start, size_t stop);
+int ads_log_next(ads_log_t *log, ads_record_t *rec);
+void ads_log_feed(ads_log_t *log, const uint8_t *data, size_t size);
+void ads_log_close(ads_log_t *log);
+
+void ads_tables_add(ads_tables_t *t, const ads_row_t *row);
+void ads_tables_clear(ads_tables_t *t);
+ads_tables_t *ads_decode_tables(const uint8_t *data, size_t size);
+void ads_tables_free(ads_tables_t *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+#endif
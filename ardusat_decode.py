@@ -0,0 +1,297 @@
+"""
+Python bindings of libardusat_decode (ardusat_decode.c), the C decoding
+engine of decode_binary. Build the shared library next to this file with
+
+    cc -O2 -shared -fPIC -o libardusat_decode.so ardusat_decode.c
+
+and decode a whole binary log into numpy arrays in one call:
+
+    >>> import ardusat_decode
+    >>> with open("MYDATA0.BIN", "rb") as f:
+    ...     tables, names, damaged, bad = ardusat_decode.arrays(f.read())
+    >>> tables["acceleration"]["x"]
+
+or into rows one record at a time with a Log. ArdusatBinaryData in
+decode_binary.py decodes with it when it is built, and falls back to its own
+pure Python decoder otherwise.
+"""
+import ctypes
+import os
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+LIBRARY_NAMES = ("libardusat_decode.so", "libardusat_decode.dylib",
+                 "ardusat_decode.dll")
+
+# row kinds of ardusat_decode.h
+ROW_READING = 0
+ROW_TIMESTAMP = 1
+ROW_SENSOR_NAME = 2
+ROW_DEADBAND = 3
+MAX_ROW_VALUES = 128
+
+
+class _Row(ctypes.Structure):
+    # ads_row_t
+    _fields_ = [("kind", ctypes.c_int),
+                ("timestamp", ctypes.c_uint32),
+                ("millis", ctypes.c_uint32),
+                ("time", ctypes.c_uint64),
+                ("name", ctypes.c_char_p),
+                ("fields", ctypes.POINTER(ctypes.c_char_p)),
+                ("text", ctypes.c_char_p),
+                ("heartbeat", ctypes.c_uint32),
+                ("id", ctypes.c_int),
+                ("integer", ctypes.c_int),
+                ("count", ctypes.c_int),
+                ("values", ctypes.c_double * MAX_ROW_VALUES)]
+
+
+class _Record(ctypes.Structure):
+    # ads_record_t
+    _fields_ = [("data", ctypes.c_void_p),
+                ("size", ctypes.c_size_t),
+                ("pos", ctypes.c_size_t),
+                ("num_rows", ctypes.c_int),
+                ("rows", ctypes.POINTER(_Row))]
+
+
+class _Log(ctypes.Structure):
+    # the public fields at the start of ads_log_t
+    _fields_ = [("damaged", ctypes.c_size_t),
+                ("bad_records", ctypes.c_size_t),
+                ("error_pos", ctypes.c_size_t),
+                ("error", ctypes.c_char_p)]
+
+
+class _Table(ctypes.Structure):
+    # ads_table_t
+    _fields_ = [("name", ctypes.c_char_p),
+                ("fields", ctypes.POINTER(ctypes.c_char_p)),
+                ("kind", ctypes.c_int),
+                ("count", ctypes.c_int),
+                ("rows", ctypes.c_size_t),
+                ("cap", ctypes.c_size_t),
+                ("time", ctypes.POINTER(ctypes.c_uint64)),
+                ("unixtime", ctypes.POINTER(ctypes.c_uint32)),
+                ("id", ctypes.POINTER(ctypes.c_uint8)),
+                ("values", ctypes.POINTER(ctypes.POINTER(ctypes.c_double)))]
+
+
+class _Tables(ctypes.Structure):
+    # ads_tables_t
+    _fields_ = [("tables", ctypes.POINTER(_Table)),
+                ("num_tables", ctypes.c_int),
+                ("names", ctypes.c_void_p),
+                ("names_len", ctypes.c_size_t),
+                ("names_cap", ctypes.c_size_t),
+                ("format", ctypes.c_void_p),
+                ("damaged", ctypes.c_size_t),
+                ("error_pos", ctypes.c_size_t),
+                ("error", ctypes.c_int),
+                ("bad_records", ctypes.c_size_t)]
+
+
+_library = None
+
+
+def library():
+    """
+    :return: libardusat_decode loaded with ctypes, None if it hasn't been
+             built next to this file
+    """
+    global _library
+    if _library is not None:
+        return _library
+    for name in LIBRARY_NAMES:
+        path = os.path.join(HERE, name)
+        if os.path.exists(path):
+            lib = ctypes.CDLL(path)
+            lib.ads_decode_tables.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+            lib.ads_decode_tables.restype = ctypes.POINTER(_Tables)
+            lib.ads_tables_free.argtypes = [ctypes.POINTER(_Tables)]
+            lib.ads_tables_free.restype = None
+            lib.ads_log_open.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+            lib.ads_log_open.restype = ctypes.POINTER(_Log)
+            lib.ads_log_next.argtypes = [ctypes.POINTER(_Log), ctypes.POINTER(_Record)]
+            lib.ads_log_next.restype = ctypes.c_int
+            lib.ads_log_feed.argtypes = [ctypes.POINTER(_Log), ctypes.c_char_p,
+                                         ctypes.c_size_t]
+            lib.ads_log_feed.restype = None
+            lib.ads_log_close.argtypes = [ctypes.POINTER(_Log)]
+            lib.ads_log_close.restype = None
+            _library = lib
+            break
+    return _library
+
+
+def _library_or_raise():
+    lib = library()
+    if lib is None:
+        raise OSError("libardusat_decode not found in %s, see ardusat_decode.h "
+                      "for how to build it" % HERE)
+    return lib
+
+
+class Log(object):
+    """
+    A binary log decoded by libardusat_decode one record at a time, into
+    the same rows as ArdusatBinaryData.next_rows() in decode_binary.py, plus
+    ("deadband", record name, sensor id, heartbeat) rows. Framed logs move on
+    past damaged blocks; other logs stop at an undecodable record, leaving
+    why and where in error and error_pos.
+
+    :raises OSError: if the library hasn't been built
+    :raises MemoryError: if the library ran out of memory
+    """
+
+    def __init__(self, data=b""):
+        self._lib = _library_or_raise()
+        # the library reads the data in place
+        self._data = bytes(data)
+        self._log = self._lib.ads_log_open(self._data, len(self._data))
+        if not self._log:
+            raise MemoryError("libardusat_decode ran out of memory")
+        self._record = _Record()
+        # names and field name arrays -> Python strings, as they repeat
+        self._names = {}
+        self._fields = {}
+
+    def feed(self, data):
+        """
+        Moves on to a new unframed piece of input, such as the records of a
+        serial tee frame, keeping the file header and timeline read so far.
+        """
+        self._data = bytes(data)
+        self._lib.ads_log_feed(self._log, self._data, len(self._data))
+
+    def next_rows(self):
+        """
+        Decodes the next record.
+
+        :return: list of the rows in the record, None at the end of the log
+        """
+        if self._lib.ads_log_next(self._log, ctypes.byref(self._record)) != 0:
+            return None
+        rows = []
+        for i in range(self._record.num_rows):
+            row = self._record.rows[i]
+            if row.kind == ROW_TIMESTAMP:
+                rows.append(("timestamp", row.timestamp, row.time))
+                continue
+            name = self._name(row.name)
+            if row.kind == ROW_SENSOR_NAME:
+                rows.append(("sensor", name, row.id,
+                             row.text.decode("ascii", "replace")))
+            elif row.kind == ROW_DEADBAND:
+                rows.append(("deadband", name, row.id, row.heartbeat))
+            else:
+                values = row.values[:row.count]
+                if row.integer:
+                    values = [int(val) for val in values]
+                rows.append(("reading", row.time, name, row.id, values,
+                             self._field_names(row)))
+        return rows
+
+    def _name(self, raw):
+        name = self._names.get(raw)
+        if name is None:
+            name = self._names[raw] = raw.decode("ascii", "replace")
+        return name
+
+    def _field_names(self, row):
+        key = ctypes.cast(row.fields, ctypes.c_void_p).value
+        fields = self._fields.get(key)
+        if fields is None:
+            fields = self._fields[key] = tuple(
+                row.fields[i].decode("ascii", "replace") for i in range(row.count))
+        return fields
+
+    @property
+    def damaged(self):
+        return self._log.contents.damaged
+
+    @property
+    def bad_records(self):
+        return self._log.contents.bad_records
+
+    @property
+    def error(self):
+        error = self._log.contents.error
+        return error.decode("ascii", "replace") if error is not None else None
+
+    @property
+    def error_pos(self):
+        return self._log.contents.error_pos
+
+    def close(self):
+        if getattr(self, "_log", None):
+            self._lib.ads_log_close(self._log)
+            self._log = None
+
+    def __del__(self):
+        self.close()
+
+
+def _column(pointer, rows):
+    """
+    :return: numpy view of a C array of rows values
+    """
+    import numpy
+    return numpy.ctypeslib.as_array(pointer, (rows,))
+
+
+def arrays(data):
+    """
+    Decodes a whole binary log with libardusat_decode. The log is read in
+    place, without copying it, and each column comes back from C in one
+    piece.
+
+    :param data: bytes of the log, as read from the file
+    :return: (tables, names, damaged, bad): dict of record name -> numpy
+             structured array in file order, with timestamp, id and field
+             columns (timestamp markers under "timestamp" with unixtime and
+             millis columns; times are uint64 on the epoch timeline), dict of
+             (record name, sensor id) -> sensor name, the number of damaged
+             blocks skipped in a framed log, and the number of records
+             skipped for a bad CRC in a log with record CRCs
+    :raises OSError: if the library hasn't been built
+    :raises MemoryError: if the library ran out of memory
+    """
+    import numpy
+
+    lib = _library_or_raise()
+    data = bytes(data)
+    tables = lib.ads_decode_tables(data, len(data))
+    if not tables:
+        raise MemoryError("libardusat_decode ran out of memory")
+    try:
+        result = {}
+        for i in range(tables.contents.num_tables):
+            table = tables.contents.tables[i]
+            name = table.name.decode("utf-8", "replace")
+            rows = table.rows
+            if table.kind == ROW_TIMESTAMP:
+                out = numpy.empty(rows, [("unixtime", "<u4"), ("millis", "<u8")])
+                out["unixtime"] = _column(table.unixtime, rows)
+                out["millis"] = _column(table.time, rows)
+            else:
+                fields = [table.fields[j].decode("utf-8", "replace")
+                          for j in range(table.count)]
+                out = numpy.empty(rows, [("timestamp", "<u8"), ("id", "u1")] +
+                                  [(field, "<f8") for field in fields])
+                out["timestamp"] = _column(table.time, rows)
+                out["id"] = _column(table.id, rows)
+                for j, field in enumerate(fields):
+                    out[field] = _column(table.values[j], rows)
+            result[name] = out
+
+        names = {}
+        text = b""
+        if tables.contents.names_len:
+            text = ctypes.string_at(tables.contents.names, tables.contents.names_len)
+        for line in text.decode("utf-8", "replace").splitlines():
+            record, sensor_id, sensor_name = line.split(",", 2)
+            names[(record, int(sensor_id))] = sensor_name
+        return result, names, tables.contents.damaged, tables.contents.bad_records
+    finally:
+        lib.ads_tables_free(tables)
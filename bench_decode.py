@@ -0,0 +1,133 @@
+"""
+Benchmarks the binary decoders on synthetic logs made by gen_binary.
+
+For each encoding, generates a log of the given size and type mix, then
+times decode_binary (CSV and columnar output), decode_binary.py (CSV and
+columnar output) and, if numpy is installed, ArdusatBinaryData.arrays() and
+libardusat_decode (if it has been built, see ardusat_decode.py), and prints the best of --repeat runs in MB/s and rows/s. Rows are the lines of
+CSV output (readings and timestamp markers), the same count for every
+decoder.
+"""
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+def best_time(run, repeat):
+    """
+    :return: the shortest wall clock time of repeat calls of run
+    """
+    best = None
+    for _ in range(repeat):
+        start = time.time()
+        run()
+        elapsed = time.time() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+def command(args):
+    """
+    :return: function running args quietly, raising if it fails
+    """
+    def run():
+        with open(os.devnull, "w") as devnull:
+            subprocess.check_call(args, stdout=devnull)
+    return run
+
+def arrays(path, native):
+    def run():
+        sys.path.insert(0, HERE)
+        import decode_binary
+        with open(path, "rb") as input_file:
+            decode_binary.ArdusatBinaryData(input_file).arrays(native)
+    return run
+
+def have_library():
+    sys.path.insert(0, HERE)
+    import ardusat_decode
+    return ardusat_decode.library() is not None
+
+def have_numpy():
+    try:
+        import numpy
+    except ImportError:
+        return False
+    return True
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Benchmarks decode_binary and "
+                                     "decode_binary.py on synthetic binary logs.")
+    parser.add_argument("-g,--generator", dest="generator",
+                        default=os.path.join(HERE, "gen_binary"),
+                        help="gen_binary executable (default: ./gen_binary)")
+    parser.add_argument("-d,--decoder", dest="decoder",
+                        default=os.path.join(HERE, "decode_binary"),
+                        help="decode_binary executable (default: ./decode_binary)")
+    parser.add_argument("-s,--size", dest="size", default="64",
+                        help="Size of each log in MB (default: 64)")
+    parser.add_argument("-m,--mix", dest="mix", default=None,
+                        help="Type mix for gen_binary, e.g. acceleration=4,temperature=1")
+    parser.add_argument("-e,--encodings", dest="encodings",
+                        default="float,int16,compact",
+                        help="Comma separated encodings (default: float,int16,compact)")
+    parser.add_argument("-t,--threads", dest="threads", default=None,
+                        help="Threads for decode_binary (default: all cores)")
+    parser.add_argument("-r,--repeat", dest="repeat", type=int, default=3,
+                        help="Runs of each decoder, the best is reported (default: 3)")
+    parser.add_argument("-n,--no-python", action="store_true", dest="no_python",
+                        help="Only benchmark decode_binary")
+    args = parser.parse_args()
+
+    for tool in (args.generator, args.decoder):
+        if not os.access(tool, os.X_OK):
+            print("%s not found, see the README for how to build it" % tool)
+            sys.exit(1)
+
+    work = tempfile.mkdtemp(prefix="bench_decode")
+    try:
+        print("%-8s %-24s %10s %12s %8s" % ("encoding", "decoder", "MB/s", "rows/s", "s"))
+        for encoding in args.encodings.split(","):
+            log = os.path.join(work, "%s.bin" % encoding)
+            csv = os.path.join(work, "%s.csv" % encoding)
+            columns = os.path.join(work, "%s_columns" % encoding)
+            gen = [args.generator, "-o", log, "-s", args.size, "-e", encoding]
+            if args.mix:
+                gen += ["-m", args.mix]
+            command(gen)()
+            megabytes = os.path.getsize(log) / float(1 << 20)
+
+            threads = ["-t", args.threads] if args.threads else []
+            runs = [
+                ("decode_binary csv", command([args.decoder] + threads + ["-o", csv, log])),
+                ("decode_binary columnar",
+                 command([args.decoder] + threads + ["-c", columns, log])),
+            ]
+            if not args.no_python:
+                script = os.path.join(HERE, "decode_binary.py")
+                runs += [
+                    ("decode_binary.py csv", command([sys.executable, script, "-o", csv, log])),
+                    ("decode_binary.py columnar",
+                     command([sys.executable, script, "-c", columns, log])),
+                ]
+                if have_numpy():
+                    runs.append(("decode_binary.py arrays", arrays(log, False)))
+                    if have_library():
+                        runs.append(("libardusat_decode arrays", arrays(log, True)))
+
+            rows = None
+            for name, run in runs:
+                seconds = best_time(run, args.repeat)
+                if rows is None:
+                    with open(csv) as output:
+                        rows = sum(1 for _ in output)
+                print("%-8s %-24s %10.1f %12.0f %8.2f" %
+                      (encoding, name, megabytes / seconds, rows / seconds, seconds))
+                sys.stdout.flush()
+    finally:
+        shutil.rmtree(work)
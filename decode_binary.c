@@ -5,7 +5,10 @@
  * @brief  Utility to decode binary data saved using the Ardusat SDK.
  *
  *         Takes a path to a binary data file as input and outputs a CSV file
- *         with the data.
+ *         with the data. The file is mapped into memory, split into chunks
+ *         at record boundaries, and the chunks are decoded on all cores by
+ *         libardusat_decode (ardusat_decode.c). Can also decode a live
+ *         stream of records from a serial port.
  */
 #ifndef ARDUINO
 
@@ -14,12 +17,27 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <math.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "utility/BinaryDataFmt.h"
+#include "ardusat_decode.h"
 
 static struct option cli_options[] = {
   { "output-file", required_argument, NULL, 'o' },
+  { "threads", required_argument, NULL, 't' },
+  { "columnar", required_argument, NULL, 'c' },
+  { "follow", no_argument, NULL, 'f' },
+  { "fill", required_argument, NULL, 'F' },
+  { "from", required_argument, NULL, 'b' },
+  { "to", required_argument, NULL, 'e' },
+  { "rtc", no_argument, NULL, 'r' },
   { "help", no_argument, NULL, 'h' },
   { 0, 0, 0, 0}
 };
@@ -27,9 +45,31 @@ static struct option cli_options[] = {
 void print_usage(char *argv [])
 {
   printf("Decodes a binary data file created using the ArdusatSDK.\n");
-  printf("usage: %s [options] FILE\n", argv[0]);
+  printf("usage: %s [options] FILE...\n", argv[0]);
+  printf("Several files are merged into one output in time order (decoding on\n");
+  printf("1 thread).\n");
   printf("Options:\n");
   printf("  -o,--output-file PATH          CSV file to write decoded data to\n");
+  printf("  -t,--threads N                 Decode on N threads (default: all cores)\n");
+  printf("  -c,--columnar DIR              Write one little endian array file per\n");
+  printf("                                 column of each record type to DIR\n");
+  printf("                                 instead of CSV\n");
+  printf("  -f,--follow                    Decode a live stream of serial tee frames\n");
+  printf("                                 from FILE (a serial port, pipe, growing\n");
+  printf("                                 file or - for stdin) as it arrives,\n");
+  printf("                                 writing CSV to stdout unless -o is given\n");
+  printf("  -F,--fill MS                   Repeat the last reading of deadbanded\n");
+  printf("                                 sensors every MS ms until their next one,\n");
+  printf("                                 for a regular series (decodes on 1 thread)\n");
+  printf("  -b,--from MS                   Only output readings at or after MS on the\n");
+  printf("                                 time column, starting from the last index\n");
+  printf("                                 record before it instead of the file start\n");
+  printf("  -e,--to MS                     Only output readings at or before MS, and\n");
+  printf("                                 stop decoding shortly after it\n");
+  printf("  -r,--rtc                       Merge files on RTC time, aligning each by\n");
+  printf("                                 its first RTC timestamp marker, for files\n");
+  printf("                                 recorded across a reboot or on different\n");
+  printf("                                 boards\n");
   printf("  -h,--help                      Print this usage info.\n");
 }
 
@@ -89,83 +129,1105 @@ char * make_output_csv_path_from_input(const char *input_path)
 
   return output_file_path;
 }
+#define MAX_FILL_STREAMS 64
 
-#define get_data_struct(typeSize, name) \
-  if (fread(buf + 1, 1, typeSize - 1, input) == 0) { \
-    return -1; \
-  } \
-  timestamp = *((uint32_t *)(buf + 2)); \
-  sensor_id = *((uint8_t *)(buf + 1)); \
-  sprintf(sensor_name, name); \
+// the file header, read while planning the chunks and shared by all of them
+static ads_format_t format;
 
-int process_next_row(FILE *input, FILE *output)
+typedef void (*emit_fn)(void *sink, const ads_row_t *row);
+
+/*
+ * Where decoded rows go: CSV or columns, after --fill and --from/--to.
+ */
+typedef struct {
+  emit_fn emit;
+  void *sink;
+  int lines;
+} output_t;
+
+/*
+ * Sensors with a deadband (see BinaryDataFmt.h) and their last reading, for
+ * forward filling with --fill. Filling needs the rows in file order, so it
+ * decodes on a single thread.
+ */
+typedef struct {
+  const char *name;
+  int id;
+  uint32_t heartbeat;
+  int valid;
+  ads_row_t last;
+} fill_stream_t;
+
+static fill_stream_t fill_streams[MAX_FILL_STREAMS];
+static int num_fill_streams = 0;
+static uint32_t fill_period = 0;
+
+// time range to output with --from and --to
+static uint64_t range_from = 0;
+static uint64_t range_to = UINT64_MAX;
+
+static int in_range(const ads_row_t *row)
+{
+  return row->kind == ADS_ROW_SENSOR_NAME ||
+         (row->time >= range_from && row->time <= range_to);
+}
+
+/*
+ * Emits a row if it is in the time range, counting the readings output.
+ */
+static void emit_row(output_t *o, const ads_row_t *row)
+{
+  if (in_range(row)) {
+    o->emit(o->sink, row);
+    if (row->kind == ADS_ROW_READING) {
+      o->lines++;
+    }
+  }
+}
+
+static fill_stream_t *find_fill_stream(const char *name, int id)
+{
+  int i;
+
+  for (i = 0; i < num_fill_streams; ++i) {
+    if (fill_streams[i].id == id && strcmp(fill_streams[i].name, name) == 0) {
+      return &fill_streams[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Takes in the heartbeat of a deadbanded sensor from its deadband row.
+ */
+static void add_fill_stream(const ads_row_t *row)
+{
+  fill_stream_t *s = find_fill_stream(row->name, row->id);
+
+  if (s == NULL && num_fill_streams < MAX_FILL_STREAMS) {
+    s = &fill_streams[num_fill_streams++];
+    s->name = row->name;
+    s->id = row->id;
+  }
+  if (s != NULL) {
+    s->heartbeat = row->heartbeat;
+    s->valid = 0;
+  }
+}
+
+/*
+ * Repeats the last reading of a deadbanded sensor every fill_period ms up
+ * to its next reading, unless the gap is longer than the sensor's heartbeat
+ * allows, which means readings were lost rather than dropped by the
+ * deadband.
+ */
+static void fill_to(output_t *o, const ads_row_t *row)
+{
+  fill_stream_t *s = find_fill_stream(row->name, row->id);
+  uint64_t t;
+
+  if (s == NULL) {
+    return;
+  }
+  if (s->valid && row->time > s->last.time &&
+      (s->heartbeat == 0 || row->time - s->last.time <= s->heartbeat + fill_period)) {
+    for (t = s->last.time + fill_period; t + fill_period / 2 < row->time;
+         t += fill_period) {
+      s->last.timestamp += (uint32_t) (t - s->last.time);
+      s->last.time = t;
+      emit_row(o, &s->last);
+    }
+  }
+  s->last = *row;
+  s->valid = 1;
+}
+
+/*
+ * Passes a row to the output, filling in deadbanded sensors before it and
+ * leaving it out if it is outside the time range.
+ */
+static void output_row(output_t *o, const ads_row_t *row)
+{
+  if (row->kind == ADS_ROW_DEADBAND) {
+    add_fill_stream(row);
+    return;
+  }
+  if (fill_period > 0 && row->kind == ADS_ROW_READING) {
+    fill_to(o, row);
+  }
+  emit_row(o, row);
+}
+
+/*
+ * Decodes the next record to the output.
+ *
+ * @return 0 if successful, -1 at the end of input or an undecodable record
+ */
+static int output_record(ads_decoder_t *d, output_t *o)
 {
-  char buf[100];
-  char sensor_name[100];
-  char val_buf[100];
-  uint8_t sensor_id;
-  uint32_t timestamp;
-  uint32_t timestamp_2;
+  ads_record_t rec;
+  int i;
 
-  if (fread(buf, 1, 1, input) == 0) {
+  if (ads_next_record(d, &rec) != 0) {
     return -1;
   }
+  for (i = 0; i < rec.num_rows; ++i) {
+    output_row(o, &rec.rows[i]);
+  }
+  return 0;
+}
 
-  // Unfortunately, we can't just rely on the struct definitions in BinaryDataFmt.h
-  // to unpack the binary data due to structure alignment issues, especially on
-  // 64 bit machines.
-  switch(buf[0]) {
-    case(ARDUSAT_SENSOR_TYPE_ACCELERATION):
-      get_data_struct(18, "acceleration")
-      sprintf(val_buf, "%f,%f,%f", *(float *)(buf + 6),
-              *(float *)(buf + 10), *(float *)(buf + 14));
-      break;
-    case(ARDUSAT_SENSOR_TYPE_MAGNETIC):
-      get_data_struct(18, "magnetic")
-      sprintf(val_buf, "%f,%f,%f", *(float *)(buf + 6),
-              *(float *)(buf + 10), *(float *)(buf + 14));
+/*
+ * Growable output text buffer, with formatters that are much faster than
+ * printf for the few formats the CSV output needs.
+ */
+typedef struct {
+  char *p;
+  size_t len;
+  size_t cap;
+} outbuf_t;
+
+static void out_reserve(outbuf_t *o, size_t n)
+{
+  if (o->len + n > o->cap) {
+    o->cap = o->cap * 2 > o->len + n ? o->cap * 2 : o->len + n + 4096;
+    o->p = (char *) realloc(o->p, o->cap);
+    if (o->p == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+}
+
+static void out_str(outbuf_t *o, const char *s)
+{
+  size_t n = strlen(s);
+
+  out_reserve(o, n);
+  memcpy(o->p + o->len, s, n);
+  o->len += n;
+}
+
+static void out_char(outbuf_t *o, char c)
+{
+  out_reserve(o, 1);
+  o->p[o->len++] = c;
+}
+
+static void out_uint(outbuf_t *o, uint64_t n)
+{
+  char buf[20];
+  int i = sizeof(buf);
+
+  do {
+    buf[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  out_reserve(o, sizeof(buf) - i);
+  memcpy(o->p + o->len, buf + i, sizeof(buf) - i);
+  o->len += sizeof(buf) - i;
+}
+
+/*
+ * Formats a value like printf's "%f" (6 decimals). Values too large to round
+ * in 64 bit integers, and NaN and infinity, go through snprintf.
+ */
+static void out_float(outbuf_t *o, double v)
+{
+  uint64_t n;
+  char frac[6];
+  int i;
+
+  if (!(v > -1e12 && v < 1e12)) {
+    out_reserve(o, 350);
+    o->len += snprintf(o->p + o->len, 350, "%f", v);
+    return;
+  }
+  if (signbit(v)) {
+    out_char(o, '-');
+    v = -v;
+  }
+  // values from floats scale exactly, so ties can be rounded to even like
+  // printf does
+  v *= 1e6;
+  n = (uint64_t) v;
+  if (v - n > 0.5 || (v - n == 0.5 && (n & 1))) {
+    n++;
+  }
+  out_uint(o, n / 1000000);
+  n %= 1000000;
+  for (i = 5; i >= 0; --i) {
+    frac[i] = '0' + n % 10;
+    n /= 10;
+  }
+  out_char(o, '.');
+  out_reserve(o, 6);
+  memcpy(o->p + o->len, frac, 6);
+  o->len += 6;
+}
+
+/*
+ * Writes a row as a line of CSV: timestamp, sensor name, id and values.
+ */
+void emit_csv(void *sink, const ads_row_t *row)
+{
+  outbuf_t *o = (outbuf_t *) sink;
+  int i;
+
+  switch (row->kind) {
+    case ADS_ROW_TIMESTAMP:
+      out_str(o, "timestamp: ");
+      out_uint(o, row->timestamp);
+      out_str(o, " at millis ");
+      out_uint(o, row->time);
       break;
-    case(ARDUSAT_SENSOR_TYPE_GYRO):
-      get_data_struct(18, "gyro")
-      sprintf(val_buf, "%f,%f,%f", *(float *)(buf + 6),
-              *(float *)(buf + 10), *(float *)(buf + 14));
+    case ADS_ROW_SENSOR_NAME:
+      out_str(o, "sensor: ");
+      out_str(o, row->name);
+      out_char(o, ',');
+      out_uint(o, row->id);
+      out_char(o, ',');
+      out_str(o, row->text);
       break;
-    case(ARDUSAT_SENSOR_TYPE_TEMPERATURE):
-      get_data_struct(10, "temperature")
-      sprintf(val_buf, "%f", *(float *)(buf + 6));
+    default:
+      out_uint(o, row->time);
+      out_char(o, ',');
+      out_str(o, row->name);
+      out_char(o, ',');
+      out_uint(o, row->id);
+      for (i = 0; i < row->count; ++i) {
+        out_char(o, ',');
+        if (row->integer) {
+          if (row->values[i] < 0) {
+            out_char(o, '-');
+          }
+          out_uint(o, (uint64_t) (row->values[i] < 0 ? -row->values[i] : row->values[i]));
+        } else {
+          out_float(o, row->values[i]);
+        }
+      }
       break;
-    case(ARDUSAT_SENSOR_TYPE_LUMINOSITY):
-      get_data_struct(10, "luminosity")
-      sprintf(val_buf, "%f", *(float *)(buf + 6));
+  }
+  out_char(o, '\n');
+}
+
+/*
+ * Columnar output collects the columns of every record name in an
+ * ads_tables_t: the timestamp, sensor id and each value, or the RTC time and
+ * millis of timestamp markers. Values are written as float32. Sensor name
+ * rows go to a small CSV file instead.
+ */
+void emit_columns(void *sink, const ads_row_t *row)
+{
+  ads_tables_add((ads_tables_t *) sink, row);
+}
+
+static void out_le(outbuf_t *o, uint64_t n, int size)
+{
+  int i;
+
+  out_reserve(o, size);
+  for (i = 0; i < size; ++i) {
+    o->p[o->len++] = n >> (8 * i);
+  }
+}
+
+/*
+ * Files of the columnar output, opened as columns first show up.
+ */
+typedef struct {
+  char *path;
+  FILE *file;
+} column_file_t;
+
+static column_file_t *column_files = NULL;
+static int num_column_files = 0;
+
+static FILE *column_file(const char *dir, const char *table, const char *column,
+                         const char *dtype)
+{
+  char path[1024];
+  int i;
+
+  snprintf(path, sizeof(path), "%s/%s.%s.%s", dir, table, column, dtype);
+  for (i = 0; i < num_column_files; ++i) {
+    if (strcmp(column_files[i].path, path) == 0) {
+      return column_files[i].file;
+    }
+  }
+  column_files = (column_file_t *) realloc(column_files,
+      (num_column_files + 1) * sizeof(column_file_t));
+  column_files[num_column_files].path = strdup(path);
+  column_files[num_column_files].file = fopen(path, "wb");
+  if (column_files[num_column_files].file == NULL) {
+    printf("Could not open file %s for writing.\n", path);
+  }
+  return column_files[num_column_files++].file;
+}
+
+static int write_column(FILE *file, outbuf_t *o)
+{
+  int ret = file != NULL && fwrite(o->p, 1, o->len, file) == o->len;
+
+  o->len = 0;
+  return ret ? 0 : -1;
+}
+
+/*
+ * Appends the columns decoded from a chunk to their files in dir, and frees
+ * them.
+ *
+ * @return 0 if successful, -1 on a write error
+ */
+int write_columns(ads_tables_t *c, const char *dir)
+{
+  ads_table_t *t;
+  outbuf_t o;
+  float value;
+  uint32_t bits;
+  size_t r;
+  int ret = 0;
+  int i, j;
+
+  memset(&o, 0, sizeof(o));
+  for (i = 0; i < c->num_tables; ++i) {
+    t = &c->tables[i];
+    if (t->kind == ADS_ROW_TIMESTAMP) {
+      for (r = 0; r < t->rows; ++r) {
+        out_le(&o, t->unixtime[r], 4);
+      }
+      ret |= write_column(column_file(dir, t->name, "unixtime", "uint32"), &o);
+      for (r = 0; r < t->rows; ++r) {
+        out_le(&o, t->time[r], 8);
+      }
+      ret |= write_column(column_file(dir, t->name, "millis", "uint64"), &o);
+      continue;
+    }
+    for (r = 0; r < t->rows; ++r) {
+      out_le(&o, t->time[r], 8);
+    }
+    ret |= write_column(column_file(dir, t->name, "timestamp", "uint64"), &o);
+    for (r = 0; r < t->rows; ++r) {
+      out_le(&o, t->id[r], 1);
+    }
+    ret |= write_column(column_file(dir, t->name, "id", "uint8"), &o);
+    for (j = 0; j < t->count; ++j) {
+      for (r = 0; r < t->rows; ++r) {
+        value = t->values[j][r];
+        memcpy(&bits, &value, 4);
+        out_le(&o, bits, 4);
+      }
+      ret |= write_column(column_file(dir, t->name, t->fields[j], "float32"), &o);
+    }
+  }
+  if (c->names_len > 0) {
+    out_reserve(&o, c->names_len);
+    memcpy(o.p, c->names, c->names_len);
+    o.len = c->names_len;
+    ret |= write_column(column_file(dir, "sensors", "names", "csv"), &o);
+  }
+  free(o.p);
+  ads_tables_clear(c);
+  return ret;
+}
+
+void close_column_files()
+{
+  int i;
+
+  for (i = 0; i < num_column_files; ++i) {
+    if (column_files[i].file != NULL) {
+      fclose(column_files[i].file);
+    }
+    free(column_files[i].path);
+  }
+  free(column_files);
+}
+
+/*
+ * Chunks of the input are decoded in parallel. Each starts at a record
+ * boundary, with a copy of the compact stream state at that point, and ends
+ * where the next chunk starts.
+ */
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE (1 << 20)
+#endif
+
+typedef struct {
+  ads_reader_t start;
+  size_t stop;
+  ads_compact_stream_t (*streams)[256];
+  ads_timeline_t timeline;
+  outbuf_t out;
+  ads_tables_t columns;
+  int lines;
+  int done;
+} chunk_t;
+
+typedef struct {
+  chunk_t *chunks;
+  size_t num_chunks;
+  size_t cap;
+  size_t error_pos;
+  int error;
+  int damaged;
+  size_t bad_records;
+} plan_t;
+
+static void add_chunk(plan_t *plan, const ads_decoder_t *d)
+{
+  chunk_t *chunk;
+
+  if (plan->num_chunks > 0 && plan->chunks[plan->num_chunks - 1].stop == (size_t) -1) {
+    plan->chunks[plan->num_chunks - 1].stop = d->r.pos;
+  }
+  if (plan->num_chunks == plan->cap) {
+    plan->cap = plan->cap ? plan->cap * 2 : 64;
+    plan->chunks = (chunk_t *) realloc(plan->chunks, plan->cap * sizeof(chunk_t));
+  }
+  chunk = &plan->chunks[plan->num_chunks++];
+  memset(chunk, 0, sizeof(*chunk));
+  chunk->start = d->r;
+  chunk->timeline = d->timeline;
+  chunk->stop = (size_t) -1;
+  chunk->streams = (ads_compact_stream_t (*)[256]) malloc(sizeof(ads_compact_streams_t));
+  memcpy(chunk->streams, d->streams, sizeof(ads_compact_streams_t));
+}
+
+/*
+ * Finds the first index record (see BinaryDataFmt.h) starting in
+ * [pos, limit), checked by its offset and CRC. In framed logs it must also
+ * lie within the used part of a good block.
+ *
+ * @return 1 if one was found, with its position and time, 0 otherwise
+ */
+int find_index(const ads_input_t *in, size_t pos, size_t limit, size_t *at,
+               uint64_t *time)
+{
+  const uint8_t *p;
+  uint32_t offset, millis;
+  size_t block;
+
+  if (limit > in->size) {
+    limit = in->size;
+  }
+  while (pos + ARDUSAT_INDEX_SIZE <= in->size && pos < limit) {
+    p = (const uint8_t *) memchr(in->data + pos, 0xFF, limit - pos);
+    if (p == NULL || (size_t) (p - in->data) + ARDUSAT_INDEX_SIZE > in->size) {
+      return 0;
+    }
+    pos = p - in->data + 1;
+    offset = p[9] | (p[10] << 8) | (p[11] << 16) | ((uint32_t) p[12] << 24);
+    if (p[1] != ARDUSAT_CONTROL_INDEX || p[2] != ARDUSAT_INDEX_SIZE - 3 ||
+        offset != pos - 1 ||
+        ads_crc_ccitt(0, p, ARDUSAT_INDEX_SIZE - 2) != (p[13] | (p[14] << 8))) {
+      continue;
+    }
+    block = offset / 512;
+    if (in->framed && (block >= in->num_blocks ||
+                       offset % 512 + ARDUSAT_INDEX_SIZE > in->block_used[block])) {
+      continue;
+    }
+    millis = p[5] | (p[6] << 8) | (p[7] << 16) | ((uint32_t) p[8] << 24);
+    *at = offset;
+    *time = ((uint64_t) (p[3] | (p[4] << 8)) << 32) | millis;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Binary searches the index records for where to decode --from and --to:
+ * from the last index before range_from, up to the index record after the
+ * first one past range_to, which all readings up to range_to come before.
+ * header_end is the first index record, up to which the file header is
+ * decoded as well. Without index records the whole input is decoded.
+ */
+void find_range(const ads_input_t *in, size_t *header_end, size_t *start,
+                size_t *stop)
+{
+  size_t lo, hi, mid, at;
+  uint64_t time;
+
+  *header_end = *start = 0;
+  *stop = (size_t) -1;
+  if (!find_index(in, 0, in->size, header_end, &time)) {
+    return;
+  }
+  for (lo = 0, hi = in->size; lo < hi;) {
+    mid = lo + (hi - lo) / 2;
+    if (!find_index(in, mid, hi, &at, &time)) {
+      hi = mid;
+    } else if (time < range_from) {
+      *start = at;
+      lo = at + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (range_to == UINT64_MAX) {
+    return;
+  }
+  for (lo = 0, hi = in->size; lo < hi;) {
+    mid = lo + (hi - lo) / 2;
+    if (!find_index(in, mid, hi, &at, &time)) {
+      hi = mid;
+    } else if (time > range_to) {
+      *stop = at;
+      hi = mid;
+    } else {
+      lo = at + 1;
+    }
+  }
+  if (*stop != (size_t) -1 && !find_index(in, *stop + 1, in->size, stop, &time)) {
+    *stop = (size_t) -1;
+  }
+}
+
+/*
+ * Moves a decoder on to pos, a record start such as an index record,
+ * dropping the compact stream state of the records skipped.
+ */
+static void skip_to(ads_decoder_t *d, size_t pos)
+{
+  const ads_input_t *in = d->r.in;
+
+  d->r.pos = pos;
+  d->r.end = in->framed ? pos / 512 * 512 + in->block_used[pos / 512] : in->size;
+  memset(d->streams, 0, sizeof(d->streams));
+}
+
+/*
+ * Walks the records of the whole input without formatting them, to read the
+ * file header and find where to split it into chunks. For framed logs this
+ * also skips damaged blocks, resuming at the next good record start. With
+ * --from or --to, only the file header and the range found by find_range
+ * are walked.
+ */
+void plan_chunks(const ads_input_t *in, plan_t *plan)
+{
+  ads_decoder_t d;
+  ads_record_t rec;
+  size_t chunk_pos, header_end, start, stop, limit;
+  int running;
+
+  memset(plan, 0, sizeof(*plan));
+  ads_format_init(&format);
+  running = ads_decoder_init(&d, in, &format) || !in->framed;
+  header_end = start = 0;
+  stop = (size_t) -1;
+  if (range_from > 0 || range_to < UINT64_MAX) {
+    find_range(in, &header_end, &start, &stop);
+  }
+  limit = start > header_end ? header_end : stop;
+
+  while (running) {
+    add_chunk(plan, &d);
+    chunk_pos = d.r.pos;
+    // decode until the end of the input or run, or until the chunk is big
+    while (ads_reader_ready(&d.r) && d.r.pos - chunk_pos < CHUNK_SIZE &&
+           d.r.pos < limit) {
+      if (ads_next_record(&d, &rec) != 0) {
+        if (d.error != NULL) {
+          printf("%s\n", d.error);
+        }
+        break;
+      }
+    }
+    if (d.r.pos >= limit) {
+      plan->chunks[plan->num_chunks - 1].stop = d.r.pos;
+      if (limit == stop) {
+        break;
+      }
+      // past the file header, skip ahead to the index record before the range
+      limit = stop;
+      if (d.r.pos < start) {
+        skip_to(&d, start);
+      }
+      continue;
+    }
+    if (ads_reader_ready(&d.r) && d.r.pos - chunk_pos >= CHUNK_SIZE) {
+      continue;
+    }
+    if (!in->framed) {
+      if (ads_reader_ready(&d.r)) {
+        plan->error = 1;
+        plan->error_pos = d.r.pos;
+      }
       break;
-    case(ARDUSAT_SENSOR_TYPE_UV):
-      get_data_struct(10, "uv")
-      sprintf(val_buf, "%f", *(float *)(buf + 6));
+    }
+    // end of a run of good blocks, or an undecodable record in it
+    plan->chunks[plan->num_chunks - 1].stop = d.r.pos;
+    memset(d.streams, 0, sizeof(d.streams));
+    running = ads_seek_block_record(&d.r, (d.r.pos - 1) / 512 + 1);
+    if (running) {
+      // don't let the previous chunk run on into the new start
+      plan->chunks[plan->num_chunks - 1].stop = d.r.pos;
+    }
+  }
+  plan->bad_records = d.bad_records;
+  if (format.version > ARDUSAT_FILE_VERSION) {
+    printf("File format version %d is newer than this decoder, "
+           "unknown records will be skipped\n", format.version);
+  }
+}
+
+/*
+ * Decodes one chunk into its CSV output buffer, or column buffers if
+ * columnar.
+ */
+void decode_chunk(chunk_t *chunk, int columnar)
+{
+  ads_decoder_t d;
+  output_t o;
+
+  memset(&d, 0, sizeof(d));
+  d.r = chunk->start;
+  d.format = &format;
+  d.timeline = chunk->timeline;
+  memcpy(d.streams, chunk->streams, sizeof(d.streams));
+  o.emit = columnar ? emit_columns : emit_csv;
+  o.sink = columnar ? (void *) &chunk->columns : (void *) &chunk->out;
+  o.lines = 0;
+  while (ads_reader_ready(&d.r) && d.r.pos != chunk->stop) {
+    if (output_record(&d, &o) != 0) {
       break;
-    case (ARDUSAT_SENSOR_TYPE_ORIENTATION):
-      get_data_struct(18, "orientation")
-      sprintf(val_buf, "%f,%f,%f", *(float *)(buf + 6),
-              *(float *)(buf + 10), *(float *)(buf + 14));
+    }
+  }
+  chunk->lines = o.lines;
+  free(chunk->streams);
+  chunk->streams = NULL;
+}
+
+/*
+ * Worker threads take chunks in order, staying at most a window of chunks
+ * ahead of the writer so that the decoded output in memory stays bounded.
+ */
+typedef struct {
+  plan_t *plan;
+  size_t next;
+  size_t written;
+  size_t window;
+  int columnar;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} workers_t;
+
+void *decode_worker(void *arg)
+{
+  workers_t *w = (workers_t *) arg;
+  size_t i;
+
+  while (1) {
+    pthread_mutex_lock(&w->lock);
+    while (w->next < w->plan->num_chunks && w->next >= w->written + w->window) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (w->next >= w->plan->num_chunks) {
+      pthread_mutex_unlock(&w->lock);
+      return NULL;
+    }
+    i = w->next++;
+    pthread_mutex_unlock(&w->lock);
+
+    decode_chunk(&w->plan->chunks[i], w->columnar);
+
+    pthread_mutex_lock(&w->lock);
+    w->plan->chunks[i].done = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+/*
+ * Decodes all chunks on num_threads threads, writing their output in order,
+ * to output as CSV or, if columns_dir is set, as columns in that directory.
+ *
+ * @return number of readings output, -1 on a write error
+ */
+int decode_chunks(plan_t *plan, int num_threads, FILE *output,
+                  const char *columns_dir)
+{
+  workers_t w;
+  pthread_t *threads;
+  chunk_t *chunk;
+  int lines = 0, ret = 0;
+  int i;
+
+  memset(&w, 0, sizeof(w));
+  w.plan = plan;
+  w.window = 4 * num_threads;
+  w.columnar = columns_dir != NULL;
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+  for (i = 0; i < num_threads; ++i) {
+    pthread_create(&threads[i], NULL, decode_worker, &w);
+  }
+
+  for (w.written = 0; w.written < plan->num_chunks; ) {
+    chunk = &plan->chunks[w.written];
+    pthread_mutex_lock(&w.lock);
+    while (!chunk->done) {
+      pthread_cond_wait(&w.cond, &w.lock);
+    }
+    pthread_mutex_unlock(&w.lock);
+
+    if (columns_dir != NULL) {
+      ret |= write_columns(&chunk->columns, columns_dir);
+    } else if (fwrite(chunk->out.p, 1, chunk->out.len, output) != chunk->out.len) {
+      ret = -1;
+    }
+    lines += chunk->lines;
+    free(chunk->out.p);
+
+    pthread_mutex_lock(&w.lock);
+    w.written++;
+    pthread_cond_broadcast(&w.cond);
+    pthread_mutex_unlock(&w.lock);
+  }
+
+  for (i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&w.lock);
+  pthread_cond_destroy(&w.cond);
+  return ret == 0 ? lines : -1;
+}
+
+/*
+ * Maps the input file into memory and, for framed logs, checks its blocks.
+ *
+ * @return 0 if successful, -1 if the file can't be read
+ */
+int open_input(const char *path, ads_input_t *in)
+{
+  const uint8_t *data = NULL;
+  struct stat st;
+  size_t size;
+  int fd;
+
+  memset(in, 0, sizeof(*in));
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+    return -1;
+  }
+  size = st.st_size;
+  if (size > 0) {
+    data = (const uint8_t *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    madvise((void *) data, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return ads_input_init(in, data, size);
+}
+
+void close_input(ads_input_t *in)
+{
+  if (in->size > 0) {
+    munmap((void *) in->data, in->size);
+  }
+  ads_input_free(in);
+}
+
+/*
+ * Several inputs, such as a rotated run of PREFIXn.BIN files, are merged
+ * into one output in time order. Each input is decoded one record at a time
+ * and a binary heap of the inputs, keyed on the time of their next row,
+ * picks the row to output next, so memory stays constant per input however
+ * long the logs are. Rows are keyed on the 64 bit epoch timeline, which
+ * carries on from file to file within a run. With --rtc, an input's keys
+ * are moved onto wall clock time by its first RTC timestamp marker instead,
+ * for logs recorded across a reboot or on different boards, whose millis()
+ * don't line up. Rows of one input stay in file order either way.
+ */
+#ifndef MERGE_FLUSH_ROWS
+#define MERGE_FLUSH_ROWS (1 << 16)
+#endif
+
+typedef struct {
+  const char *path;
+  ads_log_t log;
+  ads_format_t format;
+  ads_record_t rec;
+  int row;
+  int64_t offset;
+  uint64_t key;
+  size_t error_pos;
+  int error;
+  size_t bad_records;
+} source_t;
+
+/*
+ * Finds the offset from an input's millis to wall clock time in ms, from
+ * the first RTC timestamp marker in it.
+ *
+ * @return 1 if successful, 0 if it has no marker
+ */
+static int find_rtc_offset(source_t *s)
+{
+  ads_record_t rec;
+  int i;
+
+  ads_log_begin(&s->log, &s->format);
+  while (ads_log_next(&s->log, &rec) == 0) {
+    for (i = 0; i < rec.num_rows; ++i) {
+      if (rec.rows[i].kind == ADS_ROW_TIMESTAMP) {
+        s->offset = (int64_t) rec.rows[i].timestamp * 1000 - (int64_t) rec.rows[i].time;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Gets an input ready to decode from the start, or with --from or --to from
+ * the range found by find_range after its file header.
+ */
+static void start_source(source_t *s)
+{
+  size_t header_end, start, stop;
+
+  ads_log_begin(&s->log, &s->format);
+  if (range_from > 0 || range_to < UINT64_MAX) {
+    find_range(&s->log.in, &header_end, &start, &stop);
+    ads_log_range(&s->log, header_end, start, stop);
+  }
+  s->rec.num_rows = 0;
+  s->row = 0;
+}
+
+/*
+ * Moves an input on to its next row, decoding records until one has rows.
+ * Like plan_chunks, it resumes at the next good record start after damaged
+ * blocks of a framed log.
+ *
+ * @return 1 if there is a next row, 0 at the end of the input
+ */
+static int source_next(source_t *s)
+{
+  if (++s->row < s->rec.num_rows) {
+    return 1;
+  }
+  s->row = 0;
+  while (ads_log_next(&s->log, &s->rec) == 0) {
+    if (s->rec.num_rows > 0) {
+      return 1;
+    }
+  }
+  if (s->log.error != NULL) {
+    printf("%s: %s\n", s->path, s->log.error);
+    s->error = 1;
+    s->error_pos = s->log.error_pos;
+  }
+  s->rec.num_rows = 0;
+  return 0;
+}
+
+/*
+ * Keys an input on the time of its next row. Sensor name and deadband rows
+ * have no time and keep the key of the row before them, so they go out
+ * straight away.
+ */
+static void source_key(source_t *s)
+{
+  const ads_row_t *row = &s->rec.rows[s->row];
+
+  if (row->kind == ADS_ROW_READING || row->kind == ADS_ROW_TIMESTAMP) {
+    s->key = row->time + s->offset;
+  }
+}
+
+static int source_before(const source_t *a, const source_t *b)
+{
+  return a->key < b->key || (a->key == b->key && a < b);
+}
+
+static void sift_down(source_t **heap, int n, int i)
+{
+  source_t *s = heap[i];
+  int child;
+
+  while ((child = 2 * i + 1) < n) {
+    if (child + 1 < n && source_before(heap[child + 1], heap[child])) {
+      child++;
+    }
+    if (!source_before(heap[child], s)) {
       break;
-    case (ARDUSAT_SENSOR_TYPE_PRESSURE):
-      get_data_struct(10, "pressure")
-      sprintf(val_buf, "%f", *(float *)(buf + 6));
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = s;
+}
+
+/*
+ * Decodes the inputs merged in time order, writing output every
+ * MERGE_FLUSH_ROWS rows to output as CSV or, if columns_dir is set, as
+ * columns in that directory. With align_rtc, inputs are aligned on their
+ * RTC timestamp markers, unless one of them has none.
+ *
+ * @return number of readings output, -1 on a write error
+ */
+int merge_sources(source_t *sources, int num_sources, int align_rtc,
+                  FILE *output, const char *columns_dir)
+{
+  source_t **heap;
+  source_t *s;
+  outbuf_t out;
+  ads_tables_t columns;
+  output_t o;
+  int n = 0, pending = 0, ret = 0;
+  int i;
+
+  for (i = 0; i < num_sources && align_rtc; ++i) {
+    if (!find_rtc_offset(&sources[i])) {
+      printf("No RTC timestamp in %s, merging on millis instead\n", sources[i].path);
+      for (i = 0; i < num_sources; ++i) {
+        sources[i].offset = 0;
+      }
       break;
-    case ((char) 0xFF):
-      // check if timestamp header
-      if (fread(buf + 1, 1, 1, input) == 0 || buf[1] != (char) 0xFF ||
-          fread(buf + 2, 1, 8, input) == 0 ) {
-        return -1;
+    }
+  }
+
+  memset(&out, 0, sizeof(out));
+  memset(&columns, 0, sizeof(columns));
+  o.emit = columns_dir != NULL ? emit_columns : emit_csv;
+  o.sink = columns_dir != NULL ? (void *) &columns : (void *) &out;
+  o.lines = 0;
+  heap = (source_t **) malloc(num_sources * sizeof(source_t *));
+  for (i = 0; i < num_sources; ++i) {
+    start_source(&sources[i]);
+    if (source_next(&sources[i])) {
+      source_key(&sources[i]);
+      heap[n++] = &sources[i];
+    }
+  }
+  for (i = n / 2 - 1; i >= 0; --i) {
+    sift_down(heap, n, i);
+  }
+
+  while (n > 0) {
+    s = heap[0];
+    output_row(&o, &s->rec.rows[s->row]);
+    if (source_next(s)) {
+      source_key(s);
+    } else {
+      heap[0] = heap[--n];
+    }
+    sift_down(heap, n, 0);
+
+    if (++pending == MERGE_FLUSH_ROWS || n == 0) {
+      if (columns_dir != NULL) {
+        ret |= write_columns(&columns, columns_dir);
+      } else if (fwrite(out.p, 1, out.len, output) != out.len) {
+        ret = -1;
       }
-      timestamp = *((uint32_t *)(buf + 2));
-      timestamp_2 = *((uint32_t *)(buf + 6));
-      return fprintf(output, "timestamp: %u at millis %u\n", timestamp, timestamp_2) <= 0;
-    default:
-      printf("Unknown sensor type %d found!\n", buf[0]);
-      return -1;
+      out.len = 0;
+      pending = 0;
+    }
   }
 
-  return fprintf(output, "%d,%s,%d,%s\n", timestamp, sensor_name, sensor_id, val_buf) <= 0;
+  for (i = 0; i < num_sources; ++i) {
+    sources[i].bad_records = sources[i].log.bad_records;
+    if (sources[i].format.version > ARDUSAT_FILE_VERSION) {
+      printf("File format version %d of %s is newer than this decoder, "
+             "unknown records were skipped\n", sources[i].format.version,
+             sources[i].path);
+    }
+  }
+  free(heap);
+  free(out.p);
+  return ret == 0 ? o.lines : -1;
+}
+
+/*
+ * Follows a live stream of records sent with setLogSerialTee, decoding each
+ * frame (see BinaryDataFmt.h) as soon as it is complete and writing it to
+ * output. Bytes that don't start a frame with a good CRC are skipped, so
+ * decoding picks up again at the next frame after noise or lost bytes. Only
+ * one frame is held in memory. Regular files are polled for new data like
+ * tail -f; other inputs are read until they end.
+ *
+ * @return number of readings output, -1 on a read or write error
+ */
+int follow_stream(int fd, FILE *output, unsigned long *skipped)
+{
+  uint8_t buf[2 * (UINT8_MAX + ARDUSAT_STREAM_OVERHEAD)];
+  size_t len = 0, frame, drop;
+  ads_input_t in;
+  ads_decoder_t d;
+  outbuf_t out;
+  output_t o;
+  struct stat st;
+  struct timespec poll = { 0, 100000000 };
+  ssize_t n;
+  int regular, ret = 0;
+
+  memset(&out, 0, sizeof(out));
+  memset(&in, 0, sizeof(in));
+  ads_format_init(&format);
+  ads_decoder_init(&d, &in, &format);
+  o.emit = emit_csv;
+  o.sink = &out;
+  o.lines = 0;
+  regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  *skipped = 0;
+
+  while (1) {
+    n = read(fd, buf + len, sizeof(buf) - len);
+    if (n < 0) {
+      ret = -1;
+      break;
+    }
+    if (n == 0) {
+      if (!regular) {
+        break;
+      }
+      nanosleep(&poll, NULL);
+      continue;
+    }
+    len += n;
+
+    while (len >= 3) {
+      frame = buf[2] + ARDUSAT_STREAM_OVERHEAD;
+      drop = 1;
+      if (buf[0] == ARDUSAT_STREAM_SYNC0 && buf[1] == ARDUSAT_STREAM_SYNC1) {
+        if (len < frame) {
+          break;
+        }
+        if (ads_crc_ccitt(0, buf + 2, frame - 4) ==
+            (buf[frame - 2] | (buf[frame - 1] << 8))) {
+          in.data = buf + 3;
+          in.size = buf[2];
+          d.r.in = &in;
+          d.r.pos = 0;
+          d.r.end = in.size;
+          output_record(&d, &o);
+          drop = frame;
+        }
+      }
+      if (drop == 1) {
+        ++*skipped;
+      }
+      len -= drop;
+      memmove(buf, buf + drop, len);
+    }
+
+    if (out.len > 0) {
+      if (fwrite(out.p, 1, out.len, output) != out.len || fflush(output) != 0) {
+        ret = -1;
+        break;
+      }
+      out.len = 0;
+    }
+  }
+  free(out.p);
+  return ret == 0 ? o.lines : -1;
 }
 
 int main(int argc, char *argv[])
@@ -174,16 +1236,26 @@ int main(int argc, char *argv[])
   int option_idx;
   char *output_file_path = NULL;
   char *input_file_path = NULL;
-  FILE *input_file;
-  FILE *output_file;
+  char *columns_dir = NULL;
+  FILE *output_file = NULL;
+  source_t *sources;
+  plan_t plan;
+  size_t i;
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_inputs;
   int lines = 0;
+  int damaged = 0;
+  size_t bad_records = 0;
+  int follow = 0;
+  int align_rtc = 0;
+  unsigned long skipped;
   int ret;
 
   if (argc < 2) {
     err_print_usage(printf("You need to provide a binary data file to decode!!!\n"));
   }
 
-  while ((c = getopt_long(argc, argv, "ho:", cli_options, &option_idx)) != -1) {
+  while ((c = getopt_long(argc, argv, "ho:t:c:fF:b:e:r", cli_options, &option_idx)) != -1) {
     switch(c) {
       case 'h':
         print_usage(argv);
@@ -191,54 +1263,147 @@ int main(int argc, char *argv[])
       case 'o':
         output_file_path = optarg;
         break;
+      case 'c':
+        columns_dir = optarg;
+        break;
+      case 'f':
+        follow = 1;
+        break;
+      case 'F':
+        if (atoi(optarg) < 1) {
+          err_print_usage(printf("Invalid fill period given.\n"));
+        }
+        fill_period = atoi(optarg);
+        break;
+      case 'b':
+        range_from = strtoull(optarg, NULL, 10);
+        break;
+      case 'e':
+        range_to = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        align_rtc = 1;
+        break;
+      case 't':
+        num_threads = atoi(optarg);
+        if (num_threads < 1) {
+          err_print_usage(printf("Invalid number of threads given.\n"));
+        }
+        break;
     }
   }
+  if (num_threads < 1 || fill_period > 0) {
+    num_threads = 1;
+  }
 
   if (optind == argc) {
     err_print_usage(printf("You need to provide a binary data file to decode!!!\n"));
   }
 
-  input_file_path = argv[optind++];
+  input_file_path = argv[optind];
+  num_inputs = argc - optind;
 
-  if (check_input_file_path(input_file_path) != 0) {
-    err_print_usage(printf("Invalid input file path given.\n"));
+  if (follow) {
+    if (num_inputs > 1) {
+      err_print_usage(printf("Only one stream can be followed.\n"));
+    }
+    output_file = stdout;
+    if (output_file_path != NULL && !(output_file = fopen(output_file_path, "w"))) {
+      err_print_usage(printf("Could not open file %s for writing.\n", output_file_path));
+    }
+    c = strcmp(input_file_path, "-") == 0 ? 0 : open(input_file_path, O_RDONLY);
+    if (c < 0) {
+      err_print_usage(printf("Error opening input file %s\n", input_file_path));
+    }
+    lines = follow_stream(c, output_file, &skipped);
+    fprintf(stderr, "Decoded %d data observations from %s, skipped %lu bytes\n",
+            lines, input_file_path, skipped);
+    if (output_file != stdout) {
+      fclose(output_file);
+    }
+    return lines >= 0 ? 0 : -1;
   }
 
-  if (output_file_path == NULL)
-    output_file_path = make_output_csv_path_from_input(input_file_path);
+  for (c = 0; c < num_inputs; ++c) {
+    if (check_input_file_path(argv[optind + c]) != 0) {
+      err_print_usage(printf("Invalid input file path given.\n"));
+    }
+  }
 
-  printf("Decoding file %s and saving data to %s...\n", input_file_path, output_file_path);
+  if (columns_dir != NULL)
+    output_file_path = columns_dir;
+  else if (output_file_path == NULL)
+    output_file_path = make_output_csv_path_from_input(input_file_path);
 
-  input_file = fopen(input_file_path, "rb");
-  if (!input_file) {
-    err_print_usage(printf("Error opening input file %s\n", input_file_path));
+  if (num_inputs > 1) {
+    printf("Merging %d files and saving data to %s...\n", num_inputs, output_file_path);
+  } else {
+    printf("Decoding file %s and saving data to %s...\n", input_file_path, output_file_path);
   }
 
-  output_file = fopen(output_file_path, "w");
-  if (!output_file) {
-    err_print_usage(printf("Could not open file %s for writing.\n", output_file_path));
+  sources = (source_t *) calloc(num_inputs, sizeof(source_t));
+  for (c = 0; c < num_inputs; ++c) {
+    sources[c].path = argv[optind + c];
+    if (open_input(sources[c].path, &sources[c].log.in) != 0) {
+      err_print_usage(printf("Error opening input file %s\n", sources[c].path));
+    }
   }
 
-  while (!feof(input_file)) {
-    if (process_next_row(input_file, output_file) != 0) {
-      break;
+  if (columns_dir != NULL) {
+    mkdir(columns_dir, 0777);
+  } else {
+    output_file = fopen(output_file_path, "w");
+    if (!output_file) {
+      err_print_usage(printf("Could not open file %s for writing.\n", output_file_path));
     }
-    lines++;
   }
 
+  if (num_inputs > 1) {
+    lines = merge_sources(sources, num_inputs, align_rtc, output_file, columns_dir);
+  } else {
+    plan_chunks(&sources[0].log.in, &plan);
+    lines = decode_chunks(&plan, num_threads, output_file, columns_dir);
+    sources[0].error = plan.error;
+    sources[0].error_pos = plan.error_pos;
+    sources[0].bad_records = plan.bad_records;
+    free(plan.chunks);
+  }
 
-  if (feof(input_file)) {
+  ret = lines >= 0 ? 0 : -1;
+  for (c = 0; c < num_inputs; ++c) {
+    for (i = 0; i < sources[c].log.in.num_blocks; ++i) {
+      damaged += sources[c].log.in.block_used[i] == 0;
+    }
+    bad_records += sources[c].bad_records;
+    if (sources[c].error) {
+      printf("Uh oh, something went wrong reading %s at %lu\n", sources[c].path,
+             (unsigned long) sources[c].error_pos);
+      ret = -1;
+    }
+    close_input(&sources[c].log.in);
+  }
+  free(sources);
+  if (damaged) {
+    printf("Skipped %d damaged blocks\n", damaged);
+  }
+  if (bad_records) {
+    printf("Skipped %lu records with bad CRCs\n", (unsigned long) bad_records);
+  }
+
+  if (ret == 0 && num_inputs > 1) {
+    printf("Finished merging %d files. Saved %d data observations to %s.\n",
+           num_inputs, lines, output_file_path);
+  } else if (ret == 0) {
     printf("Finished decoding %s. Saved %d data observations to %s.\n",
            input_file_path, lines, output_file_path);
-    ret = 0;
-  } else {
-    long pos = ftell(input_file);
-    printf("Uh oh, something went wrong reading %s at %ld\n", input_file_path, pos);
-    ret = -1;
+  } else if (lines < 0) {
+    printf("Uh oh, something went wrong writing %s\n", output_file_path);
   }
 
-  fclose(input_file);
-  fclose(output_file);
+  if (output_file != NULL) {
+    fclose(output_file);
+  }
+  close_column_files();
 
   return ret;
 }
@@ -1,8 +1,30 @@
 import argparse
+import array
+import io
 import os
 import sys
 import re
+import stat
 import struct
+import time
+
+try:
+    import ardusat_decode
+except ImportError:
+    ardusat_decode = None
+
+
+def _crc8_table():
+    """
+    :return: the CRC-8 (x^8 + x^2 + x + 1) of every byte value
+    """
+    table = bytearray(256)
+    for i in range(256):
+        crc = i
+        for bit in range(8):
+            crc = ((crc << 1) ^ 0x07 if crc & 0x80 else crc << 1) & 0xFF
+        table[i] = crc
+    return table
 
 class ArdusatBinaryData(object):
     ARDUSAT_SENSOR_TYPE_ACCELERATION = b'\x00'
@@ -13,6 +35,7 @@ class ArdusatBinaryData(object):
     ARDUSAT_SENSOR_TYPE_LUMINOSITY = b'\x05'
     ARDUSAT_SENSOR_TYPE_UV = b'\x06'
     ARDUSAT_SENSOR_TYPE_PRESSURE = b'\x07'
+    ARDUSAT_SENSOR_TYPE_FRAME = b'\x08'
 
     STRUCTURE_SIZE = { ARDUSAT_SENSOR_TYPE_ACCELERATION: (18, "<BIfff"),
                        ARDUSAT_SENSOR_TYPE_MAGNETIC: (18, "<BIfff"),
@@ -24,7 +47,7 @@ class ArdusatBinaryData(object):
                        ARDUSAT_SENSOR_TYPE_PRESSURE: (10, "<BIf"),
     }
 
-    SENSOR_NAME = { ARDUSAT_SENSOR_TYPE_ACCELERATION: "accelerometer",
+    SENSOR_NAME = { ARDUSAT_SENSOR_TYPE_ACCELERATION: "acceleration",
                     ARDUSAT_SENSOR_TYPE_MAGNETIC: "magnetic",
                     ARDUSAT_SENSOR_TYPE_GYRO: "gyro",
                     ARDUSAT_SENSOR_TYPE_TEMPERATURE: "temperature",
@@ -34,10 +57,329 @@ class ArdusatBinaryData(object):
                     ARDUSAT_SENSOR_TYPE_PRESSURE: "pressure",
     }
 
-    def __init__(self, input_file, halt_on_error=False):
+    # Compact records, see utility/BinaryDataFmt.h
+    RECORD_TYPE_MASK = 0x1F
+    RECORD_ENCODING_MASK = 0xE0
+    RECORD_COMPACT_DELTA = 0x40
+    RECORD_COMPACT_KEY = 0x60
+    RECORD_INT16 = 0x20
+    CONTROL_TIMESTAMP = b'\xFF'
+    CONTROL_INT16_SCALES = b'\xFE'
+    CONTROL_FILE_HEADER = b'\xFD'
+    CONTROL_RECORD_TYPE = b'\xFC'
+    CONTROL_SENSOR_NAME = b'\xFB'
+    CONTROL_EPOCH = b'\xFA'
+    CONTROL_DEADBAND = b'\xF9'
+    CONTROL_INDEX = b'\xF8'
+    FILE_MAGIC = b"ADS"
+    BLOCK_MAGIC = 0xFA
+    BLOCK_HEADER_SIZE = 8
+    STREAM_SYNC = b'\xA5\x5A'
+    STREAM_OVERHEAD = 5
+    FILE_VERSION = 2
+    FILE_RECORD_CRC = 0x01
+    CRC8_TABLE = _crc8_table()
+    FIELD_FLOAT = 1
+    FIELD_INT16 = 2
+    FIELD_COUNTS = (3, 3, 3, 3, 1, 1, 1, 1)
+    FIELD_NAMES = (("x", "y", "z"), ("x", "y", "z"), ("x", "y", "z"),
+                   ("roll", "pitch", "heading"), ("temp",), ("lux",), ("uv",),
+                   ("pressure",))
+    COMPACT_SCALES = (1000, 100, 1000, 100, 100, 10, 100, 100)
+    INT16_SCALES = (100, 10, 10, 100, 100, 1, 1000, 10)
+
+    def __init__(self, input_file, halt_on_error=False, fill_period=0,
+                 native=True):
         self.input_file = input_file
+        # the whole file, until decoding starts
+        self.source = input_file
+        # decoded by libardusat_decode (see ardusat_decode.py) if it has been
+        # built, unless native is False, else by the pure Python decoder
+        self.native = native and ardusat_decode is not None and \
+            ardusat_decode.library() is not None
+        self.log = None
+        self.error_reported = False
+        self.runs = None
+        self.damaged_blocks = 0
+        # records are followed by a CRC-8 if the file header says so, see
+        # setLogRecordCrc; damaged records are skipped and counted
+        self.record_crc = 0
+        self.bad_records = 0
+        # header and deadband records are only taken in if set, it's cleared
+        # while looking for a good record after a damaged one
+        self.read_header = True
         self.lines = 0
         self.halt_on_error = halt_on_error
+        # (type, id) -> [timestamp, values] of the last compact record
+        self.compact_streams = {}
+        # replaced by the scale table control record of the file
+        self.int16_scales = list(self.INT16_SCALES)
+        # record type byte -> (size, field type, field count, names) from the
+        # file header
+        self.record_types = {}
+        # (64 bit time, millis) of the last epoch anchor
+        self.timeline = None
+        # repeat the readings of deadbanded sensors every fill_period ms,
+        # (name, id) -> [heartbeat, last reading] of each deadbanded sensor
+        self.fill_period = fill_period
+        self.deadbands = {}
+
+    def _read_varint(self):
+        n = 0
+        shift = 0
+        while True:
+            c = self.input_file.read(1)
+            if c == b"" or shift > 28:
+                raise EOFError("Truncated varint")
+            c = ord(c)
+            n |= (c & 0x7F) << shift
+            shift += 7
+            if not c & 0x80:
+                return n
+
+    def _read_zigzag(self):
+        n = self._read_varint()
+        return (n >> 1) ^ -(n & 1)
+
+    def _reading(self, timestamp, sensor_type, sensor_id, values):
+        return ("reading", timestamp, self.SENSOR_NAME[struct.pack("B", sensor_type)],
+                sensor_id, values, self.FIELD_NAMES[sensor_type])
+
+    def _next_compact(self, first_byte):
+        """
+        Decodes a compact key or delta record whose first byte has already
+        been read.
+        """
+        sensor_type = first_byte & self.RECORD_TYPE_MASK
+        is_key = (first_byte & self.RECORD_ENCODING_MASK) == self.RECORD_COMPACT_KEY
+        sensor_id = ord(self.input_file.read(1))
+        stream = (sensor_type, sensor_id)
+
+        if is_key:
+            timestamp = struct.unpack("<I", self.input_file.read(4))[0]
+            values = [self._read_zigzag()
+                      for i in range(self.FIELD_COUNTS[sensor_type])]
+        else:
+            if stream not in self.compact_streams:
+                # the key record was lost (e.g. in a dropped block), skip
+                # deltas until the next key record
+                self._read_varint()
+                for i in range(self.FIELD_COUNTS[sensor_type]):
+                    self._read_zigzag()
+                return []
+            timestamp, values = self.compact_streams[stream]
+            timestamp = (timestamp + self._read_varint()) & 0xFFFFFFFF
+            values = [v + self._read_zigzag() for v in values]
+        self.compact_streams[stream] = (timestamp, values)
+
+        scale = self.COMPACT_SCALES[sensor_type]
+        return [self._reading(timestamp, sensor_type, sensor_id,
+                              [float(val) / scale for val in values])]
+
+    def _next_int16(self, first_byte):
+        """
+        Decodes an int16 record whose first byte has already been read.
+        """
+        sensor_type = first_byte & self.RECORD_TYPE_MASK
+        count = self.FIELD_COUNTS[sensor_type]
+        data = struct.unpack("<BI%dh" % count,
+                             self.input_file.read(5 + 2 * count))
+        scale = self.int16_scales[sensor_type]
+        return [self._reading(data[1], sensor_type, data[0],
+                              [float(val) / scale for val in data[2:]])]
+
+    def _next_control(self, subtype):
+        """
+        Reads a length prefixed control record whose first two bytes have
+        already been read. Unknown subtypes are skipped, and header and
+        deadband records are only taken in if self.read_header is set, and in
+        a log with record CRCs if their CRC byte matches.
+        """
+        length = ord(self.input_file.read(1))
+        body = self.input_file.read(length)
+        if len(body) != length:
+            raise EOFError("Truncated control record")
+        if subtype == self.CONTROL_SENSOR_NAME and length >= 2:
+            return [("sensor", self._type_name(ord(body[0:1])),
+                     ord(body[1:2]), body[2:].decode("ascii", "replace"))]
+        elif (subtype == self.CONTROL_EPOCH and length >= 6) or \
+                (subtype == self.CONTROL_INDEX and length >= 12):
+            # an index record is also an epoch anchor
+            epoch, millis = struct.unpack("<HI", body[:6])
+            self.timeline = ((epoch << 32) | millis, millis)
+        elif not self.read_header or \
+                (self.record_crc and not self._control_crc_good(subtype, body)):
+            return []
+        if subtype == self.CONTROL_FILE_HEADER and length >= 4:
+            if body[:3] != self.FILE_MAGIC:
+                raise LookupError("Not an ArdusatSDK file header")
+            if ord(body[3:4]) > self.FILE_VERSION:
+                print("File format version %d is newer than this decoder, "
+                      "unknown records will be skipped" % ord(body[3:4]))
+            if length >= 5:
+                self.record_crc = ord(body[4:5]) & self.FILE_RECORD_CRC
+        elif subtype == self.CONTROL_RECORD_TYPE and length >= 4:
+            size, field_type, field_count = struct.unpack("<BBB", body[1:4])
+            names = body[4:].decode("ascii", "replace").split(",")
+            self.record_types[body[0:1]] = (size, field_type, field_count, names)
+        elif subtype == self.CONTROL_DEADBAND and length >= 6:
+            sensor_type, sensor_id, heartbeat = struct.unpack("<BBI", body[:6])
+            self.deadbands[(self._type_name(sensor_type), sensor_id)] = [heartbeat, None]
+        elif subtype == self.CONTROL_INT16_SCALES:
+            scales = struct.unpack("<%dH" % (length // 2), body)
+            for i, scale in enumerate(scales[:len(self.int16_scales)]):
+                self.int16_scales[i] = scale or 1
+        return []
+
+    def _control_crc_good(self, subtype, body):
+        """
+        Tells if the CRC byte after a control record just read matches,
+        without reading it.
+        """
+        pos = self.input_file.tell()
+        crc = self.input_file.read(1)
+        self.input_file.seek(pos)
+        return crc != b"" and \
+            self._crc8(b"\xFF" + subtype + struct.pack("B", len(body)) + body) == ord(crc)
+
+    def _type_name(self, sensor_type):
+        """
+        Name of a sensor type: built-in types are known, custom ones are named
+        by their description in the file header.
+        """
+        name = self.SENSOR_NAME.get(struct.pack("B", sensor_type))
+        for encoding in (0, self.RECORD_INT16):
+            desc = self.record_types.get(struct.pack("B", encoding | sensor_type))
+            if name is None and desc is not None:
+                name = desc[3][0]
+        return name or "unknown"
+
+    def _next_described(self, first_byte):
+        """
+        Decodes a fixed size record of a type the decoder doesn't know from its
+        description in the file header. Records whose fields can't be decoded
+        are skipped.
+        """
+        size, field_type, field_count, names = self.record_types[first_byte]
+        data = self.input_file.read(size - 1)
+        fmt = {self.FIELD_FLOAT: "f", self.FIELD_INT16: "h"}.get(field_type)
+        if fmt is None or size != 1 + struct.calcsize("<BI%d%s" % (field_count, fmt)):
+            if len(data) != size - 1:
+                raise EOFError("Truncated record")
+            return []
+        data = struct.unpack("<BI%d%s" % (field_count, fmt), data)
+        fields = (names[1:] + [""] * field_count)[:field_count]
+        return [("reading", data[1], names[0], data[0], list(data[2:]), fields)]
+
+    def _next_frame(self):
+        """
+        Decodes a frame record whose first byte has already been read. Returns
+        one row per reading in the frame.
+        """
+        mask, timestamp = struct.unpack("<BI", self.input_file.read(5))
+        rows = []
+        for sensor_type in range(len(self.FIELD_COUNTS)):
+            if not mask & (1 << sensor_type):
+                continue
+            count = self.FIELD_COUNTS[sensor_type]
+            data = struct.unpack("<B%df" % count,
+                                 self.input_file.read(1 + 4 * count))
+            rows.append(self._reading(timestamp, sensor_type, data[0],
+                                      list(data[1:])))
+        return rows
+
+    @staticmethod
+    def _crc_ccitt(crc, data):
+        for c in bytearray(data):
+            crc = ((crc >> 8) | (crc << 8)) & 0xFFFF
+            crc ^= c
+            crc ^= (crc & 0xFF) >> 4
+            crc ^= (crc << 12) & 0xFFFF
+            crc ^= ((crc & 0xFF) << 5) & 0xFFFF
+        return crc
+
+    @classmethod
+    def _crc8(cls, data):
+        crc = 0
+        for c in bytearray(data):
+            crc = cls.CRC8_TABLE[crc ^ c]
+        return crc
+
+    def _start(self, native):
+        """
+        Starts decoding the file: with libardusat_decode if native, else with
+        the pure Python decoder, splitting a framed log into runs of good
+        blocks.
+        """
+        source, self.source = self.source, None
+        if source is None:
+            return
+        source.seek(0)
+        if native:
+            self.log = ardusat_decode.Log(source.read())
+            self.damaged_blocks = self.log.damaged
+        elif source.read(1) == struct.pack("B", self.BLOCK_MAGIC):
+            source.seek(0)
+            self.runs = self._framed_runs(source.read())
+            self.input_file = io.BytesIO(b"")
+        else:
+            source.seek(0)
+
+    def _framed_record_crc(self, data):
+        """
+        Tells if the file header record at the start of the first block of a
+        framed log says its records have CRCs, even if the block is damaged.
+        """
+        header = data[self.BLOCK_HEADER_SIZE:self.BLOCK_HEADER_SIZE + 8]
+        return len(header) == 8 and header[:2] == b"\xFF" + self.CONTROL_FILE_HEADER and \
+            ord(header[2:3]) >= 5 and header[3:6] == self.FILE_MAGIC and \
+            bool(ord(header[7:8]) & self.FILE_RECORD_CRC)
+
+    def _framed_runs(self, data):
+        """
+        Splits a block framed log into runs of good blocks, see
+        utility/BinaryDataFmt.h. Damaged blocks are dropped, and the run after
+        one starts at the first record starting in the next good block. In a
+        log with record CRCs they are kept instead, up to the used length in
+        their header if it makes sense, or else the whole block, and their
+        records are checked one by one.
+        """
+        salvage = self._framed_record_crc(data)
+        runs = []
+        run = None
+        for number, pos in enumerate(range(0, len(data), 512)):
+            block = data[pos:pos + 512]
+            used = 0
+            if len(block) >= self.BLOCK_HEADER_SIZE:
+                magic, seq, first, used, crc = struct.unpack("<BBHHH", block[:8])
+                body = block[self.BLOCK_HEADER_SIZE:used]
+                if magic != self.BLOCK_MAGIC or seq != number & 0xFF or \
+                   used < self.BLOCK_HEADER_SIZE or used > len(block) or \
+                   self._crc_ccitt(self._crc_ccitt(0, block[:6]), body) != crc:
+                    if salvage and len(block) > self.BLOCK_HEADER_SIZE:
+                        if used <= self.BLOCK_HEADER_SIZE or used > len(block):
+                            used = len(block)
+                        body = block[self.BLOCK_HEADER_SIZE:used]
+                    else:
+                        used = 0
+            if not used:
+                self.damaged_blocks += 1
+                if run is not None:
+                    runs.append(run)
+                run = None
+                continue
+            if run is None:
+                if first < self.BLOCK_HEADER_SIZE or first >= used:
+                    continue
+                run = block[first:used]
+            else:
+                run += body
+            if used < 512:
+                runs.append(run)
+                run = None
+        if run is not None:
+            runs.append(run)
+        return iter(runs)
 
     def __iter__(self):
         return self
@@ -50,38 +392,721 @@ class ArdusatBinaryData(object):
         Looks forward in the input file to process another "line" of input 
         (binary data structure). 
 
-        :return: 0 if successful, 1 if end of file, -1 if error
+        :return: the CSV lines of the record
+        """
+        return self.format_rows(self.next_rows())
+
+    @staticmethod
+    def format_rows(rows):
+        """
+        Formats decoded rows as CSV lines.
+        """
+        output_string = ""
+        for row in rows:
+            if row[0] == "timestamp":
+                output_string += "timestamp: %d at millis %d\n" % row[1:]
+            elif row[0] == "sensor":
+                output_string += "sensor: %s,%d,%s\n" % row[1:]
+            else:
+                output_string += "%d,%s,%d" % row[1:4]
+                for val in row[4]:
+                    output_string += (",%f" if isinstance(val, float) else ",%d") % val
+                output_string += "\n"
+        return output_string
+
+    def rows(self):
+        """
+        Generates the decoded rows of the whole file, as tuples of
+        ("reading", timestamp, sensor name, sensor id, values, field names),
+        ("timestamp", unixtime, millis) or ("sensor", sensor name, sensor id,
+        name).
+        """
+        while True:
+            try:
+                rows = self.next_rows()
+            except StopIteration:
+                return
+            for row in rows:
+                yield row
+
+    def next_rows(self):
+        """
+        Decodes the next record.
+
+        :return: list of the rows in the record, see rows()
+        """
+        self._start(self.native)
+        if self.log is not None:
+            rows = self._next_log_rows()
+        elif self.runs is None:
+            try:
+                rows = self._next_record()
+            except (EOFError, struct.error, TypeError, LookupError) as e:
+                self._stop(e, self.input_file.tell())
+        else:
+            # block framed log: decode each run of good blocks on its own
+            while True:
+                try:
+                    rows = self._next_record()
+                    break
+                except (StopIteration, EOFError, struct.error, TypeError, LookupError) as e:
+                    if isinstance(e, LookupError) and self.halt_on_error:
+                        raise
+                    self.input_file = io.BytesIO(next(self.runs))
+                    self.compact_streams = {}
+        if self.fill_period:
+            rows = self._fill(rows)
+        self.lines += sum(1 for row in rows if row[0] == "reading")
+        return rows
+
+    def _stop(self, error, pos):
+        """
+        Stops decoding an unframed log at an undecodable record, as
+        libardusat_decode does. Where is printed, or raised if halt_on_error
+        is set; a record cut short by the end of the file is left out
+        quietly.
+        """
+        if self.log is None:
+            if self.input_file.read(1) == b"":
+                raise StopIteration
+            self.input_file = io.BytesIO(b"")
+            if not isinstance(error, LookupError):
+                error = "Undecodable record found!"
+        err = "%s (byte %d)" % (error, pos)
+        if self.halt_on_error:
+            raise LookupError(err)
+        if not self.error_reported:
+            self.error_reported = True
+            print(err)
+        raise StopIteration
+
+    def _next_log_rows(self):
+        """
+        Decodes the next record with libardusat_decode.
+        """
+        rows = self.log.next_rows()
+        self.bad_records = self.log.bad_records
+        if rows is None:
+            if self.log.error is not None:
+                self._stop(self.log.error, self.log.error_pos)
+            raise StopIteration
+        return self._log_rows(rows)
+
+    def _log_rows(self, rows):
+        """
+        Takes in the heartbeats of deadbanded sensors from the deadband rows
+        of libardusat_decode.
+
+        :return: the other rows
+        """
+        for row in rows:
+            if row[0] == "deadband":
+                self.deadbands[row[1:3]] = [row[3], None]
+        return [row for row in rows if row[0] != "deadband"]
+
+    def _fill(self, rows):
         """
+        Forward fills deadbanded sensors (see setLogDeadband): repeats their
+        last reading every fill_period ms up to their next one, unless the gap
+        is longer than the sensor's heartbeat allows, which means readings
+        were lost rather than dropped by the deadband.
+        """
+        filled = []
+        for row in rows:
+            stream = self.deadbands.get((row[2], row[3])) if row[0] == "reading" else None
+            if stream is not None:
+                heartbeat, last = stream
+                if last is not None and row[1] > last[1] and \
+                   (heartbeat == 0 or row[1] - last[1] <= heartbeat + self.fill_period):
+                    t = last[1] + self.fill_period
+                    while t + self.fill_period // 2 < row[1]:
+                        filled.append((last[0], t) + last[2:])
+                        t += self.fill_period
+                stream[1] = row
+            filled.append(row)
+        return filled
+
+    def follow(self, fd):
+        """
+        Follows a live stream of records sent with setLogSerialTee from a file
+        descriptor, decoding each frame (see utility/BinaryDataFmt.h) as soon
+        as it is complete, with libardusat_decode if it has been built. Bytes
+        that don't start a frame with a good CRC are skipped and counted in
+        self.skipped. Regular files are polled for new
+        data like tail -f; other inputs are read until they end.
+
+        :return: generator of the row lists of the records, see next_rows()
+        """
+        regular = stat.S_ISREG(os.fstat(fd).st_mode)
+        buf = b""
+        self.source = None
+        if self.native:
+            self.log = ardusat_decode.Log()
+        self.skipped = 0
+        while True:
+            data = os.read(fd, 4096)
+            if not data:
+                if not regular:
+                    return
+                time.sleep(0.1)
+                continue
+            buf += data
+            while len(buf) >= 3:
+                frame = ord(buf[2:3]) + self.STREAM_OVERHEAD
+                drop = 1
+                if buf[:2] == self.STREAM_SYNC:
+                    if len(buf) < frame:
+                        break
+                    if self._crc_ccitt(0, buf[2:frame - 2]) == \
+                       struct.unpack("<H", buf[frame - 2:frame])[0]:
+                        rows = []
+                        if self.log is not None:
+                            self.log.feed(buf[3:frame - 2])
+                            for record in iter(self.log.next_rows, None):
+                                rows += self._log_rows(record)
+                        else:
+                            self.input_file = io.BytesIO(buf[3:frame - 2])
+                            try:
+                                rows = self._next_record()
+                            except (StopIteration, EOFError, struct.error, TypeError,
+                                    LookupError):
+                                pass
+                        if self.fill_period:
+                            rows = self._fill(rows)
+                        self.lines += sum(1 for row in rows if row[0] == "reading")
+                        yield rows
+                        drop = frame
+                if drop == 1:
+                    self.skipped += 1
+                buf = buf[drop:]
+
+    def arrays(self, native=True):
+        """
+        Decodes the rest of the file in bulk with numpy, a lot faster than
+        iterating over it. A whole file is decoded by libardusat_decode (see
+        ardusat_decode.py) if it has been built, unless native is False, and
+        the rest of a file it has started on goes through it row by row.
+        Otherwise float, int16 and timestamp records are located by a scan of
+        the type bytes and converted all at once with numpy structured
+        dtypes, and the other records are decoded one by one. int16 values
+        are scaled with the last scale table of the file.
+
+        :return: dict of record name -> numpy structured array with timestamp,
+                 id and field columns in file order; timestamp markers are
+                 under "timestamp" with unixtime and millis columns. Times
+                 are uint64 on the epoch timeline. Sensor names are left in
+                 self.sensor_names.
+        """
+        import numpy
+
+        if native and self.native and self.source is not None:
+            self.source.seek(0)
+            result, self.sensor_names, self.damaged_blocks, self.bad_records = \
+                ardusat_decode.arrays(self.source.read())
+            self.lines += sum(len(out) for name, out in result.items()
+                              if name != "timestamp")
+            self.source = None
+            self.input_file = io.BytesIO(b"")
+            self.runs = None
+            return result
+        if self.log is not None:
+            return self._log_arrays()
+
+        self._start(False)
+        segments = [self.input_file.read()]
+        if self.runs is not None:
+            segments += list(self.runs)
+        whole = b"".join(segments)
+        view = bytearray(whole)
+        # first byte -> record offsets, name -> rows decoded one by one
+        offsets = {}
+        slow = {}
+        anchors = []
+        if self.timeline is not None:
+            anchors.append((0,) + self.timeline)
+        self.sensor_names = {}
+        # records end where only zero padding is left, see _zero_padding()
+        padding = len(view)
+        while self.runs is None and padding > 0 and view[padding - 1] == 0:
+            padding -= 1
+        start = 0
+        for segment in segments:
+            self._scan(view, start, start + len(segment), padding, offsets,
+                       slow, anchors)
+            start += len(segment)
+            self.compact_streams = {}
+
+        data = numpy.frombuffer(whole, numpy.uint8)
+        header = [("type", "u1"), ("id", "u1"), ("timestamp", "<u4")]
+        result = {}
+        parts = {}
+        for first, pos in offsets.items():
+            if not pos:
+                continue
+            pos = numpy.array(pos, numpy.int64)
+            if first == 0xFF:
+                rec = self._gather(data, pos, [("control", "u1"), ("subtype", "u1"),
+                                               ("unixtime", "<u4"), ("millis", "<u4")])
+                out = numpy.empty(len(pos), [("unixtime", "<u4"), ("millis", "<u8")])
+                out["unixtime"] = rec["unixtime"]
+                out["millis"] = self._timeline_array(anchors, pos, rec["millis"])
+                result["timestamp"] = out
+                continue
+            sensor_type = first & self.RECORD_TYPE_MASK
+            fields = self.FIELD_NAMES[sensor_type]
+            if first == sensor_type:
+                value_type, scale = "<f4", 1
+            else:
+                value_type, scale = "<i2", self.int16_scales[sensor_type]
+            rec = self._gather(data, pos, header + [(f, value_type) for f in fields])
+            values = numpy.column_stack([rec[f] for f in fields]).astype(numpy.float64)
+            name = self.SENSOR_NAME[struct.pack("B", sensor_type)]
+            parts.setdefault(name, []).append(
+                (pos, self._timeline_array(anchors, pos, rec["timestamp"]),
+                 rec["id"], values / scale, fields))
+        for name, (pos, timestamps, ids, values, fields) in slow.items():
+            parts.setdefault(name, []).append(
+                (numpy.array(pos, numpy.int64), numpy.array(timestamps, numpy.uint64),
+                 numpy.array(ids, numpy.uint8),
+                 numpy.array(values, numpy.float64).reshape(len(pos), len(fields)),
+                 fields))
+
+        for name, name_parts in parts.items():
+            fields = name_parts[0][4]
+            order = numpy.argsort(numpy.concatenate([p[0] for p in name_parts]),
+                                  kind="mergesort")
+            out = numpy.empty(len(order), [("timestamp", "<u8"), ("id", "u1")] +
+                              [(f, "<f8") for f in fields])
+            out["timestamp"] = numpy.concatenate([p[1] for p in name_parts])[order]
+            out["id"] = numpy.concatenate([p[2] for p in name_parts])[order]
+            values = numpy.concatenate([p[3] for p in name_parts])[order]
+            for i, field in enumerate(fields):
+                out[field] = values[:, i]
+            result[name] = out
+            self.lines += len(out)
+        self.input_file = io.BytesIO(b"")
+        self.runs = None
+        return result
+
+    def _log_arrays(self):
+        """
+        Collects the rest of the rows of libardusat_decode into the arrays of
+        arrays().
+        """
+        import numpy
+
+        self.sensor_names = {}
+        stamps = []
+        readings = {}
+        while True:
+            try:
+                rows = self._next_log_rows()
+            except StopIteration:
+                break
+            for row in rows:
+                if row[0] == "sensor":
+                    self.sensor_names[row[1:3]] = row[3]
+                elif row[0] == "timestamp":
+                    stamps.append(row[1:])
+                else:
+                    stream = readings.setdefault(row[2], ([], [], [], row[5]))
+                    for column, val in zip(stream, (row[1], row[3], row[4])):
+                        column.append(val)
+
+        result = {}
+        if stamps:
+            out = numpy.empty(len(stamps), [("unixtime", "<u4"), ("millis", "<u8")])
+            out["unixtime"] = [stamp[0] for stamp in stamps]
+            out["millis"] = [stamp[1] for stamp in stamps]
+            result["timestamp"] = out
+        for name, (timestamps, ids, values, fields) in readings.items():
+            out = numpy.empty(len(ids), [("timestamp", "<u8"), ("id", "u1")] +
+                              [(f, "<f8") for f in fields])
+            out["timestamp"] = timestamps
+            out["id"] = ids
+            values = numpy.array(values, numpy.float64).reshape(len(ids), len(fields))
+            for i, field in enumerate(fields):
+                out[field] = values[:, i]
+            result[name] = out
+            self.lines += len(out)
+        return result
+
+    def dataframes(self):
+        """
+        Decodes the rest of the file in bulk like arrays().
+
+        :return: dict of record name -> pandas DataFrame
+        """
+        import pandas
+        return dict((name, pandas.DataFrame(values))
+                    for name, values in self.arrays().items())
+
+    @staticmethod
+    def _timeline_array(anchors, offsets, millis):
+        """
+        Places the uint32 millis values of the records at the offsets on the
+        64 bit timeline, using the last epoch anchor before each record.
+        """
+        import numpy
+        times = millis.astype(numpy.uint64)
+        if not anchors:
+            return times
+        index = numpy.searchsorted(numpy.array([a[0] for a in anchors], numpy.int64),
+                                   offsets, side="right") - 1
+        anchored = index >= 0
+        index = index[anchored]
+        base = numpy.array([a[1] for a in anchors], numpy.int64)[index]
+        base_millis = numpy.array([a[2] for a in anchors], numpy.uint32)[index]
+        diff = (millis[anchored] - base_millis).view(numpy.int32)
+        times[anchored] = (base + diff).astype(numpy.uint64)
+        return times
+
+    @staticmethod
+    def _gather(data, offsets, fields):
+        """
+        Copies the records at the offsets of a uint8 array into a packed
+        structured array.
+        """
+        import numpy
+        dtype = numpy.dtype(fields)
+        index = offsets[:, None] + numpy.arange(dtype.itemsize)
+        return data[index].view(dtype)[:, 0]
+
+    def _scan(self, data, pos, end, padding, offsets, slow, anchors):
+        """
+        Walks the records between pos and end of a bytearray for arrays(),
+        noting the offsets of fixed size records by type byte and the epoch
+        anchors, and decoding the other records. Records stop at the zero
+        padding from padding on.
+        """
+        sizes = [0] * 256
+        for sensor_type, count in enumerate(self.FIELD_COUNTS):
+            sizes[sensor_type] = 6 + 4 * count
+            sizes[sensor_type | self.RECORD_INT16] = 6 + 2 * count
+        appends = [offsets.setdefault(first, []).append for first in range(256)]
+        segment = None
+        while pos < end and pos < padding:
+            first = data[pos]
+            size = sizes[first]
+            if first == 0xFF and pos + 1 < end and data[pos + 1] == 0xFF:
+                size = 10
+                self.compact_streams = {}
+            # a fixed size record whose CRC byte doesn't match is decoded one
+            # by one below, which skips it and finds the next good record
+            if size and pos + size + self.record_crc <= end and \
+               (not self.record_crc or
+                self._crc8(data[pos:pos + size]) == data[pos + size]):
+                appends[first](pos)
+                pos += size + self.record_crc
+                continue
+            if size and not self.record_crc:
+                break
+
+            if segment is None:
+                base = pos
+                segment = io.BytesIO(bytes(data[base:end]))
+            self.input_file = segment
+            segment.seek(pos - base)
+            timeline = self.timeline
+            try:
+                rows = self._next_record()
+            except (StopIteration, EOFError, struct.error, TypeError, LookupError):
+                break
+            if self.timeline is not timeline:
+                anchors.append((pos,) + self.timeline)
+            for row in rows:
+                if row[0] == "sensor":
+                    self.sensor_names[row[1:3]] = row[3]
+                elif row[0] == "reading":
+                    stream = slow.setdefault(row[2], ([], [], [], [], row[5]))
+                    for column, val in zip(stream, (pos, row[1], row[3], row[4])):
+                        column.append(val)
+            pos = base + segment.tell()
+
+    def _time(self, millis):
+        """
+        Places a 32 bit millis value on the 64 bit timeline of the last epoch
+        anchor, see utility/BinaryDataFmt.h.
+        """
+        if self.timeline is None:
+            return millis
+        diff = (millis - self.timeline[1]) & 0xFFFFFFFF
+        if diff >= 0x80000000:
+            diff -= 1 << 32
+        return self.timeline[0] + diff
+
+    def _next_record(self):
+        """
+        Decodes the next record. In a log with record CRCs, a record that is
+        undecodable or whose CRC byte doesn't match is counted in
+        self.bad_records and skipped with _resync().
+        """
+        start = self.input_file.tell()
+        timeline = self.timeline
+        rows = self._read_record(start)
+        if rows is None or rows is False:
+            after = self.input_file.tell() if rows is False else None
+            rows = self._resync(start, after, timeline)
+        if self.timeline is None:
+            return rows
+        for i, row in enumerate(rows):
+            if row[0] == "reading":
+                rows[i] = (row[0], self._time(row[1])) + row[2:]
+            elif row[0] == "timestamp":
+                rows[i] = (row[0], row[1], self._time(row[2]))
+        return rows
+
+    def _read_record(self, start, resync=False):
+        """
+        Decodes the record at start, checking its CRC byte in a log with
+        record CRCs. While resyncing, a record of zeros, which passes a CRC-8
+        check by chance, doesn't count either.
+
+        :return: the rows of the record; in a log with record CRCs, None if
+                 it is undecodable or False if its CRC byte doesn't match
+        """
+        self.input_file.seek(start)
+        try:
+            rows = self._decode_record()
+        except (EOFError, struct.error, TypeError, LookupError):
+            if not self.record_crc:
+                raise
+            return None
+        if not self.record_crc:
+            return rows
+        end = self.input_file.tell()
+        self.input_file.seek(start)
+        record = self.input_file.read(end - start)
+        crc = self.input_file.read(1)
+        if crc == b"" or (resync and not record.strip(b"\x00")):
+            return None
+        if self._crc8(record) != ord(crc):
+            return False
+        return rows
+
+    def _next_record_good(self):
+        """
+        Tells if the record after the one just decoded checks out too, or the
+        input ends there, so that a record found by _resync() is unlikely to
+        have matched its CRC byte by chance. The decoder state is put back.
+        """
+        pos = self.input_file.tell()
+        timeline = self.timeline
+        streams = self.compact_streams
+        self.compact_streams = dict(streams)
+        try:
+            rows = self._read_record(pos, True)
+            good = rows is not None and rows is not False
+        except StopIteration:
+            good = True
+        self.input_file.seek(pos)
+        self.timeline = timeline
+        self.compact_streams = streams
+        return good
+
+    def _try_record(self, pos, timeline):
+        """
+        Decodes the record at pos if it is good: it decodes, its CRC byte
+        matches, as does the record after it, and it isn't all zeros. What
+        the damaged record before it changed is undone first.
+
+        :return: the rows of the record, None if it isn't good
+        """
+        self.timeline = timeline
+        self.compact_streams = {}
+        rows = self._read_record(pos, True)
+        if rows is None or rows is False or not self._next_record_good():
+            return None
+        return rows
+
+    def _resync(self, start, after, timeline):
+        """
+        Finds the next good record after a damaged one in a log with record
+        CRCs (see _try_record). If only its CRC byte didn't match, its size
+        is most likely right and the record after it, at after, is tried
+        first; else every byte after start is tried in turn. What the damaged
+        record changed is undone: the timeline is put back, and as the
+        compact stream it belongs to can't be told, all streams wait for key
+        records. Header records are only taken in from the record found.
+
+        :return: the rows of the record found
+        """
+        self.bad_records += 1
+        self.read_header = False
+        try:
+            if after is not None and self._try_record(after, timeline) is not None:
+                start = after
+            else:
+                while True:
+                    start += 1
+                    self.input_file.seek(start)
+                    if self.input_file.read(1) == b"":
+                        raise StopIteration
+                    if self._try_record(start, timeline) is not None:
+                        break
+        finally:
+            self.read_header = True
+        # decode the record found again, taking it in if it is a header record
+        self.timeline = timeline
+        self.compact_streams = {}
+        return self._read_record(start) or []
+
+    def _zero_padding(self):
+        """
+        Tells if the rest of an unframed file is zeros: the padding left at
+        the end of the last block of a log file recovered after a power loss
+        (see ARDUSAT_FILE_OPEN in utility/BinaryDataFmt.h), which holds no
+        records.
+        """
+        pos = self.input_file.tell()
+        while True:
+            chunk = self.input_file.read(64)
+            if chunk.strip(b"\x00"):
+                self.input_file.seek(pos)
+                return False
+            if not chunk:
+                return True
+
+    def _decode_record(self):
         first_byte = self.input_file.read(1)
-        if first_byte == b"":
+        if first_byte == b"" or \
+           (first_byte == b"\x00" and self.runs is None and self._zero_padding()):
             raise StopIteration
 
+        encoding = ord(first_byte) & self.RECORD_ENCODING_MASK
+        if encoding in (self.RECORD_COMPACT_DELTA, self.RECORD_COMPACT_KEY) and \
+           (ord(first_byte) & self.RECORD_TYPE_MASK) < len(self.FIELD_COUNTS):
+            return self._next_compact(ord(first_byte))
+        if encoding == self.RECORD_INT16 and \
+           (ord(first_byte) & self.RECORD_TYPE_MASK) < len(self.FIELD_COUNTS):
+            return self._next_int16(ord(first_byte))
+        if first_byte == self.ARDUSAT_SENSOR_TYPE_FRAME:
+            return self._next_frame()
+
+        if first_byte not in self.STRUCTURE_SIZE and \
+           self.record_types.get(first_byte, (0,))[0] > 0:
+            return self._next_described(first_byte)
         try:
             strut_size = self.STRUCTURE_SIZE[first_byte]
         except KeyError:
-            # Check if we have a timestamp header
-            if first_byte == b'\xFF' and input_file.read(1) == b'\xFF':
-                ts1, ts2 = struct.unpack("<II", input_file.read(8))
-                return "timestamp: %d at millis %d\n" % (ts1, ts2)
-            pos = self.input_file.tell()
-            err = "Unknown sensor type %#x found at byte %d!" % \
-                  (ord(first_byte), pos)
-            if self.halt_on_error:
-                raise LookupError(err)
-            else:
-                print(err)
-                return ""
+            # Check if we have a timestamp header or other control record
+            subtype = self.input_file.read(1) if first_byte == b'\xFF' else b""
+            if subtype not in (b"", self.CONTROL_TIMESTAMP):
+                return self._next_control(subtype)
+            if subtype == self.CONTROL_TIMESTAMP:
+                ts1, ts2 = struct.unpack("<II", self.input_file.read(8))
+                # compact streams restart with key records after each marker
+                self.compact_streams = {}
+                return [("timestamp", ts1, ts2)]
+            raise LookupError("Unknown sensor type %d found!" % ord(first_byte))
 
         # Read in binary data. We've already read the first byte (sensor type),
         # so read struct_size - 1 bytes
         data = struct.unpack(strut_size[1], \
                              self.input_file.read(strut_size[0] - 1))
-        output_string = "%d,%s,%d" % \
-                        (data[1], self.SENSOR_NAME[first_byte], data[0])
-        for val in data[2:]:
-            output_string += ",%f" % val
-        self.lines += 1
-        return "%s\n" % output_string
+        return [self._reading(data[1], ord(first_byte), data[0], list(data[2:]))]
+
+
+class ColumnWriter(object):
+    """
+    Writes decoded rows as columns: one file per column of every record name,
+    holding the column as a little endian array (<name>.<column>.<dtype>, the
+    same layout decode_binary.c writes), so a column can be loaded with a
+    single read, e.g. numpy.fromfile(path, dtype="<f4").
+    """
+    FLUSH_ROWS = 65536
+
+    def __init__(self, directory):
+        self.directory = directory
+        self.columns = {}
+        self.sensor_names = None
+        if not os.path.isdir(directory):
+            os.makedirs(directory)
+
+    def _column(self, name, column, typecode, dtype):
+        key = (name, column)
+        if key not in self.columns:
+            path = os.path.join(self.directory, "%s.%s.%s" % (name, column, dtype))
+            self.columns[key] = (open(path, "wb"), array.array(typecode))
+        return self.columns[key][1]
+
+    def write(self, row):
+        if row[0] == "sensor":
+            if self.sensor_names is None:
+                self.sensor_names = open(os.path.join(self.directory,
+                                                      "sensors.names.csv"), "w")
+            self.sensor_names.write("%s,%d,%s\n" % row[1:])
+        elif row[0] == "timestamp":
+            self._column("timestamp", "unixtime", "I", "uint32").append(row[1])
+            self._column("timestamp", "millis", "Q", "uint64").append(row[2])
+        else:
+            kind, timestamp, name, sensor_id, values, fields = row
+            self._column(name, "timestamp", "Q", "uint64").append(timestamp)
+            ids = self._column(name, "id", "B", "uint8")
+            ids.append(sensor_id)
+            for field, val in zip(fields, values):
+                self._column(name, field, "f", "float32").append(val)
+            if len(ids) >= self.FLUSH_ROWS:
+                self.flush()
+
+    def flush(self):
+        for output_file, values in self.columns.values():
+            if sys.byteorder != "little":
+                values.byteswap()
+            values.tofile(output_file)
+            del values[:]
+
+    def close(self):
+        self.flush()
+        for output_file, values in self.columns.values():
+            output_file.close()
+        if self.sensor_names is not None:
+            self.sensor_names.close()
+
+def in_range(row, start, end):
+    """
+    Tells if a decoded row is within the --from/--to time range on the 64
+    bit timeline. Sensor name rows are always kept.
+    """
+    if row[0] == "reading":
+        return start <= row[1] <= end
+    elif row[0] == "timestamp":
+        return start <= row[2] <= end
+    return True
+
+def expand_compact_csv(input_file, output_file):
+    """Expands a compact CSV log (see setCsvLogFormat) into full
+    timestamp,sensorName,values lines. Timestamp deltas (+N, -N) are added
+    up from the last absolute timestamp, and sensor ids are replaced by the
+    names defined in #id=name lines. Other lines are copied as they are.
+
+    Returns the number of lines of readings written.
+    """
+    names = {}
+    last = 0
+    lines = 0
+    for line in input_file:
+        if line.startswith("#"):
+            key, sep, name = line[1:].rstrip("\r\n").partition("=")
+            if sep and key.isdigit():
+                names[key] = name
+                continue
+            if line.startswith("#ardusat compact csv"):
+                continue
+        fields = line.split(",", 2)
+        stamp = fields[0]
+        if len(fields) < 3 or not stamp.lstrip("+-").isdigit():
+            output_file.write(line)
+            continue
+        if stamp[0] in "+-":
+            last = (last + int(stamp)) & 0xFFFFFFFF
+        else:
+            last = int(stamp)
+        fields[0] = str(last)
+        fields[1] = names.get(fields[1], fields[1])
+        output_file.write(",".join(fields))
+        lines += 1
+    return lines
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="Decodes a binary data file " \
@@ -91,8 +1116,55 @@ if __name__ == "__main__":
     parser.add_argument("-s,--stop-on-error", action="store_true",
                         dest="halt_on_error",
                         help="Stop decoding if unexpected bytes encountered")
+    parser.add_argument("-c", "--columnar", nargs=1, dest="columnar",
+                        help="Write one little endian array file per column "
+                        "of each record type to this directory instead of CSV")
+    parser.add_argument("-f", "--follow", action="store_true", dest="follow",
+                        help="Decode a live stream of serial tee frames from "
+                        "the input (a serial port, pipe, growing file or - for "
+                        "stdin) as it arrives, writing CSV to stdout unless -o "
+                        "is given")
+    parser.add_argument("-F", "--fill", nargs=1, type=int, dest="fill",
+                        default=[0],
+                        help="Repeat the last reading of deadbanded sensors "
+                        "every FILL ms until their next one, for a regular "
+                        "series")
+    parser.add_argument("-b", "--from", nargs=1, type=int, dest="range_from",
+                        default=[0],
+                        help="Only output readings at or after this many ms "
+                        "on the time column")
+    parser.add_argument("-e", "--to", nargs=1, type=int, dest="range_to",
+                        default=[2 ** 64 - 1],
+                        help="Only output readings at or before this many ms "
+                        "on the time column")
+    parser.add_argument("-x", "--expand-csv", action="store_true",
+                        dest="expand_csv",
+                        help="Expand a compact CSV log into full CSV lines "
+                        "instead of decoding a binary file")
     parser.add_argument("input_file", help="Binary data file to decode")
     args = parser.parse_args()
+    start, end = args.range_from[0], args.range_to[0]
+    saved = 0
+
+    if args.follow:
+        output_file = open(args.output_file[0], "w") if args.output_file else sys.stdout
+        if args.input_file == "-":
+            fd = sys.stdin.fileno()
+        else:
+            fd = os.open(args.input_file, os.O_RDONLY)
+        data = ArdusatBinaryData(io.BytesIO(b""), args.halt_on_error,
+                                 args.fill[0])
+        try:
+            for rows in data.follow(fd):
+                rows = [row for row in rows if in_range(row, start, end)]
+                saved += sum(1 for row in rows if row[0] == "reading")
+                output_file.write(data.format_rows(rows))
+                output_file.flush()
+        except KeyboardInterrupt:
+            pass
+        sys.stderr.write("Decoded %d data observations from %s, skipped %d bytes\n"
+                         % (saved, args.input_file, data.skipped))
+        sys.exit(0)
 
     # check if input file exists
     if not os.path.isfile(args.input_file):
@@ -100,27 +1172,53 @@ if __name__ == "__main__":
         sys.exit(1)
 
     # if we don't have an output_file given, make one out of the input file path
-    if not args.output_file:
+    if args.columnar:
+        args.output_file = args.columnar[0]
+    elif not args.output_file:
         match = re.search("([^\.]*)\.[a-z]*", os.path.basename(args.input_file))
         if match is None:
             print("Unable to create output file path. " \
                   "Try specifying with the -o option")
             sys.exit(1)
         args.output_file = os.path.join(os.path.dirname(args.input_file),
-                                        "%s.%s" % (match.group(1), "csv"))
+                                        "%s%s" % (match.group(1),
+                                                  "_full.csv" if args.expand_csv
+                                                  else ".csv"))
     else:
         args.output_file = args.output_file[0]
 
+    if args.expand_csv:
+        with open(args.input_file, "r") as input_file:
+            with open(args.output_file, "w") as output_file:
+                lines = expand_compact_csv(input_file, output_file)
+        print("Expanded %s, saved %d data observations to %s" %
+              (args.input_file, lines, args.output_file))
+        sys.exit(0)
+
     print("Decoding file %s (%d bytes) and saving data to %s..." %
           (args.input_file, os.path.getsize(args.input_file), args.output_file))
 
     with open(args.input_file, "rb") as input_file:
-        with open(args.output_file, "w") as output_file:
-            data = ArdusatBinaryData(input_file, args.halt_on_error)
-            for line in data:
-                output_file.write(line)
+        data = ArdusatBinaryData(input_file, args.halt_on_error, args.fill[0])
+        if args.columnar:
+            writer = ColumnWriter(args.columnar[0])
+            for row in data.rows():
+                if in_range(row, start, end):
+                    saved += row[0] == "reading"
+                    writer.write(row)
+            writer.close()
+        else:
+            with open(args.output_file, "w") as output_file:
+                for rows in iter(data.next_rows, None):
+                    rows = [row for row in rows if in_range(row, start, end)]
+                    saved += sum(1 for row in rows if row[0] == "reading")
+                    output_file.write(data.format_rows(rows))
 
+    if data.damaged_blocks:
+        print("Skipped %d damaged blocks" % data.damaged_blocks)
+    if data.bad_records:
+        print("Skipped %d records with bad CRCs" % data.bad_records)
     print("Finished decoding %s, saved %d data observations to %s" %
-          (args.input_file, data.lines, args.output_file))
+          (args.input_file, saved, args.output_file))
 
     sys.exit(0)
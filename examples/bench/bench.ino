@@ -0,0 +1,363 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench.ino
+ *
+ *    Description:  SD card logging benchmark.
+ *
+ *                  Logs synthetic records at increasing rates with logBytes (raw
+ *                  records of several sizes), logAcceleration (CSV) and
+ *                  binaryLogAcceleration (binary), for each sync policy and file
+ *                  mode (plain log file, log queue, high-rate preallocated file).
+ *                  Each run lasts RUN_MILLIS; the rates for a test stop going up
+ *                  once more than MAX_DROP_PERCENT of the samples are dropped.
+ *
+ *                  Results are printed over Serial (115200 baud) as CSV, one line
+ *                  per run:
+ *
+ *                    api,size,sync,mode,rate,records/s,bytes/s,p50 us,p99 us,
+ *                    max us,dropped
+ *
+ *                  where rate is the target sample rate in Hz, the latencies are
+ *                  the time taken by each log call (rounded up to within 25%),
+ *                  and dropped counts the samples that were missed because a log
+ *                  call ran into the next sample time, or that the log refused
+ *                  (full queue or file). The highest rate with nothing dropped is
+ *                  the sustained rate for that setup. Run it with each SD card to
+ *                  be qualified; the log files are written to /DATA/BENCHn.* and
+ *                  can be deleted afterwards.
+ *
+ *        Version:  1.0
+ *        Created:  10/14/2026
+ *       Revision:  none
+ *       Compiler:  Arduino
+ *
+ * =====================================================================================
+ */
+
+/*-----------------------------------------------------------------------------
+ *  Includes
+ *-----------------------------------------------------------------------------*/
+#include <Arduino.h>
+#include <Wire.h>
+#include <ArdusatSDK.h>
+#include <ArdusatLogging.h>
+
+/*-----------------------------------------------------------------------------
+ *  Constant Definitions
+ *-----------------------------------------------------------------------------*/
+// CS pin used for SD card reader. Reader should be wired to DIO 10, 11, 12, 13
+const short SD_CS_PIN = 10;
+
+static char LOG_FILE_PREFIX[] = "BENCH";
+
+const unsigned long RUN_MILLIS = 5000;   // length of each run
+const unsigned long MAX_DROP_PERCENT = 1; // stop raising the rate above this
+
+#if defined(__arm__)
+const unsigned int QUEUE_BYTES = 4096;
+const unsigned long HIGH_RATE_FILE_SIZE = 8UL << 20;
+static const unsigned char RECORD_SIZES[] = {16, 64, 128, 255};
+#define MAX_RECORD_SIZE 255
+#else  // defined(__arm__)
+const unsigned int QUEUE_BYTES = 256;
+const unsigned long HIGH_RATE_FILE_SIZE = 2UL << 20;
+static const unsigned char RECORD_SIZES[] = {16, 64};
+#define MAX_RECORD_SIZE 64
+#endif  // defined(__arm__)
+
+static const unsigned int RATES[] = {10, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+
+typedef enum {
+  BENCH_BYTES = 0,   // logBytes of RECORD_SIZES bytes
+  BENCH_CSV,         // logAcceleration
+  BENCH_BINARY,      // binaryLogAcceleration
+} bench_api_e;
+
+typedef enum {
+  BENCH_FILE = 0,    // beginDataLog
+  BENCH_QUEUE,       // beginDataLog with a log queue, drained between samples
+  BENCH_HIGH_RATE,   // beginHighRateDataLog
+} bench_mode_e;
+
+static const log_sync_policy_e SYNC_POLICIES[] = {
+  LOG_SYNC_EVERY_RECORD, LOG_SYNC_BLOCK, LOG_SYNC_MILLIS,
+};
+const unsigned long SYNC_MILLIS = 1000;
+
+static const char *API_NAMES[] = {"logBytes", "logAcceleration", "binaryLogAcceleration"};
+static const char *MODE_NAMES[] = {"file", "queue", "highrate"};
+static const char *SYNC_NAMES[] = {"every", "records", "bytes", "millis", "block"};
+
+/*
+ * Latency histogram: four buckets per power of two microseconds, so values
+ * are known to within 25% without storing every sample.
+ */
+#define LATENCY_BUCKETS 80
+static uint16_t latency[LATENCY_BUCKETS];
+static unsigned long latency_max;
+
+static unsigned char record[MAX_RECORD_SIZE];
+acceleration_t accel;
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  latencyBucket
+ *  Description:  Histogram bucket for a latency of us microseconds.
+ * =====================================================================================
+ */
+static uint8_t latencyBucket(unsigned long us)
+{
+  uint8_t e = 2;
+  uint8_t bucket;
+
+  if (us < 4) {
+    return us;
+  }
+  while ((us >> (e - 2)) >= 8) {
+    e++;
+  }
+  // us is (4 + m) << (e - 2), m from 0 to 3
+  bucket = 4 * (e - 1) + ((us >> (e - 2)) & 3);
+  return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  latencyLimit
+ *  Description:  Largest latency in a bucket, in microseconds.
+ * =====================================================================================
+ */
+static unsigned long latencyLimit(uint8_t bucket)
+{
+  uint8_t e;
+
+  if (bucket < 4) {
+    return bucket;
+  }
+  e = bucket / 4 + 1;
+  return ((unsigned long) (4 + bucket % 4 + 1) << (e - 2)) - 1;
+}
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  latencyPercentile
+ *  Description:  Latency that percent of the log calls did not exceed.
+ * =====================================================================================
+ */
+static unsigned long latencyPercentile(unsigned long calls, uint8_t percent)
+{
+  unsigned long target = (calls * percent + 99) / 100;
+  unsigned long seen = 0;
+  uint8_t i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += latency[i];
+    if (seen >= target && seen > 0) {
+      return latencyLimit(i) < latency_max ? latencyLimit(i) : latency_max;
+    }
+  }
+  return latency_max;
+}
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  startLog
+ *  Description:  Opens a new log file for a run.
+ * =====================================================================================
+ */
+static bool startLog(bench_api_e api, bench_mode_e mode, log_sync_policy_e sync)
+{
+  bool csv = api == BENCH_CSV;
+  unsigned long interval = sync == LOG_SYNC_MILLIS ? SYNC_MILLIS : 1;
+
+  if (!setLogSyncPolicy(sync, interval)) {
+    return false;
+  }
+  if (mode == BENCH_QUEUE && !setLogQueueSize(QUEUE_BYTES)) {
+    return false;
+  }
+  if (mode == BENCH_HIGH_RATE) {
+    return beginHighRateDataLog(SD_CS_PIN, LOG_FILE_PREFIX, csv, HIGH_RATE_FILE_SIZE);
+  }
+  return beginDataLog(SD_CS_PIN, LOG_FILE_PREFIX, csv);
+}
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  logOne
+ *  Description:  Logs one sample with the API under test.
+ * =====================================================================================
+ */
+static int logOne(bench_api_e api, unsigned char size)
+{
+  accel.header.timestamp = millis();
+  accel.x += 0.01;
+  accel.y -= 0.01;
+  accel.z = 9.81;
+
+  switch (api) {
+    case BENCH_CSV:
+      return logAcceleration("accel", accel);
+    case BENCH_BINARY:
+      return binaryLogAcceleration(0, accel);
+    case BENCH_BYTES:
+    default:
+      record[0] = accel.header.timestamp;
+      return logBytes(record, size);
+  }
+}
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  runBench
+ *  Description:  Logs samples at rate Hz for RUN_MILLIS and prints the result.
+ *                Returns the percentage of samples dropped, or 100 if the log
+ *                could not be started.
+ * =====================================================================================
+ */
+static unsigned long runBench(bench_api_e api, bench_mode_e mode, log_sync_policy_e sync,
+                              unsigned char size, unsigned int rate)
+{
+  unsigned long period = 1000000UL / rate;
+  unsigned long calls = 0;
+  unsigned long records = 0;
+  unsigned long bytes = 0;
+  unsigned long dropped = 0;
+  unsigned long start, next, now, elapsed, t;
+  int ret;
+
+  memset(latency, 0, sizeof(latency));
+  latency_max = 0;
+  if (!startLog(api, mode, sync)) {
+    Serial.println(F("# could not start the log"));
+    setLogQueueSize(0);
+    return 100;
+  }
+
+  start = micros();
+  next = start;
+  while ((now = micros()) - start < RUN_MILLIS * 1000UL) {
+    if ((long) (now - next) < 0) {
+      // idle until the next sample, the time queued and rotating logs use
+      serviceDataLog();
+      continue;
+    }
+    // samples whose time has already passed are lost
+    if (now - next >= period) {
+      t = (now - next) / period;
+      dropped += t;
+      next += t * period;
+    }
+
+    t = micros();
+    ret = logOne(api, size);
+    t = micros() - t;
+
+    calls++;
+    if (ret > 0) {
+      records++;
+      bytes += ret;
+    } else {
+      dropped++;
+    }
+    if (latency[latencyBucket(t)] < 0XFFFF) {
+      latency[latencyBucket(t)]++;
+    }
+    if (t > latency_max) {
+      latency_max = t;
+    }
+    next += period;
+  }
+  elapsed = micros() - start;
+  endDataLog();
+  setLogQueueSize(0);
+
+  Serial.print(API_NAMES[api]);
+  Serial.print(',');
+  Serial.print(api == BENCH_BYTES ? size : 0);
+  Serial.print(',');
+  Serial.print(mode == BENCH_HIGH_RATE ? "-" : SYNC_NAMES[sync]);
+  Serial.print(',');
+  Serial.print(MODE_NAMES[mode]);
+  Serial.print(',');
+  Serial.print(rate);
+  Serial.print(',');
+  Serial.print(records * 1000000.0 / elapsed, 1);
+  Serial.print(',');
+  Serial.print(bytes * 1000000.0 / elapsed, 0);
+  Serial.print(',');
+  Serial.print(latencyPercentile(calls, 50));
+  Serial.print(',');
+  Serial.print(latencyPercentile(calls, 99));
+  Serial.print(',');
+  Serial.print(latency_max);
+  Serial.print(',');
+  Serial.println(dropped);
+
+  return dropped * 100 / (records + dropped);
+}
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  runRates
+ *  Description:  Runs one setup at increasing rates until too many samples drop.
+ * =====================================================================================
+ */
+static void runRates(bench_api_e api, bench_mode_e mode, log_sync_policy_e sync,
+                     unsigned char size)
+{
+  uint8_t i;
+
+  for (i = 0; i < sizeof(RATES) / sizeof(RATES[0]); i++) {
+    if (runBench(api, mode, sync, size, RATES[i]) > MAX_DROP_PERCENT) {
+      break;
+    }
+  }
+}
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  runSetups
+ *  Description:  Runs every sync policy and file mode for one API and size.
+ *                High-rate logs write whole blocks and ignore the sync policy,
+ *                so they run once.
+ * =====================================================================================
+ */
+static void runSetups(bench_api_e api, unsigned char size)
+{
+  uint8_t i;
+
+  for (i = 0; i < sizeof(SYNC_POLICIES) / sizeof(SYNC_POLICIES[0]); i++) {
+    runRates(api, BENCH_FILE, SYNC_POLICIES[i], size);
+    runRates(api, BENCH_QUEUE, SYNC_POLICIES[i], size);
+  }
+  runRates(api, BENCH_HIGH_RATE, LOG_SYNC_EVERY_RECORD, size);
+}
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  setup
+ *  Description:  Runs the whole benchmark once.
+ * =====================================================================================
+ */
+void setup()
+{
+  uint8_t i;
+
+  Serial.begin(115200);
+  while (!Serial);
+
+  memset(record, 0XA5, sizeof(record));
+  Serial.println(F("api,size,sync,mode,rate,records/s,bytes/s,p50 us,p99 us,max us,dropped"));
+  for (i = 0; i < sizeof(RECORD_SIZES); i++) {
+    runSetups(BENCH_BYTES, RECORD_SIZES[i]);
+  }
+  runSetups(BENCH_CSV, 0);
+  runSetups(BENCH_BINARY, 0);
+  Serial.println(F("# done"));
+}
+
+void loop()
+{
+}
@@ -0,0 +1,415 @@
+/**
+ * @file   gen_binary.cpp
+ * @brief  Utility to generate synthetic binary logs in the Ardusat SDK
+ *         format, for testing and benchmarking the decoders.
+ *
+ *         Writes the same file header, int16 scale table, epoch anchor,
+ *         records and RTC timestamp markers as a binary log made by
+ *         ArdusatLogging, with smoothly varying values for a chosen mix of
+ *         sensor types. Compact records are made by the SDK's own encoder,
+ *         so build it with utility/CompactRecord.cpp:
+ *
+ *           g++ -O2 -I. -o gen_binary gen_binary.cpp utility/CompactRecord.cpp
+ */
+#ifndef ARDUINO
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "utility/BinaryDataFmt.h"
+#include "utility/CompactRecord.h"
+
+#define SENSOR_TYPES 8
+#define MIX_TYPES (SENSOR_TYPES + 1)
+
+static const char *type_names[MIX_TYPES] = {
+  "acceleration", "magnetic", "gyro", "orientation", "temperature",
+  "luminosity", "uv", "pressure", "frame"
+};
+static const char *field_names[SENSOR_TYPES] = {
+  "x,y,z", "x,y,z", "x,y,z", "roll,pitch,heading", "temp", "lux", "uv",
+  "pressure"
+};
+static const uint8_t field_counts[] = ARDUSAT_SENSOR_FIELD_COUNTS;
+static const uint16_t int16_scales[] = ARDUSAT_INT16_SCALES;
+
+// value = offset + amplitude * sin(), per sensor type
+static const float value_offsets[SENSOR_TYPES] = {
+  0, 0, 0, 0, 22, 500, 4, 1013
+};
+static const float value_amplitudes[SENSOR_TYPES] = {
+  9.81, 50, 100, 180, 5, 400, 3, 10
+};
+
+typedef enum {
+  ENCODING_FLOAT = 0,
+  ENCODING_INT16,
+  ENCODING_COMPACT,
+} encoding_e;
+
+static struct option cli_options[] = {
+  { "output-file", required_argument, NULL, 'o' },
+  { "size", required_argument, NULL, 's' },
+  { "mix", required_argument, NULL, 'm' },
+  { "encoding", required_argument, NULL, 'e' },
+  { "sensor-ids", required_argument, NULL, 'n' },
+  { "timestamp-every", required_argument, NULL, 't' },
+  { "seed", required_argument, NULL, 'r' },
+  { "help", no_argument, NULL, 'h' },
+  { 0, 0, 0, 0}
+};
+
+void print_usage(char *argv [])
+{
+  printf("Generates a synthetic binary data file in the ArdusatSDK format.\n");
+  printf("usage: %s [options] -o FILE\n", argv[0]);
+  printf("Options:\n");
+  printf("  -o,--output-file PATH          Binary file to write\n");
+  printf("  -s,--size MB                   Size of the file in MB (default: 16)\n");
+  printf("  -m,--mix SPEC                  Relative record counts by type, e.g.\n");
+  printf("                                 acceleration=4,temperature=1 (default:\n");
+  printf("                                 one of each sensor type). Types are\n");
+  printf("                                 acceleration, magnetic, gyro, orientation,\n");
+  printf("                                 temperature, luminosity, uv, pressure and\n");
+  printf("                                 frame (one reading of each sensor type in\n");
+  printf("                                 the mix)\n");
+  printf("  -e,--encoding ENC              float, int16 or compact (default: float)\n");
+  printf("  -n,--sensor-ids N              Sensors of each type (default: 1)\n");
+  printf("  -t,--timestamp-every N         RTC timestamp marker every N records\n");
+  printf("                                 (default: 10000, 0 for none)\n");
+  printf("  -r,--seed N                    Random seed (default: 1)\n");
+  printf("  -h,--help                      Print this usage info.\n");
+}
+
+#define err_print_usage(err) err; print_usage(argv); return -1
+
+static FILE *out;
+static uint64_t out_bytes;
+static compact_table_t streams;
+
+static void put(const uint8_t *buf, size_t len)
+{
+  fwrite(buf, 1, len, out);
+  out_bytes += len;
+}
+
+static void le16(uint8_t *p, uint16_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void le32(uint8_t *p, uint32_t v)
+{
+  le16(p, v);
+  le16(p + 2, v >> 16);
+}
+
+/*
+ * Parses "type=weight,..." into weights, indexed like type_names.
+ */
+static int parse_mix(const char *spec, unsigned int *weights)
+{
+  char name[32];
+  unsigned int weight;
+  int len, i;
+
+  memset(weights, 0, MIX_TYPES * sizeof(*weights));
+  while (*spec) {
+    if (sscanf(spec, "%31[^=,]=%u%n", name, &weight, &len) != 2) {
+      return -1;
+    }
+    for (i = 0; i < MIX_TYPES && strcmp(name, type_names[i]) != 0; i++);
+    if (i == MIX_TYPES) {
+      return -1;
+    }
+    weights[i] = weight;
+    spec += len;
+    if (*spec == ',') {
+      spec++;
+    }
+  }
+  return 0;
+}
+
+static void write_control(uint8_t subtype, const uint8_t *body, uint8_t len)
+{
+  uint8_t buf[3 + 255];
+
+  buf[0] = 0xFF;
+  buf[1] = subtype;
+  buf[2] = len;
+  memcpy(buf + 3, body, len);
+  put(buf, 3 + len);
+}
+
+static void write_record_type(uint8_t type, uint8_t size, uint8_t field_type,
+                              uint8_t field_count, const char *name,
+                              const char *fields)
+{
+  uint8_t body[64];
+  int len;
+
+  body[0] = type;
+  body[1] = size;
+  body[2] = field_type;
+  body[3] = field_count;
+  len = snprintf((char *) body + 4, sizeof(body) - 4, "%s%s%s", name,
+                 fields ? "," : "", fields ? fields : "");
+  write_control(ARDUSAT_CONTROL_RECORD_TYPE, body, 4 + len);
+}
+
+/*
+ * Writes the control records a new log file starts with, in the order
+ * ArdusatLogging writes them.
+ */
+static void write_file_header(encoding_e encoding, uint32_t now)
+{
+  uint8_t body[2 * SENSOR_TYPES];
+  uint8_t type;
+
+  memcpy(body, ARDUSAT_FILE_MAGIC, 3);
+  body[3] = ARDUSAT_FILE_VERSION;
+  write_control(ARDUSAT_CONTROL_FILE_HEADER, body, 4);
+
+  for (type = 0; type < SENSOR_TYPES; type++) {
+    if (encoding == ENCODING_COMPACT) {
+      write_record_type(ARDUSAT_RECORD_COMPACT_KEY | type, 0, ARDUSAT_FIELD_ZIGZAG,
+                        field_counts[type], type_names[type], field_names[type]);
+      write_record_type(ARDUSAT_RECORD_COMPACT_DELTA | type, 0, ARDUSAT_FIELD_ZIGZAG,
+                        field_counts[type], type_names[type], field_names[type]);
+    } else if (encoding == ENCODING_INT16) {
+      write_record_type(ARDUSAT_RECORD_INT16 | type, 6 + 2 * field_counts[type],
+                        ARDUSAT_FIELD_INT16, field_counts[type], type_names[type],
+                        field_names[type]);
+    } else {
+      write_record_type(type, 6 + 4 * field_counts[type], ARDUSAT_FIELD_FLOAT,
+                        field_counts[type], type_names[type], field_names[type]);
+    }
+  }
+  write_record_type(ARDUSAT_SENSOR_TYPE_FRAME, 0, ARDUSAT_FIELD_FLOAT, 0, "frame", NULL);
+
+  if (encoding == ENCODING_INT16) {
+    for (type = 0; type < SENSOR_TYPES; type++) {
+      le16(body + 2 * type, int16_scales[type]);
+    }
+    write_control(ARDUSAT_CONTROL_INT16_SCALES, body, sizeof(body));
+  }
+
+  le16(body, 0);
+  le32(body + 2, now);
+  write_control(ARDUSAT_CONTROL_EPOCH, body, 6);
+}
+
+static void write_timestamp(uint32_t unixtime, uint32_t now)
+{
+  uint8_t buf[10];
+
+  buf[0] = 0xFF;
+  buf[1] = ARDUSAT_CONTROL_TIMESTAMP;
+  le32(buf + 2, unixtime);
+  le32(buf + 6, now);
+  put(buf, sizeof(buf));
+  // every compact stream restarts with a key record after a marker
+  compactReset(&streams);
+}
+
+/*
+ * Fills in the values of a reading of sensor type and id at time now.
+ */
+static void make_values(uint8_t type, uint8_t id, uint32_t now, float *values)
+{
+  uint8_t i;
+  double phase;
+
+  for (i = 0; i < field_counts[type]; i++) {
+    phase = now * (0.0005 + 0.0001 * i) + id + i;
+    values[i] = value_offsets[type] + value_amplitudes[type] * sin(phase) +
+                value_amplitudes[type] * 0.001 * (rand() % 21 - 10);
+  }
+}
+
+static int16_t to_int16(float value, uint16_t scale)
+{
+  float q = value * scale;
+
+  if (q >= 32767) {
+    return 32767;
+  } else if (q <= -32767) {
+    return -32767;
+  }
+  return q < 0 ? (int16_t) (q - 0.5f) : (int16_t) (q + 0.5f);
+}
+
+static void write_reading(encoding_e encoding, uint8_t type, uint8_t id, uint32_t now)
+{
+  uint8_t buf[6 + 4 * ARDUSAT_COMPACT_MAX_VALUES];
+  float values[ARDUSAT_COMPACT_MAX_VALUES];
+  uint8_t i;
+
+  make_values(type, id, now, values);
+  if (encoding == ENCODING_COMPACT) {
+    put(buf, compactEncode(&streams, buf, type, id, now, values, field_counts[type]));
+    return;
+  }
+
+  buf[0] = type;
+  buf[1] = id;
+  le32(buf + 2, now);
+  if (encoding == ENCODING_INT16) {
+    buf[0] |= ARDUSAT_RECORD_INT16;
+    for (i = 0; i < field_counts[type]; i++) {
+      le16(buf + 6 + 2 * i, to_int16(values[i], int16_scales[type]));
+    }
+    put(buf, 6 + 2 * field_counts[type]);
+  } else {
+    memcpy(buf + 6, values, 4 * field_counts[type]);
+    put(buf, 6 + 4 * field_counts[type]);
+  }
+}
+
+/*
+ * Writes a frame holding one reading of every sensor type in the mix.
+ */
+static void write_frame(const unsigned int *weights, uint8_t id, uint32_t now)
+{
+  uint8_t buf[ARDUSAT_FRAME_MAX_SIZE];
+  float values[ARDUSAT_COMPACT_MAX_VALUES];
+  uint8_t mask = 0;
+  size_t len = ARDUSAT_FRAME_HEADER_SIZE;
+  uint8_t type;
+
+  for (type = 0; type < SENSOR_TYPES; type++) {
+    if (weights[type] == 0) {
+      continue;
+    }
+    mask |= 1 << type;
+    make_values(type, id, now, values);
+    buf[len++] = id;
+    memcpy(buf + len, values, 4 * field_counts[type]);
+    len += 4 * field_counts[type];
+  }
+  buf[0] = ARDUSAT_SENSOR_TYPE_FRAME;
+  buf[1] = mask;
+  le32(buf + 2, now);
+  put(buf, len);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned int weights[MIX_TYPES];
+  unsigned int total = 0;
+  unsigned long ids = 1;
+  unsigned long marker_every = 10000;
+  unsigned long records = 0;
+  uint64_t size = 16ULL << 20;
+  encoding_e encoding = ENCODING_FLOAT;
+  const char *output_path = NULL;
+  uint32_t now = 1000;
+  uint32_t unixtime = 1700000000;
+  unsigned int pick;
+  uint8_t type;
+  int c, i;
+
+  for (i = 0; i < MIX_TYPES; i++) {
+    weights[i] = i < SENSOR_TYPES;
+  }
+  srand(1);
+
+  while ((c = getopt_long(argc, argv, "o:s:m:e:n:t:r:h", cli_options, NULL)) != -1) {
+    switch (c) {
+      case 'o':
+        output_path = optarg;
+        break;
+      case 's':
+        size = (uint64_t) (atof(optarg) * (1 << 20));
+        if (size == 0) {
+          err_print_usage(printf("Invalid size given.\n"));
+        }
+        break;
+      case 'm':
+        if (parse_mix(optarg, weights) != 0) {
+          err_print_usage(printf("Invalid type mix given.\n"));
+        }
+        break;
+      case 'e':
+        if (strcmp(optarg, "float") == 0) {
+          encoding = ENCODING_FLOAT;
+        } else if (strcmp(optarg, "int16") == 0) {
+          encoding = ENCODING_INT16;
+        } else if (strcmp(optarg, "compact") == 0) {
+          encoding = ENCODING_COMPACT;
+        } else {
+          err_print_usage(printf("Invalid encoding given.\n"));
+        }
+        break;
+      case 'n':
+        ids = strtoul(optarg, NULL, 10);
+        if (ids == 0 || ids > 256) {
+          err_print_usage(printf("Invalid number of sensor ids given.\n"));
+        }
+        break;
+      case 't':
+        marker_every = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        srand(strtoul(optarg, NULL, 10));
+        break;
+      case 'h':
+        print_usage(argv);
+        return 0;
+      default:
+        err_print_usage();
+    }
+  }
+
+  if (output_path == NULL) {
+    err_print_usage(printf("You need to provide a file to write!!!\n"));
+  }
+  for (i = 0; i < MIX_TYPES; i++) {
+    total += weights[i];
+  }
+  if (total == 0) {
+    err_print_usage(printf("The type mix is empty.\n"));
+  }
+  if ((out = fopen(output_path, "wb")) == NULL) {
+    err_print_usage(printf("Could not open file %s for writing.\n", output_path));
+  }
+  if (encoding == ENCODING_COMPACT && !compactBegin(&streams,
+                                                    ids * SENSOR_TYPES < 255 ?
+                                                    ids * SENSOR_TYPES : 255)) {
+    printf("Out of memory\n");
+    return -1;
+  }
+
+  write_file_header(encoding, now);
+  write_timestamp(unixtime, now);
+  while (out_bytes < size) {
+    pick = rand() % total;
+    for (type = 0; pick >= weights[type]; type++) {
+      pick -= weights[type];
+    }
+    if (type == ARDUSAT_SENSOR_TYPE_FRAME) {
+      write_frame(weights, rand() % ids, now);
+    } else {
+      write_reading(encoding, type, rand() % ids, now);
+    }
+    now++;
+    records++;
+    if (marker_every > 0 && records % marker_every == 0) {
+      write_timestamp(unixtime + (now - 1000) / 1000, now);
+    }
+  }
+
+  fclose(out);
+  compactEnd(&streams);
+  printf("Wrote %lu records (%llu bytes) to %s\n", records, (unsigned long long) out_bytes,
+         output_path);
+  return 0;
+}
+
+#endif
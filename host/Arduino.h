@@ -0,0 +1,136 @@
+/*
+ * Minimal Arduino core for building the logging library on a Linux host.
+ *
+ * Only what this library uses is here.  Digital pins are ignored, Serial
+ * writes to stdout and time is simulated: millis() and micros() count
+ * hostNanos, which advances with SPI traffic to the simulated SD card
+ * (utility/SdSpiHost.cpp), I2C traffic to the simulated RTC and delay().
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+
+#ifndef ARDUINO_ARCH_HOST
+#error Build with -DARDUINO=160 -DARDUINO_ARCH_HOST, see sim_sd.cpp
+#endif  // ARDUINO_ARCH_HOST
+
+/** simulated time since start up, ns */
+extern uint64_t hostNanos;
+
+// SdBaseFile.h may have defined some of these for non-AVR boards already
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#ifndef PSTR
+#define PSTR(s) (s)
+#endif
+#ifndef PGM_P
+#define PGM_P const char *
+#endif
+#ifndef pgm_read_byte
+#define pgm_read_byte(addr) (*(const unsigned char *)(addr))
+#endif
+#ifndef pgm_read_word
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#endif
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_read_float(addr) (*(const float *)(addr))
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+#define memcpy_P memcpy
+#define strcpy_P strcpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+const uint8_t SS = 10;
+const uint8_t MOSI = 11;
+const uint8_t MISO = 12;
+const uint8_t SCK = 13;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void noInterrupts();
+void interrupts();
+void yield();
+
+class __FlashStringHelper;
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t *buf, size_t n) {
+    size_t r = 0;
+    while (n--) r += write(*buf++);
+    return r;
+  }
+  size_t write(const char *s) {
+    return s ? write((const uint8_t *)s, strlen(s)) : 0;
+  }
+  size_t write(const char *buf, size_t n) {
+    return write((const uint8_t *)buf, n);
+  }
+  virtual int availableForWrite() { return 0; }
+  virtual void flush() {}
+
+  size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+  size_t print(const char *s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char v, int base = DEC) { return print((unsigned long)v, base); }
+  size_t print(int v, int base = DEC) { return print((long)v, base); }
+  size_t print(unsigned int v, int base = DEC) { return print((unsigned long)v, base); }
+  size_t print(long v, int base = DEC);
+  size_t print(unsigned long v, int base = DEC);
+  size_t print(double v, int digits = 2);
+
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+  template <typename T> size_t println(T v, int f) { size_t n = print(v, f); return n + println(); }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long) {}
+  void end() {}
+  size_t write(uint8_t b) { return fputc(b, stdout) == EOF ? 0 : 1; }
+  size_t write(const uint8_t *buf, size_t n) { return fwrite(buf, 1, n, stdout); }
+  using Print::write;
+  int availableForWrite() { return 4096; }
+  int available() { return 0; }
+  int read() { return -1; }
+  int peek() { return -1; }
+  void flush() { fflush(stdout); }
+  operator bool() { return true; }
+};
+extern HardwareSerial Serial;
+#endif  // HOST_ARDUINO_H
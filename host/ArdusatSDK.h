@@ -0,0 +1,30 @@
+/*
+ * The parts of the ArdusatSDK the logging library uses, for host builds:
+ * the sensor data types and the shared output buffer.  The sensor drivers
+ * are not built on the host; fill the structures in directly.
+ */
+#ifndef HOST_ARDUSATSDK_H
+#define HOST_ARDUSATSDK_H
+#include <Arduino.h>
+#include <Wire.h>
+
+typedef struct {
+  uint8_t type;
+  uint8_t id;
+  uint32_t timestamp;
+} _header_t;
+
+typedef struct { _header_t header; float x, y, z; } acceleration_t;
+typedef struct { _header_t header; float x, y, z; } magnetic_t;
+typedef struct { _header_t header; float x, y, z; } gyro_t;
+typedef struct { _header_t header; float t; } temperature_t;
+typedef struct { _header_t header; float lux; } luminosity_t;
+typedef struct { _header_t header; float uvindex; } uvlight_t;
+typedef struct { _header_t header; float roll, pitch, heading; } orientation_t;
+typedef struct { _header_t header; float pressure; } pressure_t;
+
+extern char *_output_buffer;
+extern int OUTPUT_BUF_SIZE;
+char *_getOutBuf();
+void _resetOutBuf();
+#endif  // HOST_ARDUSATSDK_H
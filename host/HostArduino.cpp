@@ -0,0 +1,144 @@
+/*
+ * Arduino core, Wire and ArdusatSDK pieces for host builds, see Arduino.h.
+ */
+#include <time.h>
+#include <Arduino.h>
+#include <Wire.h>
+#include <ArdusatSDK.h>
+#include <utility/MemoryFree.h>
+
+uint64_t hostNanos = 0;
+HardwareSerial Serial;
+TwoWire Wire;
+TwoWire Wire1;
+
+unsigned long millis()
+{
+  return hostNanos / 1000000;
+}
+
+unsigned long micros()
+{
+  return hostNanos / 1000;
+}
+
+void delay(unsigned long ms)
+{
+  hostNanos += 1000000ULL * ms;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  hostNanos += 1000ULL * us;
+}
+
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return HIGH; }
+void noInterrupts() {}
+void interrupts() {}
+void yield() {}
+
+size_t Print::print(long v, int base)
+{
+  if (v < 0 && base == DEC) {
+    return print('-') + print((unsigned long) -v, base);
+  }
+  return print((unsigned long) v, base);
+}
+
+size_t Print::print(unsigned long v, int base)
+{
+  char buf[8 * sizeof(long) + 1];
+  char *p = buf + sizeof(buf) - 1;
+
+  if (base < 2) {
+    base = DEC;
+  }
+  *p = '\0';
+  do {
+    *--p = "0123456789ABCDEF"[v % base];
+    v /= base;
+  } while (v);
+  return write(p);
+}
+
+size_t Print::print(double v, int digits)
+{
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), "%.*f", digits, v);
+  return write(buf);
+}
+
+/*
+ * Stands in for utility/MemoryFree.cpp, which reads the AVR heap; the host
+ * has the 8 KB of an Arduino Mega free.
+ */
+int freeMemory()
+{
+  return 8192;
+}
+
+/*
+ * DS1307 registers 0 to 6 hold the time in BCD. The clock starts at the host
+ * time and runs on simulated time.
+ */
+static uint8_t _bcd(int v)
+{
+  return (v / 10) << 4 | v % 10;
+}
+
+size_t TwoWire::write(uint8_t b)
+{
+  hostNanos += 90000;
+  if (m_first) {
+    m_reg = b;
+  }
+  m_first = false;
+  return 1;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t addr, uint8_t n)
+{
+  static time_t start = time(NULL);
+  time_t now = start + hostNanos / 1000000000ULL;
+  struct tm t;
+  uint8_t regs[7];
+
+  m_pos = m_len = 0;
+  if (addr != 0X68) {
+    return 0;
+  }
+  gmtime_r(&now, &t);
+  regs[0] = _bcd(t.tm_sec);
+  regs[1] = _bcd(t.tm_min);
+  regs[2] = _bcd(t.tm_hour);
+  regs[3] = t.tm_wday + 1;
+  regs[4] = _bcd(t.tm_mday);
+  regs[5] = _bcd(t.tm_mon + 1);
+  regs[6] = _bcd(t.tm_year % 100);
+  for (m_len = 0; m_len < n && m_len < sizeof(m_buf); m_len++) {
+    m_buf[m_len] = m_reg + m_len < 7 ? regs[m_reg + m_len] : 0;
+  }
+  hostNanos += 90000ULL * (m_len + 1);
+  return m_len;
+}
+
+/*
+ * The SDK's output buffer; beginDataLog() points it into the SD cache.
+ */
+char *_output_buffer = NULL;
+int OUTPUT_BUF_SIZE = 0;
+
+char *_getOutBuf()
+{
+  return _output_buffer;
+}
+
+void _resetOutBuf()
+{
+  if (_output_buffer != NULL) {
+    memset(_output_buffer, 0, OUTPUT_BUF_SIZE);
+  }
+}
@@ -0,0 +1,5 @@
+/* SPI for host builds: the SD card is simulated by utility/SdSpiHost.cpp. */
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+#include <Arduino.h>
+#endif  // HOST_SPI_H
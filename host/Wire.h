@@ -0,0 +1,37 @@
+/*
+ * I2C for host builds: a DS1307 RTC at address 0X68 that keeps the host's
+ * simulated time, starting from the host clock at start up.  Each byte
+ * transferred takes 90 us of simulated time, as at 100 kHz.
+ */
+#ifndef HOST_WIRE_H
+#define HOST_WIRE_H
+#include <Arduino.h>
+
+class TwoWire {
+ public:
+  TwoWire() : m_reg(0), m_pos(0), m_len(0), m_addr(0), m_first(false) {}
+  void begin() {}
+  void beginTransmission(uint8_t addr) {
+    m_addr = addr;
+    m_first = true;
+  }
+  size_t write(uint8_t b);
+  uint8_t endTransmission(bool stop = true) {
+    (void)stop;
+    return m_addr == 0X68 ? 0 : 2;
+  }
+  uint8_t requestFrom(uint8_t addr, uint8_t n);
+  int available() { return m_len - m_pos; }
+  int read() { return m_pos < m_len ? m_buf[m_pos++] : -1; }
+
+ private:
+  uint8_t m_reg;
+  uint8_t m_pos;
+  uint8_t m_len;
+  uint8_t m_addr;
+  bool m_first;
+  uint8_t m_buf[32];
+};
+extern TwoWire Wire;
+extern TwoWire Wire1;
+#endif  // HOST_WIRE_H
@@ -0,0 +1,4 @@
+/*
+ * The SdFat iostream classes need ios.h and iostream.h, which are not in this
+ * tree; the logging library does not use them, so host builds leave them out.
+ */
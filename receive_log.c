@@ -0,0 +1,405 @@
+/**
+ * @file   receive_log.c
+ * @brief  Downloads log files from a logger running serveLogDump over a
+ *         serial port.
+ *
+ *         Each file is requested with "D <file> <first block>", and the
+ *         blocks that come back in dump frames (see BinaryDataFmt.h) with a
+ *         good CRC are written to a local file of the same name. Blocks that
+ *         don't arrive are requested again, and a download that was cut off
+ *         resumes after the last whole block of the local file.
+ */
+#ifndef ARDUINO
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "utility/BinaryDataFmt.h"
+
+#define FRAME_MAX (ARDUSAT_DUMP_OVERHEAD + 512)
+
+static struct option cli_options[] = {
+  { "baud", required_argument, NULL, 'b' },
+  { "list", no_argument, NULL, 'l' },
+  { "output-dir", required_argument, NULL, 'o' },
+  { "retries", required_argument, NULL, 'r' },
+  { "timeout", required_argument, NULL, 't' },
+  { "help", no_argument, NULL, 'h' },
+  { 0, 0, 0, 0}
+};
+
+void print_usage(char *argv [])
+{
+  printf("Downloads log files from a logger running serveLogDump.\n");
+  printf("usage: %s [options] PORT [FILE...]\n", argv[0]);
+  printf("PORT is the logger's serial port, e.g. /dev/ttyUSB0. FILE is a file name\n");
+  printf("in /data on the card, e.g. MYDATA0.BIN, which is saved under the same name.\n");
+  printf("Options:\n");
+  printf("  -b,--baud BAUD                 Serial baud rate (default: 115200)\n");
+  printf("  -l,--list                      List the log files on the card\n");
+  printf("  -o,--output-dir DIR            Save files to DIR (default: .)\n");
+  printf("  -r,--retries N                 Times to request missing blocks again\n");
+  printf("                                 (default: 5)\n");
+  printf("  -t,--timeout MS                Give up on a reply after MS ms without\n");
+  printf("                                 data (default: 2000)\n");
+  printf("  -h,--help                      Print this usage info.\n");
+}
+
+#define err_print_usage(err) err; print_usage(argv); return -1
+
+static int timeout_ms = 2000;
+
+/*
+ * CRC-CCITT (polynomial 0x1021), the CRC used by the dump frames.
+ */
+static uint16_t crc_ccitt(uint16_t crc, const uint8_t *data, size_t n)
+{
+  uint8_t i;
+
+  while (n--) {
+    crc ^= (uint16_t) *data++ << 8;
+    for (i = 0; i < 8; i++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/*
+ * Sets a serial port to raw mode at the given baud rate. Other inputs, such
+ * as pipes and ptys used for testing, are left alone.
+ *
+ * @return 0 if successful, -1 if the baud rate isn't supported
+ */
+static int setup_port(int fd, long baud)
+{
+  static const struct { long baud; speed_t speed; } speeds[] = {
+    { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+    { 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+#ifdef B460800
+    { 460800, B460800 }, { 500000, B500000 }, { 921600, B921600 },
+    { 1000000, B1000000 }, { 2000000, B2000000 },
+#endif
+  };
+  struct termios tio;
+  size_t i;
+
+  for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]) &&
+       speeds[i].baud != baud; i++);
+  if (i == sizeof(speeds) / sizeof(speeds[0])) {
+    return -1;
+  }
+  if (!isatty(fd) || tcgetattr(fd, &tio) != 0) {
+    return 0;
+  }
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, speeds[i].speed);
+  cfsetospeed(&tio, speeds[i].speed);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tcsetattr(fd, TCSANOW, &tio);
+  tcflush(fd, TCIFLUSH);
+  return 0;
+}
+
+typedef struct {
+  int fd;
+  uint8_t buf[2 * FRAME_MAX];
+  size_t len;
+} port_t;
+
+/*
+ * Reads more bytes from the port into its buffer.
+ *
+ * @return number of bytes read, 0 on timeout, -1 on error
+ */
+static int port_fill(port_t *p)
+{
+  struct pollfd pfd = { p->fd, POLLIN, 0 };
+  ssize_t n;
+
+  if (p->len == sizeof(p->buf)) {
+    return -1;
+  }
+  if (poll(&pfd, 1, timeout_ms) <= 0) {
+    return 0;
+  }
+  n = read(p->fd, p->buf + p->len, sizeof(p->buf) - p->len);
+  if (n <= 0) {
+    return -1;
+  }
+  p->len += n;
+  return n;
+}
+
+static void port_drop(port_t *p, size_t n)
+{
+  p->len -= n;
+  memmove(p->buf, p->buf + n, p->len);
+}
+
+static int port_send(port_t *p, const char *line)
+{
+  size_t n = strlen(line);
+
+  return write(p->fd, line, n) == (ssize_t) n ? 0 : -1;
+}
+
+/*
+ * Reads the next dump frame with a good CRC, skipping any other bytes, such
+ * as text the sketch prints.
+ *
+ * @return data length of the frame, -1 on timeout or error
+ */
+static int read_frame(port_t *p, uint32_t *block, uint8_t *data)
+{
+  uint16_t n;
+  size_t frame;
+
+  while (1) {
+    while (p->len >= 8) {
+      n = p->buf[6] | (p->buf[7] << 8);
+      if (p->buf[0] != ARDUSAT_STREAM_SYNC0 || p->buf[1] != ARDUSAT_DUMP_SYNC1 ||
+          n > 512) {
+        port_drop(p, 1);
+        continue;
+      }
+      frame = n + ARDUSAT_DUMP_OVERHEAD;
+      if (p->len < frame) {
+        break;
+      }
+      if (crc_ccitt(0, p->buf + 2, frame - 4) !=
+          (p->buf[frame - 2] | (p->buf[frame - 1] << 8))) {
+        port_drop(p, 1);
+        continue;
+      }
+      *block = p->buf[2] | (p->buf[3] << 8) | (p->buf[4] << 16) |
+               ((uint32_t) p->buf[5] << 24);
+      memcpy(data, p->buf + 8, n);
+      port_drop(p, frame);
+      return n;
+    }
+    if (port_fill(p) <= 0) {
+      return -1;
+    }
+  }
+}
+
+/*
+ * Prints the files the logger lists.
+ *
+ * @return 0 if the list was received, -1 otherwise
+ */
+static int list_files(port_t *p)
+{
+  uint8_t *nl;
+  size_t n;
+
+  if (port_send(p, "L\n") != 0) {
+    return -1;
+  }
+  while (1) {
+    while ((nl = memchr(p->buf, '\n', p->len)) != NULL) {
+      n = nl - p->buf + 1;
+      if (n <= 2) {
+        port_drop(p, n);
+        return 0;
+      }
+      fwrite(p->buf, 1, n, stdout);
+      port_drop(p, n);
+    }
+    if (port_fill(p) <= 0) {
+      return -1;
+    }
+  }
+}
+
+/*
+ * Requests count blocks of name from first on and writes the blocks that
+ * arrive to fd, marking them in have.
+ *
+ * @return file size, -1 if the logger didn't answer, -2 if it can't send
+ *         the file
+ */
+static long request_blocks(port_t *p, const char *name, uint32_t first,
+                           uint32_t count, int fd, uint8_t **have,
+                           uint32_t *blocks)
+{
+  char line[64];
+  uint8_t data[512];
+  uint32_t block, size = 0, total;
+  int n;
+
+  snprintf(line, sizeof(line), "D %s %u %u\n", name, first, count);
+  if (port_send(p, line) != 0) {
+    return -1;
+  }
+  while ((n = read_frame(p, &block, data)) >= 0 && block != ARDUSAT_DUMP_INFO);
+  if (n != 4) {
+    return n < 0 ? -1 : -2;
+  }
+  memcpy(&size, data, 4);
+  total = (size + 511) >> 9;
+  if (total > *blocks) {
+    *have = realloc(*have, total);
+    memset(*have + *blocks, 0, total - *blocks);
+  }
+  *blocks = total;
+
+  while (first < total && count > 0 && (n = read_frame(p, &block, data)) >= 0) {
+    if (block == ARDUSAT_DUMP_INFO || block >= total) {
+      continue;
+    }
+    if (pwrite(fd, data, n, (off_t) block << 9) != n) {
+      return -1;
+    }
+    (*have)[block] = 1;
+    if (block - first + 1 >= count || block + 1 == total) {
+      break;
+    }
+  }
+  return size;
+}
+
+static uint32_t count_missing(const uint8_t *have, uint32_t blocks)
+{
+  uint32_t i, missing = 0;
+
+  for (i = 0; i < blocks; i++) {
+    missing += !have[i];
+  }
+  return missing;
+}
+
+/*
+ * Downloads one file, resuming after the whole blocks of an earlier,
+ * partial download, then requests the runs of blocks that didn't arrive
+ * again until none are missing or retries requests in a row brought none.
+ *
+ * @return 0 if the whole file was received, -1 otherwise
+ */
+static int receive_file(port_t *p, const char *name, const char *dir,
+                        int retries)
+{
+  char path[4096];
+  const char *base = strrchr(name, '/') != NULL ? strrchr(name, '/') + 1 : name;
+  struct stat st;
+  int existed;
+  uint8_t *have = NULL;
+  uint32_t blocks = 0, resume, missing, first, end, i;
+  long size = -1;
+  int fd, round;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, base);
+  existed = stat(path, &st) == 0;
+  if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Could not open %s for writing.\n", path);
+    return -1;
+  }
+  resume = st.st_size >> 9;
+
+  for (round = 0; size == -1 && round <= retries; round++) {
+    size = request_blocks(p, name, resume, 0xFFFFFFFFU, fd, &have, &blocks);
+  }
+  if (size < 0) {
+    fprintf(stderr, size == -1 ? "%s: no answer from the logger\n"
+                               : "%s: the logger can't send it\n", name);
+    close(fd);
+    free(have);
+    if (!existed) {
+      unlink(path);
+    }
+    return -1;
+  }
+  for (i = 0; i < resume && i < blocks; i++) {
+    have[i] = 1;
+  }
+
+  round = 0;
+  while ((missing = count_missing(have, blocks)) > 0 && round < retries) {
+    for (first = 0; have[first]; first++);
+    for (end = first; end < blocks && !have[end]; end++);
+    request_blocks(p, name, first, end - first, fd, &have, &blocks);
+    round = count_missing(have, blocks) < missing ? 0 : round + 1;
+  }
+
+  if (ftruncate(fd, size) != 0) {
+    missing = blocks;
+  }
+  close(fd);
+  free(have);
+  printf("%s: %u of %u blocks, %ld bytes\n", path, blocks - missing, blocks,
+         size);
+  return missing == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+  long baud = 115200;
+  int list = 0;
+  int retries = 5;
+  char *dir = ".";
+  port_t port;
+  int c, ret = 0;
+
+  while ((c = getopt_long(argc, argv, "b:lo:r:t:h", cli_options, NULL)) != -1) {
+    switch (c) {
+      case 'b':
+        baud = atol(optarg);
+        break;
+      case 'l':
+        list = 1;
+        break;
+      case 'o':
+        dir = optarg;
+        break;
+      case 'r':
+        retries = atoi(optarg);
+        break;
+      case 't':
+        timeout_ms = atoi(optarg);
+        if (timeout_ms < 1) {
+          err_print_usage(printf("Invalid timeout given.\n"));
+        }
+        break;
+      case 'h':
+        print_usage(argv);
+        return 0;
+      default:
+        err_print_usage();
+    }
+  }
+  if (optind == argc) {
+    err_print_usage(printf("You need to provide a serial port!!!\n"));
+  }
+
+  memset(&port, 0, sizeof(port));
+  port.fd = open(argv[optind], O_RDWR | O_NOCTTY);
+  if (port.fd < 0) {
+    err_print_usage(printf("Could not open serial port %s.\n", argv[optind]));
+  }
+  if (setup_port(port.fd, baud) != 0) {
+    err_print_usage(printf("Unsupported baud rate %ld.\n", baud));
+  }
+
+  if (list && list_files(&port) != 0) {
+    fprintf(stderr, "No file list received.\n");
+    ret = -1;
+  }
+  for (optind++; optind < argc; optind++) {
+    if (receive_file(&port, argv[optind], dir, retries) != 0) {
+      ret = -1;
+    }
+  }
+  close(port.fd);
+  return ret;
+}
+
+#endif /* ARDUINO */
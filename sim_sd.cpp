@@ -0,0 +1,357 @@
+/**
+ * @file   sim_sd.cpp
+ * @brief  Runs the logging library on the host against a simulated SD card,
+ *         to profile the block I/O each logging mode costs.
+ *
+ *         The library, SdFat and Sd2Card are built unchanged with the host
+ *         Arduino core in host/, whose SPI talks to a card simulated over a
+ *         FAT disk image (utility/SdSpiHost.cpp). Records are logged at a
+ *         fixed rate in simulated time and the card's counters are printed
+ *         for beginning the log, for the records and for ending the log:
+ *
+ *           mkfs.vfat -C card.img 65536
+ *           g++ -O2 -DARDUINO=160 -DARDUINO_ARCH_HOST -Ihost -I. -Iutility \
+ *             -o sim_sd sim_sd.cpp host/HostArduino.cpp ArdusatLogging.cpp \
+ *             utility/Sd2Card.cpp utility/SdSpiHost.cpp utility/SdVolume.cpp \
+ *             utility/SdBaseFile.cpp utility/SdFile.cpp utility/SdFat.cpp \
+ *             utility/SdBaseFilePrint.cpp utility/SdFatErrorPrint.cpp \
+ *             utility/FmtNumber.cpp utility/CompactRecord.cpp utility/Crc.cpp \
+ *             utility/RTClib.cpp
+ *           ./sim_sd -p every -s 16 card.img
+ *
+ *         Add -DLOG_STATS=1 to also print the library's logging statistics.
+ */
+#ifdef ARDUINO_ARCH_HOST
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <Arduino.h>
+#include "ArdusatLogging.h"
+#include "utility/SdSpiHost.h"
+
+typedef enum {
+  API_BYTES = 0,
+  API_CSV,
+  API_BINARY,
+} api_e;
+
+static const char *api_names[] = {"bytes", "csv", "binary"};
+static const char *policy_names[] = {"every", "records", "bytes", "millis", "block"};
+
+static struct option cli_options[] = {
+  { "api", required_argument, NULL, 'a' },
+  { "size", required_argument, NULL, 's' },
+  { "records", required_argument, NULL, 'n' },
+  { "rate", required_argument, NULL, 'r' },
+  { "sync", required_argument, NULL, 'p' },
+  { "interval", required_argument, NULL, 'i' },
+  { "queue", required_argument, NULL, 'q' },
+  { "high-rate", required_argument, NULL, 'H' },
+  { "burst", required_argument, NULL, 'b' },
+  { "timing", required_argument, NULL, 't' },
+  { "spi-tune", no_argument, NULL, 'T' },
+  { "help", no_argument, NULL, 'h' },
+  { 0, 0, 0, 0}
+};
+
+void print_usage(char *argv [])
+{
+  printf("Logs records to a simulated SD card and prints the block I/O it took.\n");
+  printf("usage: %s [options] IMAGE\n", argv[0]);
+  printf("IMAGE is a FAT disk image, e.g. made by mkfs.vfat -C card.img 65536\n");
+  printf("Options:\n");
+  printf("  -a,--api API                   bytes (logBytes), csv (logAcceleration) or\n");
+  printf("                                 binary (binaryLogAcceleration) (default: bytes)\n");
+  printf("  -s,--size BYTES                Record size for logBytes (default: 16)\n");
+  printf("  -n,--records N                 Records to log (default: 1000)\n");
+  printf("  -r,--rate HZ                   Records per second of simulated time\n");
+  printf("                                 (default: 100)\n");
+  printf("  -p,--sync POLICY               every, records, bytes, millis or block\n");
+  printf("                                 (default: every)\n");
+  printf("  -i,--interval N                Interval for the records, bytes and millis\n");
+  printf("                                 sync policies (default: 1)\n");
+  printf("  -q,--queue BYTES               Log through a queue of this size, serviced\n");
+  printf("                                 between records\n");
+  printf("  -H,--high-rate MB              Use a preallocated high-rate log of this size\n");
+  printf("  -b,--burst MS[:BYTES]          Write bursts every MS ms, with at most BYTES\n");
+  printf("                                 buffered, see setLogBurst\n");
+  printf("  -t,--timing SPEC               Card timing in us, e.g. write=1000,multiple=250,\n");
+  printf("                                 stop=500,read=100,erase=50000,stall=64:50000\n");
+  printf("                                 (a 50 ms stall every 64 block writes),\n");
+  printf("                                 divisor=4 (SCK divisors below 4 corrupt writes),\n");
+  printf("                                 idle=1000 (card idle this long after activity)\n");
+  printf("  -T,--spi-tune                  Tune the SPI clock at beginDataLog\n");
+  printf("  -h,--help                      Print this usage info.\n");
+}
+
+#define err_print_usage(err) err; print_usage(argv); return -1
+
+/*
+ * Parses key=value card timings into sdHostConfig.
+ */
+static bool parse_timing(char *spec)
+{
+  char *item;
+
+  for (item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+    char *value = strchr(item, '=');
+    uint32_t *field = NULL;
+
+    if (value == NULL) {
+      return false;
+    }
+    *value++ = '\0';
+    if (strcmp(item, "read") == 0) {
+      field = &sdHostConfig.readMicros;
+    } else if (strcmp(item, "write") == 0) {
+      field = &sdHostConfig.writeMicros;
+    } else if (strcmp(item, "multiple") == 0) {
+      field = &sdHostConfig.multipleMicros;
+    } else if (strcmp(item, "stop") == 0) {
+      field = &sdHostConfig.stopMicros;
+    } else if (strcmp(item, "erase") == 0) {
+      field = &sdHostConfig.eraseMicros;
+    } else if (strcmp(item, "divisor") == 0) {
+      field = &sdHostConfig.minDivisor;
+    } else if (strcmp(item, "idle") == 0) {
+      field = &sdHostConfig.idleMicros;
+    } else if (strcmp(item, "stall") == 0) {
+      if (sscanf(value, "%u:%u", &sdHostConfig.stallEvery,
+                 &sdHostConfig.stallMicros) != 2) {
+        return false;
+      }
+      continue;
+    } else {
+      return false;
+    }
+    *field = strtoul(value, NULL, 10);
+  }
+  return true;
+}
+
+/*
+ * Prints the card counters for one phase of the run, and per record if
+ * records is nonzero.
+ */
+static void print_phase(const char *name, SdHostStats *start, uint64_t nanos,
+                        unsigned long records)
+{
+  uint32_t reads = sdHostStats.blockReads - start->blockReads;
+  uint32_t writes = sdHostStats.blockWrites - start->blockWrites;
+  uint32_t commands = sdHostStats.commands - start->commands;
+
+  printf("%-8s %9u %9u %9u %9u %9u %10.1f %10.1f\n", name, commands, reads, writes,
+         sdHostStats.singleWrites - start->singleWrites,
+         sdHostStats.multipleWrites - start->multipleWrites,
+         (sdHostStats.busyMicros - start->busyMicros) / 1000.0,
+         (hostNanos - nanos) / 1000000.0);
+  if (records > 0) {
+    printf("%-8s %9.2f %9.2f %9.2f\n", "/record", (double) commands / records,
+           (double) reads / records, (double) writes / records);
+  }
+  *start = sdHostStats;
+}
+
+static int log_one(api_e api, unsigned char *record, unsigned char size)
+{
+  static acceleration_t accel;
+
+  accel.header.timestamp = millis();
+  accel.x += 0.01;
+  accel.y -= 0.01;
+  accel.z = 9.81;
+  switch (api) {
+    case API_CSV:
+      return logAcceleration("accel", accel);
+    case API_BINARY:
+      return binaryLogAcceleration(0, accel);
+    case API_BYTES:
+    default:
+      record[0] = accel.header.timestamp;
+      return logBytes(record, size);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  api_e api = API_BYTES;
+  unsigned int size = 16;
+  unsigned long records = 1000;
+  unsigned long rate = 100;
+  int policy = LOG_SYNC_EVERY_RECORD;
+  unsigned long interval = 1;
+  unsigned int queue = 0;
+  unsigned long high_rate = 0;
+  unsigned long burst = 0;
+  unsigned int burst_bytes = 0;
+  uint32_t begin_wakeups, begin_busy, begin_spi;
+  double active_ms;
+  unsigned char record[255];
+  unsigned long i, logged = 0, bytes = 0;
+  uint64_t period, next, nanos;
+  SdHostStats start;
+  log_config_t config;
+  uint32_t begin_writes;
+  int c;
+  bool ok;
+
+  while ((c = getopt_long(argc, argv, "a:s:n:r:p:i:q:H:b:t:Th", cli_options, NULL)) != -1) {
+    switch (c) {
+      case 'a':
+        for (i = 0; i < 3 && strcmp(optarg, api_names[i]) != 0; i++);
+        if (i == 3) {
+          err_print_usage(printf("Invalid api given.\n"));
+        }
+        api = (api_e) i;
+        break;
+      case 's':
+        size = atoi(optarg);
+        if (size < 1 || size > sizeof(record)) {
+          err_print_usage(printf("Invalid record size given.\n"));
+        }
+        break;
+      case 'n':
+        records = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        rate = strtoul(optarg, NULL, 10);
+        if (rate == 0) {
+          err_print_usage(printf("Invalid rate given.\n"));
+        }
+        break;
+      case 'p':
+        for (i = 0; i < 5 && strcmp(optarg, policy_names[i]) != 0; i++);
+        if (i == 5) {
+          err_print_usage(printf("Invalid sync policy given.\n"));
+        }
+        policy = i;
+        break;
+      case 'i':
+        interval = strtoul(optarg, NULL, 10);
+        break;
+      case 'q':
+        queue = atoi(optarg);
+        break;
+      case 'H':
+        high_rate = strtoul(optarg, NULL, 10) << 20;
+        break;
+      case 'b':
+        if (sscanf(optarg, "%lu:%u", &burst, &burst_bytes) < 1 || burst == 0) {
+          err_print_usage(printf("Invalid burst interval given.\n"));
+        }
+        break;
+      case 't':
+        if (!parse_timing(optarg)) {
+          err_print_usage(printf("Invalid card timing given.\n"));
+        }
+        break;
+      case 'T':
+        setLogSpiTuning(true);
+        break;
+      case 'h':
+        print_usage(argv);
+        return 0;
+      default:
+        err_print_usage();
+    }
+  }
+
+  if (optind >= argc) {
+    err_print_usage(printf("You need to provide a disk image!!!\n"));
+  }
+  if (!sdHostOpen(argv[optind])) {
+    printf("Could not open disk image %s.\n", argv[optind]);
+    return -1;
+  }
+  memset(record, 0XA5, sizeof(record));
+
+  if (!setLogSyncPolicy((log_sync_policy_e) policy, interval) ||
+      (queue > 0 && !setLogQueueSize(queue)) ||
+      !setLogBurst(burst, burst_bytes)) {
+    printf("Invalid sync policy, queue size or burst.\n");
+    return -1;
+  }
+
+  printf("%-8s %9s %9s %9s %9s %9s %10s %10s\n", "", "commands", "reads",
+         "writes", "single", "multiple", "busy ms", "time ms");
+  start = sdHostStats;
+  nanos = hostNanos;
+  if (high_rate > 0) {
+    ok = beginHighRateDataLog(SS, "SIM", api == API_CSV, high_rate);
+  } else {
+    ok = beginDataLog(SS, "SIM", api == API_CSV);
+  }
+  if (!ok) {
+    printf("Could not begin the log.\n");
+    return -1;
+  }
+  print_phase("begin", &start, nanos, 0);
+  getLogConfig(&config);
+  begin_writes = sdHostStats.blockWrites;
+  begin_wakeups = sdHostStats.wakeups;
+  begin_busy = sdHostStats.busyMicros;
+  begin_spi = sdHostStats.spiBytes;
+  resetLogStats();
+
+  nanos = hostNanos;
+  period = 1000000000ULL / rate;
+  next = hostNanos;
+  for (i = 0; i < records; i++) {
+    int ret;
+
+    // wait for the next sample, servicing the queue every 100 us meanwhile
+    while (hostNanos < next) {
+      serviceDataLog();
+      hostNanos = next - hostNanos > 100000 && queue > 0 ? hostNanos + 100000 : next;
+    }
+    if (burst > 0) {
+      serviceDataLog();
+    }
+    next += period;
+
+    ret = log_one(api, record, size);
+    if (ret > 0) {
+      logged++;
+      bytes += ret;
+    }
+  }
+  print_phase("log", &start, nanos, logged);
+
+  nanos = hostNanos;
+  endDataLog();
+  print_phase("end", &start, nanos, 0);
+
+  printf("\n%s, %s sync, %lu of %lu records logged, %lu bytes\n",
+         high_rate > 0 ? "high-rate" : (queue > 0 ? "queued" : "file"),
+         burst > 0 ? "burst" : (high_rate > 0 ? "no" : policy_names[policy]),
+         logged, records, bytes);
+  if (bytes > 0) {
+    printf("%.2f bytes written to the card per byte logged after begin\n",
+           (sdHostStats.blockWrites - begin_writes) * 512.0 / bytes);
+  }
+  // the card draws its active current while it transfers or is busy
+  active_ms = (sdHostStats.busyMicros - begin_busy) / 1000.0 +
+              (sdHostStats.spiBytes - begin_spi) * 8.0 * config.spiDivisor /
+              sdHostConfig.cpuHz * 1000.0;
+  printf("card active %.1f ms in %u wakeups after begin", active_ms,
+         sdHostStats.wakeups - begin_wakeups);
+  if (active_ms > 0) {
+    printf(", %.0f bytes logged per active ms", bytes / active_ms);
+  }
+  printf("\n");
+  printf("SPI clock F_CPU/%u\n", config.spiDivisor);
+  if (sdHostStats.erases > 0) {
+    printf("%u erase commands, %u blocks erased\n", sdHostStats.erases,
+           sdHostStats.erasedBlocks);
+  }
+#if LOG_STATS
+  printLogStats(&Serial);
+#endif  // LOG_STATS
+  sdHostClose();
+  return logged == records ? 0 : 1;
+}
+
+#endif  // ARDUINO_ARCH_HOST
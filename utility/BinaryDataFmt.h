@@ -22,10 +22,232 @@ typedef enum {
   ARDUSAT_SENSOR_TYPE_LUMINOSITY,
   ARDUSAT_SENSOR_TYPE_UV,
   ARDUSAT_SENSOR_TYPE_PRESSURE,
+  ARDUSAT_SENSOR_TYPE_FRAME,
+  // types from here up to ARDUSAT_RECORD_TYPE_MASK are free for custom
+  // records, see BinaryRecord.h
+  ARDUSAT_SENSOR_TYPE_CUSTOM,
 } ardusat_sensor_types_e;
 
 #define _bin_data_header uint8_t type; uint8_t id; uint32_t timestamp;
 
+/**
+ * The first byte of every record holds the sensor type in its low 5 bits and
+ * the record encoding in its high 3 bits. The float structs below use
+ * encoding 0, so their type byte is just the sensor type. A first byte of
+ * 0xFF starts a control record such as the RTC timestamp marker.
+ */
+#define ARDUSAT_RECORD_TYPE_MASK      0x1F
+#define ARDUSAT_RECORD_ENCODING_MASK  0xE0
+#define ARDUSAT_RECORD_FLOAT          0x00
+#define ARDUSAT_RECORD_INT16          0x20
+#define ARDUSAT_RECORD_COMPACT_DELTA  0x40
+#define ARDUSAT_RECORD_COMPACT_KEY    0x60
+#define ARDUSAT_RECORD_SUMMARY        0x80
+#define ARDUSAT_RECORD_CONTROL        0xE0
+
+/**
+ * Control records start with 0xFF and a subtype byte. The RTC timestamp
+ * marker is [0xFF][0xFF][uint32 unixtime][uint32 millis]; all other control
+ * records are [0xFF][subtype][uint8 length][length bytes], so decoders can
+ * skip subtypes they don't know.
+ */
+#define ARDUSAT_CONTROL_TIMESTAMP     0xFF
+#define ARDUSAT_CONTROL_INT16_SCALES  0xFE
+#define ARDUSAT_CONTROL_FILE_HEADER   0xFD
+#define ARDUSAT_CONTROL_RECORD_TYPE   0xFC
+#define ARDUSAT_CONTROL_SENSOR_NAME   0xFB
+#define ARDUSAT_CONTROL_EPOCH         0xFA
+#define ARDUSAT_CONTROL_DEADBAND      0xF9
+#define ARDUSAT_CONTROL_INDEX         0xF8
+
+/**
+ * Record timestamps are 32 bit millis() values, which wrap after 49.7 days.
+ * Epoch control records anchor them on a 64 bit timeline: the body is
+ * [uint16 epoch][uint32 millis], meaning millis() read `millis` after
+ * wrapping `epoch` times. A record's 64 bit time is the anchor's plus the
+ * signed 32 bit difference between the record's timestamp and `millis`, so
+ * it is exact within 24 days either side of the anchor. Binary logs write an
+ * anchor at the start of the file and whenever the top two bits of millis()
+ * change, i.e. at every wrap and every 12.4 days in between.
+ */
+#define ARDUSAT_EPOCH_SHIFT           30
+
+/**
+ * Index control records, [uint16 epoch][uint32 millis][uint32 offset]
+ * [uint16 CRC-CCITT], are written every LOG_INDEX_INTERVAL bytes of a
+ * binary log. The epoch and millis are an epoch anchor for the time the
+ * record was written, the offset is the record's own position in the file,
+ * and the CRC covers the record up to it, [0xFF][0xF8][12] included. A
+ * decoder can look for one from any position in the file, check it by its
+ * offset and CRC, and start decoding there: the records before it were
+ * logged no later than its time, and compact streams restart with key
+ * records after it. Together with the file header, that is enough to
+ * binary search a log for a time range.
+ */
+#define ARDUSAT_INDEX_SIZE            15
+
+/**
+ * Deadband control records, [uint8 sensor type][uint8 sensor id]
+ * [uint32 heartbeat ms], mark a sensor whose readings are only logged when
+ * they change (see setLogDeadband), but at least once per heartbeat if it
+ * is nonzero. Until the next reading of the sensor its value is that of the
+ * last reading, so decoders can forward fill a regular series. Binary logs
+ * write one in the file header for every such sensor.
+ */
+
+/**
+ * In block framed logs (see setLogBlockFraming) every 512 byte block of the
+ * file starts with this header, and the records continue in the rest of the
+ * block, spanning block boundaries as usual:
+ *
+ * [0xFA][uint8 block number & 0xFF][uint16 first-record offset]
+ * [uint16 bytes used in the block][uint16 CRC-CCITT]
+ *
+ * The first-record offset is where the first record that starts in the
+ * block begins, 0 if none does. The CRC covers the first 6 header bytes and
+ * the used bytes after the header. A decoder can check each block on its
+ * own, drop damaged ones and pick up again at the first record of the next
+ * good block.
+ */
+#define ARDUSAT_BLOCK_MAGIC           0xFA
+#define ARDUSAT_BLOCK_HEADER_SIZE     8
+
+/**
+ * Records teed to a serial port (see setLogSerialTee) are sent one per
+ * frame, so a host joining mid-stream or losing bytes can find the next
+ * record again:
+ *
+ * [0xA5][0x5A][uint8 record length][record][uint16 CRC-CCITT]
+ *
+ * The CRC covers the length byte and the record.
+ */
+#define ARDUSAT_STREAM_SYNC0          0xA5
+#define ARDUSAT_STREAM_SYNC1          0x5A
+#define ARDUSAT_STREAM_OVERHEAD       5
+
+/**
+ * Log files downloaded with serveLogDump are sent one block per frame:
+ *
+ * [0xA5][0xDB][uint32 block number][uint16 length][data][uint16 CRC-CCITT]
+ *
+ * The CRC covers the block number, length and data. The data is the 512
+ * bytes of the block, fewer for the last block of the file. A request is
+ * answered with an info frame, block number 0xFFFFFFFF with the uint32 file
+ * size as its data (no data if the file can't be sent), followed by the
+ * requested blocks in order.
+ */
+#define ARDUSAT_DUMP_SYNC1            0xDB
+#define ARDUSAT_DUMP_INFO             0xFFFFFFFFUL
+#define ARDUSAT_DUMP_OVERHEAD         10
+
+/**
+ * Binary log files start with a file header control record, whose body is
+ * the magic "ADS", the format version and, from version 2, a flags byte
+ * (ARDUSAT_FILE_RECORD_CRC, ARDUSAT_FILE_OPEN). It is followed by one record type control
+ * record for every record type the log may contain:
+ *
+ * [record type byte][record size][field type][field count]
+ * [name and field names, comma separated, e.g. "acceleration,x,y,z"]
+ *
+ * The record size counts all bytes of the record including the type byte,
+ * or is 0 for variable sized records (compact and frame records). Fixed size
+ * records other than frames are laid out as [type][id][uint32 timestamp]
+ * followed by the fields, so decoders can decode, or at least skip, record
+ * types they don't know.
+ *
+ * Sensor name control records, [sensor type][sensor id][name], may follow
+ * anywhere in the log.
+ */
+#define ARDUSAT_FILE_MAGIC            "ADS"
+#define ARDUSAT_FILE_VERSION          2
+
+/**
+ * With this flag set in the file header (see setLogRecordCrc), every record
+ * of the file, the file header control record included, is followed by a
+ * CRC-8 (x^8 + x^2 + x + 1, initial value 0) of its bytes. A decoder can
+ * drop a record whose CRC doesn't match and carry on with the next one.
+ * Stream frames carry the CRC byte along with the record, but the record
+ * sizes of record type control records don't count it.
+ */
+#define ARDUSAT_FILE_RECORD_CRC       0x01
+
+/**
+ * Set in the file header of a preallocated log file while it is being
+ * written, and cleared when it is closed. A file that still has it lost
+ * power before it was closed, and is followed by erased blocks of its
+ * preallocation up to its size. Decoders ignore it.
+ */
+#define ARDUSAT_FILE_OPEN             0x02
+
+#define ARDUSAT_FIELD_FLOAT           1
+#define ARDUSAT_FIELD_INT16           2
+#define ARDUSAT_FIELD_ZIGZAG          3
+
+/**
+ * Number of values in the payload of each sensor type, indexed by
+ * ardusat_sensor_types_e.
+ */
+#define ARDUSAT_SENSOR_FIELD_COUNTS { 3, 3, 3, 3, 1, 1, 1, 1 }
+
+/**
+ * Compact records store values as fixed point integers, value * scale, with
+ * these scales per sensor type (indexed by ardusat_sensor_types_e):
+ * acceleration 0.001, magnetic 0.01, gyro 0.001, orientation 0.01,
+ * temperature 0.01, luminosity 0.1, UV 0.01, pressure 0.01.
+ *
+ * A key record is [0x60 | type][id][uint32 timestamp] followed by each value
+ * as a zigzag varint. A delta record is [0x40 | type][id] followed by the
+ * timestamp minus the previous timestamp of the same type and id as a
+ * varint, then each value minus the previous value as a zigzag varint.
+ * Varints are little endian base 128, with the high bit set on all but the
+ * last byte; zigzag maps signed n to (n << 1) ^ (n >> 31). A key record
+ * starts every stream, and every stream restarts with one after an RTC
+ * timestamp marker (so decoding may begin at any marker). In block framed
+ * logs and logs with record CRCs every stream also restarts at the first
+ * record that starts in each 512 byte block of the file, so that decoding
+ * can pick up again in the block after a damaged one.
+ */
+#define ARDUSAT_COMPACT_SCALES { 1000, 100, 1000, 100, 100, 10, 100, 100 }
+#define ARDUSAT_COMPACT_MAX_VALUES 3
+
+/**
+ * Int16 records are [0x20 | type][id][uint32 timestamp] followed by each
+ * value as a little endian int16, value * scale rounded and saturated to the
+ * int16 range. The scales used for a file are written once, right after the
+ * file is opened, as an ARDUSAT_CONTROL_INT16_SCALES control record holding
+ * one uint16 per sensor type (indexed by ardusat_sensor_types_e). These are
+ * the defaults, giving ranges of +-327 m/s^2, +-3276 uT, +-3276 deg/s,
+ * +-327 deg, +-327 C, 32767 lux, UV index 32 and 3276 hPa.
+ */
+#define ARDUSAT_INT16_SCALES { 100, 10, 10, 100, 100, 1, 1000, 10 }
+
+/**
+ * A frame record batches one reading of several sensors taken at the same
+ * time behind a single header:
+ *
+ * [ARDUSAT_SENSOR_TYPE_FRAME][presence mask][uint32 timestamp]
+ *
+ * Bit n of the presence mask is set if the frame holds a reading of sensor
+ * type n. The readings follow in ascending type order, each as the sensor id
+ * followed by its values as floats (ARDUSAT_SENSOR_FIELD_COUNTS of them).
+ */
+#define ARDUSAT_FRAME_HEADER_SIZE 6
+#define ARDUSAT_FRAME_MAX_SIZE (ARDUSAT_FRAME_HEADER_SIZE + 4 * (1 + 4) + 4 * (1 + 12))
+
+/**
+ * A summary record holds statistics of one sensor's readings over a window
+ * of time (see setLogAggregation) instead of the readings themselves:
+ *
+ * [0x80 | type][id][uint32 window start][float n][float min][float max]
+ * [float mean][float stddev]
+ *
+ * n is the number of readings in the window and stddev their sample
+ * standard deviation, 0 for a single reading. Only single value sensor types
+ * are summarized. Summary records are described in the file header like
+ * other fixed size records, named e.g. "temperature_stats".
+ */
+#define ARDUSAT_SUMMARY_FIELDS 5
+
 typedef struct {
 	_bin_data_header
 	float x;
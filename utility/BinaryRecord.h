@@ -0,0 +1,90 @@
+/**
+ * @file   BinaryRecord.h
+ * @brief  Compile-time descriptions of fixed size binary records.
+ *
+ *         A record type is described by its sensor type, field type and
+ *         field count, e.g.
+ *
+ *           typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_CUSTOM, int16_t, 4> PowerRecord;
+ *
+ *         which gives its type byte, size and header description as
+ *         constants, and a pack function that stores a record with sizes
+ *         known at compile time, so it compiles to straight-line stores.
+ *         Records are laid out as [type][id][uint32 timestamp][fields], see
+ *         BinaryDataFmt.h. logRecord and logRecordType in ArdusatLogging.h
+ *         log records and their descriptions.
+ */
+
+#ifndef BINARY_RECORD_H_
+#define BINARY_RECORD_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <utility/BinaryDataFmt.h>
+
+/**
+ * Encoding and header field type of each supported field type. Records of
+ * other field types don't compile.
+ */
+template <typename T> struct BinaryField;
+
+template <> struct BinaryField<float> {
+  static const uint8_t encoding = ARDUSAT_RECORD_FLOAT;
+  static const uint8_t fieldType = ARDUSAT_FIELD_FLOAT;
+};
+
+template <> struct BinaryField<int16_t> {
+  static const uint8_t encoding = ARDUSAT_RECORD_INT16;
+  static const uint8_t fieldType = ARDUSAT_FIELD_INT16;
+};
+
+template <uint8_t Type, typename Field, uint8_t Count>
+struct BinaryRecord {
+  typedef Field field_t;
+
+  /** first byte of the record: sensor type and encoding */
+  static const uint8_t typeByte = Type | BinaryField<Field>::encoding;
+  static const uint8_t fieldType = BinaryField<Field>::fieldType;
+  static const uint8_t count = Count;
+  /** record size including the type byte */
+  static const uint8_t size = 6 + sizeof(Field) * Count;
+
+  /**
+   * Stores a record at dst, which must have room for size bytes.
+   *
+   * @param dst where to store the record
+   * @param sensorId id of the sensor
+   * @param timestamp of the reading
+   * @param values count field values
+   */
+  static void pack(unsigned char *dst, uint8_t sensorId, uint32_t timestamp,
+                   const Field *values)
+  {
+    // the type must fit in the low 5 bits of the type byte and the record
+    // in a log call
+    typedef char type_fits[Type <= ARDUSAT_RECORD_TYPE_MASK ? 1 : -1];
+    typedef char size_fits[6 + sizeof(Field) * Count < 255 ? 1 : -1];
+    (void) sizeof(type_fits);
+    (void) sizeof(size_fits);
+
+    dst[0] = typeByte;
+    dst[1] = sensorId;
+    memcpy(dst + 2, &timestamp, 4);
+    memcpy(dst + 6, values, sizeof(Field) * Count);
+  }
+};
+
+/**
+ * Float records of the built-in sensor types, as logged by the binaryLog
+ * functions with the default encoding.
+ */
+typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_ACCELERATION, float, 3> AccelerationRecord;
+typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_MAGNETIC, float, 3> MagneticRecord;
+typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_GYRO, float, 3> GyroRecord;
+typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_ORIENTATION, float, 3> OrientationRecord;
+typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_TEMPERATURE, float, 1> TemperatureRecord;
+typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_LUMINOSITY, float, 1> LuminosityRecord;
+typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_UV, float, 1> UVLightRecord;
+typedef BinaryRecord<ARDUSAT_SENSOR_TYPE_PRESSURE, float, 1> PressureRecord;
+
+#endif /* BINARY_RECORD_H_ */
@@ -0,0 +1,256 @@
+/**
+ * @file   CompactRecord.cpp
+ * @brief  Encoder for the compact delta/varint binary record format described
+ *         in BinaryDataFmt.h.
+ *
+ *         Each stream (sensor type and id) remembers the timestamp and
+ *         fixed point values of its last record, so that the next record only
+ *         stores the differences. Streams that don't fit in the stream table
+ *         are written as key records every time.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include "CompactRecord.h"
+
+typedef struct compact_stream_t {
+  uint8_t type;
+  uint8_t id;
+  uint32_t timestamp;
+  int32_t values[ARDUSAT_COMPACT_MAX_VALUES];
+} compact_stream_t;
+
+// type value of an unused stream table entry
+#define COMPACT_STREAM_UNUSED 0xFF
+
+// keeps value deltas within 32 bits
+#define COMPACT_VALUE_LIMIT 0x3FFFFFFFL
+
+static const uint16_t compact_scales[] = ARDUSAT_COMPACT_SCALES;
+
+/**
+ * Allocates a stream table used to delta encode records.
+ *
+ * @param table table to set up, zeroed or set up before
+ * @param streamCount number of sensor type/id pairs to track
+ *
+ * @return true if successful, false if out of memory
+ */
+bool compactBegin(compact_table_t *table, uint8_t streamCount)
+{
+  compactEnd(table);
+  table->streams = (compact_stream_t *) malloc(streamCount * sizeof(compact_stream_t));
+  if (table->streams == NULL) {
+    return false;
+  }
+  table->count = streamCount;
+  compactReset(table);
+  return true;
+}
+
+/**
+ * Frees a stream table.
+ */
+void compactEnd(compact_table_t *table)
+{
+  free(table->streams);
+  table->streams = NULL;
+  table->count = 0;
+}
+
+/**
+ * Forgets all previous records, so the next record of every stream is a key
+ * record. Called whenever decoding needs to be able to start afresh, such as
+ * at RTC timestamp markers.
+ */
+void compactReset(compact_table_t *table)
+{
+  uint8_t i;
+
+  for (i = 0; i < table->count; i++) {
+    table->streams[i].type = COMPACT_STREAM_UNUSED;
+  }
+}
+
+static uint8_t *_put_varint(uint8_t *p, uint32_t n)
+{
+  while (n > 0x7F) {
+    *p++ = (n & 0x7F) | 0x80;
+    n >>= 7;
+  }
+  *p++ = n;
+  return p;
+}
+
+static uint8_t *_put_zigzag(uint8_t *p, int32_t n)
+{
+  return _put_varint(p, ((uint32_t) n << 1) ^ (uint32_t) (n >> 31));
+}
+
+static int32_t _to_fixed(float value, uint16_t scale)
+{
+  float q;
+
+  if (isnan(value)) {
+    return 0;
+  }
+  q = value * scale;
+  if (q > COMPACT_VALUE_LIMIT) {
+    return COMPACT_VALUE_LIMIT;
+  } else if (q < -COMPACT_VALUE_LIMIT) {
+    return -COMPACT_VALUE_LIMIT;
+  }
+  return q < 0 ? (int32_t) (q - 0.5f) : (int32_t) (q + 0.5f);
+}
+
+/*
+ * Finds the stream table entry for type and id, claiming an unused one for a
+ * new stream.
+ *
+ * @return the entry, or NULL if the stream isn't tracked
+ */
+static compact_stream_t *_find_stream(compact_table_t *table, uint8_t type,
+                                      uint8_t id, bool *is_new)
+{
+  compact_stream_t *unused = NULL;
+  uint8_t i;
+
+  for (i = 0; i < table->count; i++) {
+    if (table->streams[i].type == type && table->streams[i].id == id) {
+      *is_new = false;
+      return &table->streams[i];
+    }
+    if (unused == NULL && table->streams[i].type == COMPACT_STREAM_UNUSED) {
+      unused = &table->streams[i];
+    }
+  }
+  *is_new = true;
+  return unused;
+}
+
+/*
+ * Encodes a record of fixed point values, see compactEncode.
+ */
+static uint8_t _encode(compact_table_t *table, uint8_t *buf, uint8_t type,
+                       uint8_t id, uint32_t timestamp, const int32_t *q,
+                       uint8_t numValues)
+{
+  compact_stream_t *stream = NULL;
+  uint8_t *p = buf + 2;
+  bool key = true;
+  uint8_t i;
+
+  if (table != NULL) {
+    stream = _find_stream(table, type, id, &key);
+  }
+  // timestamps going backwards (e.g. millis() wrapping) restart the stream
+  if (stream != NULL && !key && timestamp < stream->timestamp) {
+    key = true;
+  }
+  key = key || stream == NULL;
+
+  buf[0] = type | (key ? ARDUSAT_RECORD_COMPACT_KEY : ARDUSAT_RECORD_COMPACT_DELTA);
+  buf[1] = id;
+  if (key) {
+    *p++ = timestamp;
+    *p++ = timestamp >> 8;
+    *p++ = timestamp >> 16;
+    *p++ = timestamp >> 24;
+  } else {
+    p = _put_varint(p, timestamp - stream->timestamp);
+  }
+
+  for (i = 0; i < numValues; i++) {
+    p = _put_zigzag(p, key ? q[i] : q[i] - stream->values[i]);
+    if (stream != NULL) {
+      stream->values[i] = q[i];
+    }
+  }
+
+  if (stream != NULL) {
+    stream->type = type;
+    stream->id = id;
+    stream->timestamp = timestamp;
+  }
+  return p - buf;
+}
+
+/**
+ * Encodes a record, as a delta against the previous record of the same
+ * sensor type and id where possible.
+ *
+ * @param table stream table of the log the record goes to, NULL to encode a
+ *        key record without one
+ * @param buf output buffer with room for COMPACT_RECORD_MAX_SIZE bytes
+ * @param type sensor type (ardusat_sensor_types_e)
+ * @param id sensor id
+ * @param timestamp record timestamp
+ * @param values record values
+ * @param numValues number of values, at most ARDUSAT_COMPACT_MAX_VALUES
+ *
+ * @return number of bytes in the encoded record
+ */
+uint8_t compactEncode(compact_table_t *table, uint8_t *buf, uint8_t type,
+                      uint8_t id, uint32_t timestamp, const float *values,
+                      uint8_t numValues)
+{
+  int32_t q[ARDUSAT_COMPACT_MAX_VALUES];
+  uint8_t i;
+
+  for (i = 0; i < numValues; i++) {
+    q[i] = _to_fixed(values[i], compact_scales[type]);
+  }
+  return _encode(table, buf, type, id, timestamp, q, numValues);
+}
+
+/**
+ * Re-encodes a key record made by compactEncode without a table against a
+ * stream table, giving the record compactEncode would have made with it.
+ * This lets a log encode records as they are logged, and decide where its
+ * streams restart when the records are written.
+ *
+ * @param table stream table of the log the record goes to
+ * @param buf output buffer with room for COMPACT_RECORD_MAX_SIZE bytes
+ * @param key the key record
+ * @param len size of the key record
+ *
+ * @return number of bytes in the encoded record, 0 if key isn't a compact
+ *         key record
+ */
+uint8_t compactReencode(compact_table_t *table, uint8_t *buf,
+                        const uint8_t *key, uint8_t len)
+{
+  const uint8_t *p = key + 6;
+  const uint8_t *end = key + len;
+  int32_t q[ARDUSAT_COMPACT_MAX_VALUES];
+  uint8_t type = key[0] & ARDUSAT_RECORD_TYPE_MASK;
+  uint8_t count = 0;
+  uint8_t shift;
+  uint32_t n;
+
+  if (len < 6 ||
+      (key[0] & ARDUSAT_RECORD_ENCODING_MASK) != ARDUSAT_RECORD_COMPACT_KEY ||
+      type >= sizeof(compact_scales) / sizeof(compact_scales[0])) {
+    return 0;
+  }
+  while (p < end) {
+    if (count == ARDUSAT_COMPACT_MAX_VALUES) {
+      return 0;
+    }
+    // a zigzag varint
+    n = 0;
+    for (shift = 0; p < end && shift < 35; shift += 7) {
+      n |= (uint32_t) (*p & 0x7F) << shift;
+      if (!(*p++ & 0x80)) {
+        break;
+      }
+    }
+    if (p[-1] & 0x80) {
+      return 0;
+    }
+    q[count++] = (int32_t) (n >> 1) ^ -(int32_t) (n & 1);
+  }
+  return _encode(table, buf, type, key[1],
+                 key[2] | ((uint32_t) key[3] << 8) | ((uint32_t) key[4] << 16) |
+                 ((uint32_t) key[5] << 24), q, count);
+}
@@ -0,0 +1,37 @@
+/**
+ * @file   CompactRecord.h
+ * @brief  Encoder for the compact delta/varint binary record format described
+ *         in BinaryDataFmt.h.
+ */
+
+#ifndef COMPACT_RECORD_H_
+#define COMPACT_RECORD_H_
+
+#include <stdint.h>
+#include <utility/BinaryDataFmt.h>
+
+/** Largest encoded record: header, 5 byte timestamp and 5 bytes per value */
+#define COMPACT_RECORD_MAX_SIZE (2 + 5 + 5 * ARDUSAT_COMPACT_MAX_VALUES)
+
+struct compact_stream_t;
+
+/**
+ * Stream table of an encoder: the last record of each sensor type and id
+ * tracked. Each log has its own; a zeroed table tracks no streams, so every
+ * record is a key record.
+ */
+typedef struct {
+  struct compact_stream_t *streams;
+  uint8_t count;
+} compact_table_t;
+
+bool compactBegin(compact_table_t *table, uint8_t streamCount);
+void compactEnd(compact_table_t *table);
+void compactReset(compact_table_t *table);
+uint8_t compactEncode(compact_table_t *table, uint8_t *buf, uint8_t type,
+                      uint8_t id, uint32_t timestamp, const float *values,
+                      uint8_t numValues);
+uint8_t compactReencode(compact_table_t *table, uint8_t *buf,
+                        const uint8_t *key, uint8_t len);
+
+#endif /* COMPACT_RECORD_H_ */
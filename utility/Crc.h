@@ -0,0 +1,16 @@
+/**
+ * @file   Crc.h
+ * @brief  CRC helpers shared by the SD card driver, the log block framing and
+ *         the record CRCs of binary logs.
+ */
+
+#ifndef CRC_H_
+#define CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint16_t crcCcitt(uint16_t crc, const uint8_t *data, size_t n);
+uint8_t crc8(uint8_t crc, const uint8_t *data, size_t n);
+
+#endif /* CRC_H_ */
@@ -19,14 +19,30 @@
  */
 #include <Sd2Card.h>
 #include <SdSpi.h>
+#include <Crc.h>
 #if !USE_SOFTWARE_SPI && ENABLE_SPI_TRANSACTION
 #include <SPI.h>
 #endif  // !USE_SOFTWARE_SPI && defined(SPI_HAS_TRANSACTION)
+#if SD_FIXED_CHIP_SELECT_PIN != 0XFF && SD_FAST_CHIP_SELECT
+#include <DigitalPin.h>
+#endif  // SD_FIXED_CHIP_SELECT_PIN != 0XFF && SD_FAST_CHIP_SELECT
 // debug trace macro
 #define SD_TRACE(m, b)
 // #define SD_TRACE(m, b) Serial.print(m);Serial.println(b);
 //------------------------------------------------------------------------------
-SdSpi Sd2Card::m_spi;
+SdSpi Sd2CardBase::m_spi;
+void (*Sd2CardBase::m_busyCallback)() = 0;
+#if LOG_STATS
+SdStats sdStats;
+//------------------------------------------------------------------------------
+// count a waitNotBusy() call that started at micros() t0
+static void statBusyWait(uint32_t t0) {
+  uint32_t t = micros() - t0;
+  sdStats.busyWaits++;
+  sdStats.busyMicros += t;
+  if (t > sdStats.maxBusyMicros) sdStats.maxBusyMicros = t;
+}
+#endif  // LOG_STATS
 //==============================================================================
 #if USE_SD_CRC
 // CRC functions
@@ -48,15 +64,7 @@ static uint8_t CRC7(const uint8_t* data, uint8_t n) {
 // slower CRC-CCITT
 // uses the x^16,x^12,x^5,x^1 polynomial.
 static uint16_t CRC_CCITT(const uint8_t *data, size_t n) {
-  uint16_t crc = 0;
-  for (size_t i = 0; i < n; i++) {
-    crc = (uint8_t)(crc >> 8) | (crc << 8);
-    crc ^= data[i];
-    crc ^= (uint8_t)(crc & 0xff) >> 4;
-    crc ^= crc << 12;
-    crc ^= (crc & 0xff) << 5;
-  }
-  return crc;
+  return crcCcitt(0, data, n);
 }
 #elif USE_SD_CRC > 1  // CRC_CCITT
 //------------------------------------------------------------------------------
@@ -114,27 +122,69 @@ static uint16_t CRC_CCITT(const uint8_t* data, size_t n) {
 #endif  // CRC_CCITT
 #endif  // USE_SD_CRC
 //==============================================================================
+// chip select pin I/O
+//------------------------------------------------------------------------------
+/**
+ * \class SdChipSelect
+ * \brief Chip select pin I/O for a pin fixed at compile time.  On boards
+ * with DigitalPin.h support each write compiles to a single instruction,
+ * sbi/cbi on AVR.
+ */
+template<uint8_t Pin>
+class SdChipSelect {
+ public:
+  static void begin(uint8_t) {
+#if SD_FAST_CHIP_SELECT
+    fastPinConfig(Pin, OUTPUT, HIGH);
+#else  // SD_FAST_CHIP_SELECT
+    pinMode(Pin, OUTPUT);
+    digitalWrite(Pin, HIGH);
+#endif  // SD_FAST_CHIP_SELECT
+  }
+  static void write(uint8_t, bool level) {
+#if SD_FAST_CHIP_SELECT
+    fastDigitalWrite(Pin, level);
+#else  // SD_FAST_CHIP_SELECT
+    digitalWrite(Pin, level);
+#endif  // SD_FAST_CHIP_SELECT
+  }
+};
+//------------------------------------------------------------------------------
+/** Chip select pin I/O for the pin passed to Sd2CardT::begin(). */
+template<>
+class SdChipSelect<SD_CHIP_SELECT_RUNTIME> {
+ public:
+  static void begin(uint8_t pin) {
+    pinMode(pin, OUTPUT);
+    digitalWrite(pin, HIGH);
+  }
+  static void write(uint8_t pin, bool level) {digitalWrite(pin, level);}
+};
+//==============================================================================
 // Sd2Card member functions
 //------------------------------------------------------------------------------
 /**
  * Initialize an SD flash memory card.
  *
- * \param[in] chipSelectPin SD chip select pin number.
+ * \param[in] chipSelectPin SD chip select pin number, ignored if the pin
+ * is fixed by ChipSelectPin.
  * \param[in] sckDivisor SPI SCK clock rate divisor.
  *
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.  The reason for failure
  * can be determined by calling errorCode() and errorData().
  */
-bool Sd2Card::begin(uint8_t chipSelectPin, uint8_t sckDivisor) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::begin(uint8_t chipSelectPin, uint8_t sckDivisor) {
   m_errorCode = m_type = 0;
-  m_chipSelectPin = chipSelectPin;
+  m_writeState = SD_WRITE_IDLE;
+  m_chipSelectPin =
+    ChipSelectPin == SD_CHIP_SELECT_RUNTIME ? chipSelectPin : ChipSelectPin;
   // 16-bit init start time allows over a minute
   uint16_t t0 = (uint16_t)millis();
   uint32_t arg;
 
-  pinMode(m_chipSelectPin, OUTPUT);
-  digitalWrite(m_chipSelectPin, HIGH);
+  SdChipSelect<ChipSelectPin>::begin(m_chipSelectPin);
   m_spi.begin();
 
   // set SCK rate for initialization commands
@@ -203,7 +253,8 @@ bool Sd2Card::begin(uint8_t chipSelectPin, uint8_t sckDivisor) {
 }
 //------------------------------------------------------------------------------
 // send command and return error code.  Return zero for OK
-uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
+template<uint8_t ChipSelectPin>
+uint8_t Sd2CardT<ChipSelectPin>::cardCommand(uint8_t cmd, uint32_t arg) {
   // select card
   chipSelectLow();
 
@@ -247,7 +298,8 @@ uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
  * \return The number of 512 byte data blocks in the card
  *         or zero if an error occurs.
  */
-uint32_t Sd2Card::cardSize() {
+template<uint8_t ChipSelectPin>
+uint32_t Sd2CardT<ChipSelectPin>::cardSize() {
   csd_t csd;
   if (!readCSD(&csd)) return 0;
   if (csd.v1.csd_ver == 0) {
@@ -267,15 +319,28 @@ uint32_t Sd2Card::cardSize() {
   }
 }
 //------------------------------------------------------------------------------
-void Sd2Card::spiYield() {
+template<uint8_t ChipSelectPin>
+void Sd2CardT<ChipSelectPin>::spiYield() {
 #if ENABLE_SPI_YIELD && !USE_SOFTWARE_SPI && defined(SPI_HAS_TRANSACTION)
   chipSelectHigh();
   chipSelectLow();
 #endif  // ENABLE_SPI_YIELD && !USE_SOFTWARE_SPI && defined(SPI_HAS_TRANSACTION)
+  busyYield();
 }
 //------------------------------------------------------------------------------
-void Sd2Card::chipSelectHigh() {
-  digitalWrite(m_chipSelectPin, HIGH);
+// call the busy callback, unless it is the one waiting on the card
+void Sd2CardBase::busyYield() {
+  static bool busy = false;
+  if (m_busyCallback && !busy) {
+    busy = true;
+    m_busyCallback();
+    busy = false;
+  }
+}
+//------------------------------------------------------------------------------
+template<uint8_t ChipSelectPin>
+void Sd2CardT<ChipSelectPin>::chipSelectHigh() {
+  SdChipSelect<ChipSelectPin>::write(m_chipSelectPin, HIGH);
   // insure MISO goes high impedance
   m_spi.send(0XFF);
 #if !USE_SOFTWARE_SPI && defined(SPI_HAS_TRANSACTION)
@@ -283,12 +348,15 @@ void Sd2Card::chipSelectHigh() {
 #endif  // !USE_SOFTWARE_SPI && defined(SPI_HAS_TRANSACTION)
 }
 //------------------------------------------------------------------------------
-void Sd2Card::chipSelectLow() {
+template<uint8_t ChipSelectPin>
+void Sd2CardT<ChipSelectPin>::chipSelectLow() {
+  // a block started by writeDataAsync() must be finished first
+  if (m_writeState == SD_WRITE_DATA) writeDataFinish();
 #if !USE_SOFTWARE_SPI && defined(SPI_HAS_TRANSACTION)
   SPI.beginTransaction(SPISettings());
 #endif  // !USE_SOFTWARE_SPI && defined(SPI_HAS_TRANSACTION)
   m_spi.init(m_sckDivisor);
-  digitalWrite(m_chipSelectPin, LOW);
+  SdChipSelect<ChipSelectPin>::write(m_chipSelectPin, LOW);
 }
 //------------------------------------------------------------------------------
 /** Erase a range of blocks.
@@ -304,7 +372,8 @@ void Sd2Card::chipSelectLow() {
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::erase(uint32_t firstBlock, uint32_t lastBlock) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::erase(uint32_t firstBlock, uint32_t lastBlock) {
   csd_t csd;
   if (!readCSD(&csd)) goto fail;
   // check for single block erase
@@ -344,7 +413,8 @@ bool Sd2Card::erase(uint32_t firstBlock, uint32_t lastBlock) {
  * \return The value one, true, is returned if single block erase is supported.
  * The value zero, false, is returned if single block erase is not supported.
  */
-bool Sd2Card::eraseSingleBlockEnable() {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::eraseSingleBlockEnable() {
   csd_t csd;
   return readCSD(&csd) ? csd.v1.erase_blk_en : false;
 }
@@ -354,7 +424,8 @@ bool Sd2Card::eraseSingleBlockEnable() {
  * 
  * \return true if busy else false.
  */
-bool Sd2Card::isBusy() {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::isBusy() {
   bool rtn;
   chipSelectLow();
   for (uint8_t i = 0; i < 8; i++) {
@@ -374,7 +445,8 @@ bool Sd2Card::isBusy() {
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::readBlock(uint32_t blockNumber, uint8_t* dst) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::readBlock(uint32_t blockNumber, uint8_t* dst) {
   SD_TRACE("RB", blockNumber);
   // use address if not SDHC card
   if (type()!= SD_CARD_TYPE_SDHC) blockNumber <<= 9;
@@ -396,12 +468,14 @@ bool Sd2Card::readBlock(uint32_t blockNumber, uint8_t* dst) {
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::readData(uint8_t *dst) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::readData(uint8_t *dst) {
   chipSelectLow();
   return readData(dst, 512);
 }
 //------------------------------------------------------------------------------
-bool Sd2Card::readData(uint8_t* dst, size_t count) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::readData(uint8_t* dst, size_t count) {
 #if USE_SD_CRC
   uint16_t crc;
 #endif  // USE_SD_CRC
@@ -449,7 +523,8 @@ bool Sd2Card::readData(uint8_t* dst, size_t count) {
  * \param[out] ocr Value of OCR register.
  * \return true for success else false.
  */
-bool Sd2Card::readOCR(uint32_t* ocr) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::readOCR(uint32_t* ocr) {
   uint8_t *p = reinterpret_cast<uint8_t*>(ocr);
   if (cardCommand(CMD58, 0)) {
     error(SD_CARD_ERROR_CMD58);
@@ -466,7 +541,8 @@ bool Sd2Card::readOCR(uint32_t* ocr) {
 }
 //------------------------------------------------------------------------------
 /** read CID or CSR register */
-bool Sd2Card::readRegister(uint8_t cmd, void* buf) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::readRegister(uint8_t cmd, void* buf) {
   uint8_t* dst = reinterpret_cast<uint8_t*>(buf);
   if (cardCommand(cmd, 0)) {
     error(SD_CARD_ERROR_READ_REG);
@@ -489,7 +565,8 @@ bool Sd2Card::readRegister(uint8_t cmd, void* buf) {
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::readStart(uint32_t blockNumber) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::readStart(uint32_t blockNumber) {
   SD_TRACE("RS", blockNumber);
   if (type()!= SD_CARD_TYPE_SDHC) blockNumber <<= 9;
   if (cardCommand(CMD18, blockNumber)) {
@@ -509,7 +586,8 @@ bool Sd2Card::readStart(uint32_t blockNumber) {
 * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::readStop() {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::readStop() {
   if (cardCommand(CMD12, 0)) {
     error(SD_CARD_ERROR_CMD12);
     goto fail;
@@ -523,15 +601,19 @@ bool Sd2Card::readStop() {
 }
 //------------------------------------------------------------------------------
 // wait for card to go not busy
-bool Sd2Card::waitNotBusy(uint16_t timeoutMillis) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::waitNotBusy(uint16_t timeoutMillis) {
   uint16_t t0 = millis();
+  SD_STATS(uint32_t m0 = micros());
   while (m_spi.receive() != 0XFF) {
     if (((uint16_t)millis() - t0) >= timeoutMillis) goto fail;
     spiYield();
   }
+  SD_STATS(statBusyWait(m0));
   return true;
 
  fail:
+  SD_STATS(statBusyWait(m0));
   return false;
 }
 //------------------------------------------------------------------------------
@@ -543,7 +625,8 @@ bool Sd2Card::waitNotBusy(uint16_t timeoutMillis) {
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::writeBlock(uint32_t blockNumber, const uint8_t* src) {
   SD_TRACE("WB", blockNumber);
   // use address if not SDHC card
   if (type() != SD_CARD_TYPE_SDHC) blockNumber <<= 9;
@@ -552,6 +635,7 @@ bool Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
     goto fail;
   }
   if (!writeData(DATA_START_BLOCK, src)) goto fail;
+  m_writeState = SD_WRITE_BLOCK;
 
 #define CHECK_PROGRAMMING 0
 #if CHECK_PROGRAMMING
@@ -580,8 +664,11 @@ bool Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::writeData(const uint8_t* src) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::writeData(const uint8_t* src) {
   chipSelectLow();
+  // the sequence is closed if an async block was rejected
+  if (m_writeState != SD_WRITE_MULTIPLE) goto fail;
   // wait for previous write to finish
   if (!waitNotBusy(SD_WRITE_TIMEOUT)) goto fail;
   if (!writeData(WRITE_MULTIPLE_TOKEN, src)) goto fail;
@@ -594,8 +681,71 @@ bool Sd2Card::writeData(const uint8_t* src) {
   return false;
 }
 //------------------------------------------------------------------------------
+/** Start writing one data block in a multiple block write sequence without
+ * waiting for it to be sent.
+ *
+ * On the SAM3X and Teensy 3 the block goes out by SPI DMA while the caller
+ * does other work; elsewhere it is sent before returning.  The transfer is
+ * completed and the card's response checked by writePoll() or by the next
+ * card operation, so the data at src must not change until writeState() is
+ * no longer SD_WRITE_DATA.  A block the card rejects ends the sequence and
+ * the next writeData() or writeDataAsync() fails.
+ *
+ * \param[in] src Pointer to the location of the data to be written.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::writeDataAsync(const uint8_t* src) {
+  chipSelectLow();
+  if (m_writeState != SD_WRITE_MULTIPLE) goto fail;
+  // wait for previous write to finish
+  if (!waitNotBusy(SD_WRITE_TIMEOUT)) goto fail;
+#if USE_SD_CRC
+  m_writeCrc = CRC_CCITT(src, 512);
+#endif  // USE_SD_CRC
+  m_spi.send(WRITE_MULTIPLE_TOKEN);
+  m_spi.sendStart(src, 512);
+  // chip select stays low until writeDataFinish()
+  m_writeState = SD_WRITE_DATA;
+  return true;
+
+ fail:
+  error(SD_CARD_ERROR_WRITE_MULTIPLE);
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
+// wait for the block started by writeDataAsync() and check the response
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::writeDataFinish() {
+#if USE_SD_CRC
+  uint16_t crc = m_writeCrc;
+#else  // USE_SD_CRC
+  uint16_t crc = 0XFFFF;
+#endif  // USE_SD_CRC
+  while (!m_spi.sendDone()) busyYield();
+  m_spi.send(crc >> 8);
+  m_spi.send(crc & 0XFF);
+
+  m_status = m_spi.receive();
+  if ((m_status & DATA_RES_MASK) != DATA_RES_ACCEPTED) {
+    error(SD_CARD_ERROR_WRITE);
+    goto fail;
+  }
+  m_writeState = SD_WRITE_MULTIPLE;
+  chipSelectHigh();
+  return true;
+
+ fail:
+  m_writeState = SD_WRITE_IDLE;
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
 // send one block of data for write block or write multiple blocks
-bool Sd2Card::writeData(uint8_t token, const uint8_t* src) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::writeData(uint8_t token, const uint8_t* src) {
 #if USE_SD_CRC
   uint16_t crc = CRC_CCITT(src, 512);
 #else  // USE_SD_CRC
@@ -629,7 +779,8 @@ bool Sd2Card::writeData(uint8_t token, const uint8_t* src) {
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::writeStart(uint32_t blockNumber, uint32_t eraseCount) {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::writeStart(uint32_t blockNumber, uint32_t eraseCount) {
   SD_TRACE("WS", blockNumber);
   // send pre-erase count
   if (cardAcmd(ACMD23, eraseCount)) {
@@ -642,6 +793,7 @@ bool Sd2Card::writeStart(uint32_t blockNumber, uint32_t eraseCount) {
     error(SD_CARD_ERROR_CMD25);
     goto fail;
   }
+  m_writeState = SD_WRITE_MULTIPLE;
   chipSelectHigh();
   return true;
 
@@ -655,16 +807,75 @@ bool Sd2Card::writeStart(uint32_t blockNumber, uint32_t eraseCount) {
 * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::writeStop() {
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::writeStop() {
   chipSelectLow();
   if (!waitNotBusy(SD_WRITE_TIMEOUT)) goto fail;
   m_spi.send(STOP_TRAN_TOKEN);
   if (!waitNotBusy(SD_WRITE_TIMEOUT)) goto fail;
+  m_writeState = SD_WRITE_IDLE;
   chipSelectHigh();
   return true;
 
  fail:
+  m_writeState = SD_WRITE_IDLE;
   error(SD_CARD_ERROR_STOP_TRAN);
   chipSelectHigh();
   return false;
 }
+//------------------------------------------------------------------------------
+/** End a write multiple blocks sequence without waiting for the card to
+ * finish programming.  Poll writePoll() until it returns true before the
+ * next card operation, or that operation will wait instead.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::writeStopAsync() {
+  chipSelectLow();
+  if (!waitNotBusy(SD_WRITE_TIMEOUT)) goto fail;
+  m_spi.send(STOP_TRAN_TOKEN);
+  m_writeState = SD_WRITE_STOP;
+  chipSelectHigh();
+  return true;
+
+ fail:
+  m_writeState = SD_WRITE_IDLE;
+  error(SD_CARD_ERROR_STOP_TRAN);
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
+/** Check without waiting whether the card has finished the last write.
+ *
+ * writeBlock(), writeData() and writeStopAsync() return as soon as the data
+ * has been sent, while the card goes on programming it for a few ms.  The next
+ * card operation waits for that to finish.  Polling writePoll() until it
+ * returns true first lets the caller do other work during programming, and
+ * the next operation then starts immediately.  writeDataAsync() returns even
+ * before the data has been sent; writePoll() returns false until the transfer
+ * is done, then completes it.
+ *
+ * \return true if the card is ready for the next operation, false if it is
+ * still busy.  writeState() is SD_WRITE_IDLE once a single block write or a
+ * stopped multiple block write has completed.
+ */
+template<uint8_t ChipSelectPin>
+bool Sd2CardT<ChipSelectPin>::writePoll() {
+  bool ready;
+  if (m_writeState == SD_WRITE_DATA && !m_spi.sendDone()) return false;
+  chipSelectLow();
+  ready = m_spi.receive() == 0XFF;
+  chipSelectHigh();
+  if (ready && m_writeState != SD_WRITE_MULTIPLE) {
+    m_writeState = SD_WRITE_IDLE;
+  }
+  return ready;
+}
+//------------------------------------------------------------------------------
+// the runtime pin version, and the SdFat card if its pin is fixed
+template class Sd2CardT<SD_CHIP_SELECT_RUNTIME>;
+#if SD_FIXED_CHIP_SELECT_PIN != 0XFF
+template class Sd2CardT<SD_FIXED_CHIP_SELECT_PIN>;
+#endif  // SD_FIXED_CHIP_SELECT_PIN != 0XFF
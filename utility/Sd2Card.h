@@ -86,6 +86,47 @@ uint8_t const SD_CARD_ERROR_READ_CRC = 0X1B;
 /** SPI DMA error */
 uint8_t const SD_CARD_ERROR_SPI_DMA = 0X1C;
 //------------------------------------------------------------------------------
+// write states, see Sd2Card::writePoll()
+/** no write in progress */
+uint8_t const SD_WRITE_IDLE = 0;
+/** single block sent, card may still be programming it */
+uint8_t const SD_WRITE_BLOCK = 1;
+/** multiple block write sequence open */
+uint8_t const SD_WRITE_MULTIPLE = 2;
+/** stop token sent, card may still be finishing the sequence */
+uint8_t const SD_WRITE_STOP = 3;
+/** block of a multiple block write still being sent, see writeDataAsync() */
+uint8_t const SD_WRITE_DATA = 4;
+//------------------------------------------------------------------------------
+#if LOG_STATS
+/**
+ * \struct SdStats
+ * \brief Counters kept by the card and FAT code when LOG_STATS is nonzero.
+ */
+struct SdStats {
+  /** calls to waitNotBusy(), made before every command and block write */
+  uint32_t busyWaits;
+  /** total time spent in waitNotBusy(), us */
+  uint32_t busyMicros;
+  /** longest single waitNotBusy(), us */
+  uint32_t maxBusyMicros;
+  /** blocks missing from the volume cache, read (or reserved) in */
+  uint32_t cacheMisses;
+  /** blocks found in the cache pool instead (SD_CACHE_BLOCK_COUNT > 1) */
+  uint32_t cacheHits;
+  /** clusters allocated by SdVolume::allocContiguous() */
+  uint32_t clusterAllocs;
+  /** SdBaseFile write, writeReserve/Commit and sync failures (writeError) */
+  uint32_t writeErrors;
+};
+/** Card and FAT counters, see SdStats */
+extern SdStats sdStats;
+/** Compile statement s only if LOG_STATS is nonzero */
+#define SD_STATS(s) s
+#else  // LOG_STATS
+#define SD_STATS(s)
+#endif  // LOG_STATS
+//------------------------------------------------------------------------------
 // card types
 /** Standard capacity V1 SD card */
 uint8_t const SD_CARD_TYPE_SD1  = 1;
@@ -94,14 +135,60 @@ uint8_t const SD_CARD_TYPE_SD2  = 2;
 /** High Capacity SD card */
 uint8_t const SD_CARD_TYPE_SDHC = 3;
 //------------------------------------------------------------------------------
+/** Sd2CardT chip select pin meaning the pin passed to begin() */
+uint8_t const SD_CHIP_SELECT_RUNTIME = 0XFF;
+#if defined(__AVR__) || defined(__SAM3X8E__)\
+  || (defined(__arm__) && defined(CORE_TEENSY))
+/** Nonzero - a fixed chip select pin is written with DigitalPin.h */
+#define SD_FAST_CHIP_SELECT 1
+#else  // defined(__AVR__) || defined(__SAM3X8E__) || Teensy 3
+#define SD_FAST_CHIP_SELECT 0
+#endif  // defined(__AVR__) || defined(__SAM3X8E__) || Teensy 3
+//------------------------------------------------------------------------------
 /**
- * \class Sd2Card
+ * \class Sd2CardBase
+ * \brief SPI bus and busy callback, shared by all Sd2CardT instances.
+ */
+class Sd2CardBase {
+ public:
+  /** Set a function to call from the card's wait loops.
+   *
+   * The callback is called over and over while the card is busy programming
+   * or erasing (before every command and block write), while waiting for
+   * read data, and while an SPI DMA transfer is going out, so the sketch can
+   * do other work instead of spinning.  It runs with the card selected and
+   * the bus in use, so it must not use the SPI bus, nor call any Sd2Card,
+   * SdVolume or SdBaseFile function; it is not called again while it runs.
+   * Time spent in it counts towards the card timeouts, so it should return
+   * within a few milliseconds.
+   *
+   * \param[in] callback function to call, or NULL for none.
+   */
+  static void setBusyCallback(void (*callback)()) {m_busyCallback = callback;}
+
+ protected:
+  static void busyYield();
+  static SdSpi m_spi;
+  static void (*m_busyCallback)();
+};
+//------------------------------------------------------------------------------
+/**
+ * \class Sd2CardT
  * \brief Raw access to SD and SDHC flash memory cards.
+ *
+ * The card is selected before every command, so ChipSelectPin can fix the
+ * chip select pin at compile time: it is then written with
+ * fastDigitalWrite(), a single sbi/cbi instruction on AVR, instead of
+ * digitalWrite().  SD_CHIP_SELECT_RUNTIME uses the pin passed to begin().
+ * Sd2Card.cpp builds the runtime version and SD_FIXED_CHIP_SELECT_PIN,
+ * see SdFatConfig.h.
  */
-class Sd2Card {
+template<uint8_t ChipSelectPin = SD_CHIP_SELECT_RUNTIME>
+class Sd2CardT : public Sd2CardBase {
  public:
-  /** Construct an instance of Sd2Card. */
-  Sd2Card() : m_errorCode(SD_CARD_ERROR_INIT_NOT_CALLED), m_type(0) {}
+  /** Construct an instance of Sd2CardT. */
+  Sd2CardT() : m_errorCode(SD_CARD_ERROR_INIT_NOT_CALLED), m_type(0),
+    m_writeState(SD_WRITE_IDLE) {}
   bool begin(uint8_t chipSelectPin = SD_CHIP_SELECT_PIN,
             uint8_t sckDivisor = SPI_FULL_SPEED);
   uint32_t cardSize();
@@ -166,14 +253,24 @@ class Sd2Card {
    * \return Requested SCK divisor.
    */
   uint8_t sckDivisor() {return m_sckDivisor;}
+  /** Change the SCK divisor, from the next card operation on.
+   *
+   * \param[in] sckDivisor SPI SCK clock rate divisor, see begin().
+   */
+  void setSckDivisor(uint8_t sckDivisor) {m_sckDivisor = sckDivisor;}
   /** Return the card type: SD V1, SD V2 or SDHC
    * \return 0 - SD V1, 1 - SD V2, or 3 - SDHC.
    */
   int type() const {return m_type;}
   bool writeBlock(uint32_t blockNumber, const uint8_t* src);
   bool writeData(const uint8_t* src);
+  bool writeDataAsync(const uint8_t* src);
+  bool writePoll();
   bool writeStart(uint32_t blockNumber, uint32_t eraseCount);
+  /** \return The state of the last write, SD_WRITE_IDLE if it completed. */
+  uint8_t writeState() const {return m_writeState;}
   bool writeStop();
+  bool writeStopAsync();
 
  private:
   //----------------------------------------------------------------------------
@@ -191,12 +288,19 @@ class Sd2Card {
   void type(uint8_t value) {m_type = value;}
   bool waitNotBusy(uint16_t timeoutMillis);
   bool writeData(uint8_t token, const uint8_t* src);
+  bool writeDataFinish();
   // private data
-  static SdSpi m_spi;
   uint8_t m_chipSelectPin;
   uint8_t m_errorCode;
   uint8_t m_sckDivisor;
   uint8_t m_status;
   uint8_t m_type;
+  uint8_t m_writeState;
+#if USE_SD_CRC
+  uint16_t m_writeCrc;
+#endif  // USE_SD_CRC
 };
+//------------------------------------------------------------------------------
+/** The card driver of SdFat and SdVolume, see SD_FIXED_CHIP_SELECT_PIN */
+typedef Sd2CardT<SD_FIXED_CHIP_SELECT_PIN> Sd2Card;
 #endif  // SpiCard_h
@@ -1097,7 +1097,7 @@ int SdBaseFile::read(void* buf, size_t nbyte) {
 
       block = m_vol->clusterStartBlock(m_curCluster) + blockOfCluster;
     }
-    if (offset != 0 || toRead < 512 || block == m_vol->cacheBlockNumber()) {
+    if (offset != 0 || toRead < 512 || m_vol->cacheHolds(block, 1)) {
       // amount to be read from current block
       n = 512 - offset;
       if (n > toRead) n = toRead;
@@ -1123,8 +1123,7 @@ int SdBaseFile::read(void* buf, size_t nbyte) {
         if (mb < nb) nb = mb;
       }
       n = 512*nb;
-      if (m_vol->cacheBlockNumber() <= block
-        && block < (m_vol->cacheBlockNumber() + nb)) {
+      if (m_vol->cacheHolds(block, nb)) {
         // flush cache if a block is in the cache
         if (!m_vol->cacheSync()) {
           DBG_FAIL_MACRO;
@@ -1642,10 +1641,15 @@ bool SdBaseFile::sync() {
     // clear directory dirty
     m_flags &= ~F_FILE_DIR_DIRTY;
   }
+  if (!m_vol->fsInfoSync()) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
   return m_vol->cacheSync();
 
  fail:
   writeError = true;
+  SD_STATS(sdStats.writeErrors++);
   return false;
 }
 //------------------------------------------------------------------------------
@@ -1896,37 +1900,12 @@ int SdBaseFile::write(const void* buf, size_t nbyte) {
   while (nToWrite) {
     uint8_t blockOfCluster = m_vol->blockOfCluster(m_curPosition);
     uint16_t blockOffset = m_curPosition & 0X1FF;
-    if (blockOfCluster == 0 && blockOffset == 0) {
-      // start of new cluster
-      if (m_curCluster != 0) {
-        uint32_t next;
-        if (!m_vol->fatGet(m_curCluster, &next)) {
-          DBG_FAIL_MACRO;
-          goto fail;
-        }
-        if (m_vol->isEOC(next)) {
-          // add cluster if at end of chain
-          if (!addCluster()) {
-            DBG_FAIL_MACRO;
-            goto fail;
-          }
-        } else {
-          m_curCluster = next;
-        }
-      } else {
-        if (m_firstCluster == 0) {
-          // allocate first cluster of file
-          if (!addCluster()) {
-            DBG_FAIL_MACRO;
-            goto fail;
-          }
-        } else {
-          m_curCluster = m_firstCluster;
-        }
-      }
-    }
     // block for data write
-    uint32_t block = m_vol->clusterStartBlock(m_curCluster) + blockOfCluster;
+    uint32_t block;
+    if (!curWriteBlock(&block)) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
 
     if (blockOffset != 0 || nToWrite < 512) {
       // partial block - must use cache
@@ -1963,9 +1942,7 @@ int SdBaseFile::write(const void* buf, size_t nbyte) {
     } else if (!USE_MULTI_BLOCK_SD_IO || nToWrite < 1024) {
       // use single block write command
       n = 512;
-      if (m_vol->cacheBlockNumber() == block) {
-        m_vol->cacheInvalidate();
-      }
+      m_vol->cacheDiscard(block);
       if (!m_vol->writeBlock(block, src)) {
         DBG_FAIL_MACRO;
         goto fail;
@@ -1983,9 +1960,7 @@ int SdBaseFile::write(const void* buf, size_t nbyte) {
       }
       for (uint8_t b = 0; b < nBlock; b++) {
         // invalidate cache if block is in cache
-        if ((block + b) == m_vol->cacheBlockNumber()) {
-          m_vol->cacheInvalidate();
-        }
+        m_vol->cacheDiscard(block + b);
         if (!m_vol->sdCard()->writeData(src + 512*b)) {
           DBG_FAIL_MACRO;
           goto fail;
@@ -2020,5 +1995,144 @@ int SdBaseFile::write(const void* buf, size_t nbyte) {
  fail:
   // return for write error
   writeError = true;
+  SD_STATS(sdStats.writeErrors++);
   return -1;
 }
+//------------------------------------------------------------------------------
+// Find the block for a write at the current position, moving to the next
+// cluster of the chain, or adding one at the end of it, at a cluster boundary.
+bool SdBaseFile::curWriteBlock(uint32_t* block) {
+  uint8_t blockOfCluster = m_vol->blockOfCluster(m_curPosition);
+  uint16_t blockOffset = m_curPosition & 0X1FF;
+  if (blockOfCluster == 0 && blockOffset == 0) {
+    // start of new cluster
+    if (m_curCluster != 0) {
+      uint32_t next;
+      if (!m_vol->fatGet(m_curCluster, &next)) {
+        DBG_FAIL_MACRO;
+        goto fail;
+      }
+      if (m_vol->isEOC(next)) {
+        // add cluster if at end of chain
+        if (!addCluster()) {
+          DBG_FAIL_MACRO;
+          goto fail;
+        }
+      } else {
+        m_curCluster = next;
+      }
+    } else {
+      if (m_firstCluster == 0) {
+        // allocate first cluster of file
+        if (!addCluster()) {
+          DBG_FAIL_MACRO;
+          goto fail;
+        }
+      } else {
+        m_curCluster = m_firstCluster;
+      }
+    }
+  }
+  *block = m_vol->clusterStartBlock(m_curCluster) + blockOfCluster;
+  return true;
+
+ fail:
+  return false;
+}
+//------------------------------------------------------------------------------
+/**
+ * Reserve room in the volume cache for writing at the current position.
+ *
+ * The file's block at the current position is loaded into the cache, marked
+ * dirty and returned, so that data can be formatted straight into it without
+ * an intermediate buffer.  Store at most \a space bytes at the returned
+ * address, then call writeCommit() with the number of bytes stored.  Nothing
+ * else may use the volume cache in between.
+ *
+ * \param[out] space Bytes available from the returned address to the end of
+ * the block.
+ *
+ * \return Address in the cache for the current position or zero if an error
+ * occurs.
+ */
+uint8_t* SdBaseFile::writeReserve(uint16_t* space) {
+  cache_t* pc;
+  uint8_t cacheOption;
+  uint32_t block;
+  uint16_t blockOffset;
+  // error if not a normal file or is read-only
+  if (!isFile() || !(m_flags & O_WRITE)) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  // seek to end of file if append flag
+  if ((m_flags & O_APPEND) && m_curPosition != m_fileSize) {
+    if (!seekEnd()) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+  }
+  if (m_curPosition == 0XFFFFFFFF || !curWriteBlock(&block)) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  blockOffset = m_curPosition & 0X1FF;
+  if (blockOffset == 0 && m_curPosition >= m_fileSize) {
+    // start of new block don't need to read into cache
+    cacheOption = SdVolume::CACHE_RESERVE_FOR_WRITE;
+  } else {
+    cacheOption = SdVolume::CACHE_FOR_WRITE;
+  }
+  pc = m_vol->cacheFetch(block, cacheOption);
+  if (!pc) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  *space = 512 - blockOffset;
+  return pc->data + blockOffset;
+
+ fail:
+  writeError = true;
+  SD_STATS(sdStats.writeErrors++);
+  return 0;
+}
+//------------------------------------------------------------------------------
+/**
+ * Complete a write started with writeReserve().
+ *
+ * \param[in] nbyte Number of bytes stored at the reserved address.  Must not
+ * be more than the space returned by writeReserve().
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+bool SdBaseFile::writeCommit(uint16_t nbyte) {
+  m_curPosition += nbyte;
+  if (m_curPosition > m_fileSize) {
+    // update fileSize and insure sync will update dir entry
+    m_fileSize = m_curPosition;
+    m_flags |= F_FILE_DIR_DIRTY;
+  } else if (m_dateTime && nbyte) {
+    // insure sync will update modified date and time
+    m_flags |= F_FILE_DIR_DIRTY;
+  }
+  // flush cache if all space used.
+  if (nbyte && (m_curPosition & 0X1FF) == 0) {
+    if (!m_vol->cacheWriteData()) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+  }
+  if (m_flags & O_SYNC) {
+    if (!sync()) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+  }
+  return true;
+
+ fail:
+  writeError = true;
+  SD_STATS(sdStats.writeErrors++);
+  return false;
+}
@@ -245,6 +245,8 @@ class SdBaseFile {
   /** \return SdVolume that contains this file. */
   SdVolume* volume() const {return m_vol;}
   int write(const void* buf, size_t nbyte);
+  uint8_t* writeReserve(uint16_t* space);
+  bool writeCommit(uint16_t nbyte);
 //------------------------------------------------------------------------------
  private:
   // allow SdFat to set m_cwd
@@ -255,6 +257,7 @@ class SdBaseFile {
   // private functions
   bool addCluster();
   cache_t* addDirCluster();
+  bool curWriteBlock(uint32_t* block);
   dir_t* cacheDirEntry(uint8_t action);
   int8_t lsPrintNext(Print *pr, uint8_t flags, uint8_t indent);
   static bool make83Name(const char* str, uint8_t* name, const char** ptr);
@@ -43,7 +43,9 @@
  *
  * Set USE_SD_CRC to 2 to used a larger faster table driven CRC-CCITT function.
  */
+#ifndef USE_SD_CRC
 #define USE_SD_CRC 0
+#endif  // USE_SD_CRC
 //------------------------------------------------------------------------------
 /**
  * To use multiple SD cards set USE_MULTIPLE_CARDS nonzero.
@@ -82,6 +84,15 @@
  */
 #define FAT12_SUPPORT 0
 //------------------------------------------------------------------------------
+/**
+ * Set SD_FIXED_CHIP_SELECT_PIN to the SD chip select pin to build the card
+ * driver of SdFat for that pin.  Selecting the card, which happens on every
+ * command, is then a single sbi/cbi instruction on AVR instead of a
+ * digitalWrite() call, and the chip select pin given to begin() is ignored.
+ * 0XFF uses the pin given to begin().
+ */
+#define SD_FIXED_CHIP_SELECT_PIN 0XFF
+//------------------------------------------------------------------------------
 /**
  * Set ENABLE_SPI_TRANSACTION nonzero to enable the SPI transaction feature
  * of the standard Arduino SPI library.  You must include SPI.h in your
@@ -192,6 +203,21 @@ const uint8_t SPI_SCK_INIT_DIVISOR = 128;
 #define USE_SEPARATE_FAT_CACHE 0
 #endif  // __arm__
 //------------------------------------------------------------------------------
+/**
+ * Number of 512 byte blocks SdVolume caches.  With more than one, blocks
+ * evicted from the cache buffer (and FAT cache) are kept in a pool of
+ * SD_CACHE_BLOCK_COUNT - 1 blocks, least recently used out first, so mixed
+ * FAT, directory and data accesses don't have to read them again.  Dirty
+ * blocks are written back when they leave the pool or at sync.
+ */
+#ifndef SD_CACHE_BLOCK_COUNT
+#ifdef __arm__
+#define SD_CACHE_BLOCK_COUNT 4
+#else  // __arm__
+#define SD_CACHE_BLOCK_COUNT 1
+#endif  // __arm__
+#endif  // SD_CACHE_BLOCK_COUNT
+//------------------------------------------------------------------------------
 /**
  * Set USE_MULTI_BLOCK_SD_IO nonzero to use multi-block SD read/write.
  *
@@ -202,4 +228,13 @@ const uint8_t SPI_SCK_INIT_DIVISOR = 128;
 #else  // RAMEND
 #define USE_MULTI_BLOCK_SD_IO 1
 #endif  // RAMEND
+//------------------------------------------------------------------------------
+/**
+ * Set LOG_STATS nonzero to count card busy waits, cache misses, cluster
+ * allocations and write errors, and to time log writes, for getLogStats()
+ * in ArdusatLogging.h.  Nothing is counted or compiled in when zero.
+ */
+#ifndef LOG_STATS
+#define LOG_STATS 0
+#endif  // LOG_STATS
 #endif  // SdFatConfig_h
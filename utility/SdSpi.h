@@ -58,6 +58,11 @@
 #define USE_NATIVE_TEENSY3_SPI 1
 #endif  // TEENSY3_SOFT_SPI
 #endif  // defined(__arm__) && defined(CORE_TEENSY)
+// Linux or other host with the simulated card, see SdSpiHost.h
+#ifdef ARDUINO_ARCH_HOST
+/** Nonzero - use the simulated SD card of SdSpiHost.cpp */
+#define USE_HOST_SPI 1
+#endif  // ARDUINO_ARCH_HOST
 #endif  // !USE_ARDUINO_SPI_LIBRARY
 
 #ifndef USE_SOFTWARE_SPI
@@ -75,6 +80,17 @@
 #ifndef USE_NATIVE_TEENSY3_SPI
 #define USE_NATIVE_TEENSY3_SPI 0
 #endif  // USE_NATIVE_TEENSY3_SPI
+
+#ifndef USE_HOST_SPI
+#define USE_HOST_SPI 0
+#endif  // USE_HOST_SPI
+
+#if USE_NATIVE_SAM3X_SPI || USE_NATIVE_TEENSY3_SPI
+/** Nonzero - sendStart() may return before the data has been sent */
+#define SD_SPI_ASYNC 1
+#else  // USE_NATIVE_SAM3X_SPI || USE_NATIVE_TEENSY3_SPI
+#define SD_SPI_ASYNC 0
+#endif  // USE_NATIVE_SAM3X_SPI || USE_NATIVE_TEENSY3_SPI
 //------------------------------------------------------------------------------
 // define default chip select pin
 //
@@ -124,8 +140,31 @@ class SdSpi {
    * \param[in] n Number of bytes to send.
    */   
   void send(const uint8_t* buf, size_t n);
+  /** Start sending multiple bytes.  On the SAM3X and Teensy 3 the bytes
+   * are sent by DMA and the function returns right away; on other boards
+   * they are sent before it returns.  The buffer must not change and no
+   * other transfer may be started until sendDone() returns true.
+   *
+   * \param[in] buf Buffer for data to be sent.
+   * \param[in] n Number of bytes to send.
+   */
+  void sendStart(const uint8_t* buf, size_t n);
+  /** Check whether the transfer begun by sendStart() has finished.
+   *
+   * \return true if all bytes have been sent, else false.
+   */
+  bool sendDone();
 };
 //------------------------------------------------------------------------------
+#if !SD_SPI_ASYNC
+inline void SdSpi::sendStart(const uint8_t* buf, size_t n) {
+  send(buf, n);
+}
+inline bool SdSpi::sendDone() {
+  return true;
+}
+#endif  // !SD_SPI_ASYNC
+//------------------------------------------------------------------------------
 // Use of inline for AVR results in up to 10% better write performance.
 // Inline also save a little flash memory.
 /** inline avr native functions if nonzero. */
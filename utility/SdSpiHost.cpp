@@ -0,0 +1,326 @@
+/* Arduino SdSpi Library
+ * Copyright (C) 2013 by William Greiman
+ *
+ * This file is part of the Arduino SdSpi Library
+ *
+ * This Library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the Arduino SdSpi Library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <SdSpi.h>
+#if USE_HOST_SPI
+#include <stdio.h>
+#include <SdSpiHost.h>
+#include <SdInfo.h>
+// defaults are typical of a class 4 card
+SdHostConfig sdHostConfig = {16000000, 100, 1000, 250, 500, 50000, 0, 50000, 0,
+                              1000};
+SdHostStats sdHostStats;
+//------------------------------------------------------------------------------
+// card state, one command or data block is decoded at a time
+enum {
+  HOST_NONE = 0,       // idle, or sending a response
+  HOST_READ,           // CMD17, sending one block after readMicros
+  HOST_READ_MULTIPLE,  // CMD18, sending blocks until CMD12
+  HOST_WRITE,          // CMD24, waiting for the start block token
+  HOST_WRITE_MULTIPLE  // CMD25, waiting for a data or stop token
+};
+static FILE* hostImage = 0;
+static uint32_t hostBlocks;       // card size in blocks
+static uint32_t hostByteNanos;    // time of one SPI byte
+static uint8_t hostDivisor;       // SCK divisor
+static uint64_t hostBusyUntil;    // card busy, MISO low, until this time
+static uint64_t hostReadyAt;      // read data token sent from this time
+static uint64_t hostActiveUntil;  // end of the last transfer
+static uint8_t hostState;
+static bool hostIdle;             // CMD0 received, ACMD41 not yet
+static bool hostAppCmd;           // last command was CMD55
+static uint32_t hostBlock;        // next block to read or write
+static uint32_t hostEraseStart;
+static uint32_t hostEraseEnd;
+static uint8_t hostCmd[6];
+static uint8_t hostCmdLen;
+static int16_t hostDataLen = -1;  // bytes of a write block received, or -1
+static uint8_t hostData[514];     // write block and its CRC
+static uint8_t hostOut[3 + 512 + 2];
+static uint16_t hostOutPos;
+static uint16_t hostOutLen;
+//------------------------------------------------------------------------------
+bool sdHostOpen(const char* path) {
+  sdHostClose();
+  hostImage = fopen(path, "r+b");
+  if (!hostImage) return false;
+  if (fseek(hostImage, 0, SEEK_END)) goto fail;
+  // CSD version 2 gives the size in units of 1024 blocks
+  hostBlocks = (uint32_t)(ftell(hostImage) >> 19) << 10;
+  if (hostBlocks == 0) goto fail;
+  return true;
+
+ fail:
+  sdHostClose();
+  return false;
+}
+//------------------------------------------------------------------------------
+void sdHostClose() {
+  if (hostImage) fclose(hostImage);
+  hostImage = 0;
+  hostState = HOST_NONE;
+  hostCmdLen = 0;
+  hostDataLen = -1;
+  hostOutPos = hostOutLen = 0;
+}
+//------------------------------------------------------------------------------
+static void busy(uint32_t us) {
+  uint64_t now = hostNanos > hostBusyUntil ? hostNanos : hostBusyUntil;
+  hostBusyUntil = now + 1000ULL * us;
+  sdHostStats.busyMicros += us;
+}
+//------------------------------------------------------------------------------
+static bool blockIo(uint32_t block, uint8_t* buf, bool write) {
+  if (fseek(hostImage, (long)block << 9, SEEK_SET)) return false;
+  if (write) return fwrite(buf, 1, 512, hostImage) == 512;
+  return fread(buf, 1, 512, hostImage) == 512;
+}
+//------------------------------------------------------------------------------
+// queue the response to a command
+static void respond(uint8_t r1, const uint8_t* data = 0, uint8_t n = 0) {
+  // one byte before the response, as real cards do
+  hostOut[0] = 0XFF;
+  hostOut[1] = r1;
+  memcpy(hostOut + 2, data, n);
+  hostOutPos = 0;
+  hostOutLen = 2 + n;
+}
+//------------------------------------------------------------------------------
+// queue a register read by CMD9 or CMD10 after its R1
+static void respondRegister(const uint8_t* reg) {
+  uint8_t d[1 + 16 + 2];
+  d[0] = DATA_START_BLOCK;
+  memcpy(d + 1, reg, 16);
+  d[17] = d[18] = 0XFF;
+  respond(R1_READY_STATE, d, sizeof(d));
+}
+//------------------------------------------------------------------------------
+static void command() {
+  static const uint8_t cid[16] = {
+    0X00, 'S', 'H', 'H', 'O', 'S', 'T', ' ', 0X10, 0, 0, 0, 1, 0X01, 0X4A, 0X01
+  };
+  uint8_t cmd = hostCmd[0] & 0X3F;
+  uint32_t arg = (uint32_t)hostCmd[1] << 24 | (uint32_t)hostCmd[2] << 16
+                 | (uint32_t)hostCmd[3] << 8 | hostCmd[4];
+  uint8_t r1 = hostIdle ? R1_IDLE_STATE : R1_READY_STATE;
+  bool app = hostAppCmd;
+
+  sdHostStats.commands++;
+  sdHostStats.command[cmd]++;
+  hostAppCmd = false;
+  if (app && cmd == ACMD41) {
+    hostIdle = false;
+    respond(R1_READY_STATE);
+  } else if (app && cmd == ACMD23) {
+    respond(r1);
+  } else if (cmd == CMD0) {
+    hostIdle = true;
+    hostState = HOST_NONE;
+    respond(R1_IDLE_STATE);
+  } else if (cmd == CMD8) {
+    uint8_t d[4] = {0, 0, (uint8_t)(arg >> 8 & 0XF), (uint8_t)arg};
+    respond(r1, d, 4);
+  } else if (cmd == CMD9) {
+    // version 2 CSD, c_size in bytes 7 to 9, single block erase enabled
+    uint32_t c = (hostBlocks >> 10) - 1;
+    uint8_t csd[16] = {
+      0X40, 0X0E, 0X00, 0X32, 0X5B, 0X59, 0X00, (uint8_t)(c >> 16 & 0X3F),
+      (uint8_t)(c >> 8), (uint8_t)c, 0X7F, 0X80, 0X0A, 0X40, 0X00, 0X01
+    };
+    respondRegister(csd);
+  } else if (cmd == CMD10) {
+    respondRegister(cid);
+  } else if (cmd == CMD12) {
+    hostState = HOST_NONE;
+    // the stuff byte Sd2Card skips is the byte respond() puts first
+    respond(R1_READY_STATE);
+  } else if (cmd == CMD13) {
+    uint8_t d = 0;
+    respond(r1, &d, 1);
+  } else if (cmd == CMD17 || cmd == CMD18 || cmd == CMD24 || cmd == CMD25) {
+    if (arg >= hostBlocks) {
+      respond(r1 | 0X20);  // address error
+      return;
+    }
+    hostBlock = arg;
+    hostReadyAt = 0;
+    if (cmd == CMD17) hostState = HOST_READ;
+    if (cmd == CMD18) hostState = HOST_READ_MULTIPLE;
+    if (cmd == CMD24) hostState = HOST_WRITE;
+    if (cmd == CMD25) {
+      hostState = HOST_WRITE_MULTIPLE;
+      sdHostStats.multipleWrites++;
+    }
+    respond(r1);
+  } else if (cmd == CMD32 || cmd == CMD33) {
+    if (cmd == CMD32) hostEraseStart = arg;
+    else hostEraseEnd = arg;
+    respond(r1);
+  } else if (cmd == CMD38) {
+    uint8_t zero[512];
+    memset(zero, 0, sizeof(zero));
+    if (hostEraseStart > hostEraseEnd || hostEraseEnd >= hostBlocks) {
+      respond(r1 | 0X20);
+      return;
+    }
+    for (uint32_t b = hostEraseStart; b <= hostEraseEnd; b++) {
+      blockIo(b, zero, true);
+    }
+    sdHostStats.erases++;
+    sdHostStats.erasedBlocks += hostEraseEnd - hostEraseStart + 1;
+    respond(r1);
+    busy(sdHostConfig.eraseMicros);
+  } else if (cmd == CMD55) {
+    hostAppCmd = true;
+    respond(r1);
+  } else if (cmd == CMD58) {
+    // powered up, SDHC, 2.7 to 3.6 volts
+    uint8_t ocr[4] = {0XC0, 0XFF, 0X80, 0X00};
+    respond(r1, ocr, 4);
+  } else if (cmd == CMD59) {
+    respond(r1);
+  } else {
+    respond(r1 | R1_ILLEGAL_COMMAND);
+  }
+}
+//------------------------------------------------------------------------------
+// the last byte of a write block and its CRC has been received
+static void writeDone() {
+  bool ok;
+  if (hostDivisor < sdHostConfig.minDivisor) hostData[hostBlock % 512] ^= 0X10;
+  ok = blockIo(hostBlock, hostData, true);
+  uint32_t t = hostState == HOST_WRITE ? sdHostConfig.writeMicros
+                                       : sdHostConfig.multipleMicros;
+  sdHostStats.blockWrites++;
+  if (hostState == HOST_WRITE) {
+    sdHostStats.singleWrites++;
+    hostState = HOST_NONE;
+  } else {
+    hostBlock++;
+  }
+  if (sdHostConfig.stallEvery
+      && sdHostStats.blockWrites % sdHostConfig.stallEvery == 0) {
+    t += sdHostConfig.stallMicros;
+  }
+  hostOut[0] = ok ? DATA_RES_ACCEPTED : 0X0D;  // write error
+  hostOutPos = 0;
+  hostOutLen = 1;
+  if (!ok || hostBlock >= hostBlocks) hostState = HOST_NONE;
+  busy(t);
+}
+//------------------------------------------------------------------------------
+// queue the next block of a read once the card has it
+static bool readNext() {
+  if (hostReadyAt == 0) {
+    hostReadyAt = hostNanos + 1000ULL * sdHostConfig.readMicros;
+  }
+  if (hostNanos < hostReadyAt) return false;
+  hostReadyAt = 0;
+  hostOut[0] = DATA_START_BLOCK;
+  if (!blockIo(hostBlock, hostOut + 1, false)) {
+    hostOut[0] = 0X08;  // out of range error token
+    hostOutLen = 1;
+    hostState = HOST_NONE;
+  } else {
+    hostOut[513] = hostOut[514] = 0XFF;
+    hostOutLen = 515;
+    sdHostStats.blockReads++;
+    hostBlock++;
+    if (hostState == HOST_READ || hostBlock >= hostBlocks) {
+      hostState = HOST_NONE;
+    }
+  }
+  hostOutPos = 0;
+  return true;
+}
+//------------------------------------------------------------------------------
+// one full duplex byte transfer with the card
+static uint8_t transfer(uint8_t b) {
+  uint64_t active = hostActiveUntil > hostBusyUntil ? hostActiveUntil
+                                                    : hostBusyUntil;
+  if (hostNanos >= active + 1000ULL * sdHostConfig.idleMicros) {
+    sdHostStats.wakeups++;
+  }
+  hostNanos += hostByteNanos;
+  hostActiveUntil = hostNanos;
+  sdHostStats.spiBytes++;
+  if (!hostImage) return 0XFF;
+  if (hostDataLen >= 0) {
+    hostData[hostDataLen++] = b;
+    if (hostDataLen == sizeof(hostData)) {
+      hostDataLen = -1;
+      writeDone();
+    }
+    return 0XFF;
+  }
+  if (hostCmdLen || (b & 0XC0) == 0X40) {
+    // a command ends any response, as CMD12 does a multiple block read
+    hostOutPos = hostOutLen = 0;
+    hostCmd[hostCmdLen++] = b;
+    if (hostCmdLen == sizeof(hostCmd)) {
+      hostCmdLen = 0;
+      command();
+    }
+    return 0XFF;
+  }
+  if (hostOutPos < hostOutLen) return hostOut[hostOutPos++];
+  if (hostNanos < hostBusyUntil) return 0;
+  if (hostState == HOST_READ || hostState == HOST_READ_MULTIPLE) {
+    return readNext() ? hostOut[hostOutPos++] : 0XFF;
+  }
+  if ((hostState == HOST_WRITE && b == DATA_START_BLOCK)
+      || (hostState == HOST_WRITE_MULTIPLE && b == WRITE_MULTIPLE_TOKEN)) {
+    hostDataLen = 0;
+  } else if (hostState == HOST_WRITE_MULTIPLE && b == STOP_TRAN_TOKEN) {
+    hostState = HOST_NONE;
+    busy(sdHostConfig.stopMicros);
+  }
+  return 0XFF;
+}
+//==============================================================================
+void SdSpi::begin() {
+  hostByteNanos = 0;
+}
+//------------------------------------------------------------------------------
+void SdSpi::init(uint8_t sckDivisor) {
+  hostDivisor = sckDivisor;
+  hostByteNanos = 8000000000ULL * sckDivisor / sdHostConfig.cpuHz;
+}
+//------------------------------------------------------------------------------
+uint8_t SdSpi::receive() {
+  return transfer(0XFF);
+}
+//------------------------------------------------------------------------------
+uint8_t SdSpi::receive(uint8_t* buf, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = transfer(0XFF);
+  }
+  return 0;
+}
+//------------------------------------------------------------------------------
+void SdSpi::send(uint8_t b) {
+  transfer(b);
+}
+//------------------------------------------------------------------------------
+void SdSpi::send(const uint8_t* buf , size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    transfer(buf[i]);
+  }
+}
+#endif  // USE_HOST_SPI
@@ -0,0 +1,115 @@
+/* Arduino SdSpi Library
+ * Copyright (C) 2013 by William Greiman
+ *
+ * This file is part of the Arduino SdSpi Library
+ *
+ * This Library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the Arduino SdSpi Library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+ /**
+ * \file
+ * \brief Simulated SD card for host builds
+ *
+ * With ARDUINO_ARCH_HOST defined (see host/Arduino.h) SdSpi talks to an SDHC
+ * card simulated over a disk image file, so Sd2Card, SdVolume, SdBaseFile and
+ * the logging library run unchanged on Linux.  The card decodes the SPI
+ * commands and data tokens Sd2Card sends, counts them in sdHostStats and
+ * keeps the bus busy for the times in sdHostConfig.  Time on the host is
+ * simulated: it advances by one SPI byte time per byte transferred, by card
+ * busy time that is waited for, and by delay().
+ */
+#ifndef SdSpiHost_h
+#define SdSpiHost_h
+#include <utility/SdSpi.h>
+#if USE_HOST_SPI
+//------------------------------------------------------------------------------
+/**
+ * \struct SdHostConfig
+ * \brief Timing of the simulated card.
+ */
+struct SdHostConfig {
+  /** CPU clock, the SPI clock is cpuHz divided by the SCK divisor */
+  uint32_t cpuHz;
+  /** time from a read command to its data token, us */
+  uint32_t readMicros;
+  /** busy time after a single block write, us */
+  uint32_t writeMicros;
+  /** busy time after each block of a multiple block write, us */
+  uint32_t multipleMicros;
+  /** busy time after the stop token of a multiple block write, us */
+  uint32_t stopMicros;
+  /** busy time for an erase command, us */
+  uint32_t eraseMicros;
+  /** every stallEvery block writes take stallMicros longer, zero for never */
+  uint32_t stallEvery;
+  /** extra busy time of a stalled write, us */
+  uint32_t stallMicros;
+  /** blocks written at an SCK divisor below this are stored with a bit
+      flipped, as over wiring too long for the clock; zero for never */
+  uint32_t minDivisor;
+  /** the card drops to its idle current this long after its last transfer
+      or busy time, us */
+  uint32_t idleMicros;
+};
+/** Timing of the simulated card, may be changed at any time */
+extern SdHostConfig sdHostConfig;
+//------------------------------------------------------------------------------
+/**
+ * \struct SdHostStats
+ * \brief Counters kept by the simulated card.
+ */
+struct SdHostStats {
+  /** commands received, CMD55 prefixes included */
+  uint32_t commands;
+  /** blocks read by CMD17 and CMD18 */
+  uint32_t blockReads;
+  /** blocks written by CMD24 and CMD25 */
+  uint32_t blockWrites;
+  /** single block writes, CMD24 */
+  uint32_t singleWrites;
+  /** multiple block write sequences, CMD25 */
+  uint32_t multipleWrites;
+  /** erase commands, CMD38 */
+  uint32_t erases;
+  /** blocks erased by CMD38 */
+  uint32_t erasedBlocks;
+  /** bytes sent or received over SPI */
+  uint32_t spiBytes;
+  /** time the card was busy programming or erasing, us */
+  uint32_t busyMicros;
+  /** transfers that found the card idle, see SdHostConfig::idleMicros */
+  uint32_t wakeups;
+  /** commands received, by command index; an ACMD is counted at its index
+      as well as CMD55 */
+  uint32_t command[64];
+};
+/** Counters kept by the simulated card, may be cleared at any time */
+extern SdHostStats sdHostStats;
+//------------------------------------------------------------------------------
+/** Insert a card backed by a disk image.  The image is used as an SDHC card
+ * of its own size rounded down to a multiple of 512 KiB, so a FAT volume
+ * made with e.g. mkfs.vfat -C card.img 65536 can be mounted by SdFat::begin()
+ * afterwards.  Writes go directly to the file.
+ *
+ * \param[in] path Name of the image file.
+ *
+ * \return true for success or false if the file can not be opened or is
+ * smaller than 512 KiB.
+ */
+bool sdHostOpen(const char* path);
+/** Remove the card; commands are not answered until sdHostOpen() is called
+ *  again. */
+void sdHostClose();
+#endif  // USE_HOST_SPI
+#endif  // SdSpiHost_h
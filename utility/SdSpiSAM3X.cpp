@@ -213,4 +213,25 @@ void SdSpi::send(const uint8_t* buf , size_t n) {
   // leave RDR empty
   uint8_t b = pSpi->SPI_RDR;
 }
+//------------------------------------------------------------------------------
+/** SPI start sending multiple bytes */
+void SdSpi::sendStart(const uint8_t* buf , size_t n) {
+#if USE_SAM3X_DMAC
+  spiDmaTX(buf, n);
+#else  // USE_SAM3X_DMAC
+  send(buf, n);
+#endif  // USE_SAM3X_DMAC
+}
+//------------------------------------------------------------------------------
+/** SPI check for the end of sendStart() */
+bool SdSpi::sendDone() {
+#if USE_SAM3X_DMAC
+  Spi* pSpi = SPI0;
+  if (!dmac_channel_transfer_done(SPI_DMAC_TX_CH)) return false;
+  while ((pSpi->SPI_SR & SPI_SR_TXEMPTY) == 0) {}
+  // leave RDR empty
+  uint8_t b = pSpi->SPI_RDR;
+#endif  // USE_SAM3X_DMAC
+  return true;
+}
 #endif  // USE_NATIVE_SAM3X_SPI
@@ -42,9 +42,7 @@ uint8_t SdSpi::receive() {
 //------------------------------------------------------------------------------
 /** Soft SPI read data */
 uint8_t SdSpi::receive(uint8_t* buf, size_t n) {
-  for (size_t i = 0; i < n; i++) {
-    buf[i] = receive();
-  }
+  softSpiBus.receive(buf, n);
   return 0;
 }
 //------------------------------------------------------------------------------
@@ -53,9 +51,8 @@ void SdSpi::send(uint8_t data) {
   softSpiBus.send(data);
 }
 //------------------------------------------------------------------------------
+/** Soft SPI send data */
 void SdSpi::send(const uint8_t* buf , size_t n) {
-  for (size_t i = 0; i < n; i++) {
-    send(buf[i]);
-  }
+  softSpiBus.send(buf, n);
 }
 #endif  // USE_SOFTWARE_SPI
\ No newline at end of file
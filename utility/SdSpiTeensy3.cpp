@@ -25,6 +25,14 @@
 #define SPI_USE_8BIT_FRAME 0
 // Limit initial fifo to three entries to avoid fifo overrun
 #define SPI_INITIAL_FIFO_DEPTH 3
+/** Use DMA for multiple byte transfers if nonzero */
+#define USE_TEENSY3_DMA 1
+/** Time in ms for DMA receive timeout */
+#define TEENSY3_DMA_TIMEOUT 100
+/** DMA transmit channel, the TCD0 registers are used below */
+#define SPI_DMA_TX_CH 0
+/** DMA receive channel, the TCD1 registers are used below */
+#define SPI_DMA_RX_CH 1
 // define some symbols that are not in mk20dx128.h
 #ifndef SPI_SR_RXCTR
 #define SPI_SR_RXCTR 0XF0
@@ -41,7 +49,53 @@
  */
 void SdSpi::begin() {
   SIM_SCGC6 |= SIM_SCGC6_SPI0;
+#if USE_TEENSY3_DMA
+  SIM_SCGC6 |= SIM_SCGC6_DMAMUX;
+  SIM_SCGC7 |= SIM_SCGC7_DMA;
+  DMAMUX0_CHCFG0 = 0;
+  DMAMUX0_CHCFG1 = 0;
+  DMAMUX0_CHCFG0 = DMAMUX_SOURCE_SPI0_TX | DMAMUX_ENABLE;
+  DMAMUX0_CHCFG1 = DMAMUX_SOURCE_SPI0_RX | DMAMUX_ENABLE;
+#endif  // USE_TEENSY3_DMA
 }
+#if USE_TEENSY3_DMA
+//------------------------------------------------------------------------------
+// frame count at the end of the transfer started by sendStart()
+static uint16_t txEndCount;
+//------------------------------------------------------------------------------
+// start RX DMA, one byte from POPR per RX FIFO drain request
+static void spiDmaRX(uint8_t* dst, uint16_t count) {
+  DMA_TCD1_SADDR = &SPI0_POPR;
+  DMA_TCD1_SOFF = 0;
+  DMA_TCD1_ATTR = DMA_TCD_ATTR_SSIZE(0) | DMA_TCD_ATTR_DSIZE(0);
+  DMA_TCD1_NBYTES_MLNO = 1;
+  DMA_TCD1_SLAST = 0;
+  DMA_TCD1_DADDR = dst;
+  DMA_TCD1_DOFF = 1;
+  DMA_TCD1_CITER_ELINKNO = count;
+  DMA_TCD1_DLASTSGA = 0;
+  DMA_TCD1_BITER_ELINKNO = count;
+  DMA_TCD1_CSR = DMA_TCD_CSR_DREQ;
+  DMA_SERQ = SPI_DMA_RX_CH;
+}
+//------------------------------------------------------------------------------
+// start TX DMA, one 8-bit CTAR0 frame per TX FIFO fill request
+static void spiDmaTX(const uint8_t* src, uint16_t count) {
+  static uint8_t ff = 0XFF;
+  DMA_TCD0_SADDR = src ? src : &ff;
+  DMA_TCD0_SOFF = src ? 1 : 0;
+  DMA_TCD0_ATTR = DMA_TCD_ATTR_SSIZE(0) | DMA_TCD_ATTR_DSIZE(0);
+  DMA_TCD0_NBYTES_MLNO = 1;
+  DMA_TCD0_SLAST = 0;
+  DMA_TCD0_DADDR = &SPI0_PUSHR;
+  DMA_TCD0_DOFF = 0;
+  DMA_TCD0_CITER_ELINKNO = count;
+  DMA_TCD0_DLASTSGA = 0;
+  DMA_TCD0_BITER_ELINKNO = count;
+  DMA_TCD0_CSR = DMA_TCD_CSR_DREQ;
+  DMA_SERQ = SPI_DMA_TX_CH;
+}
+#endif  // USE_TEENSY3_DMA
 //------------------------------------------------------------------------------
 /**
  * Initialize hardware SPI
@@ -105,7 +159,27 @@ uint8_t SdSpi::receive() {
 uint8_t SdSpi::receive(uint8_t* buf, size_t n) {
   // clear any data in RX FIFO
   SPI0_MCR = SPI_MCR_MSTR | SPI_MCR_CLR_RXF | SPI_MCR_PCSIS(0x1F);
-#if SPI_USE_8BIT_FRAME
+#if USE_TEENSY3_DMA
+  uint8_t rtn = 0;
+  SPI0_SR = SPI_SR_RFOF;
+  SPI0_RSER = SPI_RSER_TFFF_RE | SPI_RSER_TFFF_DIRS |
+              SPI_RSER_RFDF_RE | SPI_RSER_RFDF_DIRS;
+  spiDmaRX(buf, n);
+  spiDmaTX(0, n);
+
+  uint32_t m = millis();
+  while (!(DMA_TCD1_CSR & DMA_TCD_CSR_DONE)) {
+    if ((millis() - m) > TEENSY3_DMA_TIMEOUT) {
+      DMA_CERQ = SPI_DMA_RX_CH;
+      DMA_CERQ = SPI_DMA_TX_CH;
+      rtn = 2;
+      break;
+    }
+  }
+  SPI0_RSER = 0;
+  if (SPI0_SR & SPI_SR_RFOF) rtn |= 1;
+  return rtn;
+#elif SPI_USE_8BIT_FRAME
   // initial number of bytes to push into TX FIFO
   int nf = n < SPI_INITIAL_FIFO_DEPTH ? n : SPI_INITIAL_FIFO_DEPTH;
   for (int i = 0; i < nf; i++) {
@@ -152,7 +226,7 @@ uint8_t SdSpi::receive(uint8_t* buf, size_t n) {
     *buf++ = w >> 8;
     *buf++ = w & 0XFF;
   }
-#endif  // SPI_USE_8BIT_FRAME
+#endif  // USE_TEENSY3_DMA
   return 0;
 }
 //------------------------------------------------------------------------------
@@ -220,4 +294,29 @@ void SdSpi::send(const uint8_t* buf , size_t n) {
   }
 #endif  // SPI_USE_8BIT_FRAME
 }
+//------------------------------------------------------------------------------
+/** SPI start sending multiple bytes */
+void SdSpi::sendStart(const uint8_t* buf , size_t n) {
+#if USE_TEENSY3_DMA
+  // clear any data in RX FIFO, received bytes are dropped when it is full
+  SPI0_MCR = SPI_MCR_MSTR | SPI_MCR_CLR_RXF | SPI_MCR_PCSIS(0x1F);
+  // the transfer counter shows when the last frame has been sent
+  txEndCount = (SPI0_TCR >> 16) + n;
+  SPI0_RSER = SPI_RSER_TFFF_RE | SPI_RSER_TFFF_DIRS;
+  spiDmaTX(buf, n);
+#else  // USE_TEENSY3_DMA
+  send(buf, n);
+#endif  // USE_TEENSY3_DMA
+}
+//------------------------------------------------------------------------------
+/** SPI check for the end of sendStart() */
+bool SdSpi::sendDone() {
+#if USE_TEENSY3_DMA
+  if ((uint16_t)(SPI0_TCR >> 16) != txEndCount) return false;
+  SPI0_RSER = 0;
+  SPI0_MCR = SPI_MCR_MSTR | SPI_MCR_CLR_RXF | SPI_MCR_PCSIS(0x1F);
+  SPI0_SR = SPI_SR_RFOF;
+#endif  // USE_TEENSY3_DMA
+  return true;
+}
 #endif  // USE_NATIVE_TEENSY3_SPI
@@ -31,6 +31,12 @@ cache_t  SdVolume::m_cacheFatBuffer;       // 512 byte cache for FAT
 uint32_t SdVolume::m_cacheFatBlockNumber;  // current Fat block number
 uint8_t  SdVolume::m_cacheFatStatus;       // status of cache Fatblock
 #endif  // USE_SEPARATE_FAT_CACHE
+#if SD_CACHE_BLOCK_COUNT > 1
+cache_t  SdVolume::m_cachePool[SD_CACHE_BLOCK_COUNT - 1];        // evicted blocks
+uint32_t SdVolume::m_cachePoolBlock[SD_CACHE_BLOCK_COUNT - 1];  // their numbers
+uint8_t  SdVolume::m_cachePoolStatus[SD_CACHE_BLOCK_COUNT - 1];  // their status
+uint8_t  SdVolume::m_cachePoolOrder[SD_CACHE_BLOCK_COUNT - 1];   // slots, MRU first
+#endif  // SD_CACHE_BLOCK_COUNT > 1
 Sd2Card* SdVolume::m_sdCard;            // pointer to SD card object
 #endif  // USE_MULTIPLE_CARDS
 //------------------------------------------------------------------------------
@@ -63,6 +69,13 @@ bool SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
   // end of group
   endCluster = bgnCluster;
 
+  // known not to fit, no need to search; a count from FSINFO may be stale,
+  // so the FAT is counted before giving up
+  if (m_freeClusterCount >= 0 && count > (uint32_t)m_freeClusterCount &&
+      (exactFreeClusterCount() < 0 || count > (uint32_t)m_freeClusterCount)) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
   // search the FAT for free clusters
   for (uint32_t n = 0;; n++, endCluster++) {
     // can't find space checked all clusters
@@ -90,8 +103,11 @@ bool SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
       break;
     }
   }
-  // remember possible next free cluster
-  if (setStart) m_allocSearchStart = endCluster + 1;
+  // remember possible next free cluster, also when a file that ends at the
+  // search start grows into it
+  if (setStart || bgnCluster == m_allocSearchStart) {
+    m_allocSearchStart = endCluster + 1;
+  }
 
   // mark end of chain
   if (!fatPutEOC(endCluster)) {
@@ -113,6 +129,8 @@ bool SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
       goto fail;
     }
   }
+  freeClustersChanged(-(int32_t)count);
+  SD_STATS(sdStats.clusterAllocs += count);
   // return first cluster number to caller
   *curCluster = bgnCluster;
   return true;
@@ -129,7 +147,16 @@ cache_t* SdVolume::cacheFetch(uint32_t blockNumber, uint8_t options) {
 }
 //------------------------------------------------------------------------------
 cache_t* SdVolume::cacheFetchData(uint32_t blockNumber, uint8_t options) {
+#if SD_CACHE_BLOCK_COUNT > 1
+  // take the block from the pool if it is there
+  if (m_cacheBlockNumber != blockNumber && cachePoolSwap(&m_cacheBuffer,
+      &m_cacheBlockNumber, &m_cacheStatus, blockNumber) < 0) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+#endif  // SD_CACHE_BLOCK_COUNT > 1
   if (m_cacheBlockNumber != blockNumber) {
+    SD_STATS(sdStats.cacheMisses++);
     if (!cacheWriteData()) {
       DBG_FAIL_MACRO;
       goto fail;
@@ -151,7 +178,16 @@ cache_t* SdVolume::cacheFetchData(uint32_t blockNumber, uint8_t options) {
 }
 //------------------------------------------------------------------------------
 cache_t* SdVolume::cacheFetchFat(uint32_t blockNumber, uint8_t options) {
+#if SD_CACHE_BLOCK_COUNT > 1
+  // take the block from the pool if it is there
+  if (m_cacheFatBlockNumber != blockNumber && cachePoolSwap(&m_cacheFatBuffer,
+      &m_cacheFatBlockNumber, &m_cacheFatStatus, blockNumber) < 0) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+#endif  // SD_CACHE_BLOCK_COUNT > 1
   if (m_cacheFatBlockNumber != blockNumber) {
+    SD_STATS(sdStats.cacheMisses++);
     if (!cacheWriteFat()) {
       DBG_FAIL_MACRO;
       goto fail;
@@ -165,7 +201,8 @@ cache_t* SdVolume::cacheFetchFat(uint32_t blockNumber, uint8_t options) {
     m_cacheFatStatus = 0;
     m_cacheFatBlockNumber = blockNumber;
   }
-  m_cacheFatStatus |= options & CACHE_STATUS_MASK;
+  // mark FAT blocks so that the pool mirrors them when it writes them back
+  m_cacheFatStatus |= (options & CACHE_STATUS_MASK) | CACHE_STATUS_FAT_BLOCK;
   return &m_cacheFatBuffer;
 
  fail:
@@ -173,7 +210,7 @@ cache_t* SdVolume::cacheFetchFat(uint32_t blockNumber, uint8_t options) {
 }
 //------------------------------------------------------------------------------
 bool SdVolume::cacheSync() {
-  return cacheWriteData() && cacheWriteFat();
+  return cacheWriteData() && cacheWriteFat() && cachePoolSync();
 }
 //------------------------------------------------------------------------------
 bool SdVolume::cacheWriteData() {
@@ -214,8 +251,18 @@ bool SdVolume::cacheWriteFat() {
 #else  // USE_SEPARATE_FAT_CACHE
 //------------------------------------------------------------------------------
 cache_t* SdVolume::cacheFetch(uint32_t blockNumber, uint8_t options) {
+#if SD_CACHE_BLOCK_COUNT > 1
+  // take the block from the pool if it is there
+  if (m_cacheBlockNumber != blockNumber && cachePoolSwap(&m_cacheBuffer,
+      &m_cacheBlockNumber, &m_cacheStatus, blockNumber) < 0) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+#endif  // SD_CACHE_BLOCK_COUNT > 1
   if (m_cacheBlockNumber != blockNumber) {
-    if (!cacheSync()) {
+    SD_STATS(sdStats.cacheMisses++);
+    // with a pool the buffer is clean here, so this writes nothing
+    if (!cacheWriteData()) {
       DBG_FAIL_MACRO;
       goto fail;
     }
@@ -240,6 +287,10 @@ cache_t* SdVolume::cacheFetchFat(uint32_t blockNumber, uint8_t options) {
 }
 //------------------------------------------------------------------------------
 bool SdVolume::cacheSync() {
+  return cacheWriteData() && cachePoolSync();
+}
+//------------------------------------------------------------------------------
+bool SdVolume::cacheWriteData() {
   if (m_cacheStatus & CACHE_STATUS_DIRTY) {
     if (!m_sdCard->writeBlock(m_cacheBlockNumber, m_cacheBuffer.data)) {
       DBG_FAIL_MACRO;
@@ -260,16 +311,159 @@ bool SdVolume::cacheSync() {
  fail:
   return false;
 }
-//------------------------------------------------------------------------------
-bool SdVolume::cacheWriteData() {
-  return cacheSync();
-}
 #endif  // USE_SEPARATE_FAT_CACHE
 //------------------------------------------------------------------------------
 void SdVolume::cacheInvalidate() {
     m_cacheBlockNumber = 0XFFFFFFFF;
     m_cacheStatus = 0;
 }
+//------------------------------------------------------------------------------
+// Drop any cached copy of a block that is about to be written directly.
+void SdVolume::cacheDiscard(uint32_t blockNumber) {
+  if (m_cacheBlockNumber == blockNumber) cacheInvalidate();
+#if SD_CACHE_BLOCK_COUNT > 1
+  for (uint8_t i = 0; i < SD_CACHE_BLOCK_COUNT - 1; i++) {
+    if (m_cachePoolBlock[i] == blockNumber) {
+      m_cachePoolBlock[i] = 0XFFFFFFFF;
+      m_cachePoolStatus[i] = 0;
+    }
+  }
+#endif  // SD_CACHE_BLOCK_COUNT > 1
+}
+//------------------------------------------------------------------------------
+// Check whether any of count blocks starting at blockNumber is in the cache
+// buffer or the cache pool.
+bool SdVolume::cacheHolds(uint32_t blockNumber, uint8_t count) {
+  if (m_cacheBlockNumber >= blockNumber &&
+      m_cacheBlockNumber < blockNumber + count) {
+    return true;
+  }
+#if SD_CACHE_BLOCK_COUNT > 1
+  for (uint8_t i = 0; i < SD_CACHE_BLOCK_COUNT - 1; i++) {
+    if (m_cachePoolBlock[i] >= blockNumber &&
+        m_cachePoolBlock[i] < blockNumber + count) {
+      return true;
+    }
+  }
+#endif  // SD_CACHE_BLOCK_COUNT > 1
+  return false;
+}
+//------------------------------------------------------------------------------
+cache_t* SdVolume::cacheRelease() {
+#if SD_CACHE_BLOCK_COUNT > 1
+  if (cachePoolSwap(&m_cacheBuffer, &m_cacheBlockNumber,
+                    &m_cacheStatus, 0XFFFFFFFF) < 0) {
+    DBG_FAIL_MACRO;
+    return 0;
+  }
+  return &m_cacheBuffer;
+#else  // SD_CACHE_BLOCK_COUNT > 1
+  return cacheClear();
+#endif  // SD_CACHE_BLOCK_COUNT > 1
+}
+//------------------------------------------------------------------------------
+void SdVolume::cachePoolInvalidate() {
+#if SD_CACHE_BLOCK_COUNT > 1
+  for (uint8_t i = 0; i < SD_CACHE_BLOCK_COUNT - 1; i++) {
+    m_cachePoolBlock[i] = 0XFFFFFFFF;
+    m_cachePoolStatus[i] = 0;
+    m_cachePoolOrder[i] = i;
+  }
+#endif  // SD_CACHE_BLOCK_COUNT > 1
+}
+//------------------------------------------------------------------------------
+bool SdVolume::cachePoolSync() {
+#if SD_CACHE_BLOCK_COUNT > 1
+  for (uint8_t i = 0; i < SD_CACHE_BLOCK_COUNT - 1; i++) {
+    if (!cachePoolWrite(i)) {
+      DBG_FAIL_MACRO;
+      return false;
+    }
+  }
+#endif  // SD_CACHE_BLOCK_COUNT > 1
+  return true;
+}
+#if SD_CACHE_BLOCK_COUNT > 1
+//------------------------------------------------------------------------------
+// Exchange the block in a cache buffer for blockNumber.  If the pool holds
+// blockNumber the two blocks swap places, otherwise the buffer's block
+// replaces the least recently used block in the pool, which is written back
+// if dirty, and the buffer is left empty for the caller to read into.  The
+// buffer's old block becomes the most recently used block in the pool.
+// Returns 1 if the buffer now holds blockNumber, 0 if it is empty and -1 if
+// a write back failed.
+int8_t SdVolume::cachePoolSwap(cache_t* buf, uint32_t* bufBlock,
+                               uint8_t* bufStatus, uint32_t blockNumber) {
+  const uint8_t n = SD_CACHE_BLOCK_COUNT - 1;
+  uint32_t poolBlock;
+  uint8_t poolStatus;
+  uint8_t i, slot;
+  bool hit;
+
+  for (i = 0; i < n - 1; i++) {
+    if (m_cachePoolBlock[m_cachePoolOrder[i]] == blockNumber) break;
+  }
+  slot = m_cachePoolOrder[i];
+  hit = m_cachePoolBlock[slot] == blockNumber;
+  if (!hit) {
+    if (*bufBlock == 0XFFFFFFFF) return 0;
+    if (!cachePoolWrite(slot)) {
+      DBG_FAIL_MACRO;
+      return -1;
+    }
+    memcpy(m_cachePool[slot].data, buf->data, 512);
+    poolBlock = 0XFFFFFFFF;
+    poolStatus = 0;
+  } else {
+    // swap a word at a time, there is no room for a third buffer
+    for (uint16_t k = 0; k < 128; k++) {
+      uint32_t t = m_cachePool[slot].fat32[k];
+      m_cachePool[slot].fat32[k] = buf->fat32[k];
+      buf->fat32[k] = t;
+    }
+    poolBlock = m_cachePoolBlock[slot];
+    poolStatus = m_cachePoolStatus[slot];
+    SD_STATS(if (blockNumber != 0XFFFFFFFF) sdStats.cacheHits++);
+  }
+  m_cachePoolBlock[slot] = *bufBlock;
+  m_cachePoolStatus[slot] = *bufStatus;
+  *bufBlock = poolBlock;
+  *bufStatus = poolStatus;
+
+  // most recently used first, empty slots last
+  if (m_cachePoolBlock[slot] != 0XFFFFFFFF) {
+    for (; i > 0; i--) m_cachePoolOrder[i] = m_cachePoolOrder[i - 1];
+    m_cachePoolOrder[0] = slot;
+  } else {
+    for (; i < n - 1; i++) m_cachePoolOrder[i] = m_cachePoolOrder[i + 1];
+    m_cachePoolOrder[n - 1] = slot;
+  }
+  return hit ? 1 : 0;
+}
+//------------------------------------------------------------------------------
+// Write back a pool block if it is dirty.
+bool SdVolume::cachePoolWrite(uint8_t slot) {
+  if (m_cachePoolStatus[slot] & CACHE_STATUS_DIRTY) {
+    uint32_t lbn = m_cachePoolBlock[slot];
+    if (!m_sdCard->writeBlock(lbn, m_cachePool[slot].data)) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+    // mirror second FAT
+    if ((m_cachePoolStatus[slot] & CACHE_STATUS_FAT_BLOCK) && m_fatCount > 1) {
+      if (!m_sdCard->writeBlock(lbn + m_blocksPerFat, m_cachePool[slot].data)) {
+        DBG_FAIL_MACRO;
+        goto fail;
+      }
+    }
+    m_cachePoolStatus[slot] &= ~CACHE_STATUS_DIRTY;
+  }
+  return true;
+
+ fail:
+  return false;
+}
+#endif  // SD_CACHE_BLOCK_COUNT > 1
 //==============================================================================
 //------------------------------------------------------------------------------
 uint32_t SdVolume::clusterStartBlock(uint32_t cluster) const {
@@ -415,6 +609,7 @@ bool SdVolume::freeChain(uint32_t cluster) {
       goto fail;
     }
     if (cluster < m_allocSearchStart) m_allocSearchStart = cluster;
+    freeClustersChanged(1);
     cluster = next;
   } while (!isEOC(cluster));
 
@@ -424,7 +619,38 @@ bool SdVolume::freeChain(uint32_t cluster) {
   return false;
 }
 //------------------------------------------------------------------------------
+// write the free cluster count and next free cluster back to FSINFO
+bool SdVolume::fsInfoSync() {
+  cache_t* pc;
+
+  if (!m_fsInfoDirty) return true;
+  // all of the sector is known, no need to read it
+  pc = cacheFetch(m_fsInfoBlock, CACHE_RESERVE_FOR_WRITE);
+  if (!pc) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  memset(pc, 0, sizeof(cache_t));
+  pc->fsinfo.leadSignature = FSINFO_LEAD_SIG;
+  pc->fsinfo.structSignature = FSINFO_STRUCT_SIG;
+  // 0XFFFFFFFF if not known
+  pc->fsinfo.freeCount = m_freeClusterCount;
+  pc->fsinfo.nextFree = m_allocSearchStart;
+  pc->fsinfo.tailSignature[2] = 0X55;
+  pc->fsinfo.tailSignature[3] = 0XAA;
+  m_fsInfoDirty = false;
+  return true;
+
+ fail:
+  return false;
+}
+//------------------------------------------------------------------------------
 /** Volume free space in clusters.
+ *
+ * The count is kept up to date as clusters are allocated and freed.  It is
+ * taken from the FSINFO sector of FAT32 volumes, otherwise the FAT is read
+ * once to count the free clusters.  The FSINFO count is only a hint, see
+ * exactFreeClusterCount().
  *
  * \return Count of free clusters for success or -1 if an error occurs.
  */
@@ -434,6 +660,7 @@ int32_t SdVolume::freeClusterCount() {
   uint32_t todo = m_clusterCount + 2;
   uint16_t n;
 
+  if (m_freeClusterCount >= 0) return m_freeClusterCount;
   if (FAT12_SUPPORT && m_fatType == 12) {
     for (unsigned i = 2; i < todo; i++) {
       uint32_t c;
@@ -469,12 +696,31 @@ int32_t SdVolume::freeClusterCount() {
     DBG_FAIL_MACRO;
     goto fail;
   }
+  m_freeClusterCount = free;
+  m_fsInfoDirty = m_fsInfoBlock != 0;
   return free;
 
  fail:
   return -1;
 }
 //------------------------------------------------------------------------------
+/** Volume free space in clusters, counted in the FAT.
+ *
+ * The FAT spec treats the FSINFO free count as a hint: other systems, or a
+ * power loss before FSINFO was written, can leave it stale.  If the count
+ * came from FSINFO, the FAT is read once to count the free clusters, and
+ * FSINFO is rewritten with the result at the next sync.
+ *
+ * \return Count of free clusters for success or -1 if an error occurs.
+ */
+int32_t SdVolume::exactFreeClusterCount() {
+  if (m_freeCountHint) {
+    m_freeCountHint = false;
+    m_freeClusterCount = -1;
+  }
+  return freeClusterCount();
+}
+//------------------------------------------------------------------------------
 /** Initialize a FAT volume.
  *
  * \param[in] dev The SD card where the volume is located.
@@ -498,8 +744,13 @@ bool SdVolume::init(Sd2Card* dev, uint8_t part) {
   m_sdCard = dev;
   m_fatType = 0;
   m_allocSearchStart = 2;
+  m_freeClusterCount = -1;
+  m_freeCountHint = false;
+  m_fsInfoBlock = 0;
+  m_fsInfoDirty = false;
   m_cacheStatus = 0;  // cacheSync() will write block if true
   m_cacheBlockNumber = 0XFFFFFFFF;
+  cachePoolInvalidate();
 #if USE_SEPARATE_FAT_CACHE
   m_cacheFatStatus = 0;  // cacheSync() will write block if true
   m_cacheFatBlockNumber = 0XFFFFFFFF;
@@ -587,6 +838,30 @@ bool SdVolume::init(Sd2Card* dev, uint8_t part) {
   } else {
     m_rootDirStart = fbs->fat32RootCluster;
     m_fatType = 32;
+    if (fbs->fat32FSInfo) {
+      m_fsInfoBlock = volumeStartBlock + fbs->fat32FSInfo;
+    }
+  }
+  // take the free count and next free cluster from FSINFO, if they are sane
+  if (m_fsInfoBlock) {
+    pc = cacheFetch(m_fsInfoBlock, CACHE_FOR_READ);
+    if (!pc) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+    if (pc->fsinfo.leadSignature != FSINFO_LEAD_SIG ||
+        pc->fsinfo.structSignature != FSINFO_STRUCT_SIG) {
+      // don't overwrite a sector that isn't FSINFO
+      m_fsInfoBlock = 0;
+    } else {
+      if (pc->fsinfo.freeCount <= m_clusterCount) {
+        m_freeClusterCount = pc->fsinfo.freeCount;
+        m_freeCountHint = true;
+      }
+      if (pc->fsinfo.nextFree >= 2 && pc->fsinfo.nextFree <= m_clusterCount + 1) {
+        m_allocSearchStart = pc->fsinfo.nextFree;
+      }
+    }
   }
   return true;
 
@@ -70,9 +70,17 @@ class SdVolume {
    */
   cache_t* cacheClear() {
     if (!cacheSync()) return 0;
+    cachePoolInvalidate();
     m_cacheBlockNumber = 0XFFFFFFFF;
     return &m_cacheBuffer;
   }
+  /** Move the cached block out of the cache buffer, so the buffer can be
+   * used as scratch memory until the next cache fetch.  With a cache pool
+   * (SD_CACHE_BLOCK_COUNT > 1) the block stays cached in the pool,
+   * otherwise this is cacheClear().
+   * \return A pointer to the cache buffer or zero if an error occurs.
+   */
+  cache_t* cacheRelease();
   /** Initialize a FAT volume.  Try partition one first then try super
    * floppy format.
    *
@@ -104,6 +112,7 @@ class SdVolume {
   /** \return The FAT type of the volume. Values are 12, 16 or 32. */
   uint8_t fatType() const {return m_fatType;}
   int32_t freeClusterCount();
+  int32_t exactFreeClusterCount();
   /** \return The number of entries in the root directory for FAT16 volumes. */
   uint32_t rootDirEntryCount() const {return m_rootDirEntryCount;}
   /** \return The logical block number for the start of the root directory
@@ -128,6 +137,10 @@ class SdVolume {
   friend class SdBaseFile;
 //------------------------------------------------------------------------------
   uint32_t m_allocSearchStart;   // Start cluster for alloc search.
+  int32_t m_freeClusterCount;    // Free clusters, -1 if not known yet.
+  bool m_freeCountHint;          // Free count taken from FSINFO, not counted.
+  uint32_t m_fsInfoBlock;        // FAT32 FSINFO block, zero if none.
+  bool m_fsInfoDirty;            // FSINFO needs to be written.
   uint8_t m_blocksPerCluster;    // Cluster size in blocks.
   uint8_t m_clusterBlockMask;    // Mask to extract block of cluster.
   uint32_t m_clusterCount;       // Clusters in one FAT.
@@ -165,6 +178,12 @@ class SdVolume {
   uint32_t m_cacheFatBlockNumber;  // current Fat block number
   uint8_t  m_cacheFatStatus;       // status of cache Fatblock
 #endif  // USE_SEPARATE_FAT_CACHE
+#if SD_CACHE_BLOCK_COUNT > 1
+  cache_t m_cachePool[SD_CACHE_BLOCK_COUNT - 1];         // evicted blocks
+  uint32_t m_cachePoolBlock[SD_CACHE_BLOCK_COUNT - 1];   // their numbers
+  uint8_t m_cachePoolStatus[SD_CACHE_BLOCK_COUNT - 1];   // their status
+  uint8_t m_cachePoolOrder[SD_CACHE_BLOCK_COUNT - 1];    // slots, MRU first
+#endif  // SD_CACHE_BLOCK_COUNT > 1
 #else  // USE_MULTIPLE_CARDS
   static uint8_t m_fatCount;            // number of FATs on volume
   static uint32_t m_blocksPerFat;       // FAT size in blocks
@@ -176,6 +195,12 @@ class SdVolume {
   static uint32_t m_cacheFatBlockNumber;  // current Fat block number
   static uint8_t  m_cacheFatStatus;       // status of cache Fatblock
 #endif  // USE_SEPARATE_FAT_CACHE
+#if SD_CACHE_BLOCK_COUNT > 1
+  static cache_t m_cachePool[SD_CACHE_BLOCK_COUNT - 1];        // evicted blocks
+  static uint32_t m_cachePoolBlock[SD_CACHE_BLOCK_COUNT - 1];  // their numbers
+  static uint8_t m_cachePoolStatus[SD_CACHE_BLOCK_COUNT - 1];  // their status
+  static uint8_t m_cachePoolOrder[SD_CACHE_BLOCK_COUNT - 1];   // slots, MRU first
+#endif  // SD_CACHE_BLOCK_COUNT > 1
   static Sd2Card* m_sdCard;            // Sd2Card object for cache
 #endif  // USE_MULTIPLE_CARDS
 
@@ -188,6 +213,13 @@ class SdVolume {
   bool cacheSync();
   bool cacheWriteData();
   bool cacheWriteFat();
+  void cacheDiscard(uint32_t blockNumber);
+  bool cacheHolds(uint32_t blockNumber, uint8_t count);
+  void cachePoolInvalidate();
+  bool cachePoolSync();
+  int8_t cachePoolSwap(cache_t* buf, uint32_t* bufBlock, uint8_t* bufStatus,
+                       uint32_t blockNumber);
+  bool cachePoolWrite(uint8_t slot);
 #else  // USE_MULTIPLE_CARDS
   static cache_t* cacheFetch(uint32_t blockNumber, uint8_t options);
   static cache_t* cacheFetchData(uint32_t blockNumber, uint8_t options);
@@ -196,6 +228,13 @@ class SdVolume {
   static bool cacheSync();
   static bool cacheWriteData();
   static bool cacheWriteFat();
+  static void cacheDiscard(uint32_t blockNumber);
+  static bool cacheHolds(uint32_t blockNumber, uint8_t count);
+  static void cachePoolInvalidate();
+  static bool cachePoolSync();
+  static int8_t cachePoolSwap(cache_t* buf, uint32_t* bufBlock,
+                              uint8_t* bufStatus, uint32_t blockNumber);
+  static bool cachePoolWrite(uint8_t slot);
 #endif  // USE_MULTIPLE_CARDS
 //------------------------------------------------------------------------------
   bool allocContiguous(uint32_t count, uint32_t* curCluster);
@@ -208,6 +247,11 @@ class SdVolume {
     return fatPut(cluster, 0x0FFFFFFF);
   }
   bool freeChain(uint32_t cluster);
+  void freeClustersChanged(int32_t change) {
+    if (m_freeClusterCount >= 0) m_freeClusterCount += change;
+    m_fsInfoDirty = m_fsInfoBlock != 0;
+  }
+  bool fsInfoSync();
   bool isEOC(uint32_t cluster) const {
     if (FAT12_SUPPORT && m_fatType == 12) return  cluster >= FAT12EOC_MIN;
     if (m_fatType == 16) return cluster >= FAT16EOC_MIN;
@@ -89,6 +89,28 @@ class SoftSPI {
     sendBit(0, data);
   }
   //----------------------------------------------------------------------------
+  /** Soft SPI receive block.  MOSI is held high, so 0XFF is sent, and only
+   * MISO is read.
+   * @param[out] buf Buffer for the data received.
+   * @param[in] n Number of bytes to receive.
+   */
+  void receive(uint8_t* buf, size_t n) {
+    fastDigitalWrite(MosiPin, 1);
+    for (uint8_t* end = buf + n; buf != end; buf++) {
+      *buf = receive();
+    }
+  }
+  //----------------------------------------------------------------------------
+  /** Soft SPI send block.  MISO is not read.
+   * @param[in] buf Data to send.
+   * @param[in] n Number of bytes to send.
+   */
+  void send(const uint8_t* buf, size_t n) {
+    for (const uint8_t* end = buf + n; buf != end; buf++) {
+      send(*buf);
+    }
+  }
+  //----------------------------------------------------------------------------
   /** Soft SPI transfer byte.
    * @param[in] txData Data byte to send.
    * @return Data byte received.